@@ -0,0 +1,271 @@
+#ifndef OSP_KCOMPAT_H
+#define OSP_KCOMPAT_H
+
+/*
+ * Userspace versions of the kernel interfaces used by the code that osprd.c
+ * shares with userspace (osprdlock.h, osprdstore.h and osprdback.h).
+ * Include this instead of the kernel headers, and before spinlock.h.
+ *
+ * Each simulated process is a 'struct task_struct'.  The thread running an
+ * ioctl on a process's behalf points 'current' at it, and a simulated signal
+ * interrupts wait_event_interruptible() just as a real one would.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ERESTARTSYS	512
+
+#define eprintk(format, ...) fprintf(stderr, format, ## __VA_ARGS__)
+
+#define GFP_ATOMIC	0
+#define GFP_KERNEL	0
+#define kmalloc(size, flags)	malloc(size)
+#define kfree(ptr)		free(ptr)
+
+typedef struct { int counter; } atomic_t;
+
+#define atomic_read(v)		__atomic_load_n(&(v)->counter, __ATOMIC_SEQ_CST)
+#define atomic_set(v, i)	__atomic_store_n(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+#define atomic_inc(v)		((void) __atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST))
+#define atomic_dec(v)		((void) __atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST))
+#define atomic_dec_and_test(v)	(__atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST) == 0)
+
+typedef struct { long counter; } atomic_long_t;
+
+#define atomic_long_read(v)	__atomic_load_n(&(v)->counter, __ATOMIC_SEQ_CST)
+#define atomic_long_set(v, i)	__atomic_store_n(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+#define atomic_long_add(i, v)	((void) __atomic_add_fetch(&(v)->counter, (i), __ATOMIC_SEQ_CST))
+#define atomic_long_sub(i, v)	((void) __atomic_sub_fetch(&(v)->counter, (i), __ATOMIC_SEQ_CST))
+
+#define smp_mb()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+
+/* Mutexes */
+
+struct mutex {
+	pthread_mutex_t m;
+};
+
+#define mutex_init(l)		pthread_mutex_init(&(l)->m, NULL)
+#define mutex_lock(l)		pthread_mutex_lock(&(l)->m)
+#define mutex_unlock(l)		pthread_mutex_unlock(&(l)->m)
+
+
+/* Atomic bit operations on arrays of longs */
+
+#define BITS_PER_LONG		(8 * (int) sizeof(long))
+#define BIT_WORD(nr)		((nr) / BITS_PER_LONG)
+#define BIT_MASK(nr)		(1UL << ((nr) % BITS_PER_LONG))
+
+static inline void set_bit(unsigned long nr, volatile unsigned long *addr)
+{
+	__atomic_or_fetch(&addr[BIT_WORD(nr)], BIT_MASK(nr), __ATOMIC_SEQ_CST);
+}
+
+static inline int test_bit(unsigned long nr, const volatile unsigned long *addr)
+{
+	return (__atomic_load_n(&addr[BIT_WORD(nr)], __ATOMIC_RELAXED)
+		& BIT_MASK(nr)) != 0;
+}
+
+static inline int test_and_clear_bit(unsigned long nr,
+				     volatile unsigned long *addr)
+{
+	return (__atomic_fetch_and(&addr[BIT_WORD(nr)], ~BIT_MASK(nr),
+				   __ATOMIC_SEQ_CST) & BIT_MASK(nr)) != 0;
+}
+
+// Return the index of the first set bit at or after 'offset', or 'size'.
+static inline unsigned long find_next_bit(const unsigned long *addr,
+					  unsigned long size,
+					  unsigned long offset)
+{
+	while (offset < size) {
+		unsigned long w = __atomic_load_n(&addr[BIT_WORD(offset)],
+						  __ATOMIC_RELAXED)
+			>> (offset % BITS_PER_LONG);
+		if (w) {
+			offset += __builtin_ctzl(w);
+			return offset < size ? offset : size;
+		}
+		offset = (BIT_WORD(offset) + 1) * BITS_PER_LONG;
+	}
+	return size;
+}
+
+#define ____cacheline_aligned_in_smp __attribute__((aligned(64)))
+
+static inline int num_online_cpus(void)
+{
+	return sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+# define cpu_relax()		__builtin_ia32_pause()
+#else
+# define cpu_relax()		__atomic_signal_fence(__ATOMIC_SEQ_CST)
+#endif
+
+// Userspace cannot tell; a spinning thread is simply preempted.
+#define need_resched()		0
+
+static inline int raw_smp_processor_id(void)
+{
+	int cpu = sched_getcpu();
+	return cpu < 0 ? 0 : cpu;
+}
+
+
+/* Wait queues */
+
+typedef struct wait_queue_head {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long nwakeups;		// Wakeups so far, so that a waiter
+					// can tell if one has happened
+} wait_queue_head_t;
+
+static inline void init_waitqueue_head(wait_queue_head_t *q)
+{
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	q->nwakeups = 0;
+}
+
+static inline void wake_up_all(wait_queue_head_t *q)
+{
+	pthread_mutex_lock(&q->lock);
+	__atomic_add_fetch(&q->nwakeups, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+#define wake_up wake_up_all
+
+
+/* Simulated processes */
+
+struct task_struct {
+	pid_t pid;
+	int sigpending;			// Set by a simulated signal
+	wait_queue_head_t *sleeping_on;	// Wait queue we are blocked on
+};
+
+extern __thread struct task_struct *osp_current;
+#define current osp_current
+
+static inline int signal_pending(struct task_struct *t)
+{
+	return __atomic_load_n(&t->sigpending, __ATOMIC_SEQ_CST);
+}
+
+// Deliver a signal to 't', waking it if it is blocked.
+static inline void send_sig_sim(struct task_struct *t)
+{
+	wait_queue_head_t *q;
+	__atomic_store_n(&t->sigpending, 1, __ATOMIC_SEQ_CST);
+	if ((q = __atomic_load_n(&t->sleeping_on, __ATOMIC_SEQ_CST)))
+		wake_up_all(q);
+}
+
+// Context switches made by the calling thread so far.
+static inline unsigned long osp_nr_switches(void)
+{
+	struct rusage ru;
+	if (getrusage(RUSAGE_THREAD, &ru) < 0)
+		return 0;
+	return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+// The time in nanoseconds.
+static inline unsigned long long osp_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The condition is tested with the wait queue's lock held, and wakers take
+// that lock to broadcast, so a wakeup cannot be lost between the test and
+// the sleep.
+#define wait_event_interruptible(wq, condition) ({			\
+	int __ret = 0;							\
+	pthread_mutex_lock(&(wq).lock);					\
+	__atomic_store_n(&current->sleeping_on, &(wq), __ATOMIC_SEQ_CST); \
+	while (!(condition)) {						\
+		if (signal_pending(current)) {				\
+			__ret = -ERESTARTSYS;				\
+			break;						\
+		}							\
+		pthread_cond_wait(&(wq).cond, &(wq).lock);		\
+	}								\
+	__atomic_store_n(&current->sleeping_on, NULL, __ATOMIC_SEQ_CST); \
+	pthread_mutex_unlock(&(wq).lock);				\
+	__ret;								\
+})
+
+// Jiffies are milliseconds here.
+#define msecs_to_jiffies(ms)	((long) (ms))
+
+// Sleep on 'cond' of 'q', whose lock is held, until the time 'end_ns'
+// (by osp_clock_ns).  The condition variable uses the realtime clock.
+static inline void osp_cond_wait_until(wait_queue_head_t *q,
+				       unsigned long long end_ns)
+{
+	unsigned long long now = osp_clock_ns(), left;
+	struct timespec ts;
+
+	left = (end_ns > now ? end_ns - now : 0);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += left / 1000000000;
+	ts.tv_nsec += left % 1000000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&q->cond, &q->lock, &ts);
+}
+
+// Like wait_event_interruptible, but gives up after 'timeout' jiffies.
+// Returns 0 if it timed out, the jiffies left (at least 1) if the
+// condition came true, or -ERESTARTSYS.
+#define wait_event_interruptible_timeout(wq, condition, timeout) ({	\
+	unsigned long long __end = osp_clock_ns() + (timeout) * 1000000ULL; \
+	unsigned long long __now;					\
+	long __ret;							\
+	pthread_mutex_lock(&(wq).lock);					\
+	__atomic_store_n(&current->sleeping_on, &(wq), __ATOMIC_SEQ_CST); \
+	for (;;) {							\
+		__now = osp_clock_ns();					\
+		if (condition) {					\
+			__ret = (__now < __end				\
+				 ? (long) ((__end - __now) / 1000000) + 1 : 1); \
+			break;						\
+		} else if (signal_pending(current)) {			\
+			__ret = -ERESTARTSYS;				\
+			break;						\
+		} else if (__now >= __end) {				\
+			__ret = 0;					\
+			break;						\
+		}							\
+		osp_cond_wait_until(&(wq), __end);			\
+	}								\
+	__atomic_store_n(&current->sleeping_on, NULL, __ATOMIC_SEQ_CST); \
+	pthread_mutex_unlock(&(wq).lock);				\
+	__ret;								\
+})
+
+#endif /* OSP_KCOMPAT_H */
@@ -0,0 +1,149 @@
+#! /usr/bin/perl -w
+
+# lab2-bench.pl: lock fairness and latency benchmark for osprd
+#
+# Runs mixes of reader and writer processes against a ramdisk.  Each
+# process repeatedly locks the ramdisk with "osprdaccess -l -T", holds the
+# lock for a while, releases it, and waits a little before the next
+# request.  From the times osprdaccess -T reports, prints a CSV line per mix
+# and role: how long lock requests waited (mean, percentiles, maximum), how
+# many times a request was overtaken by one made after it (with the ticket
+# lock, a writer should never be), and how many locks were granted per
+# second.  Give each build a different -l label and concatenate the
+# results to compare locking strategies.
+
+sub usage {
+    print STDERR <<'EOF';
+Usage: perl lab2-bench.pl [OPTIONS] > RESULTS.csv
+   -m READERS:WRITERS  Run this mix of processes.  May be repeated.
+                       Default is 1:1, 4:1, 8:2 and 1:4.
+   -H HOLD_MS          Hold each lock this long.  Default is 20.
+   -t THINK_MS         Wait this long between locks.  Default is 5.
+   -n ROUNDS           Locks per process.  Default is 10.
+   -l LABEL            Label for the results' first column.  Default "osprd".
+   -d DEVICE           Ramdisk to lock.  Default is /dev/osprda.
+   -x OSPRDACCESS      osprdaccess to run.  Default is ./osprdaccess.
+EOF
+    exit(1);
+}
+
+my(@mixes, $hold_ms, $think_ms, $rounds, $label, $device, $osprdaccess);
+$hold_ms = 20;
+$think_ms = 5;
+$rounds = 10;
+$label = "osprd";
+$device = "/dev/osprda";
+$osprdaccess = "./osprdaccess";
+
+while (@ARGV) {
+    my($opt) = shift(@ARGV);
+    usage() if !@ARGV;
+    my($val) = shift(@ARGV);
+    if ($opt eq "-m" && $val =~ /^(\d+):(\d+)$/ && $1 + $2 > 0) {
+	push(@mixes, [$1, $2]);
+    } elsif ($opt eq "-H" && $val =~ /^\d+(\.\d*)?$/) {
+	$hold_ms = $val;
+    } elsif ($opt eq "-t" && $val =~ /^\d+(\.\d*)?$/) {
+	$think_ms = $val;
+    } elsif ($opt eq "-n" && $val =~ /^\d+$/ && $val > 0) {
+	$rounds = $val;
+    } elsif ($opt eq "-l" && $val !~ /,/) {
+	$label = $val;
+    } elsif ($opt eq "-d") {
+	$device = $val;
+    } elsif ($opt eq "-x") {
+	$osprdaccess = $val;
+    } else {
+	usage();
+    }
+}
+@mixes = ([1, 1], [4, 1], [8, 2], [1, 4]) if !@mixes;
+
+my($sh) = "bash";
+my($tempfile) = "lab2bench.txt";
+
+# Return the 'p'th percentile of a sorted list.
+sub percentile {
+    my($p, @sorted) = @_;
+    return $sorted[int($p / 100 * @sorted)] if $p < 100;
+    return $sorted[-1];
+}
+
+# Run one mix.  Returns a list of [role, requested, acquired, released].
+sub run_mix {
+    my($nreaders, $nwriters) = @_;
+    my($hold) = $hold_ms / 1000;
+    my($think) = $think_ms / 1000;
+    my($script) = "";
+    my(@reqs);
+
+    foreach my $i (1 .. $nreaders + $nwriters) {
+	my($op) = ($i <= $nreaders ? "-r 0" : "-w 0 -z");
+	$script .= "(for i in \$(seq $rounds); do " .
+	    "$osprdaccess $op -l -d $hold -T $device 2>>$tempfile; " .
+	    "sleep $think; done) &\n";
+    }
+    $script .= "wait\n";
+
+    unlink($tempfile);
+    open(SH, "| $sh") || die "$sh: $!";
+    print SH $script;
+    close(SH);
+
+    open(F, $tempfile) || die "no results: did osprdaccess fail?";
+    while (defined($_ = <F>)) {
+	if (/^timing: \d+ ([rw]) ([\d.]+) ([\d.]+) ([\d.]+)$/) {
+	    push(@reqs, [$1, $2, $3, $4]);
+	} else {
+	    print STDERR "osprdaccess: $_";
+	}
+    }
+    close(F);
+    unlink($tempfile);
+    return @reqs;
+}
+
+print "label,readers,writers,hold_ms,role,locks,wait_mean_ms,wait_p50_ms,",
+    "wait_p90_ms,wait_p99_ms,wait_max_ms,overtaken,locks_per_s\n";
+
+foreach my $mix (@mixes) {
+    my($nreaders, $nwriters) = @$mix;
+    print STDERR "Running $nreaders readers, $nwriters writers\n";
+    my(@reqs) = run_mix($nreaders, $nwriters);
+    next if !@reqs;
+
+    # Locks granted per second over the whole run.
+    my($start, $end) = ($reqs[0][1], $reqs[0][3]);
+    foreach my $r (@reqs) {
+	$start = $r->[1] if $r->[1] < $start;
+	$end = $r->[3] if $r->[3] > $end;
+    }
+    my($rate) = ($end > $start ? @reqs / ($end - $start) : 0);
+
+    foreach my $role ("r", "w") {
+	my(@mine) = grep { $_->[0] eq $role } @reqs;
+	next if !@mine;
+
+	my(@waits) = sort { $a <=> $b } map { ($_->[2] - $_->[1]) * 1000 } @mine;
+	my($sum) = 0;
+	$sum += $_ foreach @waits;
+
+	# A request is overtaken by each later request acquired before it.
+	# (Readers that share the lock do not count against each other.)
+	my($overtaken) = 0;
+	foreach my $r (@mine) {
+	    foreach my $o (@reqs) {
+		next if $r->[0] eq "r" && $o->[0] eq "r";
+		$overtaken++ if $o->[1] > $r->[1] && $o->[2] < $r->[2];
+	    }
+	}
+
+	printf("%s,%d,%d,%s,%s,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%d,%.1f\n",
+	       $label, $nreaders, $nwriters, $hold_ms,
+	       $role eq "r" ? "reader" : "writer", scalar(@mine),
+	       $sum / @waits, percentile(50, @waits), percentile(90, @waits),
+	       percentile(99, @waits), $waits[-1], $overtaken, $rate);
+    }
+}
+
+exit(0);
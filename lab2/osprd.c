@@ -11,8 +11,16 @@
 #include <linux/vmalloc.h>
 #include <linux/genhd.h>
 #include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/highmem.h>
 #include <linux/wait.h>
 #include <linux/file.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/kthread.h>
+#include <linux/poll.h>
+#include <linux/timer.h>
+#include <asm/uaccess.h>
 
 #include "spinlock.h"
 #include "osprd.h"
@@ -21,7 +29,7 @@
 #define SECTOR_SIZE	512
 
 /* This flag is added to an OSPRD file's f_flags to indicate that the file
- * is locked. */
+ * is locked, or has an asynchronous lock request in line. */
 #define F_OSPRD_LOCKED	0x80000
 
 /* eprintk() prints messages to the console.
@@ -31,6 +39,10 @@
  * and KERN_EMERG will make sure that you will see messages.) */
 #define eprintk(format, ...) printk(KERN_NOTICE format, ## __VA_ARGS__)
 
+#include "osprdlock.h"		/* after eprintk, which it uses */
+#include "osprdstore.h"
+#include "osprdback.h"
+
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_DESCRIPTION("CS 111 RAM Disk");
 // EXERCISE: Pass your names into the kernel as the module's authors.
@@ -44,26 +56,92 @@ MODULE_AUTHOR("Skeletor");
 static int nsectors = 32;
 module_param(nsectors, int, 0);
 
+/* This module parameter turns on the scalable reader mode for the device
+ * locks: read locks are counted per CPU and only writers take the
+ * device-wide mutex (see osprdlock.h).  "insmod osprd.ko sharded_readers=1" */
+static int sharded_readers = 0;
+module_param(sharded_readers, int, 0);
+
+/* This module parameter makes blocked lock requests spin briefly before
+ * sleeping, when recent hold times say the lock will come free soon (see
+ * osprdlock.h).  "insmod osprd.ko adaptive_spin=1" */
+static int adaptive_spin = 0;
+module_param(adaptive_spin, int, 0);
+
+/* This module parameter gives every lock request a lease of this many
+ * milliseconds, after which the lock can be revoked (see OSPRDIOCSETLEASE in
+ * osprd.h), so a stalled process cannot keep a ramdisk locked for good.
+ * "insmod osprd.ko lock_lease=5000" */
+static int lock_lease = 0;
+module_param(lock_lease, int, 0);
+
+/* This module parameter makes the ramdisks sparse: memory for their data is
+ * allocated a chunk at a time, when first written, instead of all at load
+ * time (see osprdstore.h).  "insmod osprd.ko sparse=1 nsectors=8388608"
+ * gives four 4GB ramdisks that use no data memory until written. */
+static int sparse = 0;
+module_param(sparse, int, 0);
+
+/* This module parameter bypasses the request queues: each bio is transferred
+ * as soon as it is submitted, on the submitting CPU, instead of being queued
+ * for osprd_process_request_queue.  CPUs then do I/O to a ramdisk in
+ * parallel rather than taking turns on its queue lock (for a sparse ramdisk,
+ * the store is still locked).  "insmod osprd.ko multiqueue=1" */
+static int multiqueue = 0;
+module_param(multiqueue, int, 0);
+
+/* This module parameter makes the ramdisks sparse and compressed: each chunk
+ * is stored in the smallest form it fits, and chunks of zeros not at all
+ * (see osprdstore.h).  "insmod osprd.ko compress=1" */
+static int compress = 0;
+module_param(compress, int, 0);
+
+/* This module parameter makes the ramdisks sparse and deduplicating: chunks
+ * with the same contents, in any of the ramdisks, share one copy in memory
+ * (see osprdstore.h).  It can be combined with compress=1.
+ * "insmod osprd.ko dedup=1" */
+static int dedup = 0;
+module_param(dedup, int, 0);
+
+/* This module parameter keeps the ramdisks' data in files, so that it
+ * survives unloading the module: ramdisk osprdX is loaded from, and written
+ * back to, the file named 'backing' followed by X.  Reads come from memory.
+ * Writes are written back by a kernel thread every flush_interval
+ * milliseconds, and made durable by OSPRDIOCFLUSH (see osprdback.h).
+ * "insmod osprd.ko backing=/tmp/osprd-" uses /tmp/osprd-a to /tmp/osprd-d.
+ * Only dense ramdisks can have backing files. */
+static char *backing = NULL;
+module_param(backing, charp, 0);
+static int flush_interval = 1000;
+module_param(flush_interval, int, 0);
+
 
 /* The internal representation of our device. */
 typedef struct osprd_info {
 	uint8_t *data;                  // The data array. Its size is
 	                                // (nsectors * SECTOR_SIZE) bytes.
+					// NULL if the ramdisk is sparse.
 
-	osp_spinlock_t mutex;           // Mutex for synchronizing access to
-					// this block device
+	osprd_store_t store;		// A sparse ramdisk's data,
+					// protected by 'qlock'.
+	unsigned long long nrequests;	// Requests transferred to or from
+	unsigned long long request_ns;	// 'store', and time spent on them,
+	unsigned long long request_max_ns; // also protected by 'qlock'
+	int readonly;			// Set on a read-only snapshot
 
-	unsigned ticket_head;		// Currently running ticket for
-					// the device lock
+	osprd_backing_t back;		// Writes a dense ramdisk's data back
+					// to its backing file, if any
+	struct task_struct *flusher;	// The thread that does so
 
-	unsigned ticket_tail;		// Next available ticket for
-					// the device lock
+	struct osprd_stats *stats;	// Usage statistics, per CPU
 
-	wait_queue_head_t blockq;       // Wait queue for tasks blocked on
-					// the device lock
-
-	/* HINT: You may want to add additional fields to help
-	         in detecting deadlock. */
+	osprd_lock_t lock;		// The device lock: its mutex,
+					// ticket order, wait queue, and
+					// holders (see osprdlock.h)
+	wait_queue_head_t poll_wait;	// Woken when an asynchronous lock
+					// request is granted
+	struct timer_list lease_timer;	// Wakes 'poll_wait' when the first
+					// lease on 'lock' runs out
 
 	// The following elements are used internally; you don't need
 	// to understand them.
@@ -76,6 +154,17 @@ typedef struct osprd_info {
 #define NOSPRD 4
 static osprd_info_t osprds[NOSPRD];
 
+/* The wait-for graph that the device locks share, so that deadlocks among
+ * processes locking several devices are detected. */
+static osprd_wfg_t osprd_wfg;
+
+/* The memory of the sparse ramdisks, which snapshots and deduplication let
+ * them share. */
+static osprd_pool_t osprd_pool;
+
+/* Buckets in the pool's dedup index: as many as kmalloc allows. */
+#define OSPRD_DEDUP_BUCKETS	16384
+
 
 // Declare useful helper functions
 
@@ -100,6 +189,206 @@ static void for_each_open_file(struct task_struct *task,
 			       osprd_info_t *user_data);
 
 
+/*
+ * osprd_end_request(req, uptodate)
+ *   Complete every sector of 'req' at once.  (end_request() only completes
+ *   the current chunk, req->current_nr_sectors.)
+ */
+static void osprd_end_request(struct request *req, int uptodate)
+{
+	if (!end_that_request_first(req, uptodate, req->hard_nr_sectors)) {
+		blkdev_dequeue_request(req);
+		end_that_request_last(req, uptodate);
+	}
+}
+
+
+// The time in nanoseconds, for latency statistics.
+static unsigned long long osprd_clock_ns(void)
+{
+	struct timespec ts;
+	getnstimeofday(&ts);
+	return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Return the histogram bucket for a time of 'ns' nanoseconds.
+static inline int osprd_hist_bucket(unsigned long long ns)
+{
+	int b = 0;
+	while ((ns >>= 1) != 0)
+		b++;
+	return b < OSPRD_HIST_BUCKETS ? b : OSPRD_HIST_BUCKETS - 1;
+}
+
+// Statistics are counted per CPU, so that CPUs doing I/O at once do not
+// fight over the counters' cache lines.  Interrupts are disabled while a
+// CPU's counters change, since requests can finish in interrupt context.
+
+// Count a request of 'nsectors' sectors that began at time 'start'.
+// The caller must hold 'd->qlock' if the ramdisk is sparse.
+static void osprd_account_request(osprd_info_t *d, int writing,
+				  unsigned long nsectors,
+				  unsigned long long start)
+{
+	unsigned long long ns = osprd_clock_ns() - start;
+	struct osprd_stats *st;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	st = per_cpu_ptr(d->stats, smp_processor_id());
+	if (writing) {
+		st->writes++;
+		st->write_sectors += nsectors;
+	} else {
+		st->reads++;
+		st->read_sectors += nsectors;
+	}
+	st->request_ns[osprd_hist_bucket(ns)]++;
+	local_irq_restore(flags);
+
+	if (!d->data) {
+		d->nrequests++;
+		d->request_ns += ns;
+		if (ns > d->request_max_ns)
+			d->request_max_ns = ns;
+	}
+}
+
+// Count a lock request that began at time 'start' and returned 'r'.
+// 'waited' is set if it slept.
+static void osprd_account_lock(osprd_info_t *d, int r, int waited,
+			       unsigned long long start)
+{
+	struct osprd_stats *st;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	st = per_cpu_ptr(d->stats, smp_processor_id());
+	if (r == 0)
+		st->lock_acquires++;
+	else if (r == -EDEADLK)
+		st->lock_deadlocks++;
+	if (waited) {
+		st->lock_waits++;
+		st->lock_wait_ns[osprd_hist_bucket(osprd_clock_ns() - start)]++;
+	}
+	local_irq_restore(flags);
+}
+
+
+// Access a backing file from the kernel, for osprdback.h.  The buffers are
+// kernel memory, so the VFS is told not to check for user addresses.
+
+static long osprd_file_pread(void *file, void *buf, unsigned long len,
+			     unsigned long long off)
+{
+	mm_segment_t old_fs = get_fs();
+	loff_t pos = off;
+	long r;
+
+	set_fs(KERNEL_DS);
+	r = vfs_read((struct file *) file, (char __user *) buf, len, &pos);
+	set_fs(old_fs);
+	return r;
+}
+
+static long osprd_file_pwrite(void *file, const void *buf, unsigned long len,
+			      unsigned long long off)
+{
+	mm_segment_t old_fs = get_fs();
+	loff_t pos = off;
+	long r;
+
+	set_fs(KERNEL_DS);
+	r = vfs_write((struct file *) file, (const char __user *) buf, len,
+		      &pos);
+	set_fs(old_fs);
+	return r;
+}
+
+// Write the file's dirty pages and wait for them, as fsync(2) does.
+static int osprd_file_sync(void *file)
+{
+	struct file *filp = (struct file *) file;
+	struct inode *inode = filp->f_dentry->d_inode;
+	int r, err;
+
+	if (!filp->f_op || !filp->f_op->fsync)
+		return -EINVAL;
+	r = filemap_fdatawrite(filp->f_mapping);
+	mutex_lock(&inode->i_mutex);
+	err = filp->f_op->fsync(filp, filp->f_dentry, 0);
+	mutex_unlock(&inode->i_mutex);
+	if (!r)
+		r = err;
+	err = filemap_fdatawait(filp->f_mapping);
+	return r ? r : err;
+}
+
+static const osprd_backing_ops_t osprd_file_ops = {
+	.pread = osprd_file_pread,
+	.pwrite = osprd_file_pwrite,
+	.sync = osprd_file_sync
+};
+
+// The thread that writes a ramdisk's changes back to its backing file.
+static int osprd_flusher(void *arg)
+{
+	osprd_info_t *d = (osprd_info_t *) arg;
+	int failed = 0;
+
+	while (!kthread_should_stop()) {
+		schedule_timeout_interruptible(msecs_to_jiffies(flush_interval));
+		// Complain once per run of failures.
+		if (osprd_backing_flush(&d->back, 0) < 0) {
+			if (!failed)
+				eprintk("osprd: can't write back to backing file\n");
+			failed = 1;
+		} else
+			failed = 0;
+	}
+	return 0;
+}
+
+
+/*
+ * osprd_transfer_bio(d, bio)
+ *   Copy 'bio's data to or from the ramdisk.  Returns 0, or -ENOMEM if a
+ *   sparse ramdisk ran out of memory.  The caller must hold 'd->qlock' if
+ *   the ramdisk is sparse.
+ */
+static int osprd_transfer_bio(osprd_info_t *d, struct bio *bio)
+{
+	struct bio_vec *bvec;
+	unsigned long long off = (unsigned long long) bio->bi_sector * SECTOR_SIZE;
+	int i, r = 0;
+
+	// Each segment is contiguous both in memory and on the disk, so it
+	// is moved with a single memcpy however many sectors it spans.
+	bio_for_each_segment(bvec, bio, i) {
+		char *buf = __bio_kmap_atomic(bio, i, KM_USER0);
+		if (d->data && bio_data_dir(bio) == WRITE) {
+			memcpy(d->data + off, buf, bvec->bv_len);
+			if (d->back.file)
+				osprd_backing_dirty(&d->back, off, bvec->bv_len);
+		} else if (d->data)
+			memcpy(buf, d->data + off, bvec->bv_len);
+		else if (bio_data_dir(bio) == WRITE) {
+			if (osprd_store_write(&d->store, off, buf,
+					      bvec->bv_len) < 0)
+				r = -ENOMEM;
+		} else
+			osprd_store_read(&d->store, off, buf, bvec->bv_len);
+		__bio_kunmap_atomic(buf, KM_USER0);
+		off += bvec->bv_len;
+	}
+
+	if (r < 0)
+		eprintk("osprd: out of memory for sparse ramdisk data\n");
+	return r;
+}
+
+
 /*
  * osprd_process_request(d, req)
  *   Called when the user reads or writes a sector.
@@ -107,23 +396,69 @@ static void for_each_open_file(struct task_struct *task,
  */
 static void osprd_process_request(osprd_info_t *d, struct request *req)
 {
+	struct bio *bio;
+	int uptodate = 1;
+	unsigned long long start = osprd_clock_ns();
+
 	if (!blk_fs_request(req)) {
 		end_request(req, 0);
 		return;
 	}
 
-	// EXERCISE: Perform the read or write request by copying data between
-	// our data array and the request's buffer.
-	// Hint: The 'struct request' argument tells you what kind of request
-	// this is, and which sectors are being read or written.
-	// Read about 'struct request' in <linux/blkdev.h>.
-	// Consider the 'req->sector', 'req->current_nr_sectors', and
-	// 'req->buffer' members, and the rq_data_dir() function.
+	if (req->sector + req->nr_sectors > nsectors) {
+		eprintk("osprd: request past end of device\n");
+		osprd_end_request(req, 0);
+		return;
+	}
+
+	if (d->readonly && rq_data_dir(req) == WRITE) {
+		eprintk("osprd: write to read-only snapshot\n");
+		osprd_end_request(req, 0);
+		return;
+	}
 
-	// Your code here.
-	eprintk("Should process request...\n");
+	// The request function runs with 'qlock' held, as a sparse ramdisk
+	// needs.
+	rq_for_each_bio(bio, req)
+		if (osprd_transfer_bio(d, bio) < 0)
+			uptodate = 0;
+	osprd_account_request(d, rq_data_dir(req) == WRITE, req->nr_sectors,
+			      start);
+	osprd_end_request(req, uptodate);
+}
+
+
+/*
+ * osprd_make_request(q, bio)
+ *   Called for each bio submitted to a ramdisk when multiqueue=1, on the
+ *   submitting CPU.  Transfers the bio at once, without queueing it: a
+ *   dense ramdisk takes no lock, so bios from different CPUs are processed
+ *   in parallel, while a sparse one locks its store.
+ */
+static int osprd_make_request(request_queue_t *q, struct bio *bio)
+{
+	osprd_info_t *d = (osprd_info_t *) q->queuedata;
+	int writing = (bio_data_dir(bio) == WRITE), r;
+	unsigned long long start = osprd_clock_ns();
+
+	if (bio->bi_sector + bio_sectors(bio) > nsectors) {
+		eprintk("osprd: request past end of device\n");
+		r = -EIO;
+	} else if (d->readonly && writing) {
+		eprintk("osprd: write to read-only snapshot\n");
+		r = -EIO;
+	} else if (d->data) {
+		r = osprd_transfer_bio(d, bio);
+		osprd_account_request(d, writing, bio_sectors(bio), start);
+	} else {
+		spin_lock_irq(&d->qlock);
+		r = osprd_transfer_bio(d, bio);
+		osprd_account_request(d, writing, bio_sectors(bio), start);
+		spin_unlock_irq(&d->qlock);
+	}
 
-	end_request(req, 1);
+	bio_endio(bio, bio->bi_size, r);
+	return 0;
 }
 
 
@@ -134,10 +469,31 @@ static int osprd_open(struct inode *inode, struct file *filp)
 	// Always set the O_SYNC flag. That way, we will get writes immediately
 	// instead of waiting for them to get through write-back caches.
 	filp->f_flags |= O_SYNC;
+	// The file's lease for lock requests, in milliseconds, is kept in
+	// 'private_data', which block device files do not otherwise use.
+	filp->private_data = (void *) (unsigned long) lock_lease;
 	return 0;
 }
 
 
+// Release the device lock held by 'filp'.
+// Returns 0 on success, -EINVAL if 'filp' does not hold the lock, or
+// -ETIMEDOUT if its lease ran out and the lock was revoked.
+static int osprd_release_file(osprd_info_t *d, struct file *filp)
+{
+	osprd_holder_t *h;
+	int r;
+
+	if (!(filp->f_flags & F_OSPRD_LOCKED)
+	    || !(h = osprd_lock_release(&d->lock, filp)))
+		return -EINVAL;
+	filp->f_flags &= ~F_OSPRD_LOCKED;
+	r = (h->revoked ? -ETIMEDOUT : 0);
+	kfree(h);
+	return r;
+}
+
+
 // This function is called when a /dev/osprdX file is finally closed.
 // (If the file descriptor was dup2ed, this function is called only when the
 // last copy is closed.)
@@ -145,26 +501,62 @@ static int osprd_close_last(struct inode *inode, struct file *filp)
 {
 	if (filp) {
 		osprd_info_t *d = file2osprd(filp);
-		int filp_writable = filp->f_mode & FMODE_WRITE;
 
-		// EXERCISE: If the user closes a ramdisk file that holds
-		// a lock, release the lock.  Also wake up blocked processes
-		// as appropriate.
+		// If the user closes a ramdisk file that holds a lock,
+		// release the lock, which wakes up blocked processes.
+		// (This also cancels an asynchronous request in line.)
+		if (filp->f_flags & F_OSPRD_LOCKED)
+			osprd_release_file(d, filp);
+	}
 
-		// Your code here.
+	return 0;
+}
 
-		// This line avoids compiler warnings; you may remove it.
-		(void) filp_writable, (void) d;
 
+// This function is called for poll() and select() on a /dev/osprdX file.
+// A file whose asynchronous lock request is still in line is not ready;
+// any other file is always ready, as it would be without this function.
+// Every granted asynchronous request on the device wakes 'poll_wait', so
+// each poller checks its own request.  A poller is not asleep in the lock
+// manager, so nothing there revokes an expired lease for it; instead
+// 'lease_timer' wakes the pollers when the first lease runs out, and the
+// check revokes it.
+static unsigned int osprd_poll(struct file *filp, poll_table *wait)
+{
+	osprd_info_t *d = file2osprd(filp);
+	unsigned long long alarm = OSPRD_NO_ALARM, now;
+	unsigned long expires;
+
+	if (!d || !(filp->f_flags & F_OSPRD_LOCKED))
+		return DEFAULT_POLLMASK;
+	// Wait before checking, so a grant after the check wakes us.
+	poll_wait(filp, &d->poll_wait, wait);
+	if (!osprd_lock_pending(&d->lock, filp, &alarm))
+		return DEFAULT_POLLMASK;
+
+	if (alarm != OSPRD_NO_ALARM) {
+		now = osp_clock_ns();
+		expires = jiffies + (now < alarm
+				     ? osp_ns_to_jiffies(alarm - now) : 1);
+		// Under the lock's mutex, so that a poller with an older
+		// alarm cannot put off a sooner one.
+		osp_spin_lock(&d->lock.mutex);
+		if (!timer_pending(&d->lease_timer)
+		    || time_before(expires, d->lease_timer.expires))
+			mod_timer(&d->lease_timer, expires);
+		osp_spin_unlock(&d->lock.mutex);
 	}
-
 	return 0;
 }
 
+// Called when the first lease on a device's lock runs out while it has
+// pollers (see osprd_poll).
+static void osprd_lease_alarm(unsigned long data)
+{
+	osprd_info_t *d = (osprd_info_t *) data;
+	wake_up(&d->poll_wait);
+}
 
-/*
- * osprd_lock
- */
 
 /*
  * osprd_ioctl(inode, filp, cmd, arg)
@@ -179,76 +571,253 @@ int osprd_ioctl(struct inode *inode, struct file *filp,
 	// is file open for writing?
 	int filp_writable = (filp->f_mode & FMODE_WRITE) != 0;
 
-	// This line avoids compiler warnings; you may remove it.
-	(void) filp_writable, (void) d;
-
 	// Set 'r' to the ioctl's return value: 0 on success, negative on error
 
-	if (cmd == OSPRDIOCACQUIRE) {
-
-		// EXERCISE: Lock the ramdisk.
-		//
-		// If *filp is open for writing (filp_writable), then attempt
-		// to write-lock the ramdisk; otherwise attempt to read-lock
-		// the ramdisk.
-		//
-                // This lock request must block using 'd->blockq' until:
-		// 1) no other process holds a write lock;
-		// 2) either the request is for a read lock, or no other process
-		//    holds a read lock; and
-		// 3) lock requests should be serviced in order, so no process
-		//    that blocked earlier is still blocked waiting for the
-		//    lock.
-		//
-		// If a process acquires a lock, mark this fact by setting
-		// 'filp->f_flags |= F_OSPRD_LOCKED'.  You also need to
-		// keep track of how many read and write locks are held:
-		// change the 'osprd_info_t' structure to do this.
-		//
-		// Also wake up processes waiting on 'd->blockq' as needed.
-		//
-		// If the lock request would cause a deadlock, return -EDEADLK.
-		// If the lock request blocks and is awoken by a signal, then
-		// return -ERESTARTSYS.
-		// Otherwise, if we can grant the lock request, return 0.
-
-		// 'd->ticket_head' and 'd->ticket_tail' should help you
-		// service lock requests in order.  These implement a ticket
-		// order: 'ticket_tail' is the next ticket, and 'ticket_head'
-		// is the ticket currently being served.  You should set a local
-		// variable to 'd->ticket_head' and increment 'd->ticket_head'.
-		// Then, block at least until 'd->ticket_tail == local_ticket'.
-		// (Some of these operations are in a critical section and must
-		// be protected by a spinlock; which ones?)
-
-		// Your code here (instead of the next two lines).
-		eprintk("Attempting to acquire\n");
-		r = -ENOTTY;
-
-	} else if (cmd == OSPRDIOCTRYACQUIRE) {
-
-		// EXERCISE: ATTEMPT to lock the ramdisk.
-		//
-		// This is just like OSPRDIOCACQUIRE, except it should never
-		// block.  If OSPRDIOCACQUIRE would block or return deadlock,
-		// OSPRDIOCTRYACQUIRE should return -EBUSY.
-		// Otherwise, if we can grant the lock request, return 0.
-
-		// Your code here (instead of the next two lines).
-		eprintk("Attempting to try acquire\n");
-		r = -ENOTTY;
+	if (cmd == OSPRDIOCACQUIRE || cmd == OSPRDIOCTRYACQUIRE
+	    || cmd == OSPRDIOCACQUIRERANGE || cmd == OSPRDIOCTRYACQUIRERANGE
+	    || cmd == OSPRDIOCACQUIREASYNC
+	    || cmd == OSPRDIOCACQUIRERANGEASYNC) {
+
+		// Lock the ramdisk: write-lock it if *filp is open for
+		// writing, read-lock it otherwise.  OSPRDIOCACQUIRE blocks
+		// (in ticket order) until the lock is available, and returns
+		// -EDEADLK if the request could never be granted or
+		// -ERESTARTSYS if interrupted by a signal.
+		// OSPRDIOCTRYACQUIRE never blocks; it returns -EBUSY wherever
+		// OSPRDIOCACQUIRE would block or deadlock.
+		// The ASYNC versions put the request in line and return
+		// -EINPROGRESS instead of blocking; poll() tells when it is
+		// granted (see osprd_poll).
+		// The RANGE versions lock only the sectors in the
+		// struct osprd_range that 'arg' points to.
+		// See osprdlock.h for the details.
+		int async = (cmd == OSPRDIOCACQUIREASYNC
+			     || cmd == OSPRDIOCACQUIRERANGEASYNC);
+		int block = (cmd == OSPRDIOCACQUIRE
+			     || cmd == OSPRDIOCACQUIRERANGE || async);
+		struct osprd_range range;
+		osprd_holder_t *h;
+		unsigned long long start;
+
+		if (filp->f_flags & F_OSPRD_LOCKED) {
+			r = block ? -EDEADLK : -EBUSY;
+			osprd_account_lock(d, r, 0, 0);
+			return r;
+		}
+		if (cmd == OSPRDIOCACQUIRERANGE
+		    || cmd == OSPRDIOCTRYACQUIRERANGE
+		    || cmd == OSPRDIOCACQUIRERANGEASYNC) {
+			if (copy_from_user(&range, (void __user *) arg,
+					   sizeof(range)))
+				return -EFAULT;
+			if (range.nsectors == 0 || range.start >= nsectors
+			    || range.nsectors > nsectors - range.start)
+				return -EINVAL;
+		} else {
+			range.start = 0;
+			range.nsectors = 0;
+		}
+		if (!(h = kmalloc(sizeof(*h), GFP_KERNEL)))
+			return -ENOMEM;
+		h->owner = filp;
+		h->pid = current->pid;
+		h->writable = filp_writable;
+		h->start = range.start;
+		h->end = (range.nsectors ? range.start + range.nsectors
+			  : OSPRD_SECTOR_MAX);
+		h->lease_ns = (unsigned long long)
+			(unsigned long) filp->private_data * 1000000;
+
+		start = osprd_clock_ns();
+		if (async)
+			r = osprd_lock_acquire_async(&d->lock, h,
+						     &d->poll_wait);
+		else
+			r = osprd_lock_acquire(&d->lock, h, block);
+		// (A queued asynchronous request is counted neither as
+		// acquired nor as waiting.)
+		osprd_account_lock(d, r, h->waited, start);
+		if (r == 0 || r == -EINPROGRESS)
+			filp->f_flags |= F_OSPRD_LOCKED;
+		else
+			kfree(h);
 
 	} else if (cmd == OSPRDIOCRELEASE) {
 
-		// EXERCISE: Unlock the ramdisk.
-		//
-		// If the file hasn't locked the ramdisk, return -EINVAL.
-		// Otherwise, clear the lock from filp->f_flags, wake up
-		// the wait queue, perform any additional accounting steps
-		// you need, and return 0.
-
-		// Your code here (instead of the next line).
-		r = -ENOTTY;
+		// Unlock the ramdisk, waking the wait queue, or cancel an
+		// asynchronous request that is still in line.
+		// If the file hasn't locked the ramdisk, return -EINVAL; if
+		// its lease ran out and the lock was revoked, -ETIMEDOUT.
+		r = osprd_release_file(d, filp);
+
+	} else if (cmd == OSPRDIOCSETLEASE) {
+
+		// Set the lease, in milliseconds, for the file's later lock
+		// requests (0 for none).
+		if (arg > 24UL * 60 * 60 * 1000)
+			return -EINVAL;
+		filp->private_data = (void *) arg;
+
+	} else if (cmd == OSPRDIOCSTATS) {
+
+		// Add up the per-CPU statistics and copy them to user space.
+		// (The struct is too big for the kernel stack.)
+		struct osprd_stats *sum;
+		unsigned long long *dst, *src;
+		int cpu, i;
+		if (!(sum = kmalloc(sizeof(*sum), GFP_KERNEL)))
+			return -ENOMEM;
+		memset(sum, 0, sizeof(*sum));
+		// Every member is an unsigned long long.
+		for_each_possible_cpu(cpu) {
+			dst = (unsigned long long *) sum;
+			src = (unsigned long long *) per_cpu_ptr(d->stats, cpu);
+			for (i = 0; i < sizeof(*sum) / sizeof(*dst); i++)
+				dst[i] += src[i];
+		}
+		if (copy_to_user((void __user *) arg, sum, sizeof(*sum)))
+			r = -EFAULT;
+		kfree(sum);
+
+	} else if (cmd == OSPRDIOCWAKESTATS) {
+
+		// Copy the lock's wakeup statistics to user space.
+		struct osprd_wakestats ws;
+		osp_spin_lock(&d->lock.mutex);
+		ws.blocked = d->lock.nblocked;
+		ws.wakeups = d->lock.nwakeups;
+		ws.switches = d->lock.nswitches;
+		ws.spun = d->lock.nspun;
+		ws.hold_ns = d->lock.hold_ns;
+		ws.revoked = d->lock.nrevoked;
+		osp_spin_unlock(&d->lock.mutex);
+		if (copy_to_user((void __user *) arg, &ws, sizeof(ws)))
+			r = -EFAULT;
+
+	} else if (cmd == OSPRDIOCDISCARD) {
+
+		// Zero a range of sectors, freeing their chunks if sparse.
+		struct osprd_range range;
+		if (!filp_writable)
+			return -EBADF;
+		if (copy_from_user(&range, (void __user *) arg, sizeof(range)))
+			return -EFAULT;
+		if (range.nsectors == 0 || range.start >= nsectors
+		    || range.nsectors > nsectors - range.start)
+			return -EINVAL;
+		spin_lock_irq(&d->qlock);
+		if (d->readonly)
+			r = -EROFS;
+		else if (d->data) {
+			memset(d->data + range.start * SECTOR_SIZE, 0,
+			       range.nsectors * SECTOR_SIZE);
+			if (d->back.file)
+				osprd_backing_dirty(&d->back,
+						    range.start * SECTOR_SIZE,
+						    range.nsectors * SECTOR_SIZE);
+		} else
+			r = osprd_store_discard(&d->store,
+						range.start * SECTOR_SIZE,
+						range.nsectors * SECTOR_SIZE);
+		spin_unlock_irq(&d->qlock);
+
+	} else if (cmd == OSPRDIOCMEMSTATS) {
+
+		// Report how much memory the ramdisk's data uses.
+		struct osprd_memstats ms;
+		ms.size = (unsigned long long) nsectors * SECTOR_SIZE;
+		spin_lock_irq(&d->qlock);
+		if (d->data) {
+			ms.data = ms.size;
+			ms.metadata = 0;
+			ms.all_data = ms.size * NOSPRD;
+			ms.all_metadata = 0;
+		} else {
+			ms.data = d->store.nbytes;
+			ms.metadata = (unsigned long long) d->store.nnodes
+				* sizeof(osprd_rnode_t)
+				+ (unsigned long long) d->store.nchunks
+				* sizeof(osprd_chunk_t);
+			ms.all_data = atomic_long_read(&osprd_pool.nbytes);
+			ms.all_metadata = (unsigned long long)
+				atomic_read(&osprd_pool.nnodes) * sizeof(osprd_rnode_t)
+				+ (unsigned long long)
+				atomic_read(&osprd_pool.nchunks) * sizeof(osprd_chunk_t);
+		}
+		spin_unlock_irq(&d->qlock);
+		if (copy_to_user((void __user *) arg, &ms, sizeof(ms)))
+			r = -EFAULT;
+
+	} else if (cmd == OSPRDIOCSNAPSHOT) {
+
+		// Make the target ramdisk a copy-on-write snapshot of this one.
+		// Both request queues are locked, in device order, so that no
+		// request sees the target half-replaced.  The target's old data
+		// is freed after they are unlocked.
+		struct osprd_snapshot snap;
+		struct file *tfilp;
+		osprd_info_t *t, *first, *second;
+		osprd_store_t old;
+		if (copy_from_user(&snap, (void __user *) arg, sizeof(snap)))
+			return -EFAULT;
+		if (!(tfilp = fget(snap.fd)))
+			return -EBADF;
+		t = file2osprd(tfilp);
+		if (t && !(tfilp->f_mode & FMODE_WRITE))
+			r = -EBADF;
+		else if (!t || t == d || !sparse
+			 || (snap.flags & ~OSPRD_SNAPSHOT_WRITABLE))
+			r = -EINVAL;
+		fput(tfilp);
+		if (r < 0)
+			return r;
+
+		first = (t < d ? t : d);
+		second = (t < d ? d : t);
+		spin_lock_irq(&first->qlock);
+		spin_lock(&second->qlock);
+		osprd_store_snapshot(&t->store, &d->store, &old);
+		t->readonly = !(snap.flags & OSPRD_SNAPSHOT_WRITABLE);
+		spin_unlock(&second->qlock);
+		spin_unlock_irq(&first->qlock);
+		set_disk_ro(t->gd, t->readonly);
+		osprd_store_destroy(&old);
+
+	} else if (cmd == OSPRDIOCFLUSH) {
+
+		// Write the ramdisk's changes back to its backing file, and
+		// wait until they are durable.
+		if (d->back.file)
+			r = osprd_backing_flush(&d->back, 1);
+
+	} else if (cmd == OSPRDIOCCOMPSTATS) {
+
+		// Report how a sparse ramdisk's chunks are stored, and how long
+		// its requests take.
+		struct osprd_compstats cs;
+		int i;
+		if (d->data)
+			return -EINVAL;
+		spin_lock_irq(&d->qlock);
+		cs.chunk_size = OSPRD_CHUNK_SIZE;
+		cs.chunks = d->store.nchunks;
+		cs.same = d->store.nsame;
+		cs.compressed = d->store.ncompressed;
+		cs.stored = d->store.nbytes;
+		cs.requests = d->nrequests;
+		cs.request_ns = d->request_ns;
+		cs.request_max_ns = d->request_max_ns;
+		cs.dedup_lookups = d->store.ndedup_lookups;
+		cs.dedup_hits = d->store.ndedup_hits;
+		cs.dedup_ns = d->store.dedup_ns;
+		spin_unlock_irq(&d->qlock);
+		// The other ramdisks' counts are read without their locks;
+		// they are only statistics.
+		for (i = cs.all_chunks = 0; i < NOSPRD; i++)
+			cs.all_chunks += osprds[i].store.nchunks;
+		cs.all_distinct = atomic_read(&osprd_pool.nchunks);
+		if (copy_to_user((void __user *) arg, &cs, sizeof(cs)))
+			r = -EFAULT;
 
 	} else
 		r = -ENOTTY; /* unknown command */
@@ -260,10 +829,13 @@ int osprd_ioctl(struct inode *inode, struct file *filp,
 
 static void osprd_setup(osprd_info_t *d)
 {
-	/* Initialize the wait queue. */
-	init_waitqueue_head(&d->blockq);
-	osp_spin_lock_init(&d->mutex);
-	d->ticket_head = d->ticket_tail = 0;
+	/* Initialize the device lock. */
+	osprd_lock_init(&d->lock, (sharded_readers ? OSPRD_LOCK_SHARDED : 0)
+			| (adaptive_spin ? OSPRD_LOCK_SPIN : 0), &osprd_wfg);
+	init_waitqueue_head(&d->poll_wait);
+	init_timer(&d->lease_timer);
+	d->lease_timer.function = osprd_lease_alarm;
+	d->lease_timer.data = (unsigned long) d;
 	/* Add code here if you add fields to osprd_info_t. */
 }
 
@@ -306,6 +878,7 @@ static int _osprd_open(struct inode *inode, struct file *filp)
 		memcpy(&osprd_blk_fops, filp->f_op, sizeof(osprd_blk_fops));
 		blkdev_release = osprd_blk_fops.release;
 		osprd_blk_fops.release = _osprd_release;
+		osprd_blk_fops.poll = osprd_poll;
 	}
 	filp->f_op = &osprd_blk_fops;
 	return osprd_open(inode, filp);
@@ -369,15 +942,64 @@ static void for_each_open_file(struct task_struct *task,
 
 static void cleanup_device(osprd_info_t *d)
 {
-	wake_up_all(&d->blockq);
+	if (d->lease_timer.function)
+		del_timer_sync(&d->lease_timer);
 	if (d->gd) {
 		del_gendisk(d->gd);
 		put_disk(d->gd);
 	}
 	if (d->queue)
 		blk_cleanup_queue(d->queue);
+	if (d->flusher)
+		kthread_stop(d->flusher);
+	if (d->back.file) {
+		if (osprd_backing_flush(&d->back, 1) < 0)
+			eprintk("osprd: can't write back to backing file\n");
+		osprd_backing_destroy(&d->back);
+		filp_close((struct file *) d->back.file, NULL);
+	}
 	if (d->data)
 		vfree(d->data);
+	else
+		osprd_store_destroy(&d->store);
+	if (d->stats)
+		free_percpu(d->stats);
+}
+
+
+// Open ramdisk 'which's backing file, load the ramdisk's data from it, and
+// start the thread that writes changes back.
+
+static int setup_backing(osprd_info_t *d, int which)
+{
+	char path[256];
+	struct file *filp;
+	int r;
+
+	snprintf(path, sizeof(path), "%s%c", backing, which + 'a');
+	filp = filp_open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+	if (IS_ERR(filp)) {
+		eprintk("osprd: can't open backing file %s\n", path);
+		return PTR_ERR(filp);
+	}
+	if ((r = osprd_backing_init(&d->back, &osprd_file_ops, filp, d->data,
+				    (unsigned long long) nsectors * SECTOR_SIZE)) < 0) {
+		d->back.file = NULL;
+		filp_close(filp, NULL);
+		return r;
+	}
+	if ((r = osprd_backing_load(&d->back)) < 0) {
+		eprintk("osprd: can't read backing file %s\n", path);
+		return r;
+	}
+
+	d->flusher = kthread_run(osprd_flusher, d, "osprd%c-flush", which + 'a');
+	if (IS_ERR(d->flusher)) {
+		r = PTR_ERR(d->flusher);
+		d->flusher = NULL;
+		return r;
+	}
+	return 0;
 }
 
 
@@ -387,14 +1009,34 @@ static int setup_device(osprd_info_t *d, int which)
 {
 	memset(d, 0, sizeof(osprd_info_t));
 
-	/* Get memory to store the actual block data. */
-	if (!(d->data = vmalloc(nsectors * SECTOR_SIZE)))
+	/* Get memory to store the actual block data.  A sparse ramdisk gets
+	 * it as it is written. */
+	if (sparse) {
+		if (osprd_store_init(&d->store,
+				     (unsigned long long) nsectors * SECTOR_SIZE,
+				     &osprd_pool,
+				     (compress ? OSPRD_STORE_COMPRESS : 0)
+				     | (dedup ? OSPRD_STORE_DEDUP : 0)) < 0)
+			return -1;
+	} else if (!(d->data = vmalloc(nsectors * SECTOR_SIZE)))
+		return -1;
+	else
+		memset(d->data, 0, nsectors * SECTOR_SIZE);
+
+	/* Load it from the backing file, if any, before the disk appears. */
+	if (backing && setup_backing(d, which) < 0)
+		return -1;
+
+	if (!(d->stats = alloc_percpu(struct osprd_stats)))
 		return -1;
-	memset(d->data, 0, nsectors * SECTOR_SIZE);
 
 	/* Set up the I/O queue. */
 	spin_lock_init(&d->qlock);
-	if (!(d->queue = blk_init_queue(osprd_process_request_queue, &d->qlock)))
+	if (multiqueue) {
+		if (!(d->queue = blk_alloc_queue(GFP_KERNEL)))
+			return -1;
+		blk_queue_make_request(d->queue, osprd_make_request);
+	} else if (!(d->queue = blk_init_queue(osprd_process_request_queue, &d->qlock)))
 		return -1;
 	blk_queue_hardsect_size(d->queue, SECTOR_SIZE);
 	d->queue->queuedata = d;
@@ -434,6 +1076,15 @@ static int __init osprd_init(void)
 	(void) osp_spin_unlock;
 #endif
 
+	if (lock_lease < 0) {
+		printk(KERN_WARNING "osprd: lock_lease must not be negative\n");
+		return -EINVAL;
+	}
+	if (backing && (sparse || compress || dedup)) {
+		printk(KERN_WARNING "osprd: backing files need dense ramdisks\n");
+		return -EINVAL;
+	}
+
 	/* Register the block device name. */
 	if (register_blkdev(OSPRD_MAJOR, "osprd") < 0) {
 		printk(KERN_WARNING "osprd: unable to get major number\n");
@@ -441,6 +1092,14 @@ static int __init osprd_init(void)
 	}
 
 	/* Initialize the device structures. */
+	osprd_wfg_init(&osprd_wfg);
+	osprd_pool_init(&osprd_pool);
+	if (compress || dedup)
+		sparse = 1;
+	if (dedup && osprd_pool_dedup_init(&osprd_pool, OSPRD_DEDUP_BUCKETS) < 0) {
+		unregister_blkdev(OSPRD_MAJOR, "osprd");
+		return -ENOMEM;
+	}
 	for (i = r = 0; i < NOSPRD; i++)
 		if (setup_device(&osprds[i], i) < 0)
 			r = -EINVAL;
@@ -462,6 +1121,7 @@ static void osprd_exit(void)
 	int i;
 	for (i = 0; i < NOSPRD; i++)
 		cleanup_device(&osprds[i]);
+	osprd_pool_destroy(&osprd_pool);
 	unregister_blkdev(OSPRD_MAJOR, "osprd");
 }
 
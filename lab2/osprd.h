@@ -5,5 +5,141 @@
 #define OSPRDIOCACQUIRE		42
 #define OSPRDIOCTRYACQUIRE	43
 #define OSPRDIOCRELEASE		44
+#define OSPRDIOCWAKESTATS	45
+#define OSPRDIOCACQUIRERANGE	46
+#define OSPRDIOCTRYACQUIRERANGE	47
+
+// A range of sectors for OSPRDIOCACQUIRERANGE and OSPRDIOCTRYACQUIRERANGE,
+// which lock just those sectors.  'arg' points to one of these.
+// OSPRDIOCRELEASE releases a range lock like any other.
+struct osprd_range {
+	unsigned long long start;	// First sector
+	unsigned long long nsectors;	// Number of sectors (at least 1)
+};
+
+#define OSPRDIOCDISCARD		48
+#define OSPRDIOCMEMSTATS	49
+
+// OSPRDIOCDISCARD makes the sectors in the struct osprd_range that 'arg'
+// points to read as zeros, freeing their memory on a sparse ramdisk.  The
+// file must be open for writing.
+
+// Memory use, filled in by OSPRDIOCMEMSTATS.  'arg' points to one of these.
+struct osprd_memstats {
+	unsigned long long size;	// Device size, in bytes
+	unsigned long long data;	// Bytes of memory holding data
+	unsigned long long metadata;	// Bytes of memory indexing it
+	unsigned long long all_data;	// 'data' and 'metadata' for all the
+	unsigned long long all_metadata; // ramdisks, counting shared memory
+};					// once
+
+#define OSPRDIOCSNAPSHOT	50
+
+// OSPRDIOCSNAPSHOT makes another sparse ramdisk a snapshot of this one: a
+// copy of its current contents, made in constant time by sharing this
+// ramdisk's memory.  A chunk is copied when either ramdisk first writes it.
+// The target's old contents are lost.  'arg' points to one of these.
+struct osprd_snapshot {
+	int fd;				// Target ramdisk, open for writing
+	unsigned flags;			// OSPRD_SNAPSHOT_* flags
+};
+
+#define OSPRD_SNAPSHOT_WRITABLE	1	// Else the snapshot is read-only
+
+#define OSPRDIOCCOMPSTATS	51
+
+// Statistics for a sparse or compressed ramdisk, filled in by
+// OSPRDIOCCOMPSTATS.  'arg' points to one of these.  The compression ratio
+// is chunks * chunk_size / stored.  With deduplication, 'stored' counts a
+// shared chunk once per use; the dedup ratio over all ramdisks is
+// all_chunks / all_distinct.
+struct osprd_compstats {
+	unsigned long long chunk_size;	// Bytes per chunk
+	unsigned long long chunks;	// Chunks stored (a compressed ramdisk
+					// does not store all-zero chunks)
+	unsigned long long same;	// Chunks stored as one repeated word
+	unsigned long long compressed;	// Chunks stored LZ-compressed
+	unsigned long long stored;	// Bytes of memory holding chunk data
+	unsigned long long requests;	// Requests transferred
+	unsigned long long request_ns;	// Total time spent transferring them
+	unsigned long long request_max_ns; // Longest time for one request
+	unsigned long long dedup_lookups; // Chunk writes looked up in the
+					// dedup index
+	unsigned long long dedup_hits;	// Lookups that found a chunk to share
+	unsigned long long dedup_ns;	// Total time spent on the lookups
+	unsigned long long all_chunks;	// Chunks in all ramdisks, counting
+					// each use of a shared chunk
+	unsigned long long all_distinct; // Chunks in memory (chunks shared by
+					// snapshots also count once)
+};
+
+#define OSPRDIOCSTATS		52
+
+// Usage statistics, filled in by OSPRDIOCSTATS.  'arg' points to one of
+// these.  The times are log2 histograms: bucket i counts times from 2^i to
+// 2^(i+1)-1 nanoseconds (bucket 0 also counts 0, and the last bucket counts
+// everything longer).
+#define OSPRD_HIST_BUCKETS	32
+
+struct osprd_stats {
+	unsigned long long reads;	// Read requests
+	unsigned long long writes;	// Write requests
+	unsigned long long read_sectors; // Sectors read
+	unsigned long long write_sectors; // Sectors written
+	unsigned long long lock_acquires; // Locks granted
+	unsigned long long lock_waits;	// Lock requests that had to sleep
+	unsigned long long lock_deadlocks; // Lock requests refused with EDEADLK
+	unsigned long long request_ns[OSPRD_HIST_BUCKETS]; // Request processing
+	unsigned long long lock_wait_ns[OSPRD_HIST_BUCKETS]; // Sleeping for locks
+};
+
+#define OSPRDIOCFLUSH		53
+
+// OSPRDIOCFLUSH writes a ramdisk's changed data back to its backing file
+// (see osprd's backing= parameter) and waits until it is durable.  'arg' is
+// ignored.  Without the ioctl, changes are written back every
+// flush_interval milliseconds, but not made durable.  Returns 0 at once if
+// the ramdisk has no backing file.
+
+#define OSPRDIOCACQUIREASYNC	54
+#define OSPRDIOCACQUIRERANGEASYNC 55
+
+// OSPRDIOCACQUIREASYNC and OSPRDIOCACQUIRERANGEASYNC ask for the lock like
+// OSPRDIOCACQUIRE and OSPRDIOCACQUIRERANGE, but never block.  They return 0
+// if the lock was granted at once.  Otherwise, they return -EINPROGRESS
+// and the request waits in line, in ticket order, without the caller.
+// poll() on the file reports neither POLLIN nor POLLOUT while the request
+// waits, and both once it is granted; the file then holds the lock.
+// OSPRDIOCRELEASE (or closing the file) cancels a waiting request.  They
+// return -EDEADLK where OSPRDIOCACQUIRE would.
+
+#define OSPRDIOCSETLEASE	56
+
+// OSPRDIOCSETLEASE gives the file's later lock requests a lease of 'arg'
+// milliseconds (0, the default unless osprd's lock_lease= parameter is
+// set, means none).  A lock held longer than its lease can be revoked:
+// once the lease runs out, a request waiting for the lock, or asking for
+// it later, takes the lock away and serves the requests in line, as a
+// release would.
+// The file still counts as locking the ramdisk until OSPRDIOCRELEASE,
+// which then returns -ETIMEDOUT, so the process learns that its critical
+// section was not protected to the end.  (An asynchronous request that
+// is waiting sees leases revoked when poll() checks the file, which a
+// poll() with a timeout does when it times out.)
+
+// Lock wakeup statistics, filled in by OSPRDIOCWAKESTATS.
+// 'arg' points to one of these.
+struct osprd_wakestats {
+	unsigned long long blocked;	// Lock requests that had to sleep
+	unsigned long long wakeups;	// Wakeups sent to waiting requests
+	unsigned long long switches;	// Context switches they made while
+					// blocked
+	unsigned long long spun;	// Lock requests granted while spinning,
+					// without sleeping (adaptive_spin=1)
+	unsigned long long hold_ns;	// Recent average lock hold time
+					// (adaptive_spin=1)
+	unsigned long long revoked;	// Locks revoked when their leases ran
+					// out (see OSPRDIOCSETLEASE)
+};
 
 #endif
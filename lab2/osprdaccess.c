@@ -1,10 +1,14 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -17,6 +21,7 @@ Reads from or writes to an OSP ramdisk device.\n\
 Usage: ./osprdaccess -w [SIZE] [OPTIONS] [DEVICE...] < DATA\n\
    or: ./osprdaccess -w [SIZE] -z [DEVICE...]        (writes zeros)\n\
    or: ./osprdaccess -r [SIZE] [OPTIONS] [DEVICE...] > DATA\n\
+   or: ./osprdaccess -b BATCHFILE [-B MAXBATCH] [OPTIONS] [DEVICE...]\n\
    SIZE is the number of bytes to read/write.  Default is whole file.\n\
    Options are:\n\
    -o OFF\n\
@@ -27,8 +32,68 @@ Usage: ./osprdaccess -w [SIZE] [OPTIONS] [DEVICE...] < DATA\n\
    -L [DELAY]\n\
        Attempt to lock the ramdisk without blocking.  This is like -l, but if\n\
        -l would block, -L will return a \"resource busy\" error instead.\n\
+   -a [DELAY]\n\
+       Lock the ramdisk asynchronously: ask for the lock like -l, but go on\n\
+       without waiting for it.  Once every DEVICE is open, wait for all the\n\
+       -a locks at once with poll(), printing each device's name to standard\n\
+       error as its lock is granted, and then read/write.  For example:\n\
+         ./osprdaccess -r 0 -a /dev/osprda -a /dev/osprdb -a /dev/osprdc\n\
+   -R START NSECTORS\n\
+       Make -l, -L, or -a lock only sectors START through START+NSECTORS-1, so\n\
+       that processes locking disjoint ranges do not wait for each other.\n\
+       For example, to time two writers to separate halves of a 64-sector\n\
+       ramdisk:\n\
+         time sh -c './osprdaccess -w 16384 -o 0 -l -R 0 32 -d 1 -z &\n\
+                    ./osprdaccess -w 16384 -o 16384 -l -R 32 32 -d 1 -z; wait'\n\
+   -e MSEC\n\
+       Ask for -l, -L, or -a locks with a lease of MSEC milliseconds, after\n\
+       which the lock may be revoked if another process wants it.  Before\n\
+       exiting, release the lock and report whether it was revoked.  For\n\
+       example, this writer loses its lock to the reader a second after\n\
+       taking it:\n\
+         ./osprdaccess -w 0 -l -e 1000 -d 5 & sleep 0.5; ./osprdaccess -r 0 -l\n\
    -d DELAY\n\
        Wait DELAY seconds before reading/writing (but after locking).\n\
+   -t START NSECTORS\n\
+       Discard sectors START through START+NSECTORS-1 before reading/writing,\n\
+       so they read as zeros and, on a sparse ramdisk, free their memory.\n\
+       Needs -w; use \"-w 0\" to discard without writing.\n\
+   -m\n\
+       After reading/writing, print how much memory the ramdisk's data uses\n\
+       to standard error, and for a sparse ramdisk, how its chunks are\n\
+       stored (compression and dedup ratios) and how long its requests have\n\
+       taken.\n\
+   -s\n\
+       After reading/writing, print the ramdisk's usage statistics to\n\
+       standard error: request and lock counts, and histograms of how long\n\
+       requests took and how long lock requests slept.\n\
+   -b BATCHFILE\n\
+       Instead of reading or writing once, issue the requests listed in\n\
+       BATCHFILE, one per line: \"OFFSET LENGTH r\" or \"OFFSET LENGTH w\"\n\
+       (lines starting with # are ignored).  Runs of requests with the same\n\
+       op that are contiguous on the disk are issued together, with one\n\
+       preadv or pwritev call.  Prints each request's latency (the time its\n\
+       call took) to standard output, and the throughput and latency\n\
+       percentiles to standard error.  Writes store each 8-byte word's disk\n\
+       offset in it, or zeros with -z.\n\
+   -B MAXBATCH\n\
+       Put at most MAXBATCH requests in one call.  Default is 64; -B 1\n\
+       issues every request separately.\n\
+   -T\n\
+       Before exiting (and so releasing the lock), print when the lock was\n\
+       requested and acquired, and the current time, to standard error as\n\
+       \"timing: PID r|w REQUESTED ACQUIRED RELEASED\" (seconds since the\n\
+       epoch).  lab2-bench.pl uses this.\n\
+   -f\n\
+       After reading/writing, write the ramdisk's changes back to its backing\n\
+       file and wait until they are durable.  Needs backing=.\n\
+   -S TARGET [-W]\n\
+       Before reading/writing, make ramdisk TARGET a copy-on-write snapshot\n\
+       of the ramdisk, sharing its memory until either is written.  The\n\
+       snapshot is read-only unless -W is given.  Needs sparse=1.\n\
+       For example, to snapshot osprda into osprdb and compare them:\n\
+         ./osprdaccess -r 0 -S /dev/osprdb /dev/osprda\n\
+         cmp /dev/osprda /dev/osprdb\n\
    DEVICE is the device to read/write.  The default is /dev/osprda.\n\
    You can also give more than one device name.  All devices are opened, but\n\
    only the last device is read or written.\n");
@@ -74,6 +139,26 @@ void sleep_for(double seconds)
 	}
 }
 
+// Print a time histogram from struct osprd_stats, skipping empty buckets.
+void print_histogram(const char *name, const unsigned long long *hist)
+{
+	static const char *units[] = { "ns", "us", "ms", "s" };
+	int b;
+
+	fprintf(stderr, "%s:\n", name);
+	for (b = 0; b < OSPRD_HIST_BUCKETS; b++) {
+		unsigned long long lo = (b == 0 ? 0 : 1ULL << b);
+		int u = 0;
+		if (!hist[b])
+			continue;
+		while (lo >= 1000 && u < 3)
+			lo /= 1000, u++;
+		fprintf(stderr, "  %s%4llu %-2s: %llu\n",
+			b == OSPRD_HIST_BUCKETS - 1 ? ">=" : "  ", lo, units[u],
+			hist[b]);
+	}
+}
+
 void transfer(int fd1, int fd2, ssize_t size)
 {
 	char buf[BUFSIZ], *bufptr;
@@ -125,12 +210,193 @@ void transfer_zero(int fd2, ssize_t size)
 	}
 }
 
+// A request from a batch file.
+typedef struct batch_req {
+	off_t offset;
+	ssize_t length;
+	int writing;
+	double latency;		// Seconds its call took
+} batch_req_t;
+
+double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Read the requests in 'filename'.  Returns the number read, with the
+// requests in a malloc'd array in '*reqs'.
+ssize_t read_batch(const char *filename, batch_req_t **reqs)
+{
+	FILE *f = fopen(filename, "r");
+	char line[BUFSIZ];
+	ssize_t n = 0, cap = 0;
+	int lineno = 0;
+
+	if (!f) {
+		perror(filename);
+		exit(1);
+	}
+	*reqs = NULL;
+	while (fgets(line, sizeof(line), f)) {
+		long long offset, length;
+		char op;
+		lineno++;
+		if (line[strspn(line, " \t\n")] == '\0' || line[0] == '#')
+			continue;
+		if (sscanf(line, "%lli %lli %c", &offset, &length, &op) != 3
+		    || offset < 0 || length <= 0 || (op != 'r' && op != 'w')) {
+			fprintf(stderr, "%s:%d: bad request\n", filename, lineno);
+			exit(1);
+		}
+		if (n == cap) {
+			cap = cap ? cap * 2 : 64;
+			if (!(*reqs = realloc(*reqs, cap * sizeof(batch_req_t)))) {
+				fprintf(stderr, "out of memory\n");
+				exit(1);
+			}
+		}
+		(*reqs)[n].offset = offset;
+		(*reqs)[n].length = length;
+		(*reqs)[n].writing = (op == 'w');
+		n++;
+	}
+	fclose(f);
+	return n;
+}
+
+int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+// Issue the 'n' requests in 'reqs' to 'devfd', up to 'maxbatch' per call,
+// and report their latencies and the throughput.
+void run_batch(int devfd, batch_req_t *reqs, ssize_t n, int maxbatch,
+	       int zero)
+{
+	struct iovec iov[IOV_MAX];
+	char *buf = NULL, *p;
+	ssize_t i, j, k, r, total, bufsize = 0, nwrites = 0, ncalls = 0;
+	long long nbytes = 0;
+	double start, elapsed, t, *lat;
+
+	if (maxbatch > IOV_MAX)
+		maxbatch = IOV_MAX;
+
+	start = now();
+	for (i = 0; i < n; i = j) {
+		// Gather the run of contiguous requests with the same op.
+		total = reqs[i].length;
+		for (j = i + 1; j < n && j - i < maxbatch
+			     && reqs[j].writing == reqs[i].writing
+			     && reqs[j].offset == reqs[j - 1].offset
+				+ reqs[j - 1].length; j++)
+			total += reqs[j].length;
+
+		if (total > bufsize) {
+			free(buf);
+			if (!(buf = malloc(total))) {
+				fprintf(stderr, "out of memory\n");
+				exit(1);
+			}
+			bufsize = total;
+		}
+		if (reqs[i].writing && zero)
+			memset(buf, 0, total);
+		else if (reqs[i].writing)
+			for (k = 0; k + 8 <= total; k += 8) {
+				unsigned long long word = reqs[i].offset + k;
+				memcpy(buf + k, &word, 8);
+			}
+		for (k = i, p = buf; k < j; p += reqs[k].length, k++) {
+			iov[k - i].iov_base = p;
+			iov[k - i].iov_len = reqs[k].length;
+		}
+
+		t = now();
+		do {
+			if (reqs[i].writing)
+				r = pwritev(devfd, iov, j - i, reqs[i].offset);
+			else
+				r = preadv(devfd, iov, j - i, reqs[i].offset);
+		} while (r < 0 && (errno == EAGAIN || errno == EINTR));
+		t = now() - t;
+		ncalls++;
+		if (r < 0) {
+			fprintf(stderr, "%s at offset %lld: %s\n",
+				reqs[i].writing ? "pwritev" : "preadv",
+				(long long) reqs[i].offset, strerror(errno));
+			exit(1);
+		} else if (r != total) {
+			fprintf(stderr, "%s at offset %lld: transferred %ld of %ld bytes\n",
+				reqs[i].writing ? "pwritev" : "preadv",
+				(long long) reqs[i].offset, (long) r, (long) total);
+			exit(1);
+		}
+
+		for (k = i; k < j; k++)
+			reqs[k].latency = t;
+		nbytes += total;
+		if (reqs[i].writing)
+			nwrites += j - i;
+	}
+	elapsed = now() - start;
+	free(buf);
+
+	if (!(lat = malloc(n * sizeof(double)))) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		printf("%lld %ld %c %.1f\n", (long long) reqs[i].offset,
+		       (long) reqs[i].length, reqs[i].writing ? 'w' : 'r',
+		       reqs[i].latency * 1e6);
+		lat[i] = reqs[i].latency * 1e6;
+	}
+	qsort(lat, n, sizeof(double), compare_double);
+
+	if (elapsed <= 0)
+		elapsed = 1e-9;
+	fprintf(stderr, "%ld requests (%ld reads, %ld writes) in %ld calls: %lld bytes in %.3f s\n",
+		(long) n, (long) (n - nwrites), (long) nwrites, (long) ncalls,
+		nbytes, elapsed);
+	fprintf(stderr, "throughput: %.1f MB/s, %.0f requests/s\n",
+		nbytes / 1048576.0 / elapsed, n / elapsed);
+	if (n > 0)
+		fprintf(stderr, "latency (us): p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+			lat[n / 2], lat[n * 9 / 10], lat[n * 99 / 100],
+			lat[n - 1]);
+	free(lat);
+}
+
 int main(int argc, char *argv[])
 {
 	char *newarg;
 	int devfd, ofd;
 	int i, r, timeout = 0, zero = 0;
-	int mode = O_RDONLY, dolock = 0, dotrylock = 0;
+	int mode = O_RDONLY, dolock = 0, dotrylock = 0, doasync = 0, dorange = 0;
+	int dodiscard = 0, domemstats = 0, dostats = 0, doflush = 0;
+	const char *snapname = NULL;
+	const char *batchname = NULL;
+	int maxbatch = 64;
+	int dotiming = 0;
+	double lock_requested = 0, lock_acquired = 0;
+	struct pollfd *async = malloc(argc * sizeof(struct pollfd));
+	const char **async_names = malloc(argc * sizeof(const char *));
+	double *async_requested = malloc(argc * sizeof(double));
+	int nasync = 0;
+	batch_req_t *reqs = NULL;
+	ssize_t nreqs = 0;
+	struct osprd_snapshot snap = { -1, 0 };
+	struct osprd_range range, discard;
+	struct osprd_memstats ms;
+	struct osprd_compstats cs;
+	struct osprd_stats st;
+	ssize_t range_start, range_nsectors;
+	ssize_t lease_ms = 0;
 	ssize_t size = -1;
 	ssize_t offset = 0;
 	double delay = 0;
@@ -153,6 +419,21 @@ int main(int argc, char *argv[])
 		goto flag;
 	}
 
+	// Detect a batch option
+	if (argc >= 2 && strcmp(argv[1], "-b") == 0) {
+		if (argc < 3)
+			usage(1);
+		batchname = argv[2];
+		mode = O_RDWR;
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 2 && strcmp(argv[1], "-B") == 0) {
+		if (argc < 3 || (maxbatch = atoi(argv[2])) <= 0)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	}
+
 	// Detect an offset
 	if (argc >= 2 && strcmp(argv[1], "-o") == 0) {
 		if (argc < 2 || !parse_ssize(argv[2], &offset))
@@ -164,7 +445,7 @@ int main(int argc, char *argv[])
 	// Detect a lock option
 	if (argc >= 2 && strcmp(argv[1], "-l") == 0) {
 		dolock = 1;
-		dotrylock = 0;
+		dotrylock = doasync = 0;
 		argv++, argc--;
 		if (argc >= 2 && parse_double(argv[1], &lock_delay))
 			argv++, argc--;
@@ -174,13 +455,44 @@ int main(int argc, char *argv[])
 	// Detect an attempt-lock option
 	if (argc >= 2 && strcmp(argv[1], "-L") == 0) {
 		dotrylock = 1;
-		dolock = 0;
+		dolock = doasync = 0;
+		argv++, argc--;
+		if (argc >= 2 && parse_double(argv[1], &lock_delay))
+			argv++, argc--;
+		goto flag;
+	}
+
+	// Detect an asynchronous lock option
+	if (argc >= 2 && strcmp(argv[1], "-a") == 0) {
+		doasync = 1;
+		dolock = dotrylock = 0;
 		argv++, argc--;
 		if (argc >= 2 && parse_double(argv[1], &lock_delay))
 			argv++, argc--;
 		goto flag;
 	}
 
+	// Detect a lock range option
+	if (argc >= 2 && strcmp(argv[1], "-R") == 0) {
+		if (argc < 4 || !parse_ssize(argv[2], &range_start)
+		    || !parse_ssize(argv[3], &range_nsectors)
+		    || range_start < 0 || range_nsectors <= 0)
+			usage(1);
+		range.start = range_start;
+		range.nsectors = range_nsectors;
+		dorange = 1;
+		argv += 3, argc -= 3;
+		goto flag;
+	}
+
+	// Detect a lease option
+	if (argc >= 2 && strcmp(argv[1], "-e") == 0) {
+		if (argc < 3 || !parse_ssize(argv[2], &lease_ms) || lease_ms < 0)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	}
+
 	// Detect a delay option
 	if (argc >= 2 && strcmp(argv[1], "-d") == 0) {
 		argv++, argc--;
@@ -189,6 +501,63 @@ int main(int argc, char *argv[])
 		goto flag;
 	}
 
+	// Detect a discard option
+	if (argc >= 2 && strcmp(argv[1], "-t") == 0) {
+		if (argc < 4 || !parse_ssize(argv[2], &range_start)
+		    || !parse_ssize(argv[3], &range_nsectors)
+		    || range_start < 0 || range_nsectors <= 0)
+			usage(1);
+		discard.start = range_start;
+		discard.nsectors = range_nsectors;
+		dodiscard = 1;
+		argv += 3, argc -= 3;
+		goto flag;
+	}
+
+	// Detect a memory statistics option
+	if (argc >= 2 && strcmp(argv[1], "-m") == 0) {
+		domemstats = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
+	// Detect a statistics option
+	if (argc >= 2 && strcmp(argv[1], "-s") == 0) {
+		dostats = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
+	// Detect a snapshot option
+	if (argc >= 2 && strcmp(argv[1], "-S") == 0) {
+		if (argc < 3)
+			usage(1);
+		snapname = argv[2];
+		argv += 2, argc -= 2;
+		goto flag;
+	}
+
+	// Detect a writable snapshot option
+	if (argc >= 2 && strcmp(argv[1], "-W") == 0) {
+		snap.flags |= OSPRD_SNAPSHOT_WRITABLE;
+		argv++, argc--;
+		goto flag;
+	}
+
+	// Detect a flush option
+	if (argc >= 2 && strcmp(argv[1], "-f") == 0) {
+		doflush = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
+	// Detect a timing option
+	if (argc >= 2 && strcmp(argv[1], "-T") == 0) {
+		dotiming = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
 	// Detect a zeroes option
 	if (argc >= 2 && strcmp(argv[1], "-z") == 0) {
 		zero = 1;
@@ -214,18 +583,49 @@ int main(int argc, char *argv[])
 	}
 
 	// Lock, possibly after delay
-	if (dolock || dotrylock) {
+	if (dolock || dotrylock || doasync) {
 		if (lock_delay >= 0)
 			sleep_for(lock_delay);
-		if (dolock
+		if (lease_ms && ioctl(devfd, OSPRDIOCSETLEASE, lease_ms) == -1) {
+			perror("ioctl OSPRDIOCSETLEASE");
+			exit(1);
+		}
+		lock_requested = now();
+		if (doasync) {
+			if (ioctl(devfd, dorange ? OSPRDIOCACQUIRERANGEASYNC
+				  : OSPRDIOCACQUIREASYNC,
+				  dorange ? &range : NULL) == 0)
+				fprintf(stderr, "%s: locked\n", devname);
+			else if (errno == EINPROGRESS) {
+				// Wait for it below.
+				async[nasync].fd = devfd;
+				async[nasync].events = POLLIN;
+				async_names[nasync] = devname;
+				async_requested[nasync] = lock_requested;
+				nasync++;
+			} else {
+				perror(dorange ? "ioctl OSPRDIOCACQUIRERANGEASYNC"
+				       : "ioctl OSPRDIOCACQUIREASYNC");
+				exit(1);
+			}
+		} else if (dorange && dolock
+		    && ioctl(devfd, OSPRDIOCACQUIRERANGE, &range) == -1) {
+			perror("ioctl OSPRDIOCACQUIRERANGE");
+			exit(1);
+		} else if (dorange && dotrylock
+			   && ioctl(devfd, OSPRDIOCTRYACQUIRERANGE, &range) == -1) {
+			perror("ioctl OSPRDIOCTRYACQUIRERANGE");
+			exit(1);
+		} else if (!dorange && dolock
 		    && ioctl(devfd, OSPRDIOCACQUIRE, NULL) == -1) {
 			perror("ioctl OSPRDIOCACQUIRE");
 			exit(1);
-		} else if (dotrylock
+		} else if (!dorange && dotrylock
 			   && ioctl(devfd, OSPRDIOCTRYACQUIRE, NULL) == -1) {
 			perror("ioctl OSPRDIOCTRYACQUIRE");
 			exit(1);
 		}
+		lock_acquired = now();
 	}
 
 	// Delay
@@ -236,6 +636,49 @@ int main(int argc, char *argv[])
 	if (argc > 1)
 		goto flag;
 
+	// Wait for the asynchronous locks, in whatever order they are granted.
+	// A granted request's file polls readable.
+	while (nasync > 0) {
+		if (poll(async, nasync, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			exit(1);
+		}
+		for (i = 0; i < nasync; )
+			if (async[i].revents & POLLIN) {
+				double t = now();
+				fprintf(stderr, "%s: locked after %.6f s\n",
+					async_names[i], t - async_requested[i]);
+				if (async[i].fd == devfd)
+					lock_acquired = t;
+				nasync--;
+				async[i] = async[nasync];
+				async_names[i] = async_names[nasync];
+				async_requested[i] = async_requested[nasync];
+			} else
+				i++;
+	}
+
+	// Snapshot
+	if (snapname) {
+		if ((snap.fd = open(snapname, O_RDWR)) == -1) {
+			perror(snapname);
+			exit(1);
+		}
+		if (ioctl(devfd, OSPRDIOCSNAPSHOT, &snap) == -1) {
+			perror("ioctl OSPRDIOCSNAPSHOT");
+			exit(1);
+		}
+		close(snap.fd);
+	}
+
+	// Discard
+	if (dodiscard && ioctl(devfd, OSPRDIOCDISCARD, &discard) == -1) {
+		perror("ioctl OSPRDIOCDISCARD");
+		exit(1);
+	}
+
 	// Seek to offset
 	if (lseek(devfd, offset, SEEK_SET) == (off_t) -1) {
 		perror("lseek");
@@ -243,12 +686,83 @@ int main(int argc, char *argv[])
 	}
 
 	// Read or write
-	if ((mode & O_WRONLY) && zero)
+	if (batchname) {
+		nreqs = read_batch(batchname, &reqs);
+		run_batch(devfd, reqs, nreqs, maxbatch, zero);
+		free(reqs);
+	} else if ((mode & O_WRONLY) && zero)
 		transfer_zero(devfd, size);
 	else if (mode & O_WRONLY)
 		transfer(STDIN_FILENO, devfd, size);
 	else
 		transfer(devfd, STDOUT_FILENO, size);
 
+	// Write back to the backing file
+	if (doflush && ioctl(devfd, OSPRDIOCFLUSH, NULL) == -1) {
+		perror("ioctl OSPRDIOCFLUSH");
+		exit(1);
+	}
+
+	// Report memory use
+	if (domemstats) {
+		if (ioctl(devfd, OSPRDIOCMEMSTATS, &ms) == -1) {
+			perror("ioctl OSPRDIOCMEMSTATS");
+			exit(1);
+		}
+		fprintf(stderr, "%s: %llu bytes: %llu bytes of data memory, %llu bytes of metadata\n",
+			devname, ms.size, ms.data, ms.metadata);
+		fprintf(stderr, "all ramdisks: %llu bytes of data memory, %llu bytes of metadata\n",
+			ms.all_data, ms.all_metadata);
+		// Dense ramdisks have no chunk statistics.
+		if (ioctl(devfd, OSPRDIOCCOMPSTATS, &cs) == 0) {
+			fprintf(stderr, "%llu chunks (%llu same-filled, %llu compressed) in %llu bytes: ratio %.2f\n",
+				cs.chunks, cs.same, cs.compressed, cs.stored,
+				cs.stored ? (double) cs.chunks * cs.chunk_size / cs.stored : 0.0);
+			fprintf(stderr, "%llu requests: %.1f us average, %.1f us maximum\n",
+				cs.requests,
+				cs.requests ? cs.request_ns / 1000.0 / cs.requests : 0.0,
+				cs.request_max_ns / 1000.0);
+			if (cs.dedup_lookups)
+				fprintf(stderr, "dedup: %llu of %llu chunk writes shared a chunk, %.2f us per lookup\n",
+					cs.dedup_hits, cs.dedup_lookups,
+					cs.dedup_ns / 1000.0 / cs.dedup_lookups);
+			fprintf(stderr, "all ramdisks: %llu chunks in %llu distinct chunks: dedup ratio %.2f\n",
+				cs.all_chunks, cs.all_distinct,
+				cs.all_distinct ? (double) cs.all_chunks / cs.all_distinct : 0.0);
+		}
+	}
+
+	// Report usage statistics
+	if (dostats) {
+		if (ioctl(devfd, OSPRDIOCSTATS, &st) == -1) {
+			perror("ioctl OSPRDIOCSTATS");
+			exit(1);
+		}
+		fprintf(stderr, "%s: %llu reads (%llu sectors), %llu writes (%llu sectors)\n",
+			devname, st.reads, st.read_sectors, st.writes,
+			st.write_sectors);
+		fprintf(stderr, "locks: %llu acquired, %llu slept, %llu deadlocks refused\n",
+			st.lock_acquires, st.lock_waits, st.lock_deadlocks);
+		print_histogram("request time", st.request_ns);
+		print_histogram("lock sleep time", st.lock_wait_ns);
+	}
+
+	// Report lock timing; exiting releases the lock
+	if (dotiming)
+		fprintf(stderr, "timing: %d %c %.6f %.6f %.6f\n", (int) getpid(),
+			mode != O_RDONLY ? 'w' : 'r', lock_requested,
+			lock_acquired, now());
+
+	// With a lease, release the lock here, to find out if it was revoked
+	if (lease_ms && (dolock || dotrylock || doasync)
+	    && ioctl(devfd, OSPRDIOCRELEASE, NULL) == -1) {
+		if (errno != ETIMEDOUT) {
+			perror("ioctl OSPRDIOCRELEASE");
+			exit(1);
+		}
+		fprintf(stderr, "%s: lock revoked after its %ld ms lease ran out\n",
+			devname, (long) lease_ms);
+	}
+
 	exit(0);
 }
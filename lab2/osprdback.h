@@ -0,0 +1,179 @@
+#ifndef OSPRDBACK_H
+#define OSPRDBACK_H
+
+/*
+ * OSPRD write-back
+ *
+ *   Keeps a dense ramdisk's data in a backing file (osprd's backing=
+ *   mode), so that it survives the module being unloaded.  Reads never
+ *   touch the file.  Writes mark the chunks they change in a dirty bitmap,
+ *   and osprd_backing_flush(), called from a background thread every so
+ *   often and from OSPRDIOCFLUSH, writes the dirty chunks back.
+ *
+ *   A chunk's bit is cleared before the chunk is copied out, and a write
+ *   sets it after changing the data, so a write racing with a flush is
+ *   written back by the next flush at the latest.  Writers need no lock;
+ *   flushes are serialized by a mutex.
+ *
+ *   The file is reached through an osprd_backing_ops_t, so that osprd can
+ *   use the VFS and userspace (osprdsim) can use pread and pwrite.  Like
+ *   osprdlock.h, this file is shared with userspace (include kcompat.h
+ *   first there).
+ */
+
+#define OSPRD_BACK_CHUNK_SHIFT	12
+#define OSPRD_BACK_CHUNK_SIZE	(1 << OSPRD_BACK_CHUNK_SHIFT)	// 4096 bytes
+
+typedef struct osprd_backing_ops {
+	// Read or write 'len' bytes at offset 'off'.  Return the number of
+	// bytes transferred, or -(error code).
+	long (*pread)(void *file, void *buf, unsigned long len,
+		      unsigned long long off);
+	long (*pwrite)(void *file, const void *buf, unsigned long len,
+		       unsigned long long off);
+	// Make the data written so far durable.  Return 0 or -(error code).
+	int (*sync)(void *file);
+} osprd_backing_ops_t;
+
+typedef struct osprd_backing {
+	const osprd_backing_ops_t *ops;
+	void *file;			// The backing file; NULL if none
+	uint8_t *data;			// The ramdisk's data
+	unsigned long long size;	// ... and its size in bytes
+	unsigned long nchunks;
+	unsigned long *dirty;		// Bit per chunk: set if changed since
+					// it was last written back
+
+	struct mutex flush_mutex;	// Held while flushing
+	uint8_t *bounce;		// A chunk being written back
+	unsigned long long nflushes;	// Flushes, and chunks they wrote,
+	unsigned long long nwritten;	// protected by 'flush_mutex'
+} osprd_backing_t;
+
+
+// osprd_backing_init(b, ops, file, data, size)
+//	Initialize 'b' to write the 'size' bytes at 'data' back to 'file',
+//	with nothing dirty.  Returns 0 or -ENOMEM.
+
+static int osprd_backing_init(osprd_backing_t *b,
+			      const osprd_backing_ops_t *ops, void *file,
+			      uint8_t *data, unsigned long long size)
+{
+	unsigned long nlongs;
+
+	b->ops = ops;
+	b->file = file;
+	b->data = data;
+	b->size = size;
+	b->nchunks = (size + OSPRD_BACK_CHUNK_SIZE - 1) >> OSPRD_BACK_CHUNK_SHIFT;
+	b->nflushes = b->nwritten = 0;
+	mutex_init(&b->flush_mutex);
+
+	nlongs = (b->nchunks + BITS_PER_LONG - 1) / BITS_PER_LONG;
+	b->dirty = kmalloc(nlongs * sizeof(unsigned long), GFP_KERNEL);
+	b->bounce = kmalloc(OSPRD_BACK_CHUNK_SIZE, GFP_KERNEL);
+	if (!b->dirty || !b->bounce) {
+		kfree(b->dirty);
+		kfree(b->bounce);
+		b->dirty = NULL;
+		b->bounce = NULL;
+		return -ENOMEM;
+	}
+	memset(b->dirty, 0, nlongs * sizeof(unsigned long));
+	return 0;
+}
+
+// osprd_backing_destroy(b)
+//	Free 'b's memory.  Flush first to keep the dirty data; the caller
+//	closes the file.
+
+static void osprd_backing_destroy(osprd_backing_t *b)
+{
+	kfree(b->dirty);
+	kfree(b->bounce);
+	b->dirty = NULL;
+	b->bounce = NULL;
+}
+
+// osprd_backing_load(b)
+//	Read the backing file into the ramdisk's data.  Data past the end of
+//	a short file is left alone (zero, for a new ramdisk).  Returns 0 or
+//	-(error code).
+
+static int osprd_backing_load(osprd_backing_t *b)
+{
+	unsigned long long off = 0;
+
+	while (off < b->size) {
+		unsigned long len = (b->size - off > OSPRD_BACK_CHUNK_SIZE * 16
+				     ? OSPRD_BACK_CHUNK_SIZE * 16
+				     : b->size - off);
+		long r = b->ops->pread(b->file, b->data + off, len, off);
+		if (r < 0)
+			return r;
+		else if (r == 0)	// end of file
+			break;
+		off += r;
+	}
+	return 0;
+}
+
+// osprd_backing_dirty(b, off, len)
+//	Mark the 'len' bytes at offset 'off' as changed.  Call after
+//	changing them.
+
+static inline void osprd_backing_dirty(osprd_backing_t *b,
+				       unsigned long long off,
+				       unsigned long len)
+{
+	unsigned long i = off >> OSPRD_BACK_CHUNK_SHIFT;
+	unsigned long last = (off + len - 1) >> OSPRD_BACK_CHUNK_SHIFT;
+
+	// The data must change before the bit is visible to a flush.
+	smp_mb();
+	for (; i <= last; i++)
+		if (!test_bit(i, b->dirty))
+			set_bit(i, b->dirty);
+}
+
+// osprd_backing_flush(b, sync)
+//	Write every dirty chunk back.  If 'sync' is nonzero, also make them
+//	durable.  Returns 0 or -(error code); a chunk that could not be
+//	written stays dirty.
+
+static int osprd_backing_flush(osprd_backing_t *b, int sync)
+{
+	unsigned long i;
+	int r = 0;
+
+	mutex_lock(&b->flush_mutex);
+	for (i = find_next_bit(b->dirty, b->nchunks, 0); i < b->nchunks;
+	     i = find_next_bit(b->dirty, b->nchunks, i + 1)) {
+		unsigned long long off = (unsigned long long) i
+			<< OSPRD_BACK_CHUNK_SHIFT;
+		unsigned long len = (b->size - off > OSPRD_BACK_CHUNK_SIZE
+				     ? OSPRD_BACK_CHUNK_SIZE : b->size - off);
+		long w;
+
+		if (!test_and_clear_bit(i, b->dirty))
+			continue;
+		// Copy the chunk first, so that a write racing with the
+		// copy cannot tear the data the file gets (the write marks
+		// the chunk dirty again).
+		memcpy(b->bounce, b->data + off, len);
+		if ((w = b->ops->pwrite(b->file, b->bounce, len, off))
+		    != (long) len) {
+			set_bit(i, b->dirty);
+			r = (w < 0 ? w : -EIO);
+			break;
+		}
+		b->nwritten++;
+	}
+	if (sync && r == 0)
+		r = b->ops->sync(b->file);
+	b->nflushes++;
+	mutex_unlock(&b->flush_mutex);
+	return r;
+}
+
+#endif /* OSPRDBACK_H */
@@ -0,0 +1,1131 @@
+#ifndef OSPRDLOCK_H
+#define OSPRDLOCK_H
+
+/*
+ * OSPRD lock manager
+ *
+ *   The ticket lock and reader/writer bookkeeping behind OSPRDIOCACQUIRE,
+ *   OSPRDIOCTRYACQUIRE, and OSPRDIOCRELEASE.  This file is shared by
+ *   osprd.c and the userspace osprdsim library, so it uses only interfaces
+ *   that both provide: osp_spinlock_t, wait queues, and errno constants.
+ *   Include the kernel headers (or kcompat.h) and spinlock.h first.
+ *
+ *   Lock requests are served in ticket order.  'ticket_head' is the next
+ *   ticket to hand out and 'ticket_tail' is the ticket being served, which
+ *   is always the ticket of the oldest blocked request.  A blocked request
+ *   that is interrupted by a signal leaves the queue, so it cannot leave a
+ *   "bubble" that stops later requests from being served.
+ *
+ *   Each blocked request sleeps on its own wait queue.  Whoever makes the
+ *   lock available (a release, or a request leaving the queue) grants it
+ *   directly to the next ticket, or to the run of consecutive readers at the
+ *   front of the queue, and wakes only those requests.  No request wakes up
+ *   just to find it must sleep again.
+ *
+ *   Every request locks a range of sectors, [start, end); a whole-device
+ *   lock is the range [0, OSPRD_SECTOR_MAX).  Two requests conflict if their
+ *   ranges overlap and either is a write lock.  A request is granted when no
+ *   granted lock and no request with an earlier ticket conflicts with it, so
+ *   requests for disjoint ranges proceed in parallel while conflicting
+ *   requests are still served first come, first served.  Granted and queued
+ *   requests are kept in interval trees (treaps keyed on the start sector,
+ *   augmented with the largest end sector in each subtree and, for queued
+ *   requests, the earliest ticket), so finding a conflict takes about
+ *   O(log n) time however many ranges are locked.
+ *
+ *   Deadlocks are found with a wait-for graph shared by every lock (every
+ *   osprd device).  When a request blocks, it gets an edge to each request
+ *   it waits for: the conflicting granted locks and the conflicting requests
+ *   ahead of it.  A process blocked on a request waits for whatever that
+ *   request waits for, so a search from the new request follows edges from
+ *   each request reached to the request its owner is blocked on.  If the
+ *   search reaches the new request's own process, granting the request
+ *   could never happen and it fails with -EDEADLK.  Edges are added when a
+ *   request blocks and removed when it is granted or gives up, or when the
+ *   request they point to goes away, so the search only ever visits
+ *   requests that are actually part of a chain of waiting processes.
+ *
+ *   In sharded mode (OSPRD_LOCK_SHARDED), whole-device read locks normally
+ *   skip the device-wide mutex: a reader locks only its CPU's shard and
+ *   counts itself there, as long as no writer is waiting for or holding the
+ *   lock.  Writers always take the device-wide path, and while any writer is
+ *   on it, readers take the device-wide path too, so ticket order is kept.
+ *
+ *   With OSPRD_LOCK_SPIN, a request that must wait first spins on its own
+ *   'granted' flag if the lock should come free soon, and sleeps only if it
+ *   does not.  A sleep and wakeup cost two context switches, which
+ *   dominates the wait when locks are held only briefly.  How long to spin
+ *   is estimated from a moving average of how long the lock has been held
+ *   recently, times the number of requests ahead (see osprd_lock_spin_ns).
+ *   When hold times are long, requests go straight to sleep.
+ *
+ *   An asynchronous request (osprd_lock_acquire_async) takes a ticket and
+ *   gets in line like a blocking one, but its caller goes on instead of
+ *   sleeping; the grant wakes a wait queue the caller chose, which osprd
+ *   polls.  A process can have several asynchronous requests in line at
+ *   once, so the deadlock search follows every request a process is
+ *   waiting for, not just one.  A queued asynchronous request counts as
+ *   waiting, as if its process were blocked on it.
+ *
+ *   A request may come with a lease (h->lease_ns): once it has held the
+ *   lock that long, the lock can be revoked, so a process that stalls
+ *   while holding it cannot hold up everyone else for good.  The waiters
+ *   watch the clock on the holder's behalf: a blocked request sleeps only
+ *   until the first lease runs out, then revokes every expired lock and
+ *   serves the queue as a release would.  An asynchronous request's
+ *   process is not asleep here, so osprd_lock_pending tells its poller
+ *   when the first lease runs out, and the poller sets an alarm for then
+ *   (a timer in osprd, a timed wait in osprdsim) and checks again.  New
+ *   requests check for expired leases too.  A revoked request stays with
+ *   the lock, marked 'revoked', until its owner releases it, so the owner
+ *   finds out.  Only locks with leases are ever revoked.
+ */
+
+#ifdef __KERNEL__
+// Context switches made by the current task so far.
+# define osp_nr_switches()	(current->nvcsw + current->nivcsw)
+
+// The time in nanoseconds, for measuring hold times.
+static inline unsigned long long osp_clock_ns(void)
+{
+	struct timespec ts;
+	getnstimeofday(&ts);
+	return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Jiffies covering 'ns' nanoseconds, for sleeping until a lease runs out.
+// 2^20 ns is a little over a millisecond, which avoids a 64-bit division;
+// waking a little early just means checking again.
+# define osp_ns_to_jiffies(ns)	msecs_to_jiffies((unsigned) ((ns) >> 20) + 1)
+#else
+# define osp_ns_to_jiffies(ns)	msecs_to_jiffies((ns) / 1000000 + 1)
+#endif
+
+// Lock modes for osprd_lock_init.
+#define OSPRD_LOCK_SHARDED	1	// Per-CPU reader counts
+#define OSPRD_LOCK_SPIN		2	// Spin briefly before sleeping
+
+#define OSPRD_SPIN_MAX_NS	50000	// Longest spin, in nanoseconds
+
+#define OSPRD_NO_ALARM		(~0ULL)	// No lease to wake up for
+
+#define OSPRD_NSHARDS		16
+
+typedef unsigned long long osprd_sector_t;
+
+#define OSPRD_SECTOR_MAX	(~0ULL)	// End of a whole-device lock
+
+#define OSPRD_WFG_HASHSIZE	256
+
+struct osprd_edge;
+
+/* A lock request.  It sits on the lock's wait queue while blocked and on
+ * the holder list once granted.  The caller allocates it. */
+typedef struct osprd_holder {
+	const void *owner;		// Lock owner (in osprd, the struct file)
+	pid_t pid;			// Process that asked for the lock
+	int writable;			// Nonzero for a write lock
+	osprd_sector_t start;		// Locked sectors: [start, end)
+	osprd_sector_t end;
+	unsigned ticket;		// Place in line
+	int granted;			// Set when a blocked request is granted
+	int waited;			// Set by osprd_lock_acquire if the
+					// request had to sleep
+	unsigned long long granted_ns;	// When it was granted (OSPRD_LOCK_SPIN)
+	unsigned long long lease_ns;	// Revocable after this long (0: never)
+	unsigned long long expires_ns;	// When the lease runs out
+	int revoked;			// Set when the lease was revoked
+	unsigned long long alarm_ns;	// A blocked request wakes up by this
+					// time, when a lease runs out
+	int rearm;			// Set to wake it for an earlier one
+	wait_queue_head_t wait;		// Where a blocked request sleeps
+	wait_queue_head_t *notify;	// Also woken on the grant, if set (an
+					// asynchronous request)
+	struct osprd_holder *next;	// Next holder or waiter
+
+	// Interval tree links (see osprd_rtree_insert)
+	struct osprd_holder *left, *right;
+	unsigned prio;			// Treap priority
+	osprd_sector_t max_end;		// Largest 'end' in this subtree
+	unsigned min_ticket;		// Earliest 'ticket' in this subtree
+
+	struct osprd_holder *prev;	// Previous waiter
+
+	// Wait-for graph state (see osprd_wfg_cycle)
+	struct osprd_edge *out;		// Edges to the requests this one
+					// waits for
+	struct osprd_edge *in;		// Edges from requests waiting for it
+	struct osprd_holder *pid_next;	// Next in the graph's pid hash chain
+	int in_graph;			// Set if in the pid hash (all requests
+					// but sharded-mode fast path readers)
+	unsigned mark;			// Search generation
+	struct osprd_holder *dfs_next;	// Next on the search stack
+} osprd_holder_t;
+
+/* An edge in the wait-for graph: 'from' waits for 'to'.  Each edge is on
+ * the 'out' list of 'from' and the 'in' list of 'to'. */
+typedef struct osprd_edge {
+	osprd_holder_t *from;
+	osprd_holder_t *to;
+	struct osprd_edge *out_next, **out_pprev;
+	struct osprd_edge *in_next, **in_pprev;
+} osprd_edge_t;
+
+/* The wait-for graph.  One is shared by all the locks that requests can be
+ * waiting on at once (in osprd, all NOSPRD devices).  Its mutex nests
+ * inside each lock's mutex and outside the shard mutexes. */
+typedef struct osprd_wfg {
+	osp_spinlock_t mutex;		// Protects the graph and every edge
+	osprd_holder_t *pids[OSPRD_WFG_HASHSIZE];	// Requests by pid
+	unsigned mark;			// Search generation
+	unsigned nshard_edges;		// Edges to fast path readers
+} osprd_wfg_t;
+
+/* A reader shard, in sharded mode.  Each is on its own cache line so that
+ * readers on different CPUs do not contend. */
+typedef struct osprd_shard {
+	osp_spinlock_t mutex;		// Protects this shard
+	unsigned nreaders;		// Read locks counted here
+	osprd_holder_t *holders;	// Their requests
+} ____cacheline_aligned_in_smp osprd_shard_t;
+
+typedef struct osprd_lock {
+	osp_spinlock_t mutex;		// Mutex for synchronizing access to
+					// the fields below
+
+	unsigned ticket_head;		// Next available ticket
+
+	unsigned ticket_tail;		// Ticket currently being served
+
+	osprd_holder_t *holders;	// Granted requests
+	osprd_holder_t *waiters;	// Blocked requests, in ticket order
+	osprd_holder_t *waiters_last;	// Last request in 'waiters'
+	osprd_holder_t *revoked;	// Revoked requests, until released
+
+	unsigned nleased;		// Granted requests with leases
+	unsigned long long lease_next_ns; // No lease runs out before this
+
+	// Interval trees of the same requests, indexed by 'writable'
+	osprd_holder_t *held[2];	// Granted
+	osprd_holder_t *queued[2];	// Blocked
+
+	unsigned rand;			// Treap priority generator
+	osprd_wfg_t *wfg;		// The shared wait-for graph
+
+	int flags;			// OSPRD_LOCK_* mode
+	unsigned nslow_writers;		// Writers waiting for or holding the
+					// lock (sharded mode); while nonzero,
+					// readers take the device-wide path
+	osprd_shard_t shards[OSPRD_NSHARDS];
+
+	unsigned long long hold_ns;	// Moving average of how long the
+					// lock is held (OSPRD_LOCK_SPIN)
+
+	// Statistics (see struct osprd_wakestats in osprd.h)
+	unsigned long long nblocked;	// Requests that slept
+	unsigned long long nwakeups;	// Wakeups sent to them
+	unsigned long long nswitches;	// Context switches while they slept
+	unsigned long long nspun;	// Requests granted while spinning
+	unsigned long long nrevoked;	// Leases revoked
+} osprd_lock_t;
+
+
+// osprd_wfg_init(g)
+//	Initialize an empty wait-for graph.
+
+static void osprd_wfg_init(osprd_wfg_t *g)
+{
+	int i;
+
+	osp_spin_lock_init(&g->mutex);
+	for (i = 0; i < OSPRD_WFG_HASHSIZE; i++)
+		g->pids[i] = NULL;
+	g->mark = 0;
+	g->nshard_edges = 0;
+}
+
+
+// osprd_lock_init(l, flags, g)
+//	Initialize an unlocked lock.  'flags' is 0 or OSPRD_LOCK_SHARDED.
+//	'g' is the wait-for graph for deadlock detection, shared with every
+//	other lock that a process might hold while it waits for this one.
+
+static void osprd_lock_init(osprd_lock_t *l, int flags, osprd_wfg_t *g)
+{
+	int i;
+
+	osp_spin_lock_init(&l->mutex);
+	l->ticket_head = l->ticket_tail = 0;
+	l->holders = l->waiters = NULL;
+	l->waiters_last = NULL;
+	l->revoked = NULL;
+	l->nleased = 0;
+	l->lease_next_ns = OSPRD_NO_ALARM;
+	l->held[0] = l->held[1] = l->queued[0] = l->queued[1] = NULL;
+	l->rand = 1;
+	l->wfg = g;
+	l->flags = flags;
+	l->nslow_writers = 0;
+	for (i = 0; i < OSPRD_NSHARDS; i++) {
+		osp_spin_lock_init(&l->shards[i].mutex);
+		l->shards[i].nreaders = 0;
+		l->shards[i].holders = NULL;
+	}
+	// Until hold times are measured, guess that they are short enough
+	// to spin for.
+	l->hold_ns = OSPRD_SPIN_MAX_NS / 8;
+	l->nblocked = l->nwakeups = l->nswitches = l->nspun = 0;
+	l->nrevoked = 0;
+}
+
+
+// Return the number of read locks counted in the shards.
+// Each shard is read under its own mutex: a reader that took its shard's
+// mutex before a writer announced itself is then sure to be counted.
+
+static unsigned osprd_shard_readers(osprd_lock_t *l)
+{
+	unsigned n = 0;
+	int i;
+
+	if (!(l->flags & OSPRD_LOCK_SHARDED))
+		return 0;
+	for (i = 0; i < OSPRD_NSHARDS; i++) {
+		osp_spin_lock(&l->shards[i].mutex);
+		n += l->shards[i].nreaders;
+		osp_spin_unlock(&l->shards[i].mutex);
+	}
+	return n;
+}
+
+// Remove and return the request for 'owner' from the list '*hp'.
+static osprd_holder_t *osprd_holder_unlink(osprd_holder_t **hp,
+					   const void *owner)
+{
+	osprd_holder_t *h;
+	for (; *hp && (*hp)->owner != owner; hp = &(*hp)->next)
+		/* do nothing */;
+	if ((h = *hp))
+		*hp = h->next;
+	return h;
+}
+
+
+/* Interval trees */
+
+// Does ticket 'a' come before ticket 'b'?  Tickets wrap around, but all
+// tickets in use at once are much less than 2^31 apart.
+static inline int osprd_ticket_before(unsigned a, unsigned b)
+{
+	return (int) (a - b) < 0;
+}
+
+// Recompute 'max_end' and 'min_ticket' for 't' from its children.
+static void osprd_rtree_update(osprd_holder_t *t)
+{
+	osprd_holder_t *c[2] = { t->left, t->right };
+	int i;
+
+	t->max_end = t->end;
+	t->min_ticket = t->ticket;
+	for (i = 0; i < 2; i++)
+		if (c[i]) {
+			if (c[i]->max_end > t->max_end)
+				t->max_end = c[i]->max_end;
+			if (osprd_ticket_before(c[i]->min_ticket, t->min_ticket))
+				t->min_ticket = c[i]->min_ticket;
+		}
+}
+
+// Join two trees, where every node in 'a' sorts before every node in 'b'.
+static osprd_holder_t *osprd_rtree_merge(osprd_holder_t *a, osprd_holder_t *b)
+{
+	if (!a || !b)
+		return a ? a : b;
+	if (a->prio > b->prio) {
+		a->right = osprd_rtree_merge(a->right, b);
+		osprd_rtree_update(a);
+		return a;
+	} else {
+		b->left = osprd_rtree_merge(a, b->left);
+		osprd_rtree_update(b);
+		return b;
+	}
+}
+
+// Nodes are ordered by start sector, then by address.
+static inline int osprd_rtree_less(const osprd_holder_t *a,
+				   const osprd_holder_t *b)
+{
+	return a->start < b->start || (a->start == b->start && a < b);
+}
+
+// osprd_rtree_insert(t, h), osprd_rtree_remove(t, h)
+//	Add 'h' to, or remove it from, the tree rooted at 't', and return the
+//	new root.  The caller sets h->prio before inserting.  The expected
+//	depth of a treap is O(log n), so recursion is fine.
+
+static osprd_holder_t *osprd_rtree_insert(osprd_holder_t *t, osprd_holder_t *h)
+{
+	osprd_holder_t *c;
+
+	if (!t) {
+		h->left = h->right = NULL;
+		osprd_rtree_update(h);
+		return h;
+	}
+
+	if (osprd_rtree_less(h, t)) {
+		c = t->left = osprd_rtree_insert(t->left, h);
+		if (c->prio > t->prio) {	// rotate right
+			t->left = c->right;
+			c->right = t;
+			osprd_rtree_update(t);
+			t = c;
+		}
+	} else {
+		c = t->right = osprd_rtree_insert(t->right, h);
+		if (c->prio > t->prio) {	// rotate left
+			t->right = c->left;
+			c->left = t;
+			osprd_rtree_update(t);
+			t = c;
+		}
+	}
+	osprd_rtree_update(t);
+	return t;
+}
+
+static osprd_holder_t *osprd_rtree_remove(osprd_holder_t *t, osprd_holder_t *h)
+{
+	if (t == h)
+		return osprd_rtree_merge(h->left, h->right);
+	else if (osprd_rtree_less(h, t))
+		t->left = osprd_rtree_remove(t->left, h);
+	else
+		t->right = osprd_rtree_remove(t->right, h);
+	osprd_rtree_update(t);
+	return t;
+}
+
+// osprd_rtree_find(t, start, end, before)
+//	Return a node in 't' whose range overlaps [start, end), or NULL if
+//	there is none.  If 'before' is non-NULL, only nodes whose tickets come
+//	before '*before' count.
+
+static osprd_holder_t *osprd_rtree_find(osprd_holder_t *t,
+					osprd_sector_t start, osprd_sector_t end,
+					const unsigned *before)
+{
+	osprd_holder_t *n;
+
+	if (!t || t->max_end <= start
+	    || (before && !osprd_ticket_before(t->min_ticket, *before)))
+		return NULL;
+	if ((n = osprd_rtree_find(t->left, start, end, before)))
+		return n;
+	if (t->start >= end)
+		// So does everything to the right.
+		return NULL;
+	if (t->end > start && (!before || osprd_ticket_before(t->ticket, *before)))
+		return t;
+	return osprd_rtree_find(t->right, start, end, before);
+}
+
+
+/* The wait-for graph.  These functions must be called with g->mutex held. */
+
+// Add 'h' to the pid hash, with no edges.
+static void osprd_wfg_insert(osprd_wfg_t *g, osprd_holder_t *h)
+{
+	osprd_holder_t **bp = &g->pids[(unsigned) h->pid % OSPRD_WFG_HASHSIZE];
+	h->pid_next = *bp;
+	*bp = h;
+	h->in_graph = 1;
+}
+
+// Add an edge saying that 'from' waits for 'to'.
+static int osprd_wfg_link(osprd_wfg_t *g, osprd_holder_t *from,
+			  osprd_holder_t *to)
+{
+	osprd_edge_t *e = kmalloc(sizeof(*e), GFP_ATOMIC);
+	if (!e)
+		return -ENOMEM;
+	e->from = from;
+	e->to = to;
+	if ((e->out_next = from->out))
+		from->out->out_pprev = &e->out_next;
+	e->out_pprev = &from->out;
+	from->out = e;
+	if ((e->in_next = to->in))
+		to->in->in_pprev = &e->in_next;
+	e->in_pprev = &to->in;
+	to->in = e;
+	if (!to->in_graph)
+		g->nshard_edges++;
+	return 0;
+}
+
+static void osprd_wfg_unlink(osprd_wfg_t *g, osprd_edge_t *e)
+{
+	if ((*e->out_pprev = e->out_next))
+		e->out_next->out_pprev = e->out_pprev;
+	if ((*e->in_pprev = e->in_next))
+		e->in_next->in_pprev = e->in_pprev;
+	if (!e->to->in_graph)
+		g->nshard_edges--;
+	kfree(e);
+}
+
+// Remove 'h' from the graph, along with its edges.  If 'orphans' is
+// non-NULL, requests that were waiting for 'h' are pushed onto it (through
+// 'dfs_next').
+static void osprd_wfg_remove(osprd_wfg_t *g, osprd_holder_t *h,
+			     osprd_holder_t **orphans)
+{
+	osprd_holder_t **hp;
+
+	while (h->out)
+		osprd_wfg_unlink(g, h->out);
+	while (h->in) {
+		if (orphans) {
+			h->in->from->dfs_next = *orphans;
+			*orphans = h->in->from;
+		}
+		osprd_wfg_unlink(g, h->in);
+	}
+	if (h->in_graph) {
+		for (hp = &g->pids[(unsigned) h->pid % OSPRD_WFG_HASHSIZE];
+		     *hp != h; hp = &(*hp)->pid_next)
+			/* do nothing */;
+		*hp = h->pid_next;
+	}
+}
+
+// Push each request that process 'pid' is waiting for (one it is blocked
+// on, or asynchronous requests still in line) onto '*stack', unless the
+// search generation 'mark' has already visited it.
+static void osprd_wfg_push_blocked(osprd_wfg_t *g, pid_t pid, unsigned mark,
+				   osprd_holder_t **stack)
+{
+	osprd_holder_t *h = g->pids[(unsigned) pid % OSPRD_WFG_HASHSIZE];
+	for (; h; h = h->pid_next)
+		if (h->pid == pid && !h->granted && h->mark != mark) {
+			h->mark = mark;
+			h->dfs_next = *stack;
+			*stack = h;
+		}
+}
+
+// Return nonzero if h->pid has a request other than 'h' in the graph.
+static int osprd_wfg_has_pid(osprd_wfg_t *g, osprd_holder_t *h)
+{
+	osprd_holder_t *n = g->pids[(unsigned) h->pid % OSPRD_WFG_HASHSIZE];
+	for (; n; n = n->pid_next)
+		if (n->pid == h->pid && n != h)
+			return 1;
+	return 0;
+}
+
+// osprd_wfg_cycle(g, h)
+//	Return nonzero if the blocked request 'h', whose edges are in place,
+//	waits for its own process.  The search follows each edge to the
+//	request it reaches and then to the requests that request's owner is
+//	waiting for, visiting each waiting request at most once.
+//
+//	A cycle through 'h' must pass through another request of h->pid, so
+//	if h->pid has no other request in the graph there is nothing to
+//	search.  Fast path readers are not in the pid hash, so any edges to
+//	them force a search.
+
+static int osprd_wfg_cycle(osprd_wfg_t *g, osprd_holder_t *h)
+{
+	osprd_holder_t *x, *stack = h;
+	osprd_edge_t *e;
+	unsigned mark;
+
+	if (!osprd_wfg_has_pid(g, h) && g->nshard_edges == 0)
+		return 0;
+
+	mark = ++g->mark;
+	h->mark = mark;
+	h->dfs_next = NULL;
+	while ((x = stack)) {
+		stack = x->dfs_next;
+		for (e = x->out; e; e = e->out_next) {
+			if (e->to->pid == h->pid)
+				return 1;
+			osprd_wfg_push_blocked(g, e->to->pid, mark, &stack);
+		}
+	}
+	return 0;
+}
+
+
+// Is 'h' a whole-device request?
+static inline int osprd_holder_whole(const osprd_holder_t *h)
+{
+	return h->start == 0 && h->end == OSPRD_SECTOR_MAX;
+}
+
+// Do requests 'a' and 'b' conflict?
+static inline int osprd_holder_conflict(const osprd_holder_t *a,
+					const osprd_holder_t *b)
+{
+	return (a->writable || b->writable)
+		&& a->start < b->end && b->start < a->end;
+}
+
+
+// The following helpers must be called with l->mutex held.
+
+// Must 'h' wait?  It must if it conflicts with a granted lock, or with a
+// blocked request whose ticket comes before 'ticket'.
+static int osprd_lock_blocked(osprd_lock_t *l, osprd_holder_t *h,
+			      unsigned ticket)
+{
+	if (osprd_rtree_find(l->held[1], h->start, h->end, NULL)
+	    || osprd_rtree_find(l->queued[1], h->start, h->end, &ticket))
+		return 1;
+	if (!h->writable)
+		return 0;
+	return osprd_rtree_find(l->held[0], h->start, h->end, NULL)
+		|| osprd_rtree_find(l->queued[0], h->start, h->end, &ticket)
+		|| osprd_shard_readers(l) != 0;
+}
+
+// Add edges from the blocked request 'h' to every request it waits for.
+// Called with l->mutex and l->wfg->mutex held.
+//
+// The scan of the queue goes backwards from 'h'.  A write request ahead of
+// 'h' whose range covers h's conflicts with everything that h conflicts
+// with, so it waits (directly or not) for everything ahead of it that
+// 'h' would wait for; the scan stops there, and 'h' needs no other edges.
+// With only whole-device locks, most waiters get one edge.
+
+static int osprd_lock_wait_edges(osprd_lock_t *l, osprd_holder_t *h)
+{
+	osprd_wfg_t *g = l->wfg;
+	osprd_holder_t *n;
+	int i, r = 0;
+
+	for (n = h->prev; n; n = n->prev)
+		if (osprd_holder_conflict(h, n)) {
+			if (osprd_wfg_link(g, h, n) < 0)
+				return -ENOMEM;
+			if (n->writable && n->start <= h->start
+			    && n->end >= h->end)
+				return 0;
+		}
+
+	for (n = l->holders; n; n = n->next)
+		if (osprd_holder_conflict(h, n) && osprd_wfg_link(g, h, n) < 0)
+			return -ENOMEM;
+
+	for (i = 0; i < OSPRD_NSHARDS && h->writable
+		     && (l->flags & OSPRD_LOCK_SHARDED); i++) {
+		osp_spin_lock(&l->shards[i].mutex);
+		for (n = l->shards[i].holders; n && r == 0; n = n->next)
+			r = osprd_wfg_link(g, h, n);
+		osp_spin_unlock(&l->shards[i].mutex);
+		if (r < 0)
+			return r;
+	}
+	return 0;
+}
+
+// Take 'h' out of the wait-for graph.  Called with l->mutex held.
+//
+// A granted request waits for nothing, so requests waiting for it reach
+// nothing else through it.  But if 'h' is a waiter giving up, the requests
+// waiting for it may have relied on it to reach the requests ahead of it
+// (see osprd_lock_wait_edges), so their edges are recomputed.
+static void osprd_lock_unlink_graph(osprd_lock_t *l, osprd_holder_t *h)
+{
+	osprd_wfg_t *g = l->wfg;
+	osprd_holder_t *w, *orphans = NULL;
+
+	osp_spin_lock(&g->mutex);
+	osprd_wfg_remove(g, h, h->granted ? NULL : &orphans);
+	while ((w = orphans)) {
+		orphans = w->dfs_next;
+		while (w->out)
+			osprd_wfg_unlink(g, w->out);
+		if (osprd_lock_wait_edges(l, w) < 0)
+			eprintk("osprd: out of memory for the wait-for graph\n");
+	}
+	osp_spin_unlock(&g->mutex);
+}
+
+static void osprd_lock_grant(osprd_lock_t *l, osprd_holder_t *h)
+{
+	osprd_holder_t *w;
+
+	if (l->flags & OSPRD_LOCK_SPIN)
+		h->granted_ns = osp_clock_ns();
+	if (h->lease_ns) {
+		h->expires_ns = osp_clock_ns() + h->lease_ns;
+		l->nleased++;
+		if (h->expires_ns < l->lease_next_ns)
+			l->lease_next_ns = h->expires_ns;
+		// Waiters who would sleep past the end of this lease must wake
+		// up sooner.  Those already set to wake before then need not.
+		for (w = l->waiters; w; w = w->next)
+			if (w->alarm_ns > h->expires_ns) {
+				w->alarm_ns = h->expires_ns;
+				w->rearm = 1;
+				wake_up(&w->wait);
+			}
+	}
+	h->next = l->holders;
+	l->holders = h;
+	h->prio = l->rand = l->rand * 1103515245 + 12345;
+	l->held[h->writable] = osprd_rtree_insert(l->held[h->writable], h);
+}
+
+// Add 'h' to the end of the wait queue, with the next ticket.
+static void osprd_lock_enqueue(osprd_lock_t *l, osprd_holder_t *h)
+{
+	h->ticket = l->ticket_head++;
+	h->next = NULL;
+	if ((h->prev = l->waiters_last))
+		h->prev->next = h;
+	else {
+		l->waiters = h;
+		l->ticket_tail = h->ticket;
+	}
+	l->waiters_last = h;
+	h->prio = l->rand = l->rand * 1103515245 + 12345;
+	l->queued[h->writable] = osprd_rtree_insert(l->queued[h->writable], h);
+}
+
+// Remove the waiter 'h' from the wait queue and move 'ticket_tail' on to
+// the next ticket in line.
+static void osprd_lock_dequeue(osprd_lock_t *l, osprd_holder_t *h)
+{
+	if (h->prev)
+		h->prev->next = h->next;
+	else
+		l->waiters = h->next;
+	if (h->next)
+		h->next->prev = h->prev;
+	else
+		l->waiters_last = h->prev;
+	l->ticket_tail = (l->waiters ? l->waiters->ticket : l->ticket_head);
+	l->queued[h->writable] = osprd_rtree_remove(l->queued[h->writable], h);
+}
+
+// Grant the lock to every blocked request that no longer has to wait, and
+// wake each of them.  Nothing can pass a whole-device write request, so the
+// scan stops at one, whether it was granted or not; with only whole-device
+// locks, it grants one writer or a run of readers.
+static void osprd_lock_serve(osprd_lock_t *l)
+{
+	osprd_holder_t *h, *next;
+
+	for (h = l->waiters; h; h = next) {
+		int stop = (h->writable && osprd_holder_whole(h));
+		next = h->next;
+		if (!osprd_lock_blocked(l, h, h->ticket)) {
+			osprd_lock_dequeue(l, h);
+			osprd_lock_grant(l, h);
+			// It no longer waits for anything.
+			osp_spin_lock(&l->wfg->mutex);
+			h->granted = 1;
+			while (h->out)
+				osprd_wfg_unlink(l->wfg, h->out);
+			osp_spin_unlock(&l->wfg->mutex);
+			l->nwakeups++;
+			wake_up(&h->wait);
+			if (h->notify)
+				wake_up(h->notify);
+		}
+		if (stop)
+			break;
+	}
+}
+
+// Take the granted request 'h', already off the holder list, out of the
+// lock's other records of it.  The caller serves the queue afterwards.
+static void osprd_lock_ungrant(osprd_lock_t *l, osprd_holder_t *h)
+{
+	l->held[h->writable] = osprd_rtree_remove(l->held[h->writable], h);
+	if (l->flags & OSPRD_LOCK_SPIN)
+		// hold_ns += (sample - hold_ns) / 8
+		l->hold_ns = l->hold_ns - (l->hold_ns >> 3)
+			+ ((osp_clock_ns() - h->granted_ns) >> 3);
+	if (h->lease_ns)
+		l->nleased--;
+	osprd_lock_unlink_graph(l, h);
+	if (h->writable && (l->flags & OSPRD_LOCK_SHARDED))
+		l->nslow_writers--;
+}
+
+// Revoke every lock whose lease has run out, and grant the lock to the
+// requests that unblocks.  Called with l->mutex held.  Cheap unless a
+// lease may have run out: 'lease_next_ns' is the earliest time one can.
+static void osprd_lock_revoke(osprd_lock_t *l)
+{
+	osprd_holder_t **hp = &l->holders, *h;
+	unsigned long long now;
+	int revoked = 0;
+
+	if (l->nleased == 0 || (now = osp_clock_ns()) < l->lease_next_ns)
+		return;
+	l->lease_next_ns = OSPRD_NO_ALARM;
+	while ((h = *hp))
+		if (h->lease_ns && now >= h->expires_ns) {
+			*hp = h->next;
+			osprd_lock_ungrant(l, h);
+			h->revoked = 1;
+			h->next = l->revoked;
+			l->revoked = h;
+			l->nrevoked++;
+			revoked = 1;
+		} else {
+			if (h->lease_ns && h->expires_ns < l->lease_next_ns)
+				l->lease_next_ns = h->expires_ns;
+			hp = &h->next;
+		}
+	if (revoked)
+		osprd_lock_serve(l);
+}
+
+
+// Sharded mode's read fast path: count a read lock in this CPU's shard
+// unless a writer is on the device-wide path.  Returns nonzero on success.
+static int osprd_lock_read_fast(osprd_lock_t *l, osprd_holder_t *h)
+{
+	osprd_shard_t *s = &l->shards[raw_smp_processor_id() % OSPRD_NSHARDS];
+	int granted;
+
+	h->in_graph = 0;
+	h->in = h->out = NULL;
+	h->granted = 1;
+	osp_spin_lock(&s->mutex);
+	if ((granted = (l->nslow_writers == 0))) {
+		s->nreaders++;
+		h->next = s->holders;
+		s->holders = h;
+	}
+	osp_spin_unlock(&s->mutex);
+	return granted;
+}
+
+
+// How long the blocked request 'h' should spin before sleeping: twice the
+// time that the requests ahead of it (and the current holder) should take,
+// going by the average hold time, or 0 if that is too long to be worth
+// spinning for.  Spinning only helps while the holder can run on another
+// CPU.
+static unsigned long long osprd_lock_spin_ns(osprd_lock_t *l,
+					     osprd_holder_t *h)
+{
+	unsigned long long expect = l->hold_ns * (h->ticket - l->ticket_tail + 1);
+
+	if (!(l->flags & OSPRD_LOCK_SPIN) || num_online_cpus() < 2
+	    || expect > OSPRD_SPIN_MAX_NS)
+		return 0;
+	return expect * 2 < OSPRD_SPIN_MAX_NS ? expect * 2 : OSPRD_SPIN_MAX_NS;
+}
+
+// Spin until 'h' is granted, for at most 'ns' nanoseconds.  Returns nonzero
+// if it was.  Gives up early if another task needs the CPU or a signal
+// arrives; the caller then sleeps as usual.
+static int osprd_lock_spin(osprd_holder_t *h, unsigned long long ns)
+{
+	unsigned long long end = osp_clock_ns() + ns;
+
+	while (!*(volatile int *) &h->granted) {
+		if (need_resched() || signal_pending(current)
+		    || osp_clock_ns() >= end)
+			return 0;
+		cpu_relax();
+	}
+	return 1;
+}
+
+// Sleep until the blocked request 'h' is granted.  Returns 0, or
+// -ERESTARTSYS if a signal arrives first.  While locks with leases are
+// held, wake up when the first lease runs out, to revoke it; a lease
+// granted later that runs out sooner wakes 'h' early (osprd_lock_grant).
+static int osprd_lock_sleep(osprd_lock_t *l, osprd_holder_t *h)
+{
+	unsigned long long alarm, now;
+	long r;
+
+	for (;;) {
+		osp_spin_lock(&l->mutex);
+		osprd_lock_revoke(l);
+		alarm = h->alarm_ns = (l->nleased ? l->lease_next_ns
+				       : OSPRD_NO_ALARM);
+		h->rearm = 0;
+		osp_spin_unlock(&l->mutex);
+
+		if (alarm == OSPRD_NO_ALARM)
+			r = wait_event_interruptible(h->wait, h->granted || h->rearm);
+		else if ((now = osp_clock_ns()) < alarm)
+			r = wait_event_interruptible_timeout(h->wait,
+				h->granted || h->rearm,
+				osp_ns_to_jiffies(alarm - now));
+		else
+			r = 0;
+		if (r < 0)
+			return r;
+		else if (h->granted)
+			return 0;
+	}
+}
+
+// Return the asynchronous request that 'owner' has in line, or NULL.  Only
+// an asynchronous request can be in line while its owner does something
+// else.
+static osprd_holder_t *osprd_lock_find_async(osprd_lock_t *l,
+					     const void *owner)
+{
+	osprd_holder_t *h;
+	for (h = l->waiters; h && (h->owner != owner || !h->notify);
+	     h = h->next)
+		/* do nothing */;
+	return h;
+}
+
+// Take the blocked request 'h' out of line, because it was interrupted or
+// cancelled.  Leaving the queue may unblock the requests behind it (say,
+// readers queued behind this writer).
+static void osprd_lock_leave(osprd_lock_t *l, osprd_holder_t *h)
+{
+	osprd_lock_dequeue(l, h);
+	osprd_lock_unlink_graph(l, h);
+	if ((l->flags & OSPRD_LOCK_SHARDED) && h->writable)
+		l->nslow_writers--;
+	osprd_lock_serve(l);
+}
+
+// Grant 'h' if it need not wait.  Otherwise, if 'queue' is nonzero, give
+// it a ticket and put it in line, unless that would deadlock.  Called with
+// l->mutex held.  Returns 0 if granted, -EINPROGRESS if queued, -EBUSY if
+// 'h' must wait and 'queue' is zero, or -EDEADLK or -ENOMEM.
+static int osprd_lock_start(osprd_lock_t *l, osprd_holder_t *h, int queue)
+{
+	int sharded = (l->flags & OSPRD_LOCK_SHARDED) != 0;
+	int r;
+
+	// A writer announces itself before checking for readers, so no
+	// reader can slip into a shard after the check.
+	osprd_lock_revoke(l);
+	if (sharded && h->writable)
+		l->nslow_writers++;
+	h->ticket = l->ticket_head;
+	h->in = h->out = NULL;
+	h->revoked = 0;
+	h->alarm_ns = 0;		// Not asleep yet
+	h->rearm = 0;
+	if (!osprd_lock_blocked(l, h, l->ticket_head)) {
+		osprd_lock_grant(l, h);
+		osp_spin_lock(&l->wfg->mutex);
+		h->granted = 1;
+		osprd_wfg_insert(l->wfg, h);
+		osp_spin_unlock(&l->wfg->mutex);
+		return 0;
+	} else if (!queue) {
+		if (sharded && h->writable)
+			l->nslow_writers--;
+		return -EBUSY;
+	}
+
+	// Take a ticket and get in line, unless that would deadlock.
+	h->granted = 0;
+	init_waitqueue_head(&h->wait);
+	osprd_lock_enqueue(l, h);
+	osp_spin_lock(&l->wfg->mutex);
+	osprd_wfg_insert(l->wfg, h);
+	if ((r = osprd_lock_wait_edges(l, h)) == 0
+	    && osprd_wfg_cycle(l->wfg, h))
+		r = -EDEADLK;
+	if (r < 0) {
+		// Nothing waits for 'h' yet.
+		osprd_wfg_remove(l->wfg, h, NULL);
+		osp_spin_unlock(&l->wfg->mutex);
+		osprd_lock_dequeue(l, h);
+		if (sharded && h->writable)
+			l->nslow_writers--;
+		return r;
+	}
+	osp_spin_unlock(&l->wfg->mutex);
+	return -EINPROGRESS;
+}
+
+
+// osprd_lock_acquire(l, h, block)
+//	Acquire 'l' for the request 'h', whose 'owner', 'pid', 'writable',
+//	'start', 'end', and 'lease_ns' members must be set.  If the lock is
+//	unavailable and 'block' is zero, fail instead of blocking.
+//
+//   Returns: 0 on success, after which 'h' belongs to the lock until
+//		  osprd_lock_release returns it (if 'h' has a lease, the
+//		  lock may be revoked meanwhile);
+//	      -EDEADLK if the request would wait, directly or through other
+//		  waiters on any lock sharing l's wait-for graph, on a lock
+//		  held or requested by h->pid;
+//	      -ENOMEM if there was no memory for the wait-for graph;
+//	      -EBUSY if 'block' is zero and the request would block or
+//		  deadlock;
+//	      -ERESTARTSYS if the request blocked and was interrupted.
+
+static int osprd_lock_acquire(osprd_lock_t *l, osprd_holder_t *h, int block)
+{
+	unsigned long switches = 0;
+	unsigned long long spin_ns;
+	int r, spun = 0;
+
+	h->writable = (h->writable != 0);
+	h->waited = 0;
+	h->notify = NULL;
+	// (Locks with leases are not counted in the shards, so that they
+	// can be found to revoke.)
+	if ((l->flags & OSPRD_LOCK_SHARDED) && !h->writable && !h->lease_ns
+	    && osprd_holder_whole(h) && osprd_lock_read_fast(l, h))
+		return 0;
+
+	osp_spin_lock(&l->mutex);
+	if ((r = osprd_lock_start(l, h, block)) != -EINPROGRESS) {
+		osp_spin_unlock(&l->mutex);
+		return r;
+	}
+	spin_ns = osprd_lock_spin_ns(l, h);
+	osp_spin_unlock(&l->mutex);
+
+	if (spin_ns && osprd_lock_spin(h, spin_ns)) {
+		spun = 1;
+		r = 0;
+	} else {
+		switches = osp_nr_switches();
+		r = osprd_lock_sleep(l, h);
+		switches = osp_nr_switches() - switches;
+	}
+
+	osp_spin_lock(&l->mutex);
+	if (spun)
+		l->nspun++;
+	else {
+		l->nblocked++;
+		l->nswitches += switches;
+		h->waited = 1;
+	}
+	if (h->granted)
+		// A grant that raced with a signal still counts.
+		r = 0;
+	else
+		osprd_lock_leave(l, h);
+	osp_spin_unlock(&l->mutex);
+	return r;
+}
+
+
+// osprd_lock_acquire_async(l, h, notify)
+//	Like osprd_lock_acquire(l, h, 1), but never sleeps.  If the lock is
+//	unavailable, 'h' takes a ticket and stays in line, and the grant
+//	wakes 'notify'.  osprd_lock_pending tells whether 'h' is still in
+//	line, and osprd_lock_release cancels it.
+//
+//   Returns: 0 if the lock was granted at once (and, as for
+//		  osprd_lock_acquire, may be revoked if 'h' has a lease);
+//	      -EINPROGRESS if 'h' is in line, in which case it belongs to
+//		  the lock until osprd_lock_release returns it;
+//	      -EDEADLK or -ENOMEM as for osprd_lock_acquire.
+
+static int osprd_lock_acquire_async(osprd_lock_t *l, osprd_holder_t *h,
+				    wait_queue_head_t *notify)
+{
+	int r;
+
+	h->writable = (h->writable != 0);
+	h->waited = 0;
+	h->notify = notify;
+	// (Locks with leases are not counted in the shards, so that they
+	// can be found to revoke.)
+	if ((l->flags & OSPRD_LOCK_SHARDED) && !h->writable && !h->lease_ns
+	    && osprd_holder_whole(h) && osprd_lock_read_fast(l, h))
+		return 0;
+
+	osp_spin_lock(&l->mutex);
+	r = osprd_lock_start(l, h, 1);
+	osp_spin_unlock(&l->mutex);
+	return r;
+}
+
+
+// osprd_lock_pending(l, owner, alarm)
+//	Return nonzero if 'owner' has an asynchronous request in line for
+//	'l', zero if it holds the lock or has not asked for it.  Revokes
+//	any expired leases first.  If the request is in line and 'alarm' is
+//	not NULL, lowers '*alarm' to the time the first lease on 'l' runs
+//	out: the caller, which waits for the grant instead of sleeping in
+//	osprd_lock_sleep, must check again then, or nobody revokes it.
+
+static int osprd_lock_pending(osprd_lock_t *l, const void *owner,
+			      unsigned long long *alarm)
+{
+	osprd_holder_t *h;
+
+	osp_spin_lock(&l->mutex);
+	osprd_lock_revoke(l);
+	h = osprd_lock_find_async(l, owner);
+	if (h && alarm && l->nleased && l->lease_next_ns < *alarm)
+		*alarm = l->lease_next_ns;
+	osp_spin_unlock(&l->mutex);
+	return h != NULL;
+}
+
+
+// osprd_lock_release(l, owner)
+//	Release the lock held by 'owner', or cancel its asynchronous request
+//	if that is still in line.
+//
+//   Returns: the request that held the lock (or was cancelled, or had its
+//	      lease revoked, in which case its 'revoked' member is set),
+//	      which the caller may now free, or NULL if 'owner' neither
+//	      holds 'l' nor has a request in line or revoked.
+
+static osprd_holder_t *osprd_lock_release(osprd_lock_t *l, const void *owner)
+{
+	osprd_holder_t *h;
+	int i, wake;
+
+	// Look in the shards first, starting with this CPU's, since in
+	// sharded mode most read locks are counted there.
+	for (i = 0; i < OSPRD_NSHARDS && (l->flags & OSPRD_LOCK_SHARDED); i++) {
+		osprd_shard_t *s = &l->shards[(raw_smp_processor_id() + i)
+					      % OSPRD_NSHARDS];
+		osp_spin_lock(&s->mutex);
+		if ((h = osprd_holder_unlink(&s->holders, owner)))
+			s->nreaders--;
+		wake = (h && l->nslow_writers != 0);
+		osp_spin_unlock(&s->mutex);
+		if (h) {
+			// Only a writer can be waiting on a shard reader, and
+			// only a waiting writer has edges to one.
+			if (wake) {
+				osp_spin_lock(&l->mutex);
+				osprd_lock_unlink_graph(l, h);
+				osprd_lock_serve(l);
+				osp_spin_unlock(&l->mutex);
+			}
+			return h;
+		}
+	}
+
+	osp_spin_lock(&l->mutex);
+	if ((h = osprd_holder_unlink(&l->holders, owner))) {
+		osprd_lock_ungrant(l, h);
+		osprd_lock_serve(l);
+	} else if ((h = osprd_lock_find_async(l, owner)))
+		osprd_lock_leave(l, h);
+	else
+		h = osprd_holder_unlink(&l->revoked, owner);
+	osp_spin_unlock(&l->mutex);
+	return h;
+}
+
+#endif /* OSPRDLOCK_H */
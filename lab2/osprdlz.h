@@ -0,0 +1,168 @@
+#ifndef OSPRDLZ_H
+#define OSPRDLZ_H
+
+/*
+ * OSPRD LZ compression
+ *
+ *   A small LZ77 compressor for osprd's compressed ramdisks, in the style
+ *   of LZ4.  The compressed data is a series of sequences, each a token
+ *   byte (the number of literal bytes in the high 4 bits, the match length
+ *   minus OSPRD_LZ_MINMATCH in the low 4 bits; 15 means more length bytes
+ *   follow, each added in, until one is not 255), the literals, and a
+ *   2-byte little-endian offset back to the match.  The last sequence has
+ *   only literals.
+ *
+ *   Matches are found through a hash table of recent positions, which the
+ *   caller supplies so that no large array is put on the kernel stack.
+ *   Inputs must be shorter than 64KB.  Shared with userspace, like
+ *   osprdstore.h.
+ */
+
+#define OSPRD_LZ_MINMATCH	4
+#define OSPRD_LZ_HASH_BITS	11
+#define OSPRD_LZ_HASH_SIZE	(1 << OSPRD_LZ_HASH_BITS)
+
+static inline uint32_t osprd_lz_read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline unsigned osprd_lz_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - OSPRD_LZ_HASH_BITS);
+}
+
+// Write 'len', less the 15 already in the token, as length bytes.
+static inline uint8_t *osprd_lz_put_length(uint8_t *op, unsigned len)
+{
+	for (len -= 15; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+// Write a sequence: the literals 'lit' (of length 'litlen') and, unless
+// 'mlen' is 0, a match of 'mlen' bytes 'offset' bytes back.  Returns the
+// new output position, or NULL if it would pass 'oend'.
+static uint8_t *osprd_lz_put_sequence(uint8_t *op, uint8_t *oend,
+				      const uint8_t *lit, unsigned litlen,
+				      unsigned offset, unsigned mlen)
+{
+	unsigned mcode = mlen ? mlen - OSPRD_LZ_MINMATCH : 0;
+
+	// Worst case: token, literal length bytes, literals, offset, and
+	// match length bytes.
+	if (op + 1 + litlen / 255 + 1 + litlen + 2 + mcode / 255 + 1 > oend)
+		return NULL;
+
+	*op++ = ((litlen < 15 ? litlen : 15) << 4) | (mcode < 15 ? mcode : 15);
+	if (litlen >= 15)
+		op = osprd_lz_put_length(op, litlen);
+	memcpy(op, lit, litlen);
+	op += litlen;
+	if (mlen) {
+		*op++ = offset & 0xFF;
+		*op++ = offset >> 8;
+		if (mcode >= 15)
+			op = osprd_lz_put_length(op, mcode);
+	}
+	return op;
+}
+
+// osprd_lz_compress(src, srclen, dst, dstmax, table)
+//	Compress 'srclen' bytes from 'src' into 'dst', using 'table'
+//	(OSPRD_LZ_HASH_SIZE entries) as scratch space.  Returns the compressed
+//	length, or -1 if it would be more than 'dstmax' bytes.
+
+static int osprd_lz_compress(const uint8_t *src, unsigned srclen,
+			     uint8_t *dst, unsigned dstmax, uint16_t *table)
+{
+	unsigned ip = 0, anchor = 0;
+	uint8_t *op = dst, *oend = dst + dstmax;
+
+	memset(table, 0, OSPRD_LZ_HASH_SIZE * sizeof(uint16_t));
+	while (ip + OSPRD_LZ_MINMATCH <= srclen) {
+		uint32_t v = osprd_lz_read32(src + ip);
+		unsigned h = osprd_lz_hash(v), ref = table[h], len;
+
+		table[h] = ip;
+		if (ref >= ip || osprd_lz_read32(src + ref) != v) {
+			ip++;
+			continue;
+		}
+
+		len = OSPRD_LZ_MINMATCH;
+		while (ip + len < srclen && src[ref + len] == src[ip + len])
+			len++;
+		if (!(op = osprd_lz_put_sequence(op, oend, src + anchor,
+						 ip - anchor, ip - ref, len)))
+			return -1;
+		ip += len;
+		anchor = ip;
+	}
+
+	if (!(op = osprd_lz_put_sequence(op, oend, src + anchor,
+					 srclen - anchor, 0, 0)))
+		return -1;
+	return op - dst;
+}
+
+// Read length bytes, adding them to '*len'.  Returns the new input
+// position, or NULL if the input ends first.
+static inline const uint8_t *osprd_lz_get_length(const uint8_t *ip,
+						 const uint8_t *iend,
+						 unsigned *len)
+{
+	unsigned b;
+	do {
+		if (ip == iend)
+			return NULL;
+		*len += (b = *ip++);
+	} while (b == 255);
+	return ip;
+}
+
+// osprd_lz_decompress(src, srclen, dst, dstlen)
+//	Decompress 'srclen' bytes from 'src' into 'dst', which must come to
+//	exactly 'dstlen' bytes.  Returns 0, or -1 if the data is corrupt.
+
+static int osprd_lz_decompress(const uint8_t *src, unsigned srclen,
+			       uint8_t *dst, unsigned dstlen)
+{
+	const uint8_t *ip = src, *iend = src + srclen;
+	unsigned op = 0;
+
+	while (ip < iend) {
+		unsigned token = *ip++, litlen = token >> 4, offset, mlen;
+
+		if (litlen == 15 && !(ip = osprd_lz_get_length(ip, iend, &litlen)))
+			return -1;
+		if (litlen > (unsigned) (iend - ip) || litlen > dstlen - op)
+			return -1;
+		memcpy(dst + op, ip, litlen);
+		ip += litlen;
+		op += litlen;
+		if (ip == iend)		// the last sequence
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		mlen = token & 15;
+		if (mlen == 15 && !(ip = osprd_lz_get_length(ip, iend, &mlen)))
+			return -1;
+		mlen += OSPRD_LZ_MINMATCH;
+		if (offset == 0 || offset > op || mlen > dstlen - op)
+			return -1;
+		// The match may overlap the bytes it produces.
+		for (; mlen > 0; mlen--, op++)
+			dst[op] = dst[op - offset];
+	}
+
+	return op == dstlen ? 0 : -1;
+}
+
+#endif /* OSPRDLZ_H */
@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* Default request sizes, in bytes. */
+static const ssize_t default_sizes[] = { 512, 4096, 65536, 1048576 };
+
+void usage(int status)
+{
+	fprintf(stderr, "\
+Measures OSP ramdisk throughput.\n\
+Usage: ./osprdperf [OPTIONS] [DEVICE]\n\
+   Runs sequential and random reads and writes at several request sizes and\n\
+   prints MB/s for each.  WARNING: overwrites the device's contents.\n\
+   Options are:\n\
+   -s SIZE\n\
+       Test requests of SIZE bytes (a multiple of 512).  Give -s more than\n\
+       once to test several sizes; the -s sizes replace the defaults, which\n\
+       are 512, 4096, 65536, and 1048576.\n\
+   -t TOTAL\n\
+       Transfer TOTAL bytes per test.  Default is the device size.\n\
+   -b\n\
+       Use buffered I/O.  By default the device is opened with O_DIRECT so\n\
+       that every request reaches the driver instead of the page cache.\n\
+   -j MAXJOBS\n\
+       Instead, run random 4096-byte reads and writes from 1, 2, 4, ... up to\n\
+       MAXJOBS threads at once, and print IOPS for each.  For example,\n\
+       compare \"./osprdperf -j 8\" with the module loaded with and without\n\
+       multiqueue=1.\n\
+   DEVICE is the device to test.  The default is /dev/osprda.\n");
+	exit(status);
+}
+
+int parse_ssize(const char *arg, ssize_t *result)
+{
+	char *end_arg;
+	ssize_t val = strtol(arg, &end_arg, 0);
+	if (*arg && !*end_arg) {
+		*result = val;
+		return 1;
+	} else
+		return 0;
+}
+
+double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Run one test: 'total' bytes in requests of 'size' bytes, reading or
+// writing, at sequential or random offsets.  Returns MB/s.
+double run_test(int fd, char *buf, ssize_t devsize, ssize_t size,
+		ssize_t total, int writing, int random)
+{
+	ssize_t nslots = devsize / size, done = 0, slot = 0;
+	double start = now(), elapsed;
+
+	while (done < total) {
+		off_t off = (random ? (off_t) (rand() % nslots) : slot) * size;
+		ssize_t r;
+		if (writing)
+			r = pwrite(fd, buf, size, off);
+		else
+			r = pread(fd, buf, size, off);
+		if (r < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		else if (r != size) {
+			perror(writing ? "pwrite" : "pread");
+			exit(1);
+		}
+		done += r;
+		if (++slot == nslots)
+			slot = 0;
+	}
+
+	elapsed = now() - start;
+	return (done / 1048576.0) / (elapsed > 0 ? elapsed : 1e-9);
+}
+
+// A thread of a parallel test (run_jobs).
+typedef struct job {
+	pthread_t thread;
+	int fd;
+	ssize_t devsize, size, nreqs;
+	int writing;
+	unsigned seed;
+	pthread_barrier_t *barrier;
+	double start, end;		// When the thread started and finished
+} job_t;
+
+void *run_job(void *arg)
+{
+	job_t *j = (job_t *) arg;
+	ssize_t nslots = j->devsize / j->size, n;
+	char *buf;
+
+	// O_DIRECT needs an aligned buffer.
+	if (posix_memalign((void **) &buf, 4096, j->size) != 0) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	memset(buf, 'x', j->size);
+
+	pthread_barrier_wait(j->barrier);
+	j->start = now();
+	for (n = 0; n < j->nreqs; ) {
+		off_t off = (off_t) (rand_r(&j->seed) % nslots) * j->size;
+		ssize_t r;
+		if (j->writing)
+			r = pwrite(j->fd, buf, j->size, off);
+		else
+			r = pread(j->fd, buf, j->size, off);
+		if (r < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		else if (r != j->size) {
+			perror(j->writing ? "pwrite" : "pread");
+			exit(1);
+		}
+		n++;
+	}
+	j->end = now();
+
+	free(buf);
+	return NULL;
+}
+
+// Run a parallel test: 'njobs' threads, sharing 'fd', together make 'total'
+// bytes of random 'size'-byte requests.  Returns requests per second.
+double run_jobs(int fd, ssize_t devsize, ssize_t size, ssize_t total,
+		int writing, int njobs)
+{
+	job_t *jobs = calloc(njobs, sizeof(job_t));
+	pthread_barrier_t barrier;
+	double start = 0, end = 0, elapsed;
+	int i;
+
+	pthread_barrier_init(&barrier, NULL, njobs + 1);
+	for (i = 0; i < njobs; i++) {
+		jobs[i].fd = fd;
+		jobs[i].devsize = devsize;
+		jobs[i].size = size;
+		jobs[i].nreqs = total / size / njobs;
+		jobs[i].writing = writing;
+		jobs[i].seed = i + 1;
+		jobs[i].barrier = &barrier;
+		if (pthread_create(&jobs[i].thread, NULL, run_job, &jobs[i]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	// Time from the first thread's start to the last one's finish.  (The
+	// threads may all be done before this one runs again.)
+	pthread_barrier_wait(&barrier);
+	for (i = 0; i < njobs; i++) {
+		pthread_join(jobs[i].thread, NULL);
+		if (i == 0 || jobs[i].start < start)
+			start = jobs[i].start;
+		if (i == 0 || jobs[i].end > end)
+			end = jobs[i].end;
+	}
+	elapsed = end - start;
+
+	pthread_barrier_destroy(&barrier);
+	free(jobs);
+	return (total / size / njobs * njobs) / (elapsed > 0 ? elapsed : 1e-9);
+}
+
+int main(int argc, char *argv[])
+{
+	ssize_t sizes[32];
+	int nsizes = 0;
+	ssize_t total = -1, devsize, maxsize = 0;
+	int i, flags = O_RDWR | O_DIRECT, maxjobs = 0;
+	const char *devname = "/dev/osprda";
+	char *buf;
+	int devfd;
+
+ flag:
+	if (argc >= 3 && strcmp(argv[1], "-s") == 0) {
+		if (nsizes == 32 || !parse_ssize(argv[2], &sizes[nsizes])
+		    || sizes[nsizes] <= 0 || sizes[nsizes] % 512 != 0)
+			usage(1);
+		nsizes++;
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 3 && strcmp(argv[1], "-t") == 0) {
+		if (!parse_ssize(argv[2], &total) || total <= 0)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 3 && strcmp(argv[1], "-j") == 0) {
+		maxjobs = atoi(argv[2]);
+		if (maxjobs <= 0)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 2 && strcmp(argv[1], "-b") == 0) {
+		flags &= ~O_DIRECT;
+		argv++, argc--;
+		goto flag;
+	} else if (argc >= 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0))
+		usage(0);
+
+	if (argc == 2 && argv[1][0] != '-')
+		devname = argv[1];
+	else if (argc != 1)
+		usage(1);
+
+	if (nsizes == 0) {
+		memcpy(sizes, default_sizes, sizeof(default_sizes));
+		nsizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+	}
+
+	devfd = open(devname, flags);
+	if (devfd == -1) {
+		perror("open");
+		exit(1);
+	}
+	devsize = lseek(devfd, 0, SEEK_END);
+	if (devsize <= 0) {
+		fprintf(stderr, "%s: cannot determine device size\n", devname);
+		exit(1);
+	}
+	if (total < 0)
+		total = devsize;
+
+	if (maxjobs > 0) {
+		int njobs, writing;
+		if (devsize < 4096) {
+			fprintf(stderr, "%s: smaller than a request\n", devname);
+			exit(1);
+		}
+		printf("%-6s %-10s %12s\n", "jobs", "op", "IOPS");
+		for (njobs = 1; ; njobs *= 2) {
+			if (njobs > maxjobs)
+				njobs = maxjobs;
+			for (writing = 1; writing >= 0; writing--)
+				printf("%-6d %-10s %12.0f\n", njobs,
+				       writing ? "randwrite" : "randread",
+				       run_jobs(devfd, devsize, 4096, total,
+						writing, njobs));
+			if (njobs == maxjobs)
+				break;
+		}
+		close(devfd);
+		exit(0);
+	}
+
+	for (i = 0; i < nsizes; i++)
+		if (sizes[i] > maxsize)
+			maxsize = sizes[i];
+	// O_DIRECT needs an aligned buffer.
+	if (posix_memalign((void **) &buf, 4096, maxsize) != 0) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	memset(buf, 'x', maxsize);
+
+	printf("%-10s %-6s %10s %10s\n", "pattern", "op", "reqsize", "MB/s");
+	for (i = 0; i < nsizes; i++) {
+		int random, writing;
+		if (sizes[i] > devsize) {
+			fprintf(stderr, "skipping request size %ld: larger than device\n",
+				(long) sizes[i]);
+			continue;
+		}
+		for (random = 0; random < 2; random++)
+			for (writing = 1; writing >= 0; writing--)
+				printf("%-10s %-6s %10ld %10.1f\n",
+				       random ? "random" : "sequential",
+				       writing ? "write" : "read", (long) sizes[i],
+				       run_test(devfd, buf, devsize, sizes[i],
+						total, writing, random));
+	}
+
+	close(devfd);
+	exit(0);
+}
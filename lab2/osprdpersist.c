@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "osprd.h"
+#include "osprdsim.h"
+
+/****************************************************************************
+ * osprdpersist
+ *
+ *   Tests osprd's backing-file mode (backing=, see osprdback.h) in
+ *   userspace, through libosprdsim.  Writes to a simulated backed ramdisk
+ *   and checks that a reloaded ramdisk sees the data written before
+ *   OSPRDIOCFLUSH even if the ramdisk "crashed" afterwards, and all of it
+ *   after a clean shutdown.  Also compares the ramdisk's write throughput
+ *   with writing through to the file on every request.
+ *
+ ****************************************************************************/
+
+void usage(int status)
+{
+	fprintf(stderr, "\
+Tests and benchmarks osprd's backing-file mode in userspace.\n\
+Usage: ./osprdpersist [OPTIONS] [FILE]\n\
+   Options are:\n\
+   -s SIZE\n\
+       Ramdisk size, in bytes (a multiple of 512).  Default is 64MB.\n\
+   -i INTERVAL\n\
+       Write changes back every INTERVAL milliseconds.  Default is 100.\n\
+   FILE is the backing file.  The default is osprdpersist.img, which is\n\
+   removed afterwards.  WARNING: FILE is overwritten.\n");
+	exit(status);
+}
+
+int parse_ssize(const char *arg, ssize_t *result)
+{
+	char *end_arg;
+	ssize_t val = strtol(arg, &end_arg, 0);
+	if (*arg && !*end_arg) {
+		*result = val;
+		return 1;
+	} else
+		return 0;
+}
+
+double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+#define BLOCK	4096
+
+// Fill 'buf' with the contents of block 'block' in generation 'gen'.
+void make_block(char *buf, ssize_t block, int gen)
+{
+	int i;
+	for (i = 0; i < BLOCK; i += sizeof(int))
+		*(int *) (buf + i) = block * 7919 + gen * 104729 + i;
+}
+
+// Write generation 'gen' to every block of 'f', in random order.
+// Returns MB/s.
+double write_blocks(osprdsim_file_t *f, ssize_t nblocks, int gen)
+{
+	char buf[BLOCK];
+	ssize_t i, *order = malloc(nblocks * sizeof(ssize_t));
+	double start, elapsed;
+
+	for (i = 0; i < nblocks; i++)
+		order[i] = i;
+	for (i = nblocks - 1; i > 0; i--) {
+		ssize_t j = rand() % (i + 1), t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+
+	start = now();
+	for (i = 0; i < nblocks; i++) {
+		make_block(buf, order[i], gen);
+		if (osprdsim_pwrite(f, buf, BLOCK, order[i] * BLOCK) != BLOCK) {
+			fprintf(stderr, "write failed\n");
+			exit(1);
+		}
+	}
+	elapsed = now() - start;
+
+	free(order);
+	return (nblocks * BLOCK / 1048576.0) / (elapsed > 0 ? elapsed : 1e-9);
+}
+
+// Return the number of blocks of 'f' that do not hold generation 'gen'.
+ssize_t check_blocks(osprdsim_file_t *f, ssize_t nblocks, int gen)
+{
+	char buf[BLOCK], expected[BLOCK];
+	ssize_t i, nbad = 0;
+
+	for (i = 0; i < nblocks; i++) {
+		make_block(expected, i, gen);
+		if (osprdsim_pread(f, buf, BLOCK, i * BLOCK) != BLOCK
+		    || memcmp(buf, expected, BLOCK) != 0)
+			nbad++;
+	}
+	return nbad;
+}
+
+// The same random writes as write_blocks, but each one written straight to
+// the file, and the file synced at the end.  Returns MB/s.
+double write_through(const char *path, ssize_t nblocks)
+{
+	char buf[BLOCK];
+	ssize_t i;
+	double start, elapsed;
+	int fd = open(path, O_RDWR);
+
+	if (fd < 0) {
+		perror(path);
+		exit(1);
+	}
+	start = now();
+	for (i = 0; i < nblocks; i++) {
+		ssize_t block = rand() % nblocks;
+		make_block(buf, block, 0);
+		if (pwrite(fd, buf, BLOCK, block * BLOCK) != BLOCK) {
+			perror("pwrite");
+			exit(1);
+		}
+	}
+	fsync(fd);
+	elapsed = now() - start;
+
+	close(fd);
+	return (nblocks * BLOCK / 1048576.0) / (elapsed > 0 ? elapsed : 1e-9);
+}
+
+// A backed ramdisk, open for writing.
+typedef struct disk {
+	osprdsim_dev_t *dev;
+	osprdsim_task_t *task;
+	osprdsim_file_t *file;
+} disk_t;
+
+// Load a backed ramdisk from 'path'.
+void load(disk_t *disk, const char *path, ssize_t size, int interval)
+{
+	if (!(disk->dev = osprdsim_dev_create_backed(0, path, size / 512,
+						     interval))) {
+		perror(path);
+		exit(1);
+	}
+	if (!(disk->task = osprdsim_task_create(1))
+	    || !(disk->file = osprdsim_open(disk->task, disk->dev, 1))) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+}
+
+// Shut the ramdisk down, or crash it if 'crash' is nonzero.
+void unload(disk_t *disk, int crash)
+{
+	osprdsim_close(disk->file);
+	osprdsim_task_destroy(disk->task);
+	if (crash)
+		osprdsim_dev_crash(disk->dev);
+	else
+		osprdsim_dev_destroy(disk->dev);
+}
+
+int main(int argc, char *argv[])
+{
+	ssize_t size = 64 << 20, interval = 100, nblocks, nbad;
+	const char *path = "osprdpersist.img";
+	int remove_file = 1, r;
+	disk_t disk;
+	double start;
+
+ flag:
+	if (argc >= 3 && strcmp(argv[1], "-s") == 0) {
+		if (!parse_ssize(argv[2], &size) || size < BLOCK
+		    || size % 512 != 0)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 3 && strcmp(argv[1], "-i") == 0) {
+		if (!parse_ssize(argv[2], &interval) || interval <= 0)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0))
+		usage(0);
+
+	if (argc == 2 && argv[1][0] != '-') {
+		path = argv[1];
+		remove_file = 0;
+	} else if (argc != 1)
+		usage(1);
+	nblocks = size / BLOCK;
+
+	// Start from an empty file.
+	if (truncate(path, 0) < 0 && errno != ENOENT) {
+		perror(path);
+		exit(1);
+	}
+
+	// Writes go to memory, so they run at memory speed.
+	load(&disk, path, size, interval);
+	printf("write-back: %.1f MB/s\n", write_blocks(disk.file, nblocks, 1));
+	start = now();
+	if ((r = osprdsim_ioctl(disk.file, OSPRDIOCFLUSH, 0)) < 0) {
+		fprintf(stderr, "OSPRDIOCFLUSH: %s\n", strerror(-r));
+		exit(1);
+	}
+	printf("flush: %.1f ms\n", (now() - start) * 1000);
+
+	// Everything written before the flush survives a crash.
+	unload(&disk, 1);
+	load(&disk, path, size, interval);
+	if ((nbad = check_blocks(disk.file, nblocks, 1)) != 0) {
+		fprintf(stderr, "%ld blocks lost after flush and crash!\n",
+			(long) nbad);
+		exit(1);
+	}
+
+	// Everything survives a clean shutdown.
+	write_blocks(disk.file, nblocks, 2);
+	unload(&disk, 0);
+	load(&disk, path, size, interval);
+	if ((nbad = check_blocks(disk.file, nblocks, 2)) != 0) {
+		fprintf(stderr, "%ld blocks lost after shutdown!\n",
+			(long) nbad);
+		exit(1);
+	}
+	unload(&disk, 0);
+
+	printf("write-through: %.1f MB/s\n", write_through(path, nblocks));
+	if (remove_file)
+		unlink(path);
+	exit(0);
+}
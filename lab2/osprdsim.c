@@ -0,0 +1,406 @@
+#include "kcompat.h"
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "spinlock.h"
+#include "osprd.h"
+#include "osprdlock.h"
+#include "osprdback.h"
+#include "osprdsim.h"
+
+/****************************************************************************
+ * osprdsim
+ *
+ *   Userspace harness around osprdlock.h and osprdback.h.  The ioctl and
+ *   close paths here mirror osprd_ioctl and osprd_close_last in osprd.c,
+ *   with 'struct osprdsim_file' standing in for 'struct file', and the
+ *   flusher thread mirrors osprd_flusher.
+ *
+ ****************************************************************************/
+
+__thread struct task_struct *osp_current;
+
+struct osprdsim_dev {
+	osprd_lock_t lock;
+
+	// Only for a backed ramdisk:
+	uint8_t *data;			// The ramdisk's data, or NULL
+	unsigned long long size;	// ... and its size in bytes
+	int fd;				// The backing file
+	osprd_backing_t back;
+	pthread_t flusher;		// Writes 'back' every 'flush_ms'
+	int flush_ms;
+	int stopping;			// Set to stop 'flusher',
+	pthread_mutex_t stop_mutex;	// protected by 'stop_mutex'
+	pthread_cond_t stop_cond;
+};
+
+// All simulated ramdisks share a wait-for graph, as osprd's devices do.
+static osprd_wfg_t sim_wfg;
+static pthread_once_t sim_wfg_once = PTHREAD_ONCE_INIT;
+
+static void sim_wfg_init(void)
+{
+	osprd_wfg_init(&sim_wfg);
+}
+
+struct osprdsim_task {
+	struct task_struct task;
+	wait_queue_head_t events;	// Woken when one of the task's
+					// asynchronous lock requests is
+					// granted (like osprd's poll_wait)
+};
+
+struct osprdsim_file {
+	osprdsim_dev_t *dev;
+	osprdsim_task_t *task;
+	int writable;
+	int locked;		// Like F_OSPRD_LOCKED
+	unsigned long lease_ms;	// Lease for lock requests (OSPRDIOCSETLEASE)
+};
+
+
+osprdsim_dev_t *osprdsim_dev_create(int flags)
+{
+	osprdsim_dev_t *d = calloc(1, sizeof(*d));
+	pthread_once(&sim_wfg_once, sim_wfg_init);
+	if (d)
+		osprd_lock_init(&d->lock, (flags & OSPRDSIM_SHARDED
+					    ? OSPRD_LOCK_SHARDED : 0)
+				| (flags & OSPRDSIM_SPIN ? OSPRD_LOCK_SPIN : 0),
+				&sim_wfg);
+	return d;
+}
+
+
+
+// A backed ramdisk's file, for osprdback.h.
+
+static long sim_file_pread(void *file, void *buf, unsigned long len,
+			   unsigned long long off)
+{
+	ssize_t r = pread(((osprdsim_dev_t *) file)->fd, buf, len, off);
+	return r < 0 ? -errno : r;
+}
+
+static long sim_file_pwrite(void *file, const void *buf, unsigned long len,
+			    unsigned long long off)
+{
+	ssize_t r = pwrite(((osprdsim_dev_t *) file)->fd, buf, len, off);
+	return r < 0 ? -errno : r;
+}
+
+static int sim_file_sync(void *file)
+{
+	return fsync(((osprdsim_dev_t *) file)->fd) < 0 ? -errno : 0;
+}
+
+static const osprd_backing_ops_t sim_file_ops = {
+	.pread = sim_file_pread,
+	.pwrite = sim_file_pwrite,
+	.sync = sim_file_sync
+};
+
+static void *sim_flusher(void *arg)
+{
+	osprdsim_dev_t *d = (osprdsim_dev_t *) arg;
+	struct timespec deadline;
+	int failed = 0;
+
+	pthread_mutex_lock(&d->stop_mutex);
+	while (!d->stopping) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += d->flush_ms / 1000;
+		deadline.tv_nsec += (d->flush_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&d->stop_cond, &d->stop_mutex, &deadline);
+		if (d->stopping)
+			break;
+
+		pthread_mutex_unlock(&d->stop_mutex);
+		if (osprd_backing_flush(&d->back, 0) < 0) {
+			if (!failed)
+				eprintk("osprdsim: can't write back to backing file\n");
+			failed = 1;
+		} else
+			failed = 0;
+		pthread_mutex_lock(&d->stop_mutex);
+	}
+	pthread_mutex_unlock(&d->stop_mutex);
+	return NULL;
+}
+
+osprdsim_dev_t *osprdsim_dev_create_backed(int flags, const char *path,
+					   unsigned long nsectors,
+					   int flush_ms)
+{
+	osprdsim_dev_t *d;
+	int r;
+
+	if (flush_ms <= 0 || nsectors == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!(d = osprdsim_dev_create(flags)))
+		return NULL;
+	d->size = (unsigned long long) nsectors * 512;
+	d->flush_ms = flush_ms;
+	pthread_mutex_init(&d->stop_mutex, NULL);
+	pthread_cond_init(&d->stop_cond, NULL);
+
+	if ((d->fd = open(path, O_RDWR | O_CREAT, 0600)) < 0) {
+		free(d);
+		return NULL;
+	}
+	if (!(d->data = calloc(1, d->size))) {
+		r = -ENOMEM;
+		goto error_close;
+	}
+	if ((r = osprd_backing_init(&d->back, &sim_file_ops, d, d->data,
+				    d->size)) < 0)
+		goto error_free;
+	if ((r = osprd_backing_load(&d->back)) < 0
+	    || (r = -pthread_create(&d->flusher, NULL, sim_flusher, d)) < 0)
+		goto error_backing;
+	return d;
+
+ error_backing:
+	osprd_backing_destroy(&d->back);
+ error_free:
+	free(d->data);
+ error_close:
+	close(d->fd);
+	free(d);
+	errno = -r;
+	return NULL;
+}
+
+static void destroy_backed(osprdsim_dev_t *d, int flush)
+{
+	pthread_mutex_lock(&d->stop_mutex);
+	d->stopping = 1;
+	pthread_cond_signal(&d->stop_cond);
+	pthread_mutex_unlock(&d->stop_mutex);
+	pthread_join(d->flusher, NULL);
+
+	if (flush && osprd_backing_flush(&d->back, 1) < 0)
+		eprintk("osprdsim: can't write back to backing file\n");
+	osprd_backing_destroy(&d->back);
+	close(d->fd);
+	free(d->data);
+}
+
+void osprdsim_dev_destroy(osprdsim_dev_t *d)
+{
+	if (d->data)
+		destroy_backed(d, 1);
+	free(d);
+}
+
+void osprdsim_dev_crash(osprdsim_dev_t *d)
+{
+	if (d->data)
+		destroy_backed(d, 0);
+	free(d);
+}
+
+osprdsim_task_t *osprdsim_task_create(pid_t pid)
+{
+	osprdsim_task_t *t = calloc(1, sizeof(*t));
+	if (t) {
+		t->task.pid = pid;
+		init_waitqueue_head(&t->events);
+	}
+	return t;
+}
+
+void osprdsim_task_destroy(osprdsim_task_t *t)
+{
+	free(t);
+}
+
+void osprdsim_task_kill(osprdsim_task_t *t)
+{
+	send_sig_sim(&t->task);
+}
+
+osprdsim_file_t *osprdsim_open(osprdsim_task_t *t, osprdsim_dev_t *d,
+			       int writable)
+{
+	osprdsim_file_t *f = malloc(sizeof(*f));
+	if (f) {
+		f->dev = d;
+		f->task = t;
+		f->writable = writable;
+		f->locked = 0;
+		f->lease_ms = 0;
+	}
+	return f;
+}
+
+static int release_file(osprdsim_file_t *f)
+{
+	osprd_holder_t *h;
+	int r;
+
+	if (!f->locked || !(h = osprd_lock_release(&f->dev->lock, f)))
+		return -EINVAL;
+	f->locked = 0;
+	r = (h->revoked ? -ETIMEDOUT : 0);
+	free(h);
+	return r;
+}
+
+int osprdsim_ioctl(osprdsim_file_t *f, unsigned int cmd, unsigned long arg)
+{
+	osprdsim_dev_t *d = f->dev;
+	int r;
+
+	current = &f->task->task;
+
+	if (cmd == OSPRDIOCACQUIRE || cmd == OSPRDIOCTRYACQUIRE
+	    || cmd == OSPRDIOCACQUIRERANGE || cmd == OSPRDIOCTRYACQUIRERANGE
+	    || cmd == OSPRDIOCACQUIREASYNC
+	    || cmd == OSPRDIOCACQUIRERANGEASYNC) {
+		int async = (cmd == OSPRDIOCACQUIREASYNC
+			     || cmd == OSPRDIOCACQUIRERANGEASYNC);
+		int block = (cmd == OSPRDIOCACQUIRE
+			     || cmd == OSPRDIOCACQUIRERANGE || async);
+		struct osprd_range range = { 0, 0 };
+		osprd_holder_t *h;
+
+		if (f->locked)
+			return block ? -EDEADLK : -EBUSY;
+		if (cmd == OSPRDIOCACQUIRERANGE
+		    || cmd == OSPRDIOCTRYACQUIRERANGE
+		    || cmd == OSPRDIOCACQUIRERANGEASYNC) {
+			range = *(struct osprd_range *) arg;
+			if (range.nsectors == 0 || range.start >= OSPRDSIM_NSECTORS
+			    || range.nsectors > OSPRDSIM_NSECTORS - range.start)
+				return -EINVAL;
+		}
+		if (!(h = malloc(sizeof(*h))))
+			return -ENOMEM;
+		h->owner = f;
+		h->pid = current->pid;
+		h->writable = f->writable;
+		h->start = range.start;
+		h->end = (range.nsectors ? range.start + range.nsectors
+			  : OSPRD_SECTOR_MAX);
+		h->lease_ns = (unsigned long long) f->lease_ms * 1000000;
+
+		if (async)
+			r = osprd_lock_acquire_async(&d->lock, h,
+						     &f->task->events);
+		else
+			r = osprd_lock_acquire(&d->lock, h, block);
+		if (r == 0 || r == -EINPROGRESS)
+			f->locked = 1;
+		else
+			free(h);
+
+	} else if (cmd == OSPRDIOCRELEASE)
+		r = release_file(f);
+	else if (cmd == OSPRDIOCSETLEASE) {
+		if (arg > 24UL * 60 * 60 * 1000)
+			return -EINVAL;
+		f->lease_ms = arg;
+		r = 0;
+	} else if (cmd == OSPRDIOCWAKESTATS) {
+		struct osprd_wakestats *ws = (struct osprd_wakestats *) arg;
+		osp_spin_lock(&d->lock.mutex);
+		ws->blocked = d->lock.nblocked;
+		ws->wakeups = d->lock.nwakeups;
+		ws->switches = d->lock.nswitches;
+		ws->spun = d->lock.nspun;
+		ws->hold_ns = d->lock.hold_ns;
+		ws->revoked = d->lock.nrevoked;
+		osp_spin_unlock(&d->lock.mutex);
+		r = 0;
+	} else if (cmd == OSPRDIOCFLUSH)
+		r = d->data ? osprd_backing_flush(&d->back, 1) : 0;
+	else
+		r = -ENOTTY;
+
+	// The simulated signal has been delivered.
+	if (r == -ERESTARTSYS)
+		current->sigpending = 0;
+	return r;
+}
+
+int osprdsim_poll(osprdsim_file_t **files, int n, int block)
+{
+	osprdsim_task_t *t = files[0]->task;
+	unsigned long long alarm, now;
+	unsigned long seen;
+	int i, r;
+
+	current = &t->task;
+	for (;;) {
+		// A grant after this read changes 'nwakeups', so a wait
+		// below cannot miss one that the scan did not see.
+		seen = __atomic_load_n(&t->events.nwakeups, __ATOMIC_SEQ_CST);
+		alarm = OSPRD_NO_ALARM;
+		for (i = 0; i < n; i++)
+			if (!files[i]->locked
+			    || !osprd_lock_pending(&files[i]->dev->lock,
+						   files[i], &alarm))
+				return i;
+		if (!block)
+			return -1;
+		// Wake up when the first lease runs out, as osprd's
+		// 'lease_timer' does, so the next scan revokes it.
+		if (alarm == OSPRD_NO_ALARM)
+			r = wait_event_interruptible(t->events,
+						     t->events.nwakeups != seen);
+		else if ((now = osp_clock_ns()) < alarm)
+			r = wait_event_interruptible_timeout(t->events,
+				t->events.nwakeups != seen,
+				osp_ns_to_jiffies(alarm - now));
+		else
+			r = 0;
+		if (r < 0) {
+			current->sigpending = 0;
+			return r;
+		}
+	}
+}
+
+ssize_t osprdsim_pread(osprdsim_file_t *f, void *buf, size_t len,
+		       off_t off)
+{
+	osprdsim_dev_t *d = f->dev;
+
+	if (!d->data || off < 0 || (unsigned long long) off > d->size
+	    || len > d->size - off)
+		return -EIO;
+	memcpy(buf, d->data + off, len);
+	return len;
+}
+
+ssize_t osprdsim_pwrite(osprdsim_file_t *f, const void *buf, size_t len,
+			off_t off)
+{
+	osprdsim_dev_t *d = f->dev;
+
+	if (!f->writable)
+		return -EBADF;
+	if (!d->data || off < 0 || (unsigned long long) off > d->size
+	    || len > d->size - off)
+		return -EIO;
+	if (len > 0) {
+		memcpy(d->data + off, buf, len);
+		osprd_backing_dirty(&d->back, off, len);
+	}
+	return len;
+}
+
+void osprdsim_close(osprdsim_file_t *f)
+{
+	if (f->locked)
+		release_file(f);
+	free(f);
+}
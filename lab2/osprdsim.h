@@ -0,0 +1,80 @@
+#ifndef OSPRDSIM_H
+#define OSPRDSIM_H
+
+/*
+ * osprdsim: the osprd lock manager in userspace
+ *
+ *   libosprdsim.a compiles the same lock code as osprd.c (osprdlock.h)
+ *   against pthreads, so lock behavior can be tested and benchmarked
+ *   without QEMU.  Simulated processes open simulated ramdisks and issue
+ *   the ioctls from osprd.h against them.  Each call runs on the calling
+ *   thread, so a blocked OSPRDIOCACQUIRE blocks that thread.
+ *
+ *   A simulated ramdisk can also hold data backed by a host file, using
+ *   the same write-back code as osprd's backing= mode (osprdback.h).
+ */
+
+#include <sys/types.h>
+
+typedef struct osprdsim_dev osprdsim_dev_t;	// A simulated ramdisk
+typedef struct osprdsim_task osprdsim_task_t;	// A simulated process
+typedef struct osprdsim_file osprdsim_file_t;	// An open ramdisk file
+
+// Flags for osprdsim_dev_create.
+#define OSPRDSIM_SHARDED	1	// Lock with per-CPU reader counts,
+					// like osprd's sharded_readers=1
+#define OSPRDSIM_SPIN		2	// Spin before sleeping, like
+					// osprd's adaptive_spin=1
+
+// Size of a simulated ramdisk, which bounds the range lock ioctls.
+#define OSPRDSIM_NSECTORS	(1 << 20)
+
+osprdsim_dev_t *osprdsim_dev_create(int flags);
+void osprdsim_dev_destroy(osprdsim_dev_t *d);
+
+// Create a simulated ramdisk of 'nsectors' sectors whose data is loaded
+// from, and written back to, the file 'path' (created if missing).  A
+// thread writes changes back every 'flush_ms' milliseconds, and
+// OSPRDIOCFLUSH makes them durable.  osprdsim_dev_destroy writes back any
+// remaining changes.  Returns NULL on error, with errno set.
+osprdsim_dev_t *osprdsim_dev_create_backed(int flags, const char *path,
+					   unsigned long nsectors,
+					   int flush_ms);
+
+// Destroy a backed ramdisk without writing back its remaining changes, as
+// if the machine had crashed.
+void osprdsim_dev_crash(osprdsim_dev_t *d);
+
+osprdsim_task_t *osprdsim_task_create(pid_t pid);
+void osprdsim_task_destroy(osprdsim_task_t *t);
+
+// Send a signal to 't'.  If 't' is blocked in OSPRDIOCACQUIRE, that ioctl
+// returns -ERESTARTSYS; so does a blocking osprdsim_poll.
+void osprdsim_task_kill(osprdsim_task_t *t);
+
+// Open 'd' on behalf of 't', for writing if 'writable' is nonzero.
+osprdsim_file_t *osprdsim_open(osprdsim_task_t *t, osprdsim_dev_t *d,
+			       int writable);
+
+// Perform an osprd ioctl.  Returns 0 on success, -(error code) on error.
+int osprdsim_ioctl(osprdsim_file_t *f, unsigned int cmd, unsigned long arg);
+
+// Like poll() on osprd files: return the index of the first of the 'n'
+// files that is ready, meaning it has no asynchronous lock request in line
+// (see OSPRDIOCACQUIREASYNC), or -1 if none is.  If 'block' is nonzero,
+// wait until one is ready instead of returning -1, or until the files'
+// task is signalled (then return -ERESTARTSYS).  The files must all
+// belong to one task.
+int osprdsim_poll(osprdsim_file_t **files, int n, int block);
+
+// Read or write a backed ramdisk's data, as a request to the ramdisk
+// would.  Returns 'len' on success, -(error code) on error.
+ssize_t osprdsim_pread(osprdsim_file_t *f, void *buf, size_t len,
+		       off_t off);
+ssize_t osprdsim_pwrite(osprdsim_file_t *f, const void *buf, size_t len,
+			off_t off);
+
+// Close 'f', releasing any lock it holds.
+void osprdsim_close(osprdsim_file_t *f);
+
+#endif /* OSPRDSIM_H */
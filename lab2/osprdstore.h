@@ -0,0 +1,732 @@
+#ifndef OSPRDSTORE_H
+#define OSPRDSTORE_H
+
+/*
+ * OSPRD sparse store
+ *
+ *   The backing store for a sparse ramdisk (osprd's sparse=1 mode).  The
+ *   device's data is split into OSPRD_CHUNK_SIZE-byte chunks, and a chunk
+ *   is allocated only when it is first written.  Reading a chunk that was
+ *   never written (or was discarded) returns zeros without allocating it.
+ *
+ *   Chunks are found through a radix tree: each node has OSPRD_RADIX_SLOTS
+ *   slots, indexed by successive groups of OSPRD_RADIX_BITS bits of the
+ *   chunk number, and the tree is just tall enough to cover the device.
+ *   Nodes are freed when their last chunk is discarded.
+ *
+ *   Stores in the same pool can share nodes and chunks, which is how
+ *   osprd_store_snapshot() copies a whole store in constant time.  Every
+ *   node and chunk counts the references to it (from a store's root or
+ *   from parent nodes), and is copied before it is changed if it has more
+ *   than one: a write copies the path from the root down to its chunk,
+ *   after which that path belongs to the writer alone.
+ *
+ *   A compressed store (osprd's compress=1 mode) re-encodes each chunk
+ *   whenever it is written, in the smallest form that fits: all-zero chunks
+ *   are not stored at all, chunks that repeat one word are stored as that
+ *   word, and others are LZ-compressed (osprdlz.h) unless that saves too
+ *   little.  A partial write decompresses the chunk, changes it, and
+ *   compresses it again.
+ *
+ *   A deduplicating store (osprd's dedup=1 mode) keeps one copy of each
+ *   distinct chunk in the pool.  Its chunks are re-encoded on every write
+ *   too, but before a chunk is stored, its contents are hashed and looked
+ *   up in the pool's dedup index; if an indexed chunk has the same
+ *   contents, the store takes another reference to it instead.  Otherwise
+ *   the new chunk is added to the index.  Indexed chunks are never changed
+ *   in place, since any number of slots, in any stores in the pool, may
+ *   refer to them.  The index has a lock of its own, taken after the
+ *   store's caller's lock, since stores serialized by different locks
+ *   share it.  Deduplication can be combined with compression.
+ *
+ *   Like osprdlock.h, this file is shared with userspace (include kcompat.h
+ *   first there, then spinlock.h).  In the kernel, include osprdlock.h
+ *   first, for osp_clock_ns().  A store has no lock of its own; the caller serializes
+ *   access to each store (osprd uses the request queue lock).  Reference
+ *   counts are atomic, so stores sharing data need not share a lock.
+ *   Allocations are atomic, since osprd writes from its request function.
+ */
+
+#include "osprdlz.h"
+
+#define OSPRD_CHUNK_SHIFT	12
+#define OSPRD_CHUNK_SIZE	(1 << OSPRD_CHUNK_SHIFT)	// 4096 bytes
+
+#define OSPRD_RADIX_BITS	6
+#define OSPRD_RADIX_SLOTS	(1 << OSPRD_RADIX_BITS)
+
+// A compressed chunk is kept only if it is at most this big.
+#define OSPRD_LZ_MAXLEN		(OSPRD_CHUNK_SIZE - OSPRD_CHUNK_SIZE / 8)
+
+// Chunk kinds
+#define OSPRD_CHUNK_RAW		0	// 'data' holds the chunk as is
+#define OSPRD_CHUNK_SAME	1	// Every word of the chunk is 'fill'
+#define OSPRD_CHUNK_LZ		2	// 'data' holds the chunk compressed
+
+typedef struct osprd_chunk {
+	atomic_t ref;			// Leaf nodes pointing here
+	unsigned short kind;		// OSPRD_CHUNK_* constant
+	unsigned short len;		// Bytes of 'data'
+	unsigned short hashed;		// Set if in the pool's dedup index
+	unsigned long fill;
+	uint8_t *data;
+	uint64_t hash;			// Hash of the contents, if 'hashed'
+	struct osprd_chunk *hnext;	// Next chunk in the index bucket
+} osprd_chunk_t;
+
+typedef struct osprd_rnode {
+	void *slots[OSPRD_RADIX_SLOTS];	// Children, or chunks at the bottom
+	unsigned count;			// Number of non-NULL slots
+	atomic_t ref;			// Roots and parent nodes pointing here
+} osprd_rnode_t;
+
+// Memory allocated by a set of stores that may share data.  Shared nodes
+// and chunks are counted once.
+typedef struct osprd_pool {
+	atomic_t nchunks;
+	atomic_t nnodes;
+	atomic_long_t nbytes;		// Bytes of chunk data
+
+	// The dedup index: chunks of deduplicating stores, by content hash
+	osprd_chunk_t **buckets;	// NULL if there is no index
+	unsigned long mask;		// Number of buckets - 1
+	atomic_t nhashed;		// Chunks in the index
+	osp_spinlock_t dedup_lock;	// Protects 'buckets'
+} osprd_pool_t;
+
+// Scratch space for compressing chunks.
+typedef struct osprd_store_work {
+	uint8_t plain[OSPRD_CHUNK_SIZE];	// A chunk being changed
+	uint8_t packed[OSPRD_CHUNK_SIZE];	// Compressor output
+	uint16_t table[OSPRD_LZ_HASH_SIZE];	// Compressor hash table
+} osprd_store_work_t;
+
+// Flags for osprd_store_init
+#define OSPRD_STORE_COMPRESS	1	// Compress chunks
+#define OSPRD_STORE_DEDUP	2	// Share chunks with equal contents
+
+typedef struct osprd_store {
+	osprd_rnode_t *root;
+	int height;			// Levels of nodes above the chunks
+	unsigned long long size;	// Device size in bytes
+	osprd_pool_t *pool;
+	int flags;			// OSPRD_STORE_* flags
+	osprd_store_work_t *work;	// Non-NULL if the store is compressed
+					// or deduplicating
+
+	// The tree's contents, some of which may be shared
+	unsigned long nchunks;		// Chunks
+	unsigned long nnodes;		// Nodes
+	unsigned long nsame;		// Chunks of kind OSPRD_CHUNK_SAME
+	unsigned long ncompressed;	// Chunks of kind OSPRD_CHUNK_LZ
+	unsigned long long nbytes;	// Bytes of chunk data
+
+	// The write path's dedup lookups, how many found a chunk to share,
+	// and the time spent on them (hashing, lookup, and comparison, but not
+	// storing a new chunk)
+	unsigned long long ndedup_lookups;
+	unsigned long long ndedup_hits;
+	unsigned long long dedup_ns;
+} osprd_store_t;
+
+
+// osprd_pool_init(p)
+//	Initialize an empty pool.
+
+static void osprd_pool_init(osprd_pool_t *p)
+{
+	atomic_set(&p->nchunks, 0);
+	atomic_set(&p->nnodes, 0);
+	atomic_long_set(&p->nbytes, 0);
+	p->buckets = NULL;
+	p->mask = 0;
+	atomic_set(&p->nhashed, 0);
+	osp_spin_lock_init(&p->dedup_lock);
+}
+
+// osprd_pool_dedup_init(p, nbuckets)
+//	Give pool 'p' a dedup index of 'nbuckets' buckets (a power of 2), so
+//	its stores can be deduplicating.  Returns 0 or -ENOMEM.
+
+static int osprd_pool_dedup_init(osprd_pool_t *p, unsigned long nbuckets)
+{
+	if (!(p->buckets = kmalloc(nbuckets * sizeof(osprd_chunk_t *),
+				   GFP_KERNEL)))
+		return -ENOMEM;
+	memset(p->buckets, 0, nbuckets * sizeof(osprd_chunk_t *));
+	p->mask = nbuckets - 1;
+	return 0;
+}
+
+// osprd_pool_destroy(p)
+//	Free the pool's dedup index.  Its stores must all be destroyed.
+
+static void osprd_pool_destroy(osprd_pool_t *p)
+{
+	kfree(p->buckets);
+	p->buckets = NULL;
+}
+
+// osprd_store_init(s, size, pool, flags)
+//	Initialize an empty store for a device of 'size' bytes, allocating
+//	from 'pool'.  'flags' are OSPRD_STORE_* flags; OSPRD_STORE_DEDUP
+//	needs a pool with a dedup index.  Returns 0 or -ENOMEM.
+
+static int osprd_store_init(osprd_store_t *s, unsigned long long size,
+			    osprd_pool_t *pool, int flags)
+{
+	unsigned long n = (size + OSPRD_CHUNK_SIZE - 1) >> OSPRD_CHUNK_SHIFT;
+
+	s->root = NULL;
+	s->size = size;
+	s->pool = pool;
+	s->nchunks = s->nnodes = s->nsame = s->ncompressed = 0;
+	s->nbytes = 0;
+	s->ndedup_lookups = s->ndedup_hits = s->dedup_ns = 0;
+	s->flags = flags;
+	for (s->height = 1; n > OSPRD_RADIX_SLOTS; s->height++)
+		n = (n + OSPRD_RADIX_SLOTS - 1) >> OSPRD_RADIX_BITS;
+
+	s->work = NULL;
+	if ((flags & (OSPRD_STORE_COMPRESS | OSPRD_STORE_DEDUP))
+	    && !(s->work = kmalloc(sizeof(osprd_store_work_t), GFP_KERNEL)))
+		return -ENOMEM;
+	return 0;
+}
+
+// Allocate a chunk of kind 'kind' with 'len' bytes of (uninitialized) data.
+static osprd_chunk_t *osprd_chunk_alloc(osprd_store_t *s, int kind,
+					unsigned len)
+{
+	osprd_chunk_t *c = kmalloc(sizeof(osprd_chunk_t), GFP_ATOMIC);
+
+	if (!c)
+		return NULL;
+	c->data = NULL;
+	if (len && !(c->data = kmalloc(len, GFP_ATOMIC))) {
+		kfree(c);
+		return NULL;
+	}
+	atomic_set(&c->ref, 1);
+	c->kind = kind;
+	c->len = len;
+	c->hashed = 0;
+	c->fill = 0;
+	atomic_inc(&s->pool->nchunks);
+	atomic_long_add(len, &s->pool->nbytes);
+	return c;
+}
+
+// Drop a reference to chunk 'c', which is in the pool's dedup index.
+// Returns 1 if that was the last, after removing 'c' from the index.  The
+// index lock keeps a lookup from taking a reference to 'c' meanwhile.
+static int osprd_chunk_unhash(osprd_pool_t *p, osprd_chunk_t *c)
+{
+	osprd_chunk_t **cp;
+	int last;
+
+	osp_spin_lock(&p->dedup_lock);
+	if ((last = atomic_dec_and_test(&c->ref))) {
+		for (cp = &p->buckets[c->hash & p->mask]; *cp != c;
+		     cp = &(*cp)->hnext)
+			/* do nothing */;
+		*cp = c->hnext;
+		atomic_dec(&p->nhashed);
+	}
+	osp_spin_unlock(&p->dedup_lock);
+	return last;
+}
+
+// Drop a reference to chunk 'c', freeing it if that was the last.
+static void osprd_chunk_put(osprd_store_t *s, osprd_chunk_t *c)
+{
+	if (c->hashed ? osprd_chunk_unhash(s->pool, c)
+	    : atomic_dec_and_test(&c->ref)) {
+		atomic_dec(&s->pool->nchunks);
+		atomic_long_sub(c->len, &s->pool->nbytes);
+		kfree(c->data);
+		kfree(c);
+	}
+}
+
+// Count chunk 'c' in (if 'add' is nonzero) or out of the store's contents.
+static void osprd_store_count(osprd_store_t *s, osprd_chunk_t *c, int add)
+{
+	int d = add ? 1 : -1;
+
+	s->nchunks += d;
+	s->nsame += (c->kind == OSPRD_CHUNK_SAME ? d : 0);
+	s->ncompressed += (c->kind == OSPRD_CHUNK_LZ ? d : 0);
+	s->nbytes += d * (int) c->len;
+}
+
+// Copy chunk 'c', uncompressed, to 'dst' (OSPRD_CHUNK_SIZE bytes).
+static void osprd_chunk_load(osprd_chunk_t *c, uint8_t *dst)
+{
+	unsigned i;
+
+	if (c->kind == OSPRD_CHUNK_RAW)
+		memcpy(dst, c->data, OSPRD_CHUNK_SIZE);
+	else if (c->kind == OSPRD_CHUNK_SAME)
+		for (i = 0; i < OSPRD_CHUNK_SIZE; i += sizeof(c->fill))
+			memcpy(dst + i, &c->fill, sizeof(c->fill));
+	else if (osprd_lz_decompress(c->data, c->len, dst,
+				     OSPRD_CHUNK_SIZE) < 0) {
+		// Cannot happen: osprd_lz_compress() made the data.
+		eprintk("osprd: corrupt compressed chunk\n");
+		memset(dst, 0, OSPRD_CHUNK_SIZE);
+	}
+}
+
+// Return 1 if the chunk at 'src' repeats one word, which is put in '*fill'.
+static int osprd_chunk_same(const uint8_t *src, unsigned long *fill)
+{
+	unsigned long w;
+	unsigned i;
+
+	// memcpy, since 'src' need not be aligned
+	memcpy(fill, src, sizeof(w));
+	for (i = sizeof(w); i < OSPRD_CHUNK_SIZE; i += sizeof(w)) {
+		memcpy(&w, src + i, sizeof(w));
+		if (w != *fill)
+			return 0;
+	}
+	return 1;
+}
+
+// Drop a reference to the subtree 'n', which is 'height' levels tall,
+// freeing whatever no other node or store refers to.
+static void osprd_rnode_put(osprd_store_t *s, osprd_rnode_t *n, int height)
+{
+	int i;
+
+	if (!atomic_dec_and_test(&n->ref))
+		return;
+	for (i = 0; i < OSPRD_RADIX_SLOTS; i++)
+		if (n->slots[i] && height > 1)
+			osprd_rnode_put(s, n->slots[i], height - 1);
+		else if (n->slots[i])
+			osprd_chunk_put(s, n->slots[i]);
+	kfree(n);
+	atomic_dec(&s->pool->nnodes);
+}
+
+// osprd_store_destroy(s)
+//	Drop all of the store's data, freeing whatever it does not share, and
+//	free its scratch space.
+
+static void osprd_store_destroy(osprd_store_t *s)
+{
+	if (s->root)
+		osprd_rnode_put(s, s->root, s->height);
+	s->root = NULL;
+	s->nchunks = s->nnodes = s->nsame = s->ncompressed = 0;
+	s->nbytes = 0;
+	kfree(s->work);
+	s->work = NULL;
+}
+
+// osprd_store_snapshot(dst, src, old)
+//	Make 'dst' a copy of 'src', sharing all of its nodes and chunks.
+//	'dst's previous contents are moved to 'old', which the caller should
+//	destroy (perhaps after dropping the locks that serialize 'dst' and
+//	'src').  The stores must be the same size, in the same pool, and
+//	have the same flags.
+
+static void osprd_store_snapshot(osprd_store_t *dst, osprd_store_t *src,
+				 osprd_store_t *old)
+{
+	*old = *dst;
+	old->work = NULL;		// stays with 'dst'
+
+	dst->root = src->root;
+	dst->nchunks = src->nchunks;
+	dst->nnodes = src->nnodes;
+	dst->nsame = src->nsame;
+	dst->ncompressed = src->ncompressed;
+	dst->nbytes = src->nbytes;
+	if (dst->root)
+		atomic_inc(&dst->root->ref);
+}
+
+// Return the slot index for chunk 'chunk' at a node 'level' levels above
+// the chunks.
+static inline unsigned osprd_radix_index(unsigned long chunk, int level)
+{
+	return (chunk >> ((level - 1) * OSPRD_RADIX_BITS))
+		& (OSPRD_RADIX_SLOTS - 1);
+}
+
+// Make '*np', which is 'level' levels tall, private to this store,
+// copying it if it is shared.  Returns 0 or -ENOMEM.
+static int osprd_rnode_unshare(osprd_store_t *s, osprd_rnode_t **np,
+			       int level)
+{
+	osprd_rnode_t *n = *np, *copy;
+	int i;
+
+	if (atomic_read(&n->ref) == 1)
+		return 0;
+	if (!(copy = kmalloc(sizeof(osprd_rnode_t), GFP_ATOMIC)))
+		return -ENOMEM;
+	memcpy(copy->slots, n->slots, sizeof(n->slots));
+	copy->count = n->count;
+	atomic_set(&copy->ref, 1);
+	atomic_inc(&s->pool->nnodes);
+
+	// Take the copy's references to the children before dropping ours
+	// to 'n', so that a store still sharing 'n' never sees a child's
+	// count too low.
+	for (i = 0; i < OSPRD_RADIX_SLOTS; i++)
+		if (copy->slots[i] && level > 1)
+			atomic_inc(&((osprd_rnode_t *) copy->slots[i])->ref);
+		else if (copy->slots[i])
+			atomic_inc(&((osprd_chunk_t *) copy->slots[i])->ref);
+	osprd_rnode_put(s, n, level);
+	*np = copy;
+	return 0;
+}
+
+// Return chunk number 'chunk', or NULL if it is not allocated.
+static osprd_chunk_t *osprd_store_chunk(osprd_store_t *s, unsigned long chunk)
+{
+	osprd_rnode_t *n = s->root;
+	int level;
+
+	for (level = s->height; n && level > 1; level--)
+		n = n->slots[osprd_radix_index(chunk, level)];
+	return n ? n->slots[osprd_radix_index(chunk, 1)] : NULL;
+}
+
+// Return the slot for chunk number 'chunk' in its leaf node, ready to be
+// changed: allocate any missing nodes on the way, and copy any that are
+// shared.  Sets '*leafp' to the leaf node.  Returns NULL if out of memory.
+static osprd_chunk_t **osprd_store_slot(osprd_store_t *s, unsigned long chunk,
+					osprd_rnode_t **leafp)
+{
+	osprd_rnode_t **np = &s->root, *parent = NULL;
+	osprd_chunk_t **slot = NULL;
+	int level;
+
+	for (level = s->height; level > 0; level--) {
+		if (!*np) {
+			if (!(*np = kmalloc(sizeof(osprd_rnode_t), GFP_ATOMIC)))
+				return NULL;
+			memset(*np, 0, sizeof(osprd_rnode_t));
+			atomic_set(&(*np)->ref, 1);
+			atomic_inc(&s->pool->nnodes);
+			s->nnodes++;
+			if (parent)
+				parent->count++;
+		} else if (osprd_rnode_unshare(s, np, level) < 0)
+			return NULL;
+		slot = (osprd_chunk_t **) &(*np)->slots[osprd_radix_index(chunk, level)];
+		if (level > 1) {
+			parent = *np;
+			np = (osprd_rnode_t **) slot;
+		}
+	}
+
+	*leafp = *np;
+	return slot;
+}
+
+// Return chunk number 'chunk' of a store that neither compresses nor
+// deduplicates, ready to be written: allocate it (zeroed), or copy it if
+// it is shared.  Returns NULL if out of memory.
+static uint8_t *osprd_store_chunk_write(osprd_store_t *s, unsigned long chunk)
+{
+	osprd_rnode_t *leaf;
+	osprd_chunk_t **slot = osprd_store_slot(s, chunk, &leaf), *c;
+
+	if (!slot)
+		return NULL;
+	if (*slot && atomic_read(&(*slot)->ref) == 1)
+		return (*slot)->data;
+
+	if (!(c = osprd_chunk_alloc(s, OSPRD_CHUNK_RAW, OSPRD_CHUNK_SIZE)))
+		return NULL;
+	if (*slot) {
+		osprd_chunk_load(*slot, c->data);
+		osprd_store_count(s, *slot, 0);
+		osprd_chunk_put(s, *slot);
+	} else {
+		memset(c->data, 0, OSPRD_CHUNK_SIZE);
+		leaf->count++;
+	}
+	osprd_store_count(s, c, 1);
+	*slot = c;
+	return c->data;
+}
+
+// Discard chunk number 'chunk' from the subtree '*np', 'level' levels
+// tall, freeing any node left empty.  Returns 0 or -ENOMEM.
+static int osprd_store_drop(osprd_store_t *s, osprd_rnode_t **np,
+			    unsigned long chunk, int level)
+{
+	void **slot;
+	int r = 0;
+
+	if (!*np || !(*np)->slots[osprd_radix_index(chunk, level)])
+		return 0;
+	if (osprd_rnode_unshare(s, np, level) < 0)
+		return -ENOMEM;
+
+	slot = &(*np)->slots[osprd_radix_index(chunk, level)];
+	if (level > 1) {
+		r = osprd_store_drop(s, (osprd_rnode_t **) slot, chunk, level - 1);
+		if (!*slot)
+			(*np)->count--;
+	} else {
+		osprd_store_count(s, *slot, 0);
+		osprd_chunk_put(s, *slot);
+		*slot = NULL;
+		(*np)->count--;
+	}
+
+	if ((*np)->count == 0) {
+		osprd_rnode_put(s, *np, level);
+		*np = NULL;
+		s->nnodes--;
+	}
+	return r;
+}
+
+// Return a new chunk holding the OSPRD_CHUNK_SIZE bytes at 'src', which
+// are not all zeros.  A compressed store picks the smallest form that
+// fits; others store the bytes as they are.  Returns NULL if out of memory.
+static osprd_chunk_t *osprd_chunk_encode(osprd_store_t *s, const uint8_t *src)
+{
+	osprd_chunk_t *c;
+	unsigned long fill;
+	int len;
+
+	if (!(s->flags & OSPRD_STORE_COMPRESS))
+		len = 0;
+	else if (osprd_chunk_same(src, &fill)) {
+		if ((c = osprd_chunk_alloc(s, OSPRD_CHUNK_SAME, 0)))
+			c->fill = fill;
+		return c;
+	} else
+		len = osprd_lz_compress(src, OSPRD_CHUNK_SIZE, s->work->packed,
+					OSPRD_LZ_MAXLEN, s->work->table);
+
+	if (len > 0) {
+		if ((c = osprd_chunk_alloc(s, OSPRD_CHUNK_LZ, len)))
+			memcpy(c->data, s->work->packed, len);
+	} else if ((c = osprd_chunk_alloc(s, OSPRD_CHUNK_RAW, OSPRD_CHUNK_SIZE)))
+		memcpy(c->data, src, OSPRD_CHUNK_SIZE);
+	return c;
+}
+
+// Return a hash of the OSPRD_CHUNK_SIZE bytes at 'src'.  Four words are
+// hashed at a time, independently, so the multiplies can overlap.
+static uint64_t osprd_chunk_hash(const uint8_t *src)
+{
+	uint64_t h[4] = { 1, 2, 3, 4 }, w;
+	unsigned i, j;
+
+	for (i = 0; i < OSPRD_CHUNK_SIZE; i += 4 * sizeof(w))
+		for (j = 0; j < 4; j++) {
+			memcpy(&w, src + i + j * sizeof(w), sizeof(w));
+			h[j] = (h[j] ^ w) * 0x9E3779B97F4A7C15ULL;
+			h[j] ^= h[j] >> 29;
+		}
+	return ((h[0] * 31 + h[1]) * 31 + h[2]) * 31 + h[3];
+}
+
+// Return a chunk holding the OSPRD_CHUNK_SIZE bytes at 'src', which are not
+// all zeros: an indexed chunk with the same contents, with a new reference
+// to it, or else a new chunk, added to the index.  Returns NULL if out of
+// memory.
+static osprd_chunk_t *osprd_store_dedup(osprd_store_t *s, const uint8_t *src)
+{
+	osprd_pool_t *p = s->pool;
+	unsigned long long start = osp_clock_ns();
+	uint64_t hash = osprd_chunk_hash(src);
+	osprd_chunk_t *c;
+
+	// Take a reference to the first chunk with the same hash, so that it
+	// stays put while it is compared outside the lock.
+	osp_spin_lock(&p->dedup_lock);
+	for (c = p->buckets[hash & p->mask]; c && c->hash != hash;
+	     c = c->hnext)
+		/* do nothing */;
+	if (c)
+		atomic_inc(&c->ref);
+	osp_spin_unlock(&p->dedup_lock);
+
+	// 'packed' is free until a new chunk is compressed.
+	if (c && c->kind != OSPRD_CHUNK_RAW)
+		osprd_chunk_load(c, s->work->packed);
+	if (c && memcmp(c->kind == OSPRD_CHUNK_RAW ? c->data : s->work->packed,
+			src, OSPRD_CHUNK_SIZE) != 0) {
+		osprd_chunk_put(s, c);	// A collision: store a copy
+		c = NULL;
+	}
+
+	s->ndedup_lookups++;
+	s->dedup_ns += osp_clock_ns() - start;
+	if (c)
+		s->ndedup_hits++;
+	else if ((c = osprd_chunk_encode(s, src))) {
+		c->hash = hash;
+		c->hashed = 1;
+		osp_spin_lock(&p->dedup_lock);
+		c->hnext = p->buckets[hash & p->mask];
+		p->buckets[hash & p->mask] = c;
+		atomic_inc(&p->nhashed);
+		osp_spin_unlock(&p->dedup_lock);
+	}
+	return c;
+}
+
+// Store the OSPRD_CHUNK_SIZE bytes at 'src' as chunk number 'chunk' of a
+// compressed or deduplicating store.  Returns 0 or -ENOMEM.
+static int osprd_store_encode(osprd_store_t *s, unsigned long chunk,
+			      const uint8_t *src)
+{
+	osprd_rnode_t *leaf;
+	osprd_chunk_t **slot, *c;
+	unsigned long fill;
+
+	if (osprd_chunk_same(src, &fill) && fill == 0)
+		return osprd_store_drop(s, &s->root, chunk, s->height);
+	else if (s->flags & OSPRD_STORE_DEDUP)
+		c = osprd_store_dedup(s, src);
+	else
+		c = osprd_chunk_encode(s, src);
+	if (!c)
+		return -ENOMEM;
+
+	if (!(slot = osprd_store_slot(s, chunk, &leaf))) {
+		osprd_chunk_put(s, c);
+		return -ENOMEM;
+	}
+	if (*slot) {
+		osprd_store_count(s, *slot, 0);
+		osprd_chunk_put(s, *slot);
+	} else
+		leaf->count++;
+	osprd_store_count(s, c, 1);
+	*slot = c;
+	return 0;
+}
+
+// Change the 'n' bytes at offset 'coff' in chunk number 'chunk' of a
+// compressed or deduplicating store to the bytes at 'buf', or to zeros if
+// 'buf' is NULL.  Returns 0 or -ENOMEM.
+static int osprd_store_update(osprd_store_t *s, unsigned long chunk,
+			      unsigned long coff, const char *buf,
+			      unsigned long n)
+{
+	osprd_chunk_t *c = osprd_store_chunk(s, chunk);
+	uint8_t *plain = s->work->plain;
+
+	if (buf && n == OSPRD_CHUNK_SIZE)
+		return osprd_store_encode(s, chunk, (const uint8_t *) buf);
+	else if (!c && !buf)		// already zeros
+		return 0;
+
+	if (c)
+		osprd_chunk_load(c, plain);
+	else
+		memset(plain, 0, OSPRD_CHUNK_SIZE);
+	if (buf)
+		memcpy(plain + coff, buf, n);
+	else
+		memset(plain + coff, 0, n);
+	return osprd_store_encode(s, chunk, plain);
+}
+
+
+// osprd_store_read(s, off, buf, len)
+//	Copy 'len' bytes at byte offset 'off' into 'buf'.  Unallocated chunks
+//	read as zeros.
+
+static void osprd_store_read(osprd_store_t *s, unsigned long long off,
+			     char *buf, unsigned long len)
+{
+	while (len > 0) {
+		unsigned long coff = off & (OSPRD_CHUNK_SIZE - 1);
+		unsigned long n = OSPRD_CHUNK_SIZE - coff;
+		osprd_chunk_t *c = osprd_store_chunk(s, off >> OSPRD_CHUNK_SHIFT);
+		if (n > len)
+			n = len;
+		if (!c)
+			memset(buf, 0, n);
+		else if (c->kind == OSPRD_CHUNK_RAW)
+			memcpy(buf, c->data + coff, n);
+		else if (n == OSPRD_CHUNK_SIZE)
+			osprd_chunk_load(c, (uint8_t *) buf);
+		else {
+			osprd_chunk_load(c, s->work->plain);
+			memcpy(buf, s->work->plain + coff, n);
+		}
+		off += n, buf += n, len -= n;
+	}
+}
+
+// osprd_store_write(s, off, buf, len)
+//	Copy 'len' bytes from 'buf' to byte offset 'off', allocating (or
+//	unsharing) chunks as needed.  Returns 0 on success or -ENOMEM, in
+//	which case part of the data may have been written.
+
+static int osprd_store_write(osprd_store_t *s, unsigned long long off,
+			     const char *buf, unsigned long len)
+{
+	while (len > 0) {
+		unsigned long coff = off & (OSPRD_CHUNK_SIZE - 1);
+		unsigned long n = OSPRD_CHUNK_SIZE - coff;
+		unsigned long chunkno = off >> OSPRD_CHUNK_SHIFT;
+		uint8_t *chunk;
+		if (n > len)
+			n = len;
+		if (s->work) {
+			if (osprd_store_update(s, chunkno, coff, buf, n) < 0)
+				return -ENOMEM;
+		} else if ((chunk = osprd_store_chunk_write(s, chunkno)))
+			memcpy(chunk + coff, buf, n);
+		else
+			return -ENOMEM;
+		off += n, buf += n, len -= n;
+	}
+	return 0;
+}
+
+// osprd_store_discard(s, off, len)
+//	Make 'len' bytes at byte offset 'off' read as zeros.  Chunks wholly
+//	inside the range are dropped; the parts of partly covered chunks are
+//	zeroed.  Returns 0 on success or -ENOMEM (possible only if the store
+//	shares data, compresses, or deduplicates), in which case part of the range may
+//	have been zeroed.
+
+static int osprd_store_discard(osprd_store_t *s, unsigned long long off,
+			       unsigned long long len)
+{
+	while (len > 0) {
+		unsigned long coff = off & (OSPRD_CHUNK_SIZE - 1);
+		unsigned long n = OSPRD_CHUNK_SIZE - coff;
+		unsigned long chunkno = off >> OSPRD_CHUNK_SHIFT;
+		uint8_t *chunk;
+		if (n > len)
+			n = len;
+		// A chunk is wholly discarded if the range covers it up to the
+		// end of the device.
+		if (coff == 0 && (n == OSPRD_CHUNK_SIZE || off + n >= s->size)) {
+			if (osprd_store_drop(s, &s->root, chunkno, s->height) < 0)
+				return -ENOMEM;
+		} else if (s->work) {
+			if (osprd_store_update(s, chunkno, coff, NULL, n) < 0)
+				return -ENOMEM;
+		} else if (osprd_store_chunk(s, chunkno)) {
+			if (!(chunk = osprd_store_chunk_write(s, chunkno)))
+				return -ENOMEM;
+			memset(chunk + coff, 0, n);
+		}
+		off += n, len -= n;
+	}
+	return 0;
+}
+
+#endif /* OSPRDSTORE_H */
@@ -0,0 +1,267 @@
+#include "kcompat.h"
+#include "spinlock.h"
+#include <sys/time.h>
+
+#include "osprdstore.h"
+
+/****************************************************************************
+ * osprdstorebench
+ *
+ *   Benchmark for the sparse ramdisk store (osprdstore.h), run in userspace.
+ *   Fills a store, then measures how long a snapshot of it takes compared
+ *   with copying its data, and how much slower writes are while the store
+ *   shares its chunks with the snapshot (each first write copies a chunk)
+ *   than once they are private again.  For deduplicating stores, also
+ *   reports how many chunk writes found a chunk to share, and what the
+ *   lookups cost.
+ *
+ ****************************************************************************/
+
+void usage(int status)
+{
+	fprintf(stderr, "\
+Benchmarks osprd's sparse store and its copy-on-write snapshots.\n\
+Usage: ./osprdstorebench [OPTIONS]\n\
+   Options are:\n\
+   -f FILL\n\
+       Bytes of data to write before snapshotting.  Default is 256MB.\n\
+   -s SIZE\n\
+       Write request size, in bytes.  Default is 4096.\n\
+   -c\n\
+       Use compressed stores.  The data written is text, which compresses\n\
+       about 2:1.\n\
+   -d\n\
+       Use deduplicating stores.  Every request writes the same data, so\n\
+       the store needs only a chunk or two; add -u for the other extreme.\n\
+   -u\n\
+       Make the data of every request different, by numbering it.\n");
+	exit(status);
+}
+
+int parse_ssize(const char *arg, ssize_t *result)
+{
+	char *end_arg;
+	ssize_t val = strtol(arg, &end_arg, 0);
+	if (*arg && !*end_arg) {
+		*result = val;
+		return 1;
+	} else
+		return 0;
+}
+
+double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Set if each request's data should be numbered
+static int unique;
+
+// Write 'total' bytes to 's' in requests of 'size' bytes, at sequential or
+// random offsets.  Returns MB/s.
+double run_writes(osprd_store_t *s, char *buf, ssize_t total, ssize_t size,
+		  int random)
+{
+	static unsigned long serial;
+	ssize_t nslots = total / size, slot;
+	double start = now(), elapsed;
+
+	for (slot = 0; slot < nslots; slot++) {
+		ssize_t which = random ? rand() % nslots : slot;
+		if (unique)
+			sprintf(buf, "%08lx", serial++);
+		if (osprd_store_write(s, (unsigned long long) which * size,
+				      buf, size) < 0) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+
+	elapsed = now() - start;
+	return (nslots * size / 1048576.0) / (elapsed > 0 ? elapsed : 1e-9);
+}
+
+// Fill 'buf' with text: random words from a small vocabulary.
+void make_text(char *buf, ssize_t size)
+{
+	static const char *words[] = {
+		"osprd ", "ramdisk ", "sector ", "lock ", "chunk ", "the ",
+		"request ", "queue ", "store ", "snapshot ", "of ", "and\n"
+	};
+	ssize_t i = 0;
+
+	while (i < size) {
+		const char *w = words[rand() % (sizeof(words) / sizeof(words[0]))];
+		while (*w && i < size)
+			buf[i++] = *w++;
+	}
+}
+
+// Print the memory the stores in 'pool' use.
+void print_memory(osprd_pool_t *pool)
+{
+	printf("memory: %d chunks in %ld bytes, %d nodes\n",
+	       atomic_read(&pool->nchunks), atomic_long_read(&pool->nbytes),
+	       atomic_read(&pool->nnodes));
+}
+
+// Print what deduplicating store 's' found to share, and at what cost.
+void print_dedup(osprd_store_t *s, osprd_pool_t *pool)
+{
+	printf("dedup: %llu of %llu chunk writes shared a chunk, %.0f ns per lookup; "
+	       "%lu chunks in %d distinct chunks\n",
+	       s->ndedup_hits, s->ndedup_lookups,
+	       s->ndedup_lookups ? (double) s->dedup_ns / s->ndedup_lookups : 0.0,
+	       s->nchunks, atomic_read(&pool->nhashed));
+}
+
+// Copy the first 'total' bytes of 'src' into 'dst', as a snapshot made by
+// copying would.  Returns the time taken in seconds.
+double copy_store(osprd_store_t *dst, osprd_store_t *src, ssize_t total)
+{
+	static char buf[1 << 16];
+	double start = now();
+	ssize_t off;
+
+	for (off = 0; off < total; off += sizeof(buf)) {
+		ssize_t n = total - off < (ssize_t) sizeof(buf)
+			? total - off : (ssize_t) sizeof(buf);
+		osprd_store_read(src, off, buf, n);
+		if (osprd_store_write(dst, off, buf, n) < 0) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	return now() - start;
+}
+
+// Return 1 if the first 'total' bytes of 'a' and 'b' match.
+int same_data(osprd_store_t *a, osprd_store_t *b, ssize_t total)
+{
+	static char abuf[1 << 16], bbuf[1 << 16];
+	ssize_t off;
+
+	for (off = 0; off < total; off += sizeof(abuf)) {
+		ssize_t n = total - off < (ssize_t) sizeof(abuf)
+			? total - off : (ssize_t) sizeof(abuf);
+		osprd_store_read(a, off, abuf, n);
+		osprd_store_read(b, off, bbuf, n);
+		if (memcmp(abuf, bbuf, n) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	ssize_t fill = 256 << 20, size = 4096;
+	osprd_pool_t pool;
+	osprd_store_t dev, snap, copy, old;
+	double start, snap_time, copy_time;
+	int i, random, flags = 0;
+	char *buf;
+
+ flag:
+	if (argc >= 3 && strcmp(argv[1], "-f") == 0) {
+		if (!parse_ssize(argv[2], &fill) || fill <= 0)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 3 && strcmp(argv[1], "-s") == 0) {
+		if (!parse_ssize(argv[2], &size) || size <= 0)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 2 && strcmp(argv[1], "-c") == 0) {
+		flags |= OSPRD_STORE_COMPRESS;
+		argv++, argc--;
+		goto flag;
+	} else if (argc >= 2 && strcmp(argv[1], "-d") == 0) {
+		flags |= OSPRD_STORE_DEDUP;
+		argv++, argc--;
+		goto flag;
+	} else if (argc >= 2 && strcmp(argv[1], "-u") == 0) {
+		unique = 1;
+		argv++, argc--;
+		goto flag;
+	} else if (argc >= 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0))
+		usage(0);
+	if (argc != 1 || size > fill)
+		usage(1);
+
+	if (!(buf = malloc(size < 16 ? 16 : size))) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	make_text(buf, size);
+
+	// The stores are made 16 times larger than 'fill',
+	// like a mostly empty sparse ramdisk.
+	osprd_pool_init(&pool);
+	if (((flags & OSPRD_STORE_DEDUP)
+	     && osprd_pool_dedup_init(&pool, 1 << 16) < 0)
+	    || osprd_store_init(&dev, (unsigned long long) fill * 16, &pool, flags) < 0
+	    || osprd_store_init(&snap, (unsigned long long) fill * 16, &pool, flags) < 0
+	    || osprd_store_init(&copy, (unsigned long long) fill * 16, &pool, flags) < 0) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	printf("fill: %.1f MB/s\n", run_writes(&dev, buf, fill, size, 0));
+	if (flags & OSPRD_STORE_DEDUP)
+		print_dedup(&dev, &pool);
+
+	// A snapshot is too quick to time once.  Each one replaces the last.
+	osprd_store_snapshot(&snap, &dev, &old);
+	start = now();
+	for (i = 0; i < 1000; i++) {
+		osprd_store_destroy(&old);
+		osprd_store_snapshot(&snap, &dev, &old);
+	}
+	snap_time = (now() - start) / 1000;
+	copy_time = copy_store(&copy, &dev, fill);
+	printf("snapshot of %ld bytes: %.3f us (copying the data: %.1f us)\n",
+	       (long) fill, snap_time * 1e6, copy_time * 1e6);
+	print_memory(&pool);
+
+	// Writes right after a snapshot copy each chunk (and the nodes above
+	// it) before changing it; writes after that do not.
+	printf("%-10s %-16s %10s\n", "pattern", "writes", "MB/s");
+	for (random = 0; random < 2; random++) {
+		osprd_store_destroy(&old);
+		osprd_store_snapshot(&snap, &dev, &old);
+		printf("%-10s %-16s %10.1f\n", random ? "random" : "sequential",
+		       "after snapshot", run_writes(&dev, buf, fill, size, random));
+		printf("%-10s %-16s %10.1f\n", random ? "random" : "sequential",
+		       "private", run_writes(&dev, buf, fill, size, random));
+	}
+	print_memory(&pool);
+
+	// The snapshot must still hold the data from when it was taken.
+	memset(buf, 'y', size);
+	osprd_store_destroy(&old);
+	osprd_store_snapshot(&snap, &copy, &old);
+	run_writes(&copy, buf, fill, size, 0);
+	// (With -u, 'dev' has since been written with different data.)
+	if ((!unique && !same_data(&snap, &dev, fill))
+	    || same_data(&snap, &copy, fill)) {
+		fprintf(stderr, "snapshot data is wrong!\n");
+		exit(1);
+	}
+
+	// Discarding all of a store's data frees it just as destroying does.
+	osprd_store_destroy(&old);
+	osprd_store_discard(&dev, 0, dev.size);
+	osprd_store_destroy(&snap);
+	osprd_store_destroy(&copy);
+	if (atomic_read(&pool.nchunks) != 0 || atomic_read(&pool.nnodes) != 0
+	    || atomic_long_read(&pool.nbytes) != 0
+	    || atomic_read(&pool.nhashed) != 0) {
+		fprintf(stderr, "leaked %d chunks, %d nodes!\n",
+			atomic_read(&pool.nchunks), atomic_read(&pool.nnodes));
+		exit(1);
+	}
+	osprd_pool_destroy(&pool);
+	exit(0);
+}
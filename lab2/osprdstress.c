@@ -0,0 +1,503 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "osprd.h"
+#include "osprdsim.h"
+
+/****************************************************************************
+ * osprdstress
+ *
+ *   Stress benchmark for the osprd lock manager, run in userspace through
+ *   libosprdsim.  Thousands of simulated processes (one thread each)
+ *   repeatedly open a simulated ramdisk, lock it (or, with -r, a range of
+ *   its sectors) for reading or writing, hold the lock briefly, and release
+ *   it.  With -D, each process locks two devices at once, in random order,
+ *   so lock-order deadlocks happen and must be detected.  With -E, locks
+ *   are requested asynchronously and waited for with osprdsim_poll.  With
+ *   -S, a few processes stall while holding their locks, and -L gives locks
+ *   leases, so that the stalled locks are revoked; -W checks that no
+ *   request waits much longer than a lease.
+ *   Reports lock acquisition latency percentiles, throughput, and any
+ *   mutual exclusion violations.
+ *
+ ****************************************************************************/
+
+void usage(int status)
+{
+	fprintf(stderr, "\
+Stress-tests the osprd lock manager in userspace.\n\
+Usage: ./osprdstress [OPTIONS]\n\
+   Options are:\n\
+   -p NPROCS\n\
+       Number of simulated processes.  Default is 1000.\n\
+   -n NOPS\n\
+       Lock acquisitions per process.  Default is 100.\n\
+   -w PERCENT\n\
+       Percentage of acquisitions that are write locks.  Default is 10.\n\
+   -H USEC\n\
+       Microseconds to hold each lock (busy-waiting).  Default is 0.\n\
+   -s\n\
+       Use the sharded lock mode (per-CPU reader counts).\n\
+   -a\n\
+       Use adaptive spinning: blocked requests spin briefly before sleeping\n\
+       when recent hold times are short.\n\
+   -r NSECTORS\n\
+       Lock sector ranges instead of the whole device.  Each acquisition locks\n\
+       one of NSLOTS disjoint NSECTORS-sector ranges, chosen at random.\n\
+   -k NSLOTS\n\
+       Number of ranges for -r.  Default is 64.\n\
+   -D NDEVS\n\
+       Use NDEVS devices (at least 2), and lock two different ones, chosen at\n\
+       random, in each acquisition.  Processes that would deadlock get\n\
+       EDEADLK, release their first lock, and go on; the number of\n\
+       deadlocks found is reported.  For example, \"./osprdstress -p 500\n\
+       -D 4 -w 100\" times deadlock detection among hundreds of lockers.\n\
+   -E\n\
+       Event loop mode: request locks with OSPRDIOCACQUIREASYNC and wait for\n\
+       them with osprdsim_poll.  With -D, a process requests both of its\n\
+       locks before waiting for either, so both wait in line at once.\n\
+   -S MSEC\n\
+       One acquisition in a thousand stalls, holding its lock for MSEC\n\
+       milliseconds (sleeping).  Stalled holders are left out of the\n\
+       exclusion check, since a revoked lock no longer protects them.\n\
+   -L MSEC\n\
+       Give every lock request a lease of MSEC milliseconds\n\
+       (OSPRDIOCSETLEASE), after which the lock may be revoked.  For example,\n\
+       compare the maximum latency of \"./osprdstress -p 100 -S 500\" with\n\
+       and without \"-L 20\".\n\
+   -W MSEC\n\
+       With -L, fail (exit status 1) if any acquisition waits longer than\n\
+       the lease plus MSEC milliseconds.  For example, \"./osprdstress -p 30\n\
+       -n 200 -H 10 -S 100 -L 20 -E -D 2 -w 50 -W 20\" checks that leases\n\
+       are revoked even when every waiter is an asynchronous one.\n\
+   -C\n\
+       Scaling run: repeat the test with 1, 2, 4, ... up to NPROCS processes\n\
+       in both the device-wide and sharded modes, and print throughput for\n\
+       each.  For example, \"./osprdstress -C -p 64 -w 0\" shows how read\n\
+       locks scale with cores.\n\
+   -A\n\
+       Spin comparison: repeat the test with hold times of 0, 1, 10, 100,\n\
+       and 1000 microseconds, with and without -a, and print latency and\n\
+       throughput for each.  For example, \"./osprdstress -A -p 8 -n 2000\".\n\
+       (Spinning needs more than one CPU.)\n");
+	exit(status);
+}
+
+static int nprocs = 1000;
+static int nops = 100;
+static int write_pct = 10;
+static long hold_ns = 0;
+static int dev_flags = 0;
+static int range_sectors = 0;
+static int nslots = 64;
+static int ndevs = 1;
+static int async_mode = 0;
+static long stall_ns = 0;
+static unsigned long lease_ms = 0;
+static long lease_slack_ns = -1;
+
+static osprdsim_dev_t **devs;
+static pthread_barrier_t start_barrier;
+
+// Holders currently inside the critical section, used to check exclusion.
+// There is one slot per lockable range on each device (one per device
+// without -r).
+typedef struct slot {
+	int readers, writers;
+} slot_t;
+static slot_t *slots;
+static long violations;
+static long deadlocks;
+
+// The results of one run.
+typedef struct result {
+	long n;			// Number of acquisitions
+	long *latencies;	// Their latencies, sorted
+	long elapsed;		// Wall-clock time, in nanoseconds
+	struct osprd_wakestats ws; // Lock wakeup statistics
+} result_t;
+
+typedef struct proc {
+	pthread_t thread;
+	osprdsim_task_t *task;
+	unsigned seed;
+	long *latencies;	// Acquisition latencies, in nanoseconds
+} proc_t;
+
+
+static long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void hold(void)
+{
+	long end;
+	if (hold_ns <= 0)
+		return;
+	end = now_ns() + hold_ns;
+	while (now_ns() < end)
+		/* spin */;
+}
+
+static void check_exclusion(slot_t *s, int writable)
+{
+	int readers = __atomic_load_n(&s->readers, __ATOMIC_SEQ_CST);
+	int writers = __atomic_load_n(&s->writers, __ATOMIC_SEQ_CST);
+	if (writers > 1 || (writers == 1 && (readers > 0 || !writable)))
+		__atomic_add_fetch(&violations, 1, __ATOMIC_SEQ_CST);
+}
+
+// Open device 'devno' and lock it (or a random range of it).  Returns the
+// ioctl's result; on success (or -EINPROGRESS, in event loop mode), '*fp'
+// is the file and '*sp' the slot locked.
+static int lock_one(proc_t *p, int devno, int writable, osprdsim_file_t **fp,
+		    slot_t **sp)
+{
+	int slot = (range_sectors ? rand_r(&p->seed) % nslots : 0);
+	struct osprd_range range;
+	int r;
+
+	if (!(*fp = osprdsim_open(p->task, devs[devno], writable))) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	*sp = &slots[devno * nslots + slot];
+	if (lease_ms && osprdsim_ioctl(*fp, OSPRDIOCSETLEASE, lease_ms) != 0) {
+		fprintf(stderr, "OSPRDIOCSETLEASE failed\n");
+		exit(1);
+	}
+	if (range_sectors) {
+		range.start = (unsigned long long) slot * range_sectors;
+		range.nsectors = range_sectors;
+		r = osprdsim_ioctl(*fp, async_mode ? OSPRDIOCACQUIRERANGEASYNC
+				   : OSPRDIOCACQUIRERANGE,
+				   (unsigned long) &range);
+	} else
+		r = osprdsim_ioctl(*fp, async_mode ? OSPRDIOCACQUIREASYNC
+				   : OSPRDIOCACQUIRE, 0);
+	if (r != 0 && r != -EINPROGRESS)
+		osprdsim_close(*fp);
+	return r;
+}
+
+static void *proc_main(void *arg)
+{
+	proc_t *p = (proc_t *) arg;
+	int i, j;
+
+	pthread_barrier_wait(&start_barrier);
+
+	for (i = 0; i < nops; i++) {
+		int nlocks = (ndevs > 1 ? 2 : 1), nheld = 0, npending = 0;
+		int writable[2], devno[2];
+		osprdsim_file_t *f[2], *pending[2];
+		slot_t *slot[2];
+		long start;
+		int r = 0, stall = (stall_ns && rand_r(&p->seed) % 1000 == 0);
+
+		devno[0] = rand_r(&p->seed) % ndevs;
+		if (ndevs > 1)
+			devno[1] = (devno[0] + 1
+				    + rand_r(&p->seed) % (ndevs - 1)) % ndevs;
+
+		start = now_ns();
+		for (j = 0; j < nlocks && r == 0; j++) {
+			writable[j] = (rand_r(&p->seed) % 100) < write_pct;
+			r = lock_one(p, devno[j], writable[j], &f[j], &slot[j]);
+			if (r == -EINPROGRESS) {
+				pending[npending++] = f[j];
+				r = 0;
+			}
+			if (r == 0)
+				nheld++;
+		}
+		// Wait for the requests in line, in whatever order they are
+		// granted.
+		while (npending > 0) {
+			int k = osprdsim_poll(pending, npending, 1);
+			if (k < 0) {
+				fprintf(stderr, "osprdsim_poll: error %d\n", k);
+				exit(1);
+			}
+			pending[k] = pending[--npending];
+		}
+		p->latencies[i] = now_ns() - start;
+		if (r == -EDEADLK && nheld > 0)
+			__atomic_add_fetch(&deadlocks, 1, __ATOMIC_SEQ_CST);
+		else if (r != 0) {
+			fprintf(stderr, "OSPRDIOCACQUIRE: error %d\n", r);
+			exit(1);
+		}
+
+		for (j = 0; j < nheld && !stall; j++) {
+			int *active = (writable[j] ? &slot[j]->writers
+				       : &slot[j]->readers);
+			__atomic_add_fetch(active, 1, __ATOMIC_SEQ_CST);
+			check_exclusion(slot[j], writable[j]);
+		}
+		if (stall) {
+			struct timespec ts = { stall_ns / 1000000000,
+					       stall_ns % 1000000000 };
+			nanosleep(&ts, NULL);
+		} else
+			hold();
+		for (j = 0; j < nheld; j++) {
+			int *active = (writable[j] ? &slot[j]->writers
+				       : &slot[j]->readers);
+			if (!stall)
+				__atomic_sub_fetch(active, 1, __ATOMIC_SEQ_CST);
+			osprdsim_close(f[j]);
+		}
+	}
+
+	return NULL;
+}
+
+static int compare_long(const void *a, const void *b)
+{
+	long x = *(const long *) a, y = *(const long *) b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(const long *sorted, long n, double pct)
+{
+	long i = (long) (pct / 100.0 * (n - 1) + 0.5);
+	return sorted[i] / 1000.0;
+}
+
+// Run 'nprocs' simulated processes against new devices with 'flags'.
+static void run(int nprocs, int flags, result_t *res)
+{
+	pthread_attr_t attr;
+	proc_t *procs;
+	osprdsim_file_t *f;
+	struct osprd_wakestats ws;
+	long start;
+	int i;
+
+	res->n = (long) nprocs * nops;
+	if (!(devs = calloc(ndevs, sizeof(*devs)))
+	    || !(procs = calloc(nprocs, sizeof(*procs)))
+	    || !(res->latencies = malloc(sizeof(long) * res->n))) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < ndevs; i++)
+		if (!(devs[i] = osprdsim_dev_create(flags))) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+
+	pthread_barrier_init(&start_barrier, NULL, nprocs + 1);
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 64 * 1024);
+
+	for (i = 0; i < nprocs; i++) {
+		procs[i].task = osprdsim_task_create(1000 + i);
+		procs[i].seed = i + 1;
+		procs[i].latencies = &res->latencies[(long) i * nops];
+		if (!procs[i].task
+		    || pthread_create(&procs[i].thread, &attr, proc_main, &procs[i]) != 0) {
+			fprintf(stderr, "cannot create process %d\n", i);
+			exit(1);
+		}
+	}
+
+	start = now_ns();
+	pthread_barrier_wait(&start_barrier);
+	for (i = 0; i < nprocs; i++)
+		pthread_join(procs[i].thread, NULL);
+	res->elapsed = now_ns() - start;
+
+	// Each process recorded its latencies into its own slice.
+	qsort(res->latencies, res->n, sizeof(long), compare_long);
+
+	// Ask the devices how often their locks put processes to sleep.
+	memset(&res->ws, 0, sizeof(res->ws));
+	for (i = 0; i < ndevs; i++) {
+		f = osprdsim_open(procs[0].task, devs[i], 0);
+		if (!f || osprdsim_ioctl(f, OSPRDIOCWAKESTATS,
+					 (unsigned long) &ws) != 0) {
+			fprintf(stderr, "OSPRDIOCWAKESTATS failed\n");
+			exit(1);
+		}
+		osprdsim_close(f);
+		res->ws.blocked += ws.blocked;
+		res->ws.wakeups += ws.wakeups;
+		res->ws.switches += ws.switches;
+		res->ws.spun += ws.spun;
+		res->ws.revoked += ws.revoked;
+	}
+
+	for (i = 0; i < nprocs; i++)
+		osprdsim_task_destroy(procs[i].task);
+	pthread_barrier_destroy(&start_barrier);
+	for (i = 0; i < ndevs; i++)
+		osprdsim_dev_destroy(devs[i]);
+	free(devs);
+	free(procs);
+}
+
+static double throughput(const result_t *res)
+{
+	return res->n / (res->elapsed / 1e9);
+}
+
+int main(int argc, char *argv[])
+{
+	result_t res, sharded_res;
+	int opt, scaling = 0, spincmp = 0;
+
+	while ((opt = getopt(argc, argv, "p:n:w:H:sar:k:D:ES:L:W:CAh")) != -1)
+		switch (opt) {
+		case 'p':
+			nprocs = atoi(optarg);
+			break;
+		case 'n':
+			nops = atoi(optarg);
+			break;
+		case 'w':
+			write_pct = atoi(optarg);
+			break;
+		case 'H':
+			hold_ns = atol(optarg) * 1000;
+			break;
+		case 's':
+			dev_flags |= OSPRDSIM_SHARDED;
+			break;
+		case 'a':
+			dev_flags |= OSPRDSIM_SPIN;
+			break;
+		case 'r':
+			range_sectors = atoi(optarg);
+			break;
+		case 'k':
+			nslots = atoi(optarg);
+			break;
+		case 'D':
+			ndevs = atoi(optarg);
+			if (ndevs < 2)
+				usage(1);
+			break;
+		case 'E':
+			async_mode = 1;
+			break;
+		case 'S':
+			stall_ns = atol(optarg) * 1000000;
+			break;
+		case 'L':
+			lease_ms = atol(optarg);
+			break;
+		case 'W':
+			lease_slack_ns = atol(optarg) * 1000000;
+			break;
+		case 'C':
+			scaling = 1;
+			break;
+		case 'A':
+			spincmp = 1;
+			break;
+		case 'h':
+			usage(0);
+		default:
+			usage(1);
+		}
+	if (optind != argc || nprocs <= 0 || nops <= 0
+	    || write_pct < 0 || write_pct > 100 || range_sectors < 0
+	    || nslots <= 0 || stall_ns < 0
+	    || (lease_slack_ns >= 0 && !lease_ms)
+	    || (long long) range_sectors * nslots > OSPRDSIM_NSECTORS)
+		usage(1);
+	if (!(slots = calloc((long) ndevs * nslots, sizeof(*slots)))) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	if (scaling) {
+		int n;
+		printf("writers %d%%  hold %ldus  acquisitions/process %d\n",
+		       write_pct, hold_ns / 1000, nops);
+		printf("%8s %16s %16s %8s\n", "procs", "device-wide/s",
+		       "sharded/s", "speedup");
+		for (n = 1; ; n = (n * 2 > nprocs && n < nprocs ? nprocs : n * 2)) {
+			run(n, 0, &res);
+			run(n, OSPRDSIM_SHARDED, &sharded_res);
+			printf("%8d %16.0f %16.0f %7.2fx\n", n, throughput(&res),
+			       throughput(&sharded_res),
+			       throughput(&sharded_res) / throughput(&res));
+			free(res.latencies);
+			free(sharded_res.latencies);
+			if (n >= nprocs)
+				break;
+		}
+		exit(violations ? 1 : 0);
+	}
+
+	if (spincmp) {
+		static const long holds_us[] = { 0, 1, 10, 100, 1000 };
+		int h, spin;
+		printf("processes %d  writers %d%%  acquisitions/process %d\n",
+		       nprocs, write_pct, nops);
+		printf("%8s %-6s %10s %10s %12s %10s %10s\n", "hold(us)",
+		       "mode", "p50(us)", "p99(us)", "acquires/s", "spun",
+		       "slept");
+		for (h = 0; h < (int) (sizeof(holds_us) / sizeof(holds_us[0])); h++)
+			for (spin = 0; spin < 2; spin++) {
+				hold_ns = holds_us[h] * 1000;
+				run(nprocs, (dev_flags & ~OSPRDSIM_SPIN)
+				    | (spin ? OSPRDSIM_SPIN : 0), &res);
+				printf("%8ld %-6s %10.1f %10.1f %12.0f %10llu %10llu\n",
+				       holds_us[h], spin ? "spin" : "sleep",
+				       percentile(res.latencies, res.n, 50),
+				       percentile(res.latencies, res.n, 99),
+				       throughput(&res), res.ws.spun,
+				       res.ws.blocked);
+				free(res.latencies);
+			}
+		exit(violations ? 1 : 0);
+	}
+
+	run(nprocs, dev_flags, &res);
+	printf("processes %d  acquisitions/process %d  writers %d%%  hold %ldus%s%s\n",
+	       nprocs, nops, write_pct, hold_ns / 1000,
+	       dev_flags & OSPRDSIM_SHARDED ? "  sharded" : "",
+	       dev_flags & OSPRDSIM_SPIN ? "  adaptive spin" : "");
+	if (range_sectors)
+		printf("locking %d ranges of %d sectors\n", nslots, range_sectors);
+	if (ndevs > 1)
+		printf("locking 2 of %d devices at a time: %ld deadlocks detected\n",
+		       ndevs, deadlocks);
+	printf("acquisitions %ld in %.3f s: %.0f acquisitions/s\n",
+	       res.n, res.elapsed / 1e9, throughput(&res));
+	printf("latency (us): p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+	       percentile(res.latencies, res.n, 50),
+	       percentile(res.latencies, res.n, 90),
+	       percentile(res.latencies, res.n, 99),
+	       percentile(res.latencies, res.n, 99.9),
+	       res.latencies[res.n - 1] / 1000.0);
+	printf("blocked %llu  wakeups %llu  context switches while blocked %llu\n",
+	       res.ws.blocked, res.ws.wakeups, res.ws.switches);
+	if (dev_flags & OSPRDSIM_SPIN)
+		printf("granted while spinning %llu\n", res.ws.spun);
+	if (lease_ms)
+		printf("lease %lums: %llu locks revoked\n", lease_ms,
+		       res.ws.revoked);
+	printf("exclusion violations: %ld\n", violations);
+	if (lease_slack_ns >= 0 && res.latencies[res.n - 1]
+	    > (long) lease_ms * 1000000 + lease_slack_ns) {
+		printf("FAIL: waited %.1f ms, more than the %lu ms lease plus %ld ms\n",
+		       res.latencies[res.n - 1] / 1e6, lease_ms,
+		       lease_slack_ns / 1000000);
+		exit(1);
+	}
+	exit(violations ? 1 : 0);
+}
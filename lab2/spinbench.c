@@ -0,0 +1,271 @@
+#include "kcompat.h"
+#include "spinlock.h"
+
+/****************************************************************************
+ * spinbench
+ *
+ *   Microbenchmark for the locks that osp_spinlock_t can be (spinlock.h),
+ *   run in userspace.  Threads repeatedly take a lock, update a few shared
+ *   cache lines, and release it.  For each lock and number of threads,
+ *   reports throughput and the handoff latency: the time from one thread's
+ *   release until a waiting thread has the lock.
+ *
+ *   The locks compared are a pthread mutex (what libosprdsim uses), a
+ *   test-and-test-and-set lock (like the kernel's spinlock_t of this era),
+ *   a ticket lock, and the queued lock, osp_mcs_lock.
+ *
+ ****************************************************************************/
+
+void usage(int status)
+{
+	fprintf(stderr, "\
+Compares spinlock implementations under contention.\n\
+Usage: ./spinbench [OPTIONS]\n\
+   Options are:\n\
+   -t MAXTHREADS\n\
+       Run with 1, 2, 4, ... up to MAXTHREADS threads.  Default is 64.\n\
+   -d MSEC\n\
+       Run each test for MSEC milliseconds.  Default is 200.\n\
+   -c LINES\n\
+       Cache lines the critical section writes.  Default is 2.\n\
+   -l LOCK\n\
+       Test only LOCK: pthread, tas, ticket, or mcs.\n\
+   Spinning locks behave badly with more threads than CPUs: a waiter may\n\
+   spin while the thread it waits for is not running.\n");
+	exit(status);
+}
+
+#define MAX_SAMPLES	65536
+
+// A test-and-test-and-set lock.
+typedef struct tas_lock {
+	int locked;
+} tas_lock_t;
+
+static void tas_lock(tas_lock_t *l)
+{
+	while (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n(&l->locked, __ATOMIC_RELAXED))
+			cpu_relax();
+}
+
+static void tas_unlock(tas_lock_t *l)
+{
+	__atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+}
+
+// A ticket lock.
+typedef struct ticket_lock {
+	unsigned next, owner;
+} ticket_lock_t;
+
+static void ticket_lock(ticket_lock_t *l)
+{
+	unsigned t = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+	while (__atomic_load_n(&l->owner, __ATOMIC_ACQUIRE) != t)
+		cpu_relax();
+}
+
+static void ticket_unlock(ticket_lock_t *l)
+{
+	__atomic_store_n(&l->owner, l->owner + 1, __ATOMIC_RELEASE);
+}
+
+enum { LOCK_PTHREAD, LOCK_TAS, LOCK_TICKET, LOCK_MCS, NLOCKS };
+static const char *lock_names[] = { "pthread", "tas", "ticket", "mcs" };
+
+// The lock under test, and the data it protects, each on its own lines.
+static struct {
+	pthread_mutex_t pthread ____cacheline_aligned_in_smp;
+	tas_lock_t tas ____cacheline_aligned_in_smp;
+	ticket_lock_t ticket ____cacheline_aligned_in_smp;
+	osp_mcs_lock_t mcs ____cacheline_aligned_in_smp;
+	unsigned long long release_ns ____cacheline_aligned_in_smp;
+	int releaser;			// Thread that last released the lock
+	unsigned long data[64][8] ____cacheline_aligned_in_smp;
+} shared;
+
+static int which_lock;
+static int nlines = 2;
+static volatile int stop;
+static pthread_barrier_t barrier;
+
+typedef struct worker {
+	pthread_t thread;
+	int id;
+	unsigned long long nacquires;
+	unsigned long long *samples;	// Handoff latencies, in ns
+	int nsamples;
+} worker_t;
+
+static void lock(void)
+{
+	switch (which_lock) {
+	case LOCK_PTHREAD:
+		pthread_mutex_lock(&shared.pthread);
+		break;
+	case LOCK_TAS:
+		tas_lock(&shared.tas);
+		break;
+	case LOCK_TICKET:
+		ticket_lock(&shared.ticket);
+		break;
+	default:
+		osp_mcs_lock(&shared.mcs);
+	}
+}
+
+static void unlock(void)
+{
+	switch (which_lock) {
+	case LOCK_PTHREAD:
+		pthread_mutex_unlock(&shared.pthread);
+		break;
+	case LOCK_TAS:
+		tas_unlock(&shared.tas);
+		break;
+	case LOCK_TICKET:
+		ticket_unlock(&shared.ticket);
+		break;
+	default:
+		osp_mcs_unlock(&shared.mcs);
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	worker_t *w = (worker_t *) arg;
+	int i;
+
+	pthread_barrier_wait(&barrier);
+	while (!stop) {
+		unsigned long long before = osp_clock_ns(), now;
+		lock();
+		now = osp_clock_ns();
+		// A handoff: the lock came from another thread, and this one
+		// was already waiting when it was released.
+		if (shared.releaser != w->id && shared.release_ns > before
+		    && w->nsamples < MAX_SAMPLES)
+			w->samples[w->nsamples++] = now - shared.release_ns;
+		for (i = 0; i < nlines; i++)
+			shared.data[i][0]++;
+		w->nacquires++;
+		shared.releaser = w->id;
+		shared.release_ns = osp_clock_ns();
+		unlock();
+	}
+	return NULL;
+}
+
+static int compare_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *) a;
+	unsigned long long y = *(const unsigned long long *) b;
+	return (x > y) - (x < y);
+}
+
+// Run 'nthreads' threads on lock 'lk' for 'msec' milliseconds and print
+// the results.
+static void run(int lk, int nthreads, int msec)
+{
+	worker_t *workers = calloc(nthreads, sizeof(worker_t));
+	unsigned long long total = 0, *all;
+	long nall = 0;
+	int i;
+
+	which_lock = lk;
+	pthread_mutex_init(&shared.pthread, NULL);
+	shared.tas.locked = 0;
+	shared.ticket.next = shared.ticket.owner = 0;
+	osp_mcs_lock_init(&shared.mcs);
+	shared.releaser = -1;
+	shared.release_ns = 0;
+	stop = 0;
+
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		workers[i].id = i;
+		if (!(workers[i].samples = malloc(MAX_SAMPLES * sizeof(unsigned long long)))
+		    || pthread_create(&workers[i].thread, NULL, worker_main,
+				      &workers[i]) != 0) {
+			fprintf(stderr, "cannot create thread %d\n", i);
+			exit(1);
+		}
+	}
+	pthread_barrier_wait(&barrier);
+	usleep(msec * 1000);
+	stop = 1;
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		total += workers[i].nacquires;
+		nall += workers[i].nsamples;
+	}
+	if (!(all = malloc((nall + 1) * sizeof(unsigned long long)))) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (i = 0, nall = 0; i < nthreads; i++) {
+		memcpy(all + nall, workers[i].samples,
+		       workers[i].nsamples * sizeof(unsigned long long));
+		nall += workers[i].nsamples;
+		free(workers[i].samples);
+	}
+	qsort(all, nall, sizeof(unsigned long long), compare_ull);
+
+	printf("%8d %-8s %14.0f", nthreads, lock_names[lk],
+	       total / (msec / 1000.0));
+	if (nall > 0)
+		printf(" %10llu %10llu\n", all[nall / 2], all[nall * 99 / 100]);
+	else
+		printf(" %10s %10s\n", "-", "-");
+
+	pthread_barrier_destroy(&barrier);
+	free(all);
+	free(workers);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, maxthreads = 64, msec = 200, only = -1, lk, n;
+
+	while ((opt = getopt(argc, argv, "t:d:c:l:h")) != -1)
+		switch (opt) {
+		case 't':
+			maxthreads = atoi(optarg);
+			break;
+		case 'd':
+			msec = atoi(optarg);
+			break;
+		case 'c':
+			nlines = atoi(optarg);
+			break;
+		case 'l':
+			for (only = 0; only < NLOCKS; only++)
+				if (strcmp(optarg, lock_names[only]) == 0)
+					break;
+			if (only == NLOCKS)
+				usage(1);
+			break;
+		case 'h':
+			usage(0);
+		default:
+			usage(1);
+		}
+	if (optind != argc || maxthreads <= 0 || msec <= 0 || nlines < 0
+	    || nlines > 64)
+		usage(1);
+
+	printf("%d CPUs, %d ms per test, %d cache lines written per acquisition\n",
+	       num_online_cpus(), msec, nlines);
+	printf("%8s %-8s %14s %10s %10s\n", "threads", "lock", "acquires/s",
+	       "p50(ns)", "p99(ns)");
+	for (n = 1; ; n = (n * 2 > maxthreads && n < maxthreads ? maxthreads : n * 2)) {
+		for (lk = 0; lk < NLOCKS; lk++)
+			if (only < 0 || only == lk)
+				run(lk, n, msec);
+		if (n >= maxthreads)
+			break;
+	}
+	exit(0);
+}
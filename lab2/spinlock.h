@@ -3,7 +3,147 @@
 
 #define CONFIG_OSP_SPINLOCK !(defined(CONFIG_SMP) || defined(CONFIG_PREEMPT))
 
-#if CONFIG_OSP_SPINLOCK
+/* Uncomment this line (or build with -DOSP_SPINLOCK_MCS) to make
+ * osp_spinlock_t a queued spinlock, in the kernel and in userspace alike.
+ * See osp_mcs_lock below. */
+/* #define OSP_SPINLOCK_MCS 1 */
+
+#if !defined(__KERNEL__) || defined(OSP_SPINLOCK_MCS)
+
+/*
+ * Queued (MCS-style) spinlock
+ *
+ *   A test-and-set lock makes every waiter spin on the lock's own cache
+ *   line, so each release sends that line to every waiting CPU, and the
+ *   waiters fight over who gets it next.  Here waiters line up instead:
+ *   each adds a node to the end of the queue ('tail') and spins on a flag
+ *   in its own node, on its own cache line, until the waiter ahead of it
+ *   passes it the head of the line.  Only the waiter at the head watches
+ *   the lock word itself.  Once it has the lock, it passes the head on, so
+ *   a node is needed only while waiting.  That lets a single node per CPU
+ *   (per thread, in userspace) serve every lock, however locks nest, and
+ *   keeps the one-argument osp_spin_lock() interface.  The lock must not
+ *   be taken from interrupt handlers (osprd's locks are not).
+ *
+ *   Locks are granted in the order waiters join the queue, except that a
+ *   CPU finding no one queued may take a free lock directly.
+ */
+
+#ifdef __KERNEL__
+# include <linux/percpu.h>
+# include <linux/preempt.h>
+# include <asm/system.h>	/* xchg(), cmpxchg() */
+# define osp_mcs_xchg(p, v)		xchg((p), (v))
+# define osp_mcs_cmpxchg(p, o, n)	cmpxchg((p), (o), (n))
+# define osp_mcs_read(x)		(*(volatile typeof(x) *) &(x))
+# define osp_mcs_write(x, v)		(*(volatile typeof(x) *) &(x) = (v))
+#else
+/* Include kcompat.h first, for cpu_relax() and ____cacheline_aligned_in_smp. */
+# define osp_mcs_xchg(p, v)	__atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+# define osp_mcs_cmpxchg(p, o, n) ({					\
+	typeof(*(p)) __old = (o);					\
+	__atomic_compare_exchange_n((p), &__old, (n), 0,		\
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+	__old;								\
+})
+# define osp_mcs_read(x)	__atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+# define osp_mcs_write(x, v)	__atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#endif
+
+struct osp_mcs_node {
+	struct osp_mcs_node *next;	// Next waiter in line
+	int head;			// Set when this waiter reaches the head
+} ____cacheline_aligned_in_smp;
+
+typedef struct osp_mcs_lock {
+	int locked;			// Set while held
+	struct osp_mcs_node *tail;	// Last waiter in line, or NULL
+} osp_mcs_lock_t;
+
+#ifdef __KERNEL__
+static DEFINE_PER_CPU(struct osp_mcs_node, osp_mcs_self);
+// Holding a spinlock disables preemption, so this CPU's node stays ours.
+# define osp_mcs_begin()	preempt_disable()
+# define osp_mcs_end()		preempt_enable()
+# define osp_mcs_node()		(&__get_cpu_var(osp_mcs_self))
+#else
+static __thread struct osp_mcs_node osp_mcs_self;
+# define osp_mcs_begin()	do { } while (0)
+# define osp_mcs_end()		do { } while (0)
+# define osp_mcs_node()		(&osp_mcs_self)
+#endif
+
+static inline void osp_mcs_lock_init(osp_mcs_lock_t *lock)
+{
+	lock->locked = 0;
+	lock->tail = NULL;
+}
+
+static inline void osp_mcs_lock(osp_mcs_lock_t *lock)
+{
+	struct osp_mcs_node *node, *prev, *next;
+
+	osp_mcs_begin();
+	if (osp_mcs_read(lock->tail) == NULL
+	    && osp_mcs_cmpxchg(&lock->locked, 0, 1) == 0)
+		return;
+
+	// Get in line, and wait to reach the head.
+	node = osp_mcs_node();
+	node->next = NULL;
+	node->head = 0;
+	if ((prev = osp_mcs_xchg(&lock->tail, node))) {
+		osp_mcs_write(prev->next, node);
+		while (!osp_mcs_read(node->head))
+			cpu_relax();
+	}
+
+	// At the head: wait for the lock itself.
+	while (osp_mcs_read(lock->locked)
+	       || osp_mcs_cmpxchg(&lock->locked, 0, 1) != 0)
+		cpu_relax();
+
+	// Pass the head of the line on, or leave an empty line.
+	if (osp_mcs_read(lock->tail) == node
+	    && osp_mcs_cmpxchg(&lock->tail, node, NULL) == node)
+		return;
+	while (!(next = osp_mcs_read(node->next)))
+		cpu_relax();
+	osp_mcs_write(next->head, 1);
+}
+
+static inline void osp_mcs_unlock(osp_mcs_lock_t *lock)
+{
+#ifdef __KERNEL__
+	smp_mb();
+#endif
+	osp_mcs_write(lock->locked, 0);
+	osp_mcs_end();
+}
+
+#endif /* !__KERNEL__ || OSP_SPINLOCK_MCS */
+
+
+#if defined(OSP_SPINLOCK_MCS)
+
+typedef osp_mcs_lock_t osp_spinlock_t;
+
+#define osp_spin_lock_init	osp_mcs_lock_init
+#define osp_spin_lock		osp_mcs_lock
+#define osp_spin_unlock		osp_mcs_unlock
+
+#elif !defined(__KERNEL__)
+
+/* Userspace builds (the osprdsim library) use a pthread mutex. */
+#include <pthread.h>
+
+typedef pthread_mutex_t osp_spinlock_t;
+
+#define osp_spin_lock_init(lock)	pthread_mutex_init((lock), NULL)
+#define osp_spin_lock		pthread_mutex_lock
+#define osp_spin_unlock		pthread_mutex_unlock
+
+#elif CONFIG_OSP_SPINLOCK
 
 #include <linux/kernel.h>	/* printk() */
 
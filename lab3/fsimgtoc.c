@@ -21,7 +21,9 @@ print(FILE *f, long size, FILE *out)
 	long last = 0;
 	long printed = 0;
 
-	fprintf(out, "unsigned char ospfs_data[%ld] = {\n", size);
+	// Aligned so that ospfsops.h can read the bitmap a word at a time.
+	fprintf(out, "unsigned char ospfs_data[%ld]\n"
+		"\t__attribute__((aligned(sizeof(unsigned long)))) = {\n", size);
 	c = getc(f);
 	while (c != EOF) {
 		if (c == 0 && designated_initializers)
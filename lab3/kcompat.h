@@ -0,0 +1,78 @@
+#ifndef OSP_KCOMPAT_H
+#define OSP_KCOMPAT_H
+
+/*
+ * Userspace versions of the kernel interfaces used by the code that
+ * ospfsmod.c shares with userspace (ospfsops.h).  Include this instead of
+ * the kernel headers, and before ospfs.h.
+ *
+ * "User space" and the file system image share one address space here, so
+ * copy_to_user and copy_from_user are plain copies that never fail.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#define eprintk(format, ...) fprintf(stderr, format, ## __VA_ARGS__)
+
+#define __user
+
+#define copy_to_user(to, from, n)	(memcpy((to), (from), (n)), 0UL)
+#define copy_from_user(to, from, n)	(memcpy((to), (from), (n)), 0UL)
+
+
+/* Bit operations */
+
+static inline unsigned long __ffs(unsigned long word)
+{
+	return __builtin_ctzl(word);
+}
+
+static inline unsigned long hweight_long(unsigned long word)
+{
+	return __builtin_popcountl(word);
+}
+
+
+/* Memory allocation */
+
+#define GFP_KERNEL	0
+
+static inline void *kmalloc(size_t size, int flags)
+{
+	return malloc(size);
+}
+
+static inline void kfree(const void *ptr)
+{
+	free((void *) ptr);
+}
+
+
+/* Error pointers */
+
+#define MAX_ERRNO	4095
+
+static inline void *ERR_PTR(long error)
+{
+	return (void *) error;
+}
+
+static inline long PTR_ERR(const void *ptr)
+{
+	return (long) ptr;
+}
+
+static inline int IS_ERR(const void *ptr)
+{
+	return (unsigned long) ptr >= (unsigned long) -MAX_ERRNO;
+}
+
+#endif /* OSP_KCOMPAT_H */
@@ -14,6 +14,9 @@
 #define OSPFS_BLKSIZE       (1 << OSPFS_BLKSIZE_BITS) /* == 1024 */
 #define OSPFS_BLKBITSIZE    (OSPFS_BLKSIZE * 8)
 
+// Largest image, in blocks.  OSPFS computes block addresses in 32 bits.
+#define OSPFS_MAXNBLOCKS    (1 << 21)
+
 
 /*****************************************************************************
  * FILE SYSTEM LAYOUT
@@ -61,11 +64,25 @@
 #define OSPFS_FREEMAP_BLK  2  // First block in free block
                               // bitmap
 
+// Optional features, in the superblock's 'os_features' member.  Images
+// made before a feature existed have its bit clear, since the rest of the
+// superblock block is zero.
+#define OSPFS_FEATURE_DIRINDEX	1  // Directory entries are indexed by name
+				   // (see DIRECTORY INDEX below)
+#define OSPFS_FEATURE_EXTENTS	2  // Files are mapped by extents
+				   // (see EXTENTS below)
+
 typedef struct ospfs_super {
 	uint32_t os_magic;     // Magic number: OSPFS_MAGIC
 	uint32_t os_nblocks;   // Number of blocks on disk
 	uint32_t os_ninodes;   // Number of inodes on disk
 	uint32_t os_firstinob; // First inode block
+	uint32_t os_features;  // OSPFS_FEATURE_* flags
+
+	// With OSPFS_FEATURE_DIRINDEX:
+	uint32_t os_dirindex;  // Directory index inode (0 until built)
+	uint32_t os_dirindex_nslots; // Number of slots in the index
+	uint32_t os_dirindex_count;  // Number of slots in use
 } ospfs_super_t;
 
 
@@ -170,6 +187,54 @@ typedef struct ospfs_symlink_inode {
 } ospfs_symlink_inode_t;
 
 
+/*****************************************************************************
+ * EXTENTS
+ *
+ *   On images with OSPFS_FEATURE_EXTENTS, regular files and directories
+ *   do not store a block number for each block.  Instead their data is a
+ *   series of "extents": runs of consecutive blocks, each described by its
+ *   first block and its length.  The first extent holds the file's first
+ *   'oe_count' blocks, the next extent the blocks after those, and so on.
+ *   A file written in order onto a mostly empty disk has only a few.
+ *
+ *   We use a separate type of inode structure for these files, namely
+ *   'struct ospfs_extent_inode'.  It stores the first OSPFS_NIEXTENTS
+ *   extents itself.  Files with more use the "extent index block", a block
+ *   of pointers to "extent blocks", each of which holds OSPFS_BLKEXTENTS
+ *   more extents.  Extents are never empty, and together they hold exactly
+ *   the blocks needed for 'oi_size' bytes.
+ *
+ *   Symbolic links are the same on every image.  The feature is set by
+ *   'ospfsformat -e'; an ospfs module that predates it cannot read the
+ *   image.
+ *
+ *****************************************************************************/
+
+typedef struct ospfs_extent {
+	uint32_t oe_start;		    // First block
+	uint32_t oe_count;		    // Number of blocks
+} ospfs_extent_t;
+
+// Number of extents in 'struct ospfs_extent_inode'.
+#define OSPFS_NIEXTENTS		5
+// Number of extents in an extent block.
+#define OSPFS_BLKEXTENTS	(OSPFS_BLKSIZE / sizeof(ospfs_extent_t))
+// Maximum number of extents in a file.
+#define OSPFS_MAXEXTENTS	\
+	(OSPFS_NIEXTENTS + OSPFS_NINDIRECT * OSPFS_BLKEXTENTS)
+
+typedef struct ospfs_extent_inode {
+	uint32_t oi_size;                   // File size
+	uint32_t oi_ftype;                  // OSPFS_FTYPE_REG or _DIR
+	uint32_t oi_nlink;                  // Link count (0 means free)
+	uint32_t oi_mode;		    // File permissions mode
+
+	ospfs_extent_t oi_extent[OSPFS_NIEXTENTS]; // First extents
+	uint32_t oi_nextents;		    // Number of extents
+	uint32_t oi_extindex;		    // Extent index block
+} ospfs_extent_inode_t;
+
+
 /*****************************************************************************
  * DIRECTORY ENTRIES
  *
@@ -193,4 +258,36 @@ typedef struct ospfs_direntry {
 	char od_name[OSPFS_MAXNAMELEN + 1];	// File name
 } ospfs_direntry_t;
 
+
+/*****************************************************************************
+ * DIRECTORY INDEX
+ *
+ *   Finding a name in a directory means scanning every entry.  On images
+ *   with OSPFS_FEATURE_DIRINDEX, a hash table maps each (directory, name)
+ *   pair to the offset of its entry, so a lookup reads one or two slots and
+ *   the entry itself.  One table covers all directories.  It is stored as
+ *   the data of the inode 'os_dirindex', which is in no directory, as an
+ *   array of 'os_dirindex_nslots' slots (a power of 2).
+ *
+ *   A name hashes to the slot 'ds_hash & (os_dirindex_nslots - 1)'; if
+ *   that slot is taken, the entry is in the next free slot after it.  An
+ *   empty slot has 'ds_dir' 0.  The table is rebuilt at twice the size,
+ *   from the directories themselves, before it becomes more than half full.
+ *
+ *   The index is built the first time it is needed, so 'ospfsformat -i'
+ *   only sets the feature bit.  Images without the bit are scanned as
+ *   before.  An ospfs module that predates the index does not update it,
+ *   so it must not write to an image that has one.
+ *
+ *****************************************************************************/
+
+typedef struct ospfs_dirindex_slot {
+	uint32_t ds_dir;	// Directory inode number (0 if slot is empty)
+	uint32_t ds_hash;	// Hash of directory and name
+	uint32_t ds_off;	// Offset of the entry in the directory
+	uint32_t ds_unused;
+} ospfs_dirindex_slot_t;
+
+#define OSPFS_DIRINDEX_SLOTSIZE	16
+
 #endif
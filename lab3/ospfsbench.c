@@ -0,0 +1,461 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "ospfslib.h"
+#include "ospfs.h"
+
+/****************************************************************************
+ * ospfsbench
+ *
+ *   Benchmark for OSPFS's file system code (ospfsops.h), run in userspace
+ *   on an image made by ospfsformat.  Creates files in the root directory,
+ *   looks them up (and looks up names that are not there), writes and
+ *   reads back their data, and unlinks them, timing each phase.  Then
+ *   checks that every block came back.  Compare images made with and
+ *   without 'ospfsformat -i' to see what the directory index buys.
+ *   With -a, it also times appending a lot of data a little at a time,
+ *   which is mostly a test of the block allocator, and with -t, growing
+ *   and shrinking files by truncating them.
+ *
+ ****************************************************************************/
+
+void usage(int status)
+{
+	fprintf(stderr, "\
+Benchmarks OSPFS file operations on an image file.\n\
+Usage: ./ospfsbench [OPTIONS] IMAGE\n\
+   IMAGE is changed, but is left with the files it started with.\n\
+   'make bench.img' makes an empty image to use.\n\
+   Options are:\n\
+   -n NFILES\n\
+       Number of files to create.  Default is 1000.\n\
+   -s SIZE\n\
+       Bytes of data to write to each file.  Default is 4096.\n\
+   -k NLOOKUPS\n\
+       Number of lookups of random files, and of missing files, to time.\n\
+       Default is NFILES.\n\
+   -a APPENDSIZE\n\
+       Also append APPENDSIZE bytes, 4096 at a time, to new files, moving\n\
+       on to another file whenever one reaches the maximum file size.\n\
+       Then read it back, 4096 bytes at a time and a whole file at a time.\n\
+   -w WAYS\n\
+       Append to WAYS files at once, taking turns, so that their blocks\n\
+       are interleaved.  Default is 1.\n\
+   -t TRUNCSIZE\n\
+       Also truncate new files up to a total of TRUNCSIZE bytes, each at\n\
+       most the maximum file size, and back down to 0, 4 times, by way of\n\
+       half and a quarter of that size.  Checks that grown files read as\n\
+       zeros past their old ends, and keep their data before them.\n");
+	exit(status);
+}
+
+int parse_size(const char *arg, long *result)
+{
+	char *end_arg;
+	long val = strtol(arg, &end_arg, 0);
+	if (*arg && !*end_arg) {
+		*result = val;
+		return 1;
+	} else
+		return 0;
+}
+
+double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+void check(long r, const char *what, long i)
+{
+	if (r < 0) {
+		fprintf(stderr, "%s %ld: %s\n", what, i, strerror(-r));
+		exit(1);
+	}
+}
+
+void report(const char *phase, long nops, double elapsed, long nbytes)
+{
+	printf("%-8s %10.0f ops/s %10.2f us/op", phase, nops / elapsed,
+	       elapsed * 1e6 / nops);
+	if (nbytes)
+		printf(" %10.1f MB/s", nbytes / elapsed / (1 << 20));
+	printf("\n");
+}
+
+// Mark each block of the 'n' bytes at 'buf', which go at offset 'off'
+// (a multiple of the block size) in the 'i'th file written, with 'i' and
+// the block's number in the file.  A read that lands in the wrong block,
+// or in another file's block, then reads the wrong data.
+void stamp(char *buf, long n, long i, long off)
+{
+	long k;
+	for (k = 0; k + 8 <= n; k += OSPFS_BLKSIZE) {
+		uint64_t word = ((uint64_t) i << 32) | ((off + k) / OSPFS_BLKSIZE);
+		memcpy(buf + k, &word, 8);
+	}
+}
+
+// Append 'total' bytes to files named append00, append01, ..., 'ways' at
+// a time, each up to the maximum file size.  Then read them back, count
+// the blocks they use besides their data, unlink them, and check that
+// their blocks all came back.
+#define APPEND_CHUNK	4096
+
+void append_bench(long total, long ways, char *buf, char *rbuf)
+{
+	uint32_t nfree = ospfslib_nfree(), ndata = 0;
+	long done, nops = 0, nappfiles = 0, i;
+	int *inos = malloc((total / OSPFS_MAXFILESIZE + 1) * ways * sizeof(*inos));
+	char *bigbuf = malloc(OSPFS_MAXFILESIZE);
+	uint32_t off = OSPFS_MAXFILESIZE;
+	char name[OSPFS_MAXNAMELEN + 1];
+	double start = now(), elapsed;
+
+	if (!inos || !bigbuf) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (done = 0; done < total; off += APPEND_CHUNK) {
+		// Start 'ways' new files when the last ones are full.
+		if (off + APPEND_CHUNK > OSPFS_MAXFILESIZE) {
+			for (i = 0; i < ways; i++, nappfiles++) {
+				sprintf(name, "append%02ld", nappfiles);
+				check(inos[nappfiles] = ospfslib_create(OSPFS_ROOT_INO,
+									name, 0666),
+				      "create", nappfiles);
+			}
+			off = 0;
+		}
+		for (i = nappfiles - ways; i < nappfiles && done < total; i++) {
+			long n = total - done < APPEND_CHUNK ? total - done : APPEND_CHUNK;
+			stamp(buf, n, i, off);
+			check(ospfslib_pwrite(inos[i], buf, n, off), "append", nops);
+			done += n;
+			nops++;
+		}
+	}
+	report("append", nops, now() - start, total);
+
+	start = now();
+	nops = 0;
+	for (i = 0; i < nappfiles; i++) {
+		ssize_t size = ospfslib_size(inos[i]);
+		check(size, "size", i);
+		ndata += (size + OSPFS_BLKSIZE - 1) / OSPFS_BLKSIZE;
+		for (off = 0; off < size; off += APPEND_CHUNK) {
+			long n = size - off < APPEND_CHUNK ? size - off : APPEND_CHUNK;
+			stamp(buf, n, i, off);
+			if (ospfslib_pread(inos[i], rbuf, APPEND_CHUNK, off) != n
+			    || memcmp(buf, rbuf, n) != 0) {
+				fprintf(stderr, "read the wrong appended data!\n");
+				exit(1);
+			}
+			nops++;
+		}
+	}
+	report("reread", nops, now() - start, total);
+
+	// Time only the reads, and check each file's data after its read.
+	elapsed = 0;
+	for (i = 0; i < nappfiles; i++) {
+		ssize_t size;
+		start = now();
+		check(size = ospfslib_pread(inos[i], bigbuf, OSPFS_MAXFILESIZE, 0),
+		      "read", i);
+		elapsed += now() - start;
+		for (off = 0; off < size; off += APPEND_CHUNK) {
+			long n = size - off < APPEND_CHUNK ? size - off : APPEND_CHUNK;
+			stamp(buf, n, i, off);
+			if (memcmp(buf, bigbuf + off, n) != 0) {
+				fprintf(stderr, "read the wrong appended data!\n");
+				exit(1);
+			}
+		}
+	}
+	report("bigread", nappfiles, elapsed, total);
+	printf("%-8s %10u data blocks %10u other blocks\n", "blocks",
+	       ndata, nfree - ospfslib_nfree() - ndata);
+
+	for (i = 0; i < nappfiles; i++) {
+		sprintf(name, "append%02ld", i);
+		check(ospfslib_unlink(OSPFS_ROOT_INO, name), "unlink", i);
+	}
+	if (ospfslib_nfree() != nfree) {
+		fprintf(stderr, "leaked %u blocks!\n", nfree - ospfslib_nfree());
+		exit(1);
+	}
+	free(inos);
+	free(bigbuf);
+}
+
+// Write a marked block at block 'b' of the 'i'th file, 'ino'.
+void put_block(int ino, long i, long b)
+{
+	char blk[OSPFS_BLKSIZE];
+	memset(blk, 'x', sizeof(blk));
+	stamp(blk, sizeof(blk), i, b * OSPFS_BLKSIZE);
+	check(ospfslib_pwrite(ino, blk, sizeof(blk), b * OSPFS_BLKSIZE)
+	      == sizeof(blk) ? 0 : -EIO, "write", i);
+}
+
+// Write a mark at the start of each block from 'from' to 'to' of the
+// 'i'th file, 'ino', so that they are not zero when freed and reused.
+void scribble(int ino, long i, long from, long to)
+{
+	long b;
+	for (b = from; b < to; b++) {
+		uint64_t word = ((uint64_t) i << 32) | b;
+		check(ospfslib_pwrite(ino, &word, 8, b * OSPFS_BLKSIZE),
+		      "write", i);
+	}
+}
+
+// Check that block 'b' of the 'i'th file, 'ino', holds what put_block
+// wrote there, or only zeros if 'zeros' is set.
+void check_block(int ino, long i, long b, int zeros, const char *what)
+{
+	char blk[OSPFS_BLKSIZE], want[OSPFS_BLKSIZE];
+	memset(want, zeros ? 0 : 'x', sizeof(want));
+	if (!zeros)
+		stamp(want, sizeof(want), i, b * OSPFS_BLKSIZE);
+	if (ospfslib_pread(ino, blk, sizeof(blk), b * OSPFS_BLKSIZE)
+	    != sizeof(blk) || memcmp(blk, want, sizeof(blk)) != 0) {
+		fprintf(stderr, "%s: wrong data in block %ld of file %ld!\n",
+			what, b, i);
+		exit(1);
+	}
+}
+
+// Create files named trunc00, trunc01, ..., enough to hold 'total' bytes
+// at the maximum file size each.  Then 4 times truncate each up to half
+// its size, up to its size, down to a quarter of it, back up, and down to
+// 0, checking the data on each side of the old end after every grow: the
+// last old block keeps what was written to it, and the first new block
+// reads as zeros.  The blocks a shrink frees have data in them, so later
+// grows reuse blocks that must be erased.  Only the truncates are timed.  Check that their blocks all came back.
+#define TRUNCATE_ROUNDS	4
+
+void truncate_bench(long total)
+{
+	uint32_t nfree = ospfslib_nfree();
+	long ntruncfiles = (total + OSPFS_MAXFILESIZE - 1) / OSPFS_MAXFILESIZE;
+	int *inos = malloc(ntruncfiles * sizeof(*inos));
+	double grow = 0, shrink = 0, start;
+	long ngrow = 0, nshrink = 0, grown = 0, shrunk = 0;
+	char name[OSPFS_MAXNAMELEN + 1];
+	long round, i;
+
+	if (!inos) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < ntruncfiles; i++) {
+		sprintf(name, "trunc%02ld", i);
+		check(inos[i] = ospfslib_create(OSPFS_ROOT_INO, name, 0666),
+		      "create", i);
+	}
+	nfree = ospfslib_nfree();
+
+	for (round = 0; round < TRUNCATE_ROUNDS; round++)
+		for (i = 0; i < ntruncfiles; i++) {
+			long size = total - i * OSPFS_MAXFILESIZE;
+			long half, quarter;
+			if (size > OSPFS_MAXFILESIZE)
+				size = OSPFS_MAXFILESIZE;
+			size -= size % OSPFS_BLKSIZE;
+			half = size / 2 - size / 2 % OSPFS_BLKSIZE;
+			quarter = size / 4 - size / 4 % OSPFS_BLKSIZE;
+			if (quarter == 0)
+				continue;
+
+			start = now();
+			check(ospfslib_truncate(inos[i], half), "grow", i);
+			grow += now() - start;
+			put_block(inos[i], i, half / OSPFS_BLKSIZE - 1);
+
+			start = now();
+			check(ospfslib_truncate(inos[i], size), "grow", i);
+			grow += now() - start;
+			check_block(inos[i], i, half / OSPFS_BLKSIZE - 1, 0, "grow");
+			check_block(inos[i], i, half / OSPFS_BLKSIZE, 1, "grow");
+			put_block(inos[i], i, quarter / OSPFS_BLKSIZE - 1);
+			scribble(inos[i], i, quarter / OSPFS_BLKSIZE,
+				 size / OSPFS_BLKSIZE);
+
+			start = now();
+			check(ospfslib_truncate(inos[i], quarter), "shrink", i);
+			shrink += now() - start;
+
+			start = now();
+			check(ospfslib_truncate(inos[i], size), "grow", i);
+			grow += now() - start;
+			check_block(inos[i], i, quarter / OSPFS_BLKSIZE - 1, 0,
+				    "regrow");
+			check_block(inos[i], i, quarter / OSPFS_BLKSIZE, 1,
+				    "regrow");
+
+			start = now();
+			check(ospfslib_truncate(inos[i], 0), "shrink", i);
+			shrink += now() - start;
+
+			ngrow += 3;
+			nshrink += 2;
+			grown += 2 * size - quarter;
+			shrunk += 2 * size - quarter;
+		}
+	if (ngrow) {
+		report("grow", ngrow, grow, grown);
+		report("shrink", nshrink, shrink, shrunk);
+	}
+
+	if (ospfslib_nfree() != nfree) {
+		fprintf(stderr, "leaked %u blocks!\n", nfree - ospfslib_nfree());
+		exit(1);
+	}
+	for (i = 0; i < ntruncfiles; i++) {
+		sprintf(name, "trunc%02ld", i);
+		check(ospfslib_unlink(OSPFS_ROOT_INO, name), "unlink", i);
+	}
+	free(inos);
+}
+
+int main(int argc, char *argv[])
+{
+	long nfiles = 1000, size = 4096, nlookups = -1, append = 0, trunc = 0;
+	long ways = 1, i;
+	uint32_t nfree;
+	int *inos;
+	char name[OSPFS_MAXNAMELEN + 1], *buf, *rbuf;
+	double start;
+	int r;
+
+ flag:
+	if (argc >= 3 && strcmp(argv[1], "-n") == 0) {
+		if (!parse_size(argv[2], &nfiles) || nfiles <= 0)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 3 && strcmp(argv[1], "-s") == 0) {
+		if (!parse_size(argv[2], &size) || size < 0
+		    || size > OSPFS_MAXFILESIZE)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 3 && strcmp(argv[1], "-k") == 0) {
+		if (!parse_size(argv[2], &nlookups) || nlookups <= 0)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 3 && strcmp(argv[1], "-t") == 0) {
+		if (!parse_size(argv[2], &trunc) || trunc < 0)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 3 && strcmp(argv[1], "-w") == 0) {
+		if (!parse_size(argv[2], &ways) || ways <= 0)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 3 && strcmp(argv[1], "-a") == 0) {
+		if (!parse_size(argv[2], &append) || append < 0)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0))
+		usage(0);
+	if (argc != 2)
+		usage(1);
+	if (nlookups < 0)
+		nlookups = nfiles;
+
+	if ((r = ospfslib_open(argv[1])) < 0) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(-r));
+		exit(1);
+	}
+	inos = malloc(nfiles * sizeof(*inos));
+	buf = malloc(size + APPEND_CHUNK + 1);
+	rbuf = malloc(size + APPEND_CHUNK + 1);
+	if (!inos || !buf || !rbuf) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < size + APPEND_CHUNK; i++)
+		buf[i] = 'a' + i % 26;
+
+	start = now();
+	for (i = 0; i < nfiles; i++) {
+		sprintf(name, "bench%06ld", i);
+		check(inos[i] = ospfslib_create(OSPFS_ROOT_INO, name, 0666),
+		      "create", i);
+	}
+	report("create", nfiles, now() - start, 0);
+	// Only the directory has grown so far.  Its blocks stay allocated
+	// after the files are unlinked, but the files' blocks do not.
+	nfree = ospfslib_nfree();
+
+	start = now();
+	for (i = 0; i < nlookups; i++) {
+		long which = rand() % nfiles;
+		sprintf(name, "bench%06ld", which);
+		if ((r = ospfslib_lookup(OSPFS_ROOT_INO, name)) != inos[which])
+			check(r < 0 ? r : -EIO, "lookup", which);
+	}
+	report("lookup", nlookups, now() - start, 0);
+
+	start = now();
+	for (i = 0; i < nlookups; i++) {
+		sprintf(name, "missing%06ld", i);
+		if ((r = ospfslib_lookup(OSPFS_ROOT_INO, name)) != -ENOENT)
+			check(r < 0 ? r : -EIO, "missing lookup", i);
+	}
+	report("miss", nlookups, now() - start, 0);
+
+	if (size) {
+		start = now();
+		for (i = 0; i < nfiles; i++) {
+			stamp(buf, size, i, 0);
+			check(ospfslib_pwrite(inos[i], buf, size, 0), "write", i);
+		}
+		report("write", nfiles, now() - start, nfiles * size);
+
+		start = now();
+		for (i = 0; i < nfiles; i++) {
+			check(ospfslib_pread(inos[i], rbuf, size + 1, 0) == size
+			      ? 0 : -EIO, "read", i);
+			stamp(buf, size, i, 0);
+			if (memcmp(buf, rbuf, size) != 0) {
+				fprintf(stderr, "read the wrong data from file %ld!\n", i);
+				exit(1);
+			}
+		}
+		report("read", nfiles, now() - start, nfiles * size);
+	}
+
+	start = now();
+	for (i = 0; i < nfiles; i++) {
+		sprintf(name, "bench%06ld", i);
+		check(ospfslib_unlink(OSPFS_ROOT_INO, name), "unlink", i);
+	}
+	report("unlink", nfiles, now() - start, 0);
+
+	if (ospfslib_lookup(OSPFS_ROOT_INO, "bench000000") != -ENOENT) {
+		fprintf(stderr, "unlinked file is still there!\n");
+		exit(1);
+	}
+	if (ospfslib_nfree() != nfree) {
+		fprintf(stderr, "leaked %u blocks!\n", nfree - ospfslib_nfree());
+		exit(1);
+	}
+
+	if (append)
+		append_bench(append, ways, buf, rbuf);
+	if (trunc)
+		truncate_bench(trunc);
+	check(ospfslib_close(), "close", 0);
+	exit(0);
+}
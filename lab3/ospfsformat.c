@@ -32,6 +32,7 @@ uint32_t nextb;
 uint32_t nextinode;
 int verbose = 0;
 int link_contents = 0;
+uint32_t features = 0;
 
 struct Hardlink {
 	unsigned long osp_ino;
@@ -145,6 +146,7 @@ swizzleinode(struct ospfs_inode *inode)
 	swizzle(&inode->oi_ftype);
 	swizzle(&inode->oi_mode);
 	swizzle(&inode->oi_nlink);
+	// The extents in a struct ospfs_extent_inode are in these same words.
 	for (i = 0; i < OSPFS_NDIRECT; i++)
 		swizzle(&inode->oi_direct[i]);
 	swizzle(&inode->oi_indirect);
@@ -173,6 +175,10 @@ swizzleblock(struct Block *b)
 		swizzle(&s->os_nblocks);
 		swizzle(&s->os_ninodes);
 		swizzle(&s->os_firstinob);
+		swizzle(&s->os_features);
+		swizzle(&s->os_dirindex);
+		swizzle(&s->os_dirindex_nslots);
+		swizzle(&s->os_dirindex_count);
 		break;
 	case BLOCK_DIR:
 		for (i = 0; i < OSPFS_BLKSIZE; i += OSPFS_DIRENTRY_SIZE) {
@@ -311,14 +317,80 @@ opendisk(const char *name)
 	super.os_nblocks = nblocks;
 	super.os_ninodes = ninodes;
 	super.os_firstinob = OSPFS_FREEMAP_BLK + nbitblock;
+	super.os_features = features;
 	if (verbose)
 		fprintf(stderr, "superblock, free block bitmap %d, first inode block %d, first data block %d\n", OSPFS_FREEMAP_BLK, super.os_firstinob, nextb);
 }
 
+// Returns a pointer to extent inode 'ino's 'i'th extent.  If that is in an
+// extent block, sets '*bext' to the block, which the caller must putblk;
+// otherwise sets '*bext' to 0.  Allocates the extent index block and the
+// extent block if they do not exist yet.
+struct ospfs_extent *
+getextent(struct ospfs_extent_inode *ino, uint32_t i, struct Block **bext, int indent)
+{
+	struct Block *bindex;
+
+	*bext = 0;
+	if (i < OSPFS_NIEXTENTS)
+		return &ino->oi_extent[i];
+	i -= OSPFS_NIEXTENTS;
+
+	if (ino->oi_extindex == 0) {
+		bindex = getblk(nextb++, 1, BLOCK_BITS);
+		ino->oi_extindex = bindex->bno;
+		if (verbose)
+			fprintf(stderr, "%*sextent index block %d\n", indent, "", nextb - 1);
+	} else
+		bindex = getblk(ino->oi_extindex, 0, BLOCK_BITS);
+	if (bindex->u.u[i / OSPFS_BLKEXTENTS] == 0) {
+		*bext = getblk(nextb++, 1, BLOCK_BITS);
+		bindex->u.u[i / OSPFS_BLKEXTENTS] = (*bext)->bno;
+		if (verbose)
+			fprintf(stderr, "%*sextent block %d\n", indent, "", nextb - 1);
+	} else
+		*bext = getblk(bindex->u.u[i / OSPFS_BLKEXTENTS], 0, BLOCK_BITS);
+	putblk(bindex);
+	return (struct ospfs_extent *) (*bext)->u.u + i % OSPFS_BLKEXTENTS;
+}
+
+// Adds block 'bno' to the end of extent inode 'ino'.
+void
+storeextent(struct ospfs_extent_inode *ino, uint32_t bno, int indent)
+{
+	struct ospfs_extent *e;
+	struct Block *bext;
+
+	if (ino->oi_nextents > 0) {
+		e = getextent(ino, ino->oi_nextents - 1, &bext, indent);
+		if (e->oe_start + e->oe_count == bno) {
+			e->oe_count++;
+			goto done;
+		}
+		if (bext)
+			putblk(bext);
+	}
+	if (ino->oi_nextents == OSPFS_MAXEXTENTS) {
+		fprintf(stderr, "file too fragmented\n");
+		abort();
+	}
+	e = getextent(ino, ino->oi_nextents, &bext, indent);
+	e->oe_start = bno;
+	e->oe_count = 1;
+	ino->oi_nextents++;
+
+done:
+	if (bext)
+		putblk(bext);
+}
+
 void
 storeblk(struct ospfs_inode *ino, struct Block *b, int nblk, int indent)
 {
-	if (nblk < OSPFS_NDIRECT)
+	if ((super.os_features & OSPFS_FEATURE_EXTENTS)
+	    && nblk < OSPFS_MAXFILEBLKS)
+		storeextent((struct ospfs_extent_inode *) ino, b->bno, indent);
+	else if (nblk < OSPFS_NDIRECT)
 		ino->oi_direct[nblk] = b->bno;
 	else if (nblk < OSPFS_NDIRECT + OSPFS_NINDIRECT) {
 		struct Block *bindir;
@@ -383,7 +455,14 @@ allocdirentry(struct ospfs_inode *dirino, const char *name, struct Block **dirb,
 		return 0;
 
 	nblk = (int)((dirino->oi_size + OSPFS_BLKSIZE - 1) / OSPFS_BLKSIZE) - 1;
-	if (nblk >= OSPFS_NDIRECT + OSPFS_NINDIRECT) {
+	if (nblk >= 0 && (super.os_features & OSPFS_FEATURE_EXTENTS)) {
+		struct ospfs_extent_inode *eino = (struct ospfs_extent_inode *) dirino;
+		struct Block *bext;
+		struct ospfs_extent *e = getextent(eino, eino->oi_nextents - 1, &bext, indent);
+		*dirb = getblk(e->oe_start + e->oe_count - 1, 0, BLOCK_DIR);
+		if (bext)
+			putblk(bext);
+	} else if (nblk >= OSPFS_NDIRECT + OSPFS_NINDIRECT) {
 		uint32_t nblk_off = nblk - OSPFS_NDIRECT - OSPFS_NINDIRECT;
 		struct Block *bindir2 = getblk(dirino->oi_indirect2, 0, BLOCK_BITS);
 		struct Block *bindir = getblk(bindir2->u.u[nblk_off / OSPFS_NINDIRECT], 0, BLOCK_BITS);
@@ -723,9 +802,11 @@ flushdisk(void)
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: ospfsformat [-c] [-l SRC:DST] fs.img NBLOCKS NINODES files...\n\
-       ospfsformat [-c] [-l SRC:DST] fs.img NBLOCKS NINODES -r DIR\n\
+	fprintf(stderr, "Usage: ospfsformat [-c] [-i] [-e] [-l SRC:DST] fs.img NBLOCKS NINODES files...\n\
+       ospfsformat [-c] [-i] [-e] [-l SRC:DST] fs.img NBLOCKS NINODES -r DIR\n\
   \"-c\" means treat files with identical contents as hard links.\n\
+  \"-i\" means index directory entries by name (OSPFS_FEATURE_DIRINDEX).\n\
+  \"-e\" means map files by extents (OSPFS_FEATURE_EXTENTS).\n\
   \"-l SRC:DST\" means add a symbolic link from SRC to DST.\n");
 	abort();
 }
@@ -757,6 +838,14 @@ main(int argc, char **argv)
 		argc--, argv++, link_contents = 1;
 		goto option;
 	}
+	if (argc > 1 && strcmp(argv[1], "-i") == 0) {
+		argc--, argv++, features |= OSPFS_FEATURE_DIRINDEX;
+		goto option;
+	}
+	if (argc > 1 && strcmp(argv[1], "-e") == 0) {
+		argc--, argv++, features |= OSPFS_FEATURE_EXTENTS;
+		goto option;
+	}
 	if (argc > 1 && strcmp(argv[1], "-l") == 0) {
 		struct linkrecord *nl;
 		if (argc < 3 || strchr(argv[2], ':') == 0)
@@ -779,7 +868,7 @@ main(int argc, char **argv)
 		usage();
 
 	nblocks = strtol(argv[2], &s, 0);
-	if (*s || s == argv[2] || nblocks < 2 || nblocks > 8192)
+	if (*s || s == argv[2] || nblocks < 2 || nblocks > OSPFS_MAXNBLOCKS)
 		usage();
 
 	ninodes = strtol(argv[3], &s, 0);
@@ -802,7 +891,7 @@ main(int argc, char **argv)
 	rootino->oi_ftype = OSPFS_FTYPE_DIR;
 	rootino->oi_nlink = 1;
 	rootino->oi_mode = 0777;
-	if (strcmp(argv[4], "-r") == 0) {
+	if (argc > 4 && strcmp(argv[4], "-r") == 0) {
 		if (argc != 6)
 			usage();
 		writedirectory(rootino, argv[5], 1, 0, 0777);
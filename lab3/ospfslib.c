@@ -0,0 +1,237 @@
+#include "kcompat.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ospfs.h"
+#include "ospfslib.h"
+
+/****************************************************************************
+ * ospfslib
+ *
+ *   OSPFS in userspace.  The open image file is mapped at 'ospfs_data',
+ *   where ospfsmod.c has the array from fsimg.c, and ospfsops.h works on it
+ *   the same way.
+ *
+ ****************************************************************************/
+
+static uint8_t *ospfs_data;
+static ospfs_super_t *ospfs_super;
+
+#include "ospfsops.h"
+
+static int image_fd = -1;
+static size_t image_size;
+// ospfslib has no open files, so pread and pwrite use a block-map cursor
+// chosen by inode number.  A cursor starts over when it is used with a
+// different inode.
+#define NCURSORS	16
+static ospfs_cursor_t cursors[NCURSORS];
+
+int ospfslib_open(const char *path)
+{
+	struct stat st;
+	void *data;
+	ospfs_super_t *super;
+
+	if (ospfs_data)
+		return -EBUSY;
+	if ((image_fd = open(path, O_RDWR)) < 0)
+		return -errno;
+	if (fstat(image_fd, &st) < 0)
+		goto error;
+	if (st.st_size < 2 * OSPFS_BLKSIZE) {
+		errno = EINVAL;
+		goto error;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    image_fd, 0);
+	if (data == MAP_FAILED)
+		goto error;
+	super = (ospfs_super_t *) ((uint8_t *) data + OSPFS_BLKSIZE);
+	if (super->os_magic != OSPFS_MAGIC
+	    || super->os_nblocks > OSPFS_MAXNBLOCKS
+	    || (off_t) super->os_nblocks * OSPFS_BLKSIZE > st.st_size
+	    || super->os_ninodes <= OSPFS_ROOT_INO) {
+		munmap(data, st.st_size);
+		errno = EINVAL;
+		goto error;
+	}
+
+	ospfs_data = data;
+	ospfs_super = super;
+	image_size = st.st_size;
+	// Forget where the last image's searches left off.
+	ospfs_next_ino = 0;
+	ospfs_blank_hint.dir = 0;
+	ospfs_dirindex_wait = 0;
+	ospfs_alloc.ready = 0;
+	memset(cursors, 0, sizeof(cursors));
+	return 0;
+
+    error:
+	{
+		int r = -errno;
+		close(image_fd);
+		image_fd = -1;
+		return r;
+	}
+}
+
+int ospfslib_close(void)
+{
+	int r = 0;
+
+	if (!ospfs_data)
+		return -EBADF;
+	if (msync(ospfs_data, image_size, MS_SYNC) < 0)
+		r = -errno;
+	munmap(ospfs_data, image_size);
+	close(image_fd);
+	ospfs_dirindex_forget();
+	ospfs_data = NULL;
+	ospfs_super = NULL;
+	image_fd = -1;
+	return r;
+}
+
+// Find the live inode 'ino', which must have type 'ftype'.
+static int get_inode(uint32_t ino, uint32_t ftype, ospfs_inode_t **oip)
+{
+	ospfs_inode_t *oi;
+
+	if (!ospfs_data)
+		return -EBADF;
+	if (ino == 0 || !(oi = ospfs_inode(ino)) || oi->oi_nlink == 0)
+		return -ENOENT;
+	if (oi->oi_ftype != ftype) {
+		if (ftype == OSPFS_FTYPE_DIR)
+			return -ENOTDIR;
+		return oi->oi_ftype == OSPFS_FTYPE_DIR ? -EISDIR : -EINVAL;
+	}
+	*oip = oi;
+	return 0;
+}
+
+int ospfslib_lookup(uint32_t dir_ino, const char *name)
+{
+	ospfs_inode_t *dir_oi;
+	ospfs_direntry_t *od;
+	int r;
+
+	if ((r = get_inode(dir_ino, OSPFS_FTYPE_DIR, &dir_oi)) < 0)
+		return r;
+	if (strlen(name) > OSPFS_MAXNAMELEN)
+		return -ENAMETOOLONG;
+	if (!(od = find_direntry(dir_oi, name, -1)))
+		return -ENOENT;
+	return od->od_ino;
+}
+
+int ospfslib_create(uint32_t dir_ino, const char *name, int mode)
+{
+	ospfs_inode_t *dir_oi;
+	int r;
+
+	if ((r = get_inode(dir_ino, OSPFS_FTYPE_DIR, &dir_oi)) < 0)
+		return r;
+	return ospfs_create_file(dir_oi, name, strlen(name), mode);
+}
+
+int ospfslib_symlink(uint32_t dir_ino, const char *name, const char *symname)
+{
+	ospfs_inode_t *dir_oi;
+	int r;
+
+	if ((r = get_inode(dir_ino, OSPFS_FTYPE_DIR, &dir_oi)) < 0)
+		return r;
+	return ospfs_create_symlink(dir_oi, name, strlen(name), symname);
+}
+
+int ospfslib_link(uint32_t dir_ino, const char *name, uint32_t ino)
+{
+	ospfs_inode_t *dir_oi, *oi;
+	int r;
+
+	if ((r = get_inode(dir_ino, OSPFS_FTYPE_DIR, &dir_oi)) < 0)
+		return r;
+	if ((r = get_inode(ino, OSPFS_FTYPE_REG, &oi)) < 0)
+		return r;
+	if ((r = ospfs_add_direntry(dir_oi, name, strlen(name), ino)) < 0)
+		return r;
+	oi->oi_nlink++;
+	return 0;
+}
+
+int ospfslib_unlink(uint32_t dir_ino, const char *name)
+{
+	ospfs_inode_t *dir_oi;
+	int r;
+
+	if ((r = get_inode(dir_ino, OSPFS_FTYPE_DIR, &dir_oi)) < 0)
+		return r;
+	return ospfs_remove_direntry(dir_oi, name, strlen(name));
+}
+
+ssize_t ospfslib_pread(uint32_t ino, void *buf, size_t len, off_t off)
+{
+	ospfs_inode_t *oi;
+	loff_t pos = off;
+	int r;
+
+	if ((r = get_inode(ino, OSPFS_FTYPE_REG, &oi)) < 0)
+		return r;
+	if (off < 0)
+		return -EINVAL;
+	return ospfs_file_read(oi, &cursors[ino % NCURSORS], buf, len, &pos);
+}
+
+ssize_t ospfslib_pwrite(uint32_t ino, const void *buf, size_t len, off_t off)
+{
+	ospfs_inode_t *oi;
+	loff_t pos = off;
+	int r;
+
+	if ((r = get_inode(ino, OSPFS_FTYPE_REG, &oi)) < 0)
+		return r;
+	if (off < 0)
+		return -EINVAL;
+	return ospfs_file_write(oi, &cursors[ino % NCURSORS], buf, len, &pos);
+}
+
+int ospfslib_truncate(uint32_t ino, uint32_t size)
+{
+	ospfs_inode_t *oi;
+	int r;
+
+	if ((r = get_inode(ino, OSPFS_FTYPE_REG, &oi)) < 0)
+		return r;
+	if (size > OSPFS_MAXFILESIZE)
+		return -EFBIG;
+	return change_size(oi, size);
+}
+
+ssize_t ospfslib_size(uint32_t ino)
+{
+	ospfs_inode_t *oi;
+	int r;
+
+	if ((r = get_inode(ino, OSPFS_FTYPE_REG, &oi)) < 0)
+		return r;
+	return oi->oi_size;
+}
+
+uint32_t ospfslib_nfree(void)
+{
+	void *bitmap;
+	uint32_t blockno, nfree = 0;
+
+	if (!ospfs_data)
+		return 0;
+	bitmap = ospfs_block(OSPFS_FREEMAP_BLK);
+	for (blockno = 0; blockno < ospfs_super->os_nblocks; blockno++)
+		nfree += bitvector_test(bitmap, blockno);
+	return nfree;
+}
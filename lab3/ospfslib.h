@@ -0,0 +1,57 @@
+#ifndef OSPFSLIB_H
+#define OSPFSLIB_H
+
+/*
+ * ospfslib: OSPFS in userspace
+ *
+ *   libospfs.a compiles the same file system code as ospfsmod.c
+ *   (ospfsops.h) as an ordinary library, so OSPFS can be tested and
+ *   benchmarked without QEMU.  It works directly on an image file made by
+ *   ospfsformat, mapped into memory, so changes land in the image just as
+ *   the module's land in its ramdisk.
+ *
+ *   Files are named by inode number; ospfslib_lookup turns a name in a
+ *   directory into one.  Like the module, the library takes no locks, and
+ *   only one image can be open at a time.
+ *
+ *   Functions return 0 (or a count or inode number) on success and
+ *   -(error code) on error.
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Open the OSPFS image in the file 'path'.  -EINVAL means the file is not
+// an OSPFS image, and -EBUSY that another image is already open.
+int ospfslib_open(const char *path);
+
+// Write changes back to the image file and close it.
+int ospfslib_close(void);
+
+// Return the inode number of the entry 'name' in directory 'dir_ino'.
+int ospfslib_lookup(uint32_t dir_ino, const char *name);
+
+// Create an empty regular file, or a symbolic link to 'symname', named
+// 'name' in directory 'dir_ino'.  Return the new inode number.
+int ospfslib_create(uint32_t dir_ino, const char *name, int mode);
+int ospfslib_symlink(uint32_t dir_ino, const char *name, const char *symname);
+
+// Add a hard link named 'name' in directory 'dir_ino' to inode 'ino'.
+int ospfslib_link(uint32_t dir_ino, const char *name, uint32_t ino);
+
+// Remove the entry 'name' from directory 'dir_ino'.  A file's blocks are
+// freed with its last link.
+int ospfslib_unlink(uint32_t dir_ino, const char *name);
+
+// Read or write a regular file's data.  Writes past the end grow the file.
+ssize_t ospfslib_pread(uint32_t ino, void *buf, size_t len, off_t off);
+ssize_t ospfslib_pwrite(uint32_t ino, const void *buf, size_t len, off_t off);
+
+// Change a regular file's size, or return it.
+int ospfslib_truncate(uint32_t ino, uint32_t size);
+ssize_t ospfslib_size(uint32_t ino);
+
+// Return the number of free blocks.
+uint32_t ospfslib_nfree(void);
+
+#endif /* OSPFSLIB_H */
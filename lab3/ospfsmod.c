@@ -14,6 +14,7 @@
 #include <asm/uaccess.h>
 #include <linux/kernel.h>
 #include <linux/sched.h>
+#include <linux/bitops.h>
 
 /****************************************************************************
  * ospfsmod
@@ -40,8 +41,11 @@ extern uint32_t ospfs_length;
 static ospfs_super_t * const ospfs_super =
 	(ospfs_super_t *) &ospfs_data[OSPFS_BLKSIZE];
 
-static int change_size(ospfs_inode_t *oi, uint32_t want_size);
-static ospfs_direntry_t *find_direntry(ospfs_inode_t *dir_oi, const char *name, int namelen);
+// The file system operations themselves -- block and inode lookup, the
+// free-block bitmap, change_size, reading and writing file data, and
+// directory entries -- are in ospfsops.h, which the userspace ospfslib
+// library shares.
+#include "ospfsops.h"
 
 
 /*****************************************************************************
@@ -91,132 +95,6 @@ static struct super_operations ospfs_superblock_ops;
 
 
 
-/*****************************************************************************
- * BITVECTOR OPERATIONS
- *
- *   OSPFS uses a free bitmap to keep track of free blocks.
- *   These bitvector operations, which set, clear, and test individual bits
- *   in a bitmap, may be useful.
- */
-
-// bitvector_set -- Set 'i'th bit of 'vector' to 1.
-static inline void
-bitvector_set(void *vector, int i)
-{
-	((uint32_t *) vector) [i / 32] |= (1 << (i % 32));
-}
-
-// bitvector_clear -- Set 'i'th bit of 'vector' to 0.
-static inline void
-bitvector_clear(void *vector, int i)
-{
-	((uint32_t *) vector) [i / 32] &= ~(1 << (i % 32));
-}
-
-// bitvector_test -- Return the value of the 'i'th bit of 'vector'.
-static inline int
-bitvector_test(const void *vector, int i)
-{
-	return (((const uint32_t *) vector) [i / 32] & (1 << (i % 32))) != 0;
-}
-
-
-
-/*****************************************************************************
- * OSPFS HELPER FUNCTIONS
- */
-
-// ospfs_size2nblocks(size)
-//	Returns the number of blocks required to hold 'size' bytes of data.
-//
-//   Input:   size -- file size
-//   Returns: a number of blocks
-
-uint32_t
-ospfs_size2nblocks(uint32_t size)
-{
-	return (size + OSPFS_BLKSIZE - 1) / OSPFS_BLKSIZE;
-}
-
-
-// ospfs_block(blockno)
-//	Use this function to load a block's contents from "disk".
-//
-//   Input:   blockno -- block number
-//   Returns: a pointer to that block's data
-
-static void *
-ospfs_block(uint32_t blockno)
-{
-	return &ospfs_data[blockno * OSPFS_BLKSIZE];
-}
-
-
-// ospfs_inode(ino)
-//	Use this function to load a 'ospfs_inode' structure from "disk".
-//
-//   Input:   ino -- inode number
-//   Returns: a pointer to the corresponding ospfs_inode structure
-
-static inline ospfs_inode_t *
-ospfs_inode(ino_t ino)
-{
-	ospfs_inode_t *oi;
-	if (ino >= ospfs_super->os_ninodes)
-		return 0;
-	oi = ospfs_block(ospfs_super->os_firstinob);
-	return &oi[ino];
-}
-
-
-// ospfs_inode_blockno(oi, offset)
-//	Use this function to look up the blocks that are part of a file's
-//	contents.
-//
-//   Inputs:  oi     -- pointer to a OSPFS inode
-//	      offset -- byte offset into that inode
-//   Returns: the block number of the block that contains the 'offset'th byte
-//	      of the file
-
-static inline uint32_t
-ospfs_inode_blockno(ospfs_inode_t *oi, uint32_t offset)
-{
-	uint32_t blockno = offset / OSPFS_BLKSIZE;
-	if (offset >= oi->oi_size || oi->oi_ftype == OSPFS_FTYPE_SYMLINK)
-		return 0;
-	else if (blockno >= OSPFS_NDIRECT + OSPFS_NINDIRECT) {
-		uint32_t blockoff = blockno - (OSPFS_NDIRECT + OSPFS_NINDIRECT);
-		uint32_t *indirect2_block = ospfs_block(oi->oi_indirect2);
-		uint32_t *indirect_block = ospfs_block(indirect2_block[blockoff / OSPFS_NINDIRECT]);
-		return indirect_block[blockoff % OSPFS_NINDIRECT];
-	} else if (blockno >= OSPFS_NDIRECT) {
-		uint32_t *indirect_block = ospfs_block(oi->oi_indirect);
-		return indirect_block[blockno - OSPFS_NDIRECT];
-	} else
-		return oi->oi_direct[blockno];
-}
-
-
-// ospfs_inode_data(oi, offset)
-//	Use this function to load part of inode's data from "disk",
-//	where 'offset' is relative to the first byte of inode data.
-//
-//   Inputs:  oi     -- pointer to a OSPFS inode
-//	      offset -- byte offset into 'oi's data contents
-//   Returns: a pointer to the 'offset'th byte of 'oi's data contents
-//
-//	Be careful: the returned pointer is only valid within a single block.
-//	This function is a simple combination of 'ospfs_inode_blockno'
-//	and 'ospfs_block'.
-
-static inline void *
-ospfs_inode_data(ospfs_inode_t *oi, uint32_t offset)
-{
-	uint32_t blockno = ospfs_inode_blockno(oi, offset);
-	return (uint8_t *) ospfs_block(blockno) + (offset % OSPFS_BLKSIZE);
-}
-
-
 /*****************************************************************************
  * LOW-LEVEL FILE SYSTEM FUNCTIONS
  * There are no exercises in this section, and you don't need to understand
@@ -327,8 +205,6 @@ ospfs_delete_dentry(struct dentry *dentry)
 
 /*****************************************************************************
  * DIRECTORY OPERATIONS
- *
- * EXERCISE: Finish 'ospfs_dir_readdir' and 'ospfs_symlink'.
  */
 
 // ospfs_dir_lookup(dir, dentry, ignore)
@@ -351,7 +227,7 @@ ospfs_dir_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *ign
 	// Find the OSPFS inode corresponding to 'dir'
 	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
 	struct inode *entry_inode = NULL;
-	int entry_off;
+	ospfs_direntry_t *od;
 
 	// Make sure filename is not too long
 	if (dentry->d_name.len > OSPFS_MAXNAMELEN)
@@ -360,21 +236,13 @@ ospfs_dir_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *ign
 	// Mark with our operations
 	dentry->d_op = &ospfs_dentry_ops;
 
-	// Search through the directory block
-	for (entry_off = 0; entry_off < dir_oi->oi_size;
-	     entry_off += OSPFS_DIRENTRY_SIZE) {
-		// Find the OSPFS inode for the entry
-		ospfs_direntry_t *od = ospfs_inode_data(dir_oi, entry_off);
-
-		// Set 'entry_inode' if we find the file we are looking for
-		if (od->od_ino > 0
-		    && strlen(od->od_name) == dentry->d_name.len
-		    && memcmp(od->od_name, dentry->d_name.name, dentry->d_name.len) == 0) {
-			entry_inode = ospfs_mk_linux_inode(dir->i_sb, od->od_ino);
-			if (!entry_inode)
-				return (struct dentry *) ERR_PTR(-EINVAL);
-			break;
-		}
+	// Set 'entry_inode' if we find the file we are looking for
+	od = find_direntry(dir_oi, (const char *) dentry->d_name.name,
+			   dentry->d_name.len);
+	if (od) {
+		entry_inode = ospfs_mk_linux_inode(dir->i_sb, od->od_ino);
+		if (!entry_inode)
+			return (struct dentry *) ERR_PTR(-EINVAL);
 	}
 
 	// We return a dentry whether or not the file existed.
@@ -417,8 +285,6 @@ ospfs_dir_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *ign
 //
 //   Returns: 1 at end of directory, 0 if filldir returns < 0 before the end
 //     of the directory, and -(error number) on error.
-//
-//   EXERCISE: Finish implementing this function.
 
 static int
 ospfs_dir_readdir(struct file *filp, void *dirent, filldir_t filldir)
@@ -447,35 +313,38 @@ ospfs_dir_readdir(struct file *filp, void *dirent, filldir_t filldir)
 	while (r == 0 && ok_so_far >= 0 && f_pos >= 2) {
 		ospfs_direntry_t *od;
 		ospfs_inode_t *entry_oi;
+		uint32_t off = (f_pos - 2) * OSPFS_DIRENTRY_SIZE;
+		int type;
+
+		// At the end of the directory?
+		if (off >= dir_oi->oi_size) {
+			r = 1;
+			break;
+		}
+
+		// Skip blank directory entries (inode number 0).
+		od = ospfs_inode_data(dir_oi, off);
+		if (od->od_ino == 0) {
+			f_pos++;
+			continue;
+		}
 
-		/* If at the end of the directory, set 'r' to 1 and exit
-		 * the loop.  For now we do this all the time.
-		 *
-		 * EXERCISE: Your code here */
-		r = 1;		/* Fix me! */
-		break;		/* Fix me! */
-
-		/* Get a pointer to the next entry (od) in the directory.
-		 * The file system interprets the contents of a
-		 * directory-file as a sequence of ospfs_direntry structures.
-		 * You will find 'f_pos' and 'ospfs_inode_data' useful.
-		 *
-		 * Then use the fields of that file to fill in the directory
-		 * entry.  To figure out whether a file is a regular file or
-		 * another directory, use 'ospfs_inode' to get the directory
-		 * entry's corresponding inode, and check out its 'oi_ftype'
-		 * member.
-		 *
-		 * Make sure you ignore blank directory entries!  (Which have
-		 * an inode number of 0.)
-		 *
-		 * If the current entry is successfully read (the call to
-		 * filldir returns >= 0), or the current entry is skipped,
-		 * your function should advance f_pos by the proper amount to
-		 * advance to the next directory entry.
-		 */
-
-		/* EXERCISE: Your code here */
+		entry_oi = ospfs_inode(od->od_ino);
+		if (!entry_oi) {
+			r = -EIO;
+			break;
+		}
+		if (entry_oi->oi_ftype == OSPFS_FTYPE_DIR)
+			type = DT_DIR;
+		else if (entry_oi->oi_ftype == OSPFS_FTYPE_SYMLINK)
+			type = DT_LNK;
+		else
+			type = DT_REG;
+
+		ok_so_far = filldir(dirent, od->od_name, strlen(od->od_name),
+				    f_pos, od->od_ino, type);
+		if (ok_so_far >= 0)
+			f_pos++;
 	}
 
 	// Save the file position and return!
@@ -493,300 +362,32 @@ ospfs_dir_readdir(struct file *filp, void *dirent, filldir_t filldir)
 //                      directory.
 //
 //   Returns: 0 if success and -ENOENT on entry not found.
-//
-//   EXERCISE: Make sure that deleting symbolic links works correctly.
 
 static int
 ospfs_unlink(struct inode *dirino, struct dentry *dentry)
 {
-	ospfs_inode_t *oi = ospfs_inode(dentry->d_inode->i_ino);
 	ospfs_inode_t *dir_oi = ospfs_inode(dentry->d_parent->d_inode->i_ino);
-	int entry_off;
-	ospfs_direntry_t *od;
-
-	od = NULL; // silence compiler warning; entry_off indicates when !od
-	for (entry_off = 0; entry_off < dir_oi->oi_size;
-	     entry_off += OSPFS_DIRENTRY_SIZE) {
-		od = ospfs_inode_data(dir_oi, entry_off);
-		if (od->od_ino > 0
-		    && strlen(od->od_name) == dentry->d_name.len
-		    && memcmp(od->od_name, dentry->d_name.name, dentry->d_name.len) == 0)
-			break;
-	}
+	int r = ospfs_remove_direntry(dir_oi, (const char *) dentry->d_name.name,
+				      dentry->d_name.len);
 
-	if (entry_off == dir_oi->oi_size) {
+	if (r == -ENOENT)
 		printk("<1>ospfs_unlink should not fail!\n");
-		return -ENOENT;
-	}
-
-	od->od_ino = 0;
-	oi->oi_nlink--;
-	return 0;
-}
-
-
-
-/*****************************************************************************
- * FREE-BLOCK BITMAP OPERATIONS
- *
- * EXERCISE: Implement these functions.
- */
-
-// allocate_block()
-//	Use this function to allocate a block.
-//
-//   Inputs:  none
-//   Returns: block number of the allocated block,
-//	      or 0 if the disk is full
-//
-//   This function searches the free-block bitmap, which starts at Block 2, for
-//   a free block, allocates it (by marking it non-free), and returns the block
-//   number to the caller.  The block itself is not touched.
-//
-//   Note:  A value of 0 for a bit indicates the corresponding block is
-//      allocated; a value of 1 indicates the corresponding block is free.
-//
-//   You can use the functions bitvector_set(), bitvector_clear(), and
-//   bitvector_test() to do bit operations on the map.
-
-static uint32_t
-allocate_block(void)
-{
-	/* EXERCISE: Your code here */
-	return 0;
+	return r;
 }
 
 
-// free_block(blockno)
-//	Use this function to free an allocated block.
-//
-//   Inputs:  blockno -- the block number to be freed
-//   Returns: none
-//
-//   This function should mark the named block as free in the free-block
-//   bitmap.  (You might want to program defensively and make sure the block
-//   number isn't obviously bogus: the boot sector, superblock, free-block
-//   bitmap, and inode blocks must never be freed.  But this is not required.)
-
-static void
-free_block(uint32_t blockno)
-{
-	/* EXERCISE: Your code here */
-}
-
 
 /*****************************************************************************
  * FILE OPERATIONS
  *
- * EXERCISE: Finish off change_size, read, and write.
- *
- * The find_*, add_block, and remove_block functions are only there to support
- * the change_size function.  If you prefer to code change_size a different
- * way, then you may not need these functions.
- *
+ * These connect Linux's file operations to change_size, ospfs_file_read,
+ * and ospfs_file_write in ospfsops.h.
  */
 
-// The following functions are used in our code to unpack a block number into
-// its consituent pieces: the doubly indirect block number (if any), the
-// indirect block number (which might be one of many in the doubly indirect
-// block), and the direct block number (which might be one of many in an
-// indirect block).  We use these functions in our implementation of
-// change_size.
-
-
-// int32_t indir2_index(uint32_t b)
-//	Returns the doubly-indirect block index for file block b.
-//
-// Inputs:  b -- the zero-based index of the file block (e.g., 0 for the first
-//		 block, 1 for the second, etc.)
-// Returns: 0 if block index 'b' requires using the doubly indirect
-//	       block, -1 if it does not.
-//
-// EXERCISE: Fill in this function.
-
-static int32_t
-indir2_index(uint32_t b)
-{
-	// Your code here.
-	return -1;
-}
-
-
-// int32_t indir_index(uint32_t b)
-//	Returns the indirect block index for file block b.
-//
-// Inputs:  b -- the zero-based index of the file block
-// Returns: -1 if b is one of the file's direct blocks;
-//	    0 if b is located under the file's first indirect block;
-//	    otherwise, the offset of the relevant indirect block within
-//		the doubly indirect block.
-//
-// EXERCISE: Fill in this function.
-
-static int32_t
-indir_index(uint32_t b)
-{
-	// Your code here.
-	return -1;
-}
-
-
-// int32_t indir_index(uint32_t b)
-//	Returns the indirect block index for file block b.
-//
-// Inputs:  b -- the zero-based index of the file block
-// Returns: the index of block b in the relevant indirect block or the direct
-//	    block array.
-//
-// EXERCISE: Fill in this function.
-
-static int32_t
-direct_index(uint32_t b)
-{
-	// Your code here.
-	return -1;
-}
-
-
-// add_block(ospfs_inode_t *oi)
-//   Adds a single data block to a file, adding indirect and
-//   doubly-indirect blocks if necessary. (Helper function for
-//   change_size).
-//
-// Inputs: oi -- pointer to the file we want to grow
-// Returns: 0 if successful, < 0 on error.  Specifically:
-//          -ENOSPC if you are unable to allocate a block
-//          due to the disk being full or
-//          -EIO for any other error.
-//          If the function is successful, then oi->oi_size
-//          should be set to the maximum file size in bytes that could
-//          fit in oi's data blocks.  If the function returns an error,
-//          then oi->oi_size should remain unchanged. Any newly
-//          allocated blocks should be erased (set to zero).
-//
-// EXERCISE: Finish off this function.
-//
-// Remember that allocating a new data block may require allocating
-// as many as three disk blocks, depending on whether a new indirect
-// block and/or a new indirect^2 block is required. If the function
-// fails with -ENOSPC or -EIO, then you need to make sure that you
-// free any indirect (or indirect^2) blocks you may have allocated!
-//
-// Also, make sure you:
-//  1) zero out any new blocks that you allocate
-//  2) store the disk block number of any newly allocated block
-//     in the appropriate place in the inode or one of the
-//     indirect blocks.
-//  3) update the oi->oi_size field
-
-static int
-add_block(ospfs_inode_t *oi)
-{
-	// current number of blocks in file
-	uint32_t n = ospfs_size2nblocks(oi->oi_size);
-
-	// keep track of allocations to free in case of -ENOSPC
-	uint32_t *allocated[2] = { 0, 0 };
-
-	/* EXERCISE: Your code here */
-	return -EIO; // Replace this line
-}
-
-
-// remove_block(ospfs_inode_t *oi)
-//   Removes a single data block from the end of a file, freeing
-//   any indirect and indirect^2 blocks that are no
-//   longer needed. (Helper function for change_size)
-//
-// Inputs: oi -- pointer to the file we want to shrink
-// Returns: 0 if successful, < 0 on error.
-//          If the function is successful, then oi->oi_size
-//          should be set to the maximum file size that could
-//          fit in oi's blocks.  If the function returns -EIO (for
-//          instance if an indirect block that should be there isn't),
-//          then oi->oi_size should remain unchanged.
-//
-// EXERCISE: Finish off this function.
-//
-// Remember that you must free any indirect and doubly-indirect blocks
-// that are no longer necessary after shrinking the file.  Removing a
-// single data block could result in as many as 3 disk blocks being
-// deallocated.  Also, if you free a block, make sure that
-// you set the block pointer to 0.  Don't leave pointers to
-// deallocated blocks laying around!
-
-static int
-remove_block(ospfs_inode_t *oi)
-{
-	// current number of blocks in file
-	uint32_t n = ospfs_size2nblocks(oi->oi_size);
-
-	/* EXERCISE: Your code here */
-	return -EIO; // Replace this line
-}
-
-
-// change_size(oi, want_size)
-//	Use this function to change a file's size, allocating and freeing
-//	blocks as necessary.
-//
-//   Inputs:  oi	-- pointer to the file whose size we're changing
-//	      want_size -- the requested size in bytes
-//   Returns: 0 on success, < 0 on error.  In particular:
-//		-ENOSPC: if there are no free blocks available
-//		-EIO:    an I/O error -- for example an indirect block should
-//			 exist, but doesn't
-//	      If the function succeeds, the file's oi_size member should be
-//	      changed to want_size, with blocks allocated as appropriate.
-//	      Any newly-allocated blocks should be erased (set to 0).
-//	      If there is an -ENOSPC error when growing a file,
-//	      the file size and allocated blocks should not change from their
-//	      original values!!!
-//            (However, if there is an -EIO error, do not worry too much about
-//	      restoring the file.)
-//
-//   If want_size has the same number of blocks as the current file, life
-//   is good -- the function is pretty easy.  But the function might have
-//   to add or remove blocks.
-//
-//   If you need to grow the file, then do so by adding one block at a time
-//   using the add_block function you coded above. If one of these additions
-//   fails with -ENOSPC, you must shrink the file back to its original size!
-//
-//   If you need to shrink the file, remove blocks from the end of
-//   the file one at a time using the remove_block function you coded above.
-//
-//   Also: Don't forget to change the size field in the metadata of the file.
-//         (The value that the final add_block or remove_block set it to
-//          is probably not correct).
-//
-//   EXERCISE: Finish off this function.
-
-static int
-change_size(ospfs_inode_t *oi, uint32_t new_size)
-{
-	uint32_t old_size = oi->oi_size;
-	int r = 0;
-
-	while (ospfs_size2nblocks(oi->oi_size) < ospfs_size2nblocks(new_size)) {
-	        /* EXERCISE: Your code here */
-		return -EIO; // Replace this line
-	}
-	while (ospfs_size2nblocks(oi->oi_size) > ospfs_size2nblocks(new_size)) {
-	        /* EXERCISE: Your code here */
-		return -EIO; // Replace this line
-	}
-
-	/* EXERCISE: Make sure you update necessary file meta data
-	             and return the proper value. */
-	return -EIO; // Replace this line
-}
-
-
 // ospfs_notify_change
 //	This function gets called when the user changes a file's size,
 //	owner, or permissions, among other things.
-//	OSPFS only pays attention to file size changes (see change_size above).
+//	OSPFS only pays attention to file size changes (see change_size in ospfsops.h).
 //	We have written this function for you -- except for file quotas.
 
 static int
@@ -817,6 +418,42 @@ ospfs_notify_change(struct dentry *dentry, struct iattr *attr)
 }
 
 
+// ospfs_open_file
+//	Linux calls this function when a regular file is opened.
+//	It is the file_operations.open callback.
+//
+//   Inputs:  inode	-- the file's inode
+//            filp	-- the new file pointer
+//   Returns: 0 on success, -ENOMEM if out of memory.
+//
+//   Gives the open file its own block-map cursor (see ospfs_cursor_t in
+//   ospfsops.h) in 'filp->private_data', for ospfs_read and ospfs_write.
+
+static int
+ospfs_open_file(struct inode *inode, struct file *filp)
+{
+	ospfs_cursor_t *cursor = kmalloc(sizeof(*cursor), GFP_KERNEL);
+	if (!cursor)
+		return -ENOMEM;
+	cursor->c_ino = 0;
+	filp->private_data = cursor;
+	return 0;
+}
+
+
+// ospfs_release_file
+//	Linux calls this function when the last reference to an open regular
+//	file goes away.  It is the file_operations.release callback.
+//	Frees the cursor from ospfs_open_file.
+
+static int
+ospfs_release_file(struct inode *inode, struct file *filp)
+{
+	kfree(filp->private_data);
+	return 0;
+}
+
+
 // ospfs_read
 //	Linux calls this function to read data from a file.
 //	It is the file_operations.read callback.
@@ -827,54 +464,13 @@ ospfs_notify_change(struct dentry *dentry, struct iattr *attr)
 //            f_pos     -- points to the file position
 //   Returns: Number of chars read on success, -(error code) on error.
 //
-//   This function copies the corresponding bytes from the file into the user
-//   space ptr (buffer).  Use copy_to_user() to accomplish this.
-//   The current file position is passed into the function
-//   as 'f_pos'; read data starting at that position, and update the position
-//   when you're done.
-//
-//   EXERCISE: Complete this function.
+//   See ospfs_file_read.
 
 static ssize_t
 ospfs_read(struct file *filp, char __user *buffer, size_t count, loff_t *f_pos)
 {
 	ospfs_inode_t *oi = ospfs_inode(filp->f_dentry->d_inode->i_ino);
-	int retval = 0;
-	size_t amount = 0;
-
-	// Make sure we don't read past the end of the file!
-	// Change 'count' so we never read past the end of the file.
-	/* EXERCISE: Your code here */
-
-	// Copy the data to user block by block
-	while (amount < count && retval >= 0) {
-		uint32_t blockno = ospfs_inode_blockno(oi, *f_pos);
-		uint32_t n;
-		char *data;
-
-		// ospfs_inode_blockno returns 0 on error
-		if (blockno == 0) {
-			retval = -EIO;
-			goto done;
-		}
-
-		data = ospfs_block(blockno);
-
-		// Figure out how much data is left in this block to read.
-		// Copy data into user space. Return -EFAULT if unable to write
-		// into user space.
-		// Use variable 'n' to track number of bytes moved.
-		/* EXERCISE: Your code here */
-		retval = -EIO; // Replace these lines
-		goto done;
-
-		buffer += n;
-		amount += n;
-		*f_pos += n;
-	}
-
-    done:
-	return (retval >= 0 ? amount : retval);
+	return ospfs_file_read(oi, filp->private_data, buffer, count, f_pos);
 }
 
 
@@ -888,162 +484,62 @@ ospfs_read(struct file *filp, char __user *buffer, size_t count, loff_t *f_pos)
 //            f_pos     -- points to the file position
 //   Returns: Number of chars written on success, -(error code) on error.
 //
-//   This function copies the corresponding bytes from the user space ptr
-//   into the file.  Use copy_from_user() to accomplish this. Unlike read(),
-//   where you cannot read past the end of the file, it is OK to write past
-//   the end of the file; this should simply change the file's size.
-//
-//   EXERCISE: Complete this function.
+//   See ospfs_file_write.  Files opened with O_APPEND are always written
+//   at the end.
 
 static ssize_t
 ospfs_write(struct file *filp, const char __user *buffer, size_t count, loff_t *f_pos)
 {
-	ospfs_inode_t *oi = ospfs_inode(filp->f_dentry->d_inode->i_ino);
-	int retval = 0;
-	size_t amount = 0;
-
-	// Support files opened with the O_APPEND flag.  To detect O_APPEND,
-	// use struct file's f_flags field and the O_APPEND bit.
-	/* EXERCISE: Your code here */
-
-	// If the user is writing past the end of the file, change the file's
-	// size to accomodate the request.  (Use change_size().)
-	/* EXERCISE: Your code here */
-
-	// Copy data block by block
-	while (amount < count && retval >= 0) {
-		uint32_t blockno = ospfs_inode_blockno(oi, *f_pos);
-		uint32_t n;
-		char *data;
-
-		if (blockno == 0) {
-			retval = -EIO;
-			goto done;
-		}
-
-		data = ospfs_block(blockno);
-
-		// Figure out how much data is left in this block to write.
-		// Copy data from user space. Return -EFAULT if unable to read
-		// read user space.
-		// Keep track of the number of bytes moved in 'n'.
-		/* EXERCISE: Your code here */
-		retval = -EIO; // Replace these lines
-		goto done;
-
-		buffer += n;
-		amount += n;
-		*f_pos += n;
-	}
-
-    done:
-	return (retval >= 0 ? amount : retval);
-}
-
+	struct inode *inode = filp->f_dentry->d_inode;
+	ospfs_inode_t *oi = ospfs_inode(inode->i_ino);
+	ssize_t retval;
 
-// find_direntry(dir_oi, name, namelen)
-//	Looks through the directory to find an entry with name 'name' (length
-//	in characters 'namelen').  Returns a pointer to the directory entry,
-//	if one exists, or NULL if one does not.
-//
-//   Inputs:  dir_oi  -- the OSP inode for the directory
-//	      name    -- name to search for
-//	      namelen -- length of 'name'.  (If -1, then use strlen(name).)
-//
-//	We have written this function for you.
+	if (filp->f_flags & O_APPEND)
+		*f_pos = oi->oi_size;
 
-static ospfs_direntry_t *
-find_direntry(ospfs_inode_t *dir_oi, const char *name, int namelen)
-{
-	int off;
-	if (namelen < 0)
-		namelen = strlen(name);
-	for (off = 0; off < dir_oi->oi_size; off += OSPFS_DIRENTRY_SIZE) {
-		ospfs_direntry_t *od = ospfs_inode_data(dir_oi, off);
-		if (od->od_ino
-		    && strlen(od->od_name) == namelen
-		    && memcmp(od->od_name, name, namelen) == 0)
-			return od;
-	}
-	return 0;
+	retval = ospfs_file_write(oi, filp->private_data, buffer, count, f_pos);
+	inode->i_size = oi->oi_size;
+	return retval;
 }
 
 
-// create_blank_direntry(dir_oi)
-//	'dir_oi' is an OSP inode for a directory.
-//	Return a blank directory entry in that directory.  This might require
-//	adding a new block to the directory.  Returns an error pointer (see
-//	below) on failure.
-//
-// ERROR POINTERS: The Linux kernel uses a special convention for returning
-// error values in the form of pointers.  Here's how it works.
-//	- ERR_PTR(errno): Creates a pointer value corresponding to an error.
-//	- IS_ERR(ptr): Returns true iff 'ptr' is an error value.
-//	- PTR_ERR(ptr): Returns the error value for an error pointer.
-//	For example:
-//
-//	static ospfs_direntry_t *create_blank_direntry(...) {
-//		return ERR_PTR(-ENOSPC);
-//	}
-//	static int ospfs_create(...) {
-//		...
-//		ospfs_direntry_t *od = create_blank_direntry(...);
-//		if (IS_ERR(od))
-//			return PTR_ERR(od);
-//		...
-//	}
-//
-//	The create_blank_direntry function should use this convention.
-//
-// EXERCISE: Write this function.
-
-static ospfs_direntry_t *
-create_blank_direntry(ospfs_inode_t *dir_oi)
-{
-	// Outline:
-	// 1. Check the existing directory data for an empty entry.  Return one
-	//    if you find it.
-	// 2. If there's no empty entries, add a block to the directory.
-	//    Use ERR_PTR if this fails; otherwise, clear out all the directory
-	//    entries and return one of them.
-
-	/* EXERCISE: Your code here. */
-	return ERR_PTR(-EINVAL); // Replace this line
-}
-
 // ospfs_link(src_dentry, dir, dst_dentry
 //   Linux calls this function to create hard links.
 //   It is the ospfs_dir_inode_ops.link callback.
 //
-//   Inputs: src_dentry   -- a pointer to the dentry for the source file.  This
-//                           file's inode contains the real data for the hard
-//                           linked filae.  The important elements are:
-//                             src_dentry->d_name.name
-//                             src_dentry->d_name.len
-//                             src_dentry->d_inode->i_ino
+//   Inputs: src_dentry   -- a pointer to the dentry for the source file.
 //           dir          -- a pointer to the containing directory for the new
 //                           hard link.
 //           dst_dentry   -- a pointer to the dentry for the new hard link file.
-//                           The important elements are:
-//                             dst_dentry->d_name.name
-//                             dst_dentry->d_name.len
-//                             dst_dentry->d_inode->i_ino
-//                           Two of these values are already set.  One must be
-//                           set by you, which one?
+//                           Its inode is set to the source file's.
 //   Returns: 0 on success, -(error code) on error.  In particular:
-//               -ENAMETOOLONG if dst_dentry->d_name.len is too large, or
-//			       'symname' is too long;
+//               -ENAMETOOLONG if dst_dentry->d_name.len is too large;
 //               -EEXIST       if a file named the same as 'dst_dentry' already
 //                             exists in the given 'dir';
 //               -ENOSPC       if the disk is full & the file can't be created;
 //               -EIO          on I/O error.
-//
-//   EXERCISE: Complete this function.
 
 static int
 ospfs_link(struct dentry *src_dentry, struct inode *dir, struct dentry *dst_dentry) {
-	/* EXERCISE: Your code here. */
-	return -EINVAL;
+	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
+	ino_t src_ino = src_dentry->d_inode->i_ino;
+	ospfs_inode_t *src_oi = ospfs_inode(src_ino);
+	struct inode *i;
+	int r;
+
+	if (!src_oi)
+		return -EIO;
+	if ((r = ospfs_add_direntry(dir_oi,
+				    (const char *) dst_dentry->d_name.name,
+				    dst_dentry->d_name.len, src_ino)) < 0)
+		return r;
+	src_oi->oi_nlink++;
+	src_dentry->d_inode->i_nlink = src_oi->oi_nlink;
+
+	if (!(i = ospfs_mk_linux_inode(dir->i_sb, src_ino)))
+		return -ENOMEM;
+	d_instantiate(dst_dentry, i);
+	return 0;
 }
 
 // ospfs_create
@@ -1066,26 +562,18 @@ ospfs_link(struct dentry *src_dentry, struct inode *dir, struct dentry *dst_dent
 //               -ENOSPC       if the disk is full & the file can't be created;
 //               -EIO          on I/O error.
 //
-//   We have provided strictly less skeleton code for this function than for
-//   the others.  Here's a brief outline of what you need to do:
-//   1. Check for the -EEXIST error and find an empty directory entry using the
-//	helper functions above.
-//   2. Find an empty inode.  Set the 'entry_ino' variable to its inode number.
-//   3. Initialize the directory entry and inode.
-//
-//   EXERCISE: Complete this function.
+//   See ospfs_create_file.
 
 static int
 ospfs_create(struct inode *dir, struct dentry *dentry, int mode, struct nameidata *nd)
 {
 	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
-	uint32_t entry_ino = 0;
-	/* EXERCISE: Your code here. */
-	return -EINVAL; // Replace this line
+	int entry_ino = ospfs_create_file(dir_oi,
+					  (const char *) dentry->d_name.name,
+					  dentry->d_name.len, mode);
+	if (entry_ino < 0)
+		return entry_ino;
 
-	/* Execute this code after your function has successfully created the
-	   file.  Set entry_ino to the created file's inode number before
-	   getting here. */
 	{
 		struct inode *i = ospfs_mk_linux_inode(dir->i_sb, entry_ino);
 		if (!i)
@@ -1116,20 +604,18 @@ ospfs_create(struct inode *dir, struct dentry *dentry, int mode, struct nameidat
 //               -ENOSPC       if the disk is full & the file can't be created;
 //               -EIO          on I/O error.
 //
-//   EXERCISE: Complete this function.
+//   See ospfs_create_symlink.
 
 static int
 ospfs_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
 {
 	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
-	uint32_t entry_ino = 0;
-
-	/* EXERCISE: Your code here. */
-	return -EINVAL;
+	int entry_ino = ospfs_create_symlink(dir_oi,
+					     (const char *) dentry->d_name.name,
+					     dentry->d_name.len, symname);
+	if (entry_ino < 0)
+		return entry_ino;
 
-	/* Execute this code after your function has successfully created the
-	   file.  Set entry_ino to the created file's inode number before
-	   getting here. */
 	{
 		struct inode *i = ospfs_mk_linux_inode(dir->i_sb, entry_ino);
 		if (!i)
@@ -1180,6 +666,8 @@ static struct inode_operations ospfs_reg_inode_ops = {
 
 static struct file_operations ospfs_reg_file_ops = {
 	.llseek		= generic_file_llseek,
+	.open		= ospfs_open_file,
+	.release	= ospfs_release_file,
 	.read		= ospfs_read,
 	.write		= ospfs_write
 };
@@ -1221,6 +709,7 @@ static int __init init_ospfs_fs(void)
 static void __exit exit_ospfs_fs(void)
 {
 	unregister_filesystem(&ospfs_fs_type);
+	ospfs_dirindex_forget();
 	eprintk("Unloading ospfs module\n");
 }
 
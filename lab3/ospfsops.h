@@ -0,0 +1,1904 @@
+#ifndef OSPFSOPS_H
+#define OSPFSOPS_H
+
+/*
+ * OSPFS file system operations
+ *
+ *   The parts of OSPFS that work on the file system image itself: block
+ *   and inode lookup, the free-block bitmap, growing and shrinking files,
+ *   reading and writing file data, and adding and removing directory
+ *   entries.  This file is shared by ospfsmod.c and the userspace ospfslib
+ *   library, so it uses only interfaces that both provide: errno constants,
+ *   error pointers, and copy_to_user/copy_from_user.  Include the kernel
+ *   headers (or kcompat.h) and ospfs.h first.  The bitmap code assumes a
+ *   little-endian machine.
+ *
+ *   The includer defines the image these functions operate on:
+ *	uint8_t ospfs_data[]		-- the image's bytes (or a pointer)
+ *	ospfs_super_t *ospfs_super	-- its superblock, block 1
+ *   In the kernel module the image is the array in fsimg.c; in ospfslib it
+ *   is an image file mapped into memory.
+ *
+ *   Nothing here takes a lock.  The kernel serializes file system calls
+ *   for OSPFS with the big kernel lock, and ospfslib is single-threaded.
+ */
+
+
+/*****************************************************************************
+ * BITVECTOR OPERATIONS
+ *
+ *   OSPFS uses a free bitmap to keep track of free blocks.
+ *   These bitvector operations, which set, clear, and test individual bits
+ *   in a bitmap, may be useful.
+ */
+
+// bitvector_set -- Set 'i'th bit of 'vector' to 1.
+static inline void
+bitvector_set(void *vector, int i)
+{
+	((uint32_t *) vector) [i / 32] |= (1U << (i % 32));
+}
+
+// bitvector_clear -- Set 'i'th bit of 'vector' to 0.
+static inline void
+bitvector_clear(void *vector, int i)
+{
+	((uint32_t *) vector) [i / 32] &= ~(1U << (i % 32));
+}
+
+// bitvector_test -- Return the value of the 'i'th bit of 'vector'.
+static inline int
+bitvector_test(const void *vector, int i)
+{
+	return (((const uint32_t *) vector) [i / 32] & (1U << (i % 32))) != 0;
+}
+
+
+
+/*****************************************************************************
+ * OSPFS HELPER FUNCTIONS
+ */
+
+// ospfs_size2nblocks(size)
+//	Returns the number of blocks required to hold 'size' bytes of data.
+//
+//   Input:   size -- file size
+//   Returns: a number of blocks
+
+static inline uint32_t
+ospfs_size2nblocks(uint32_t size)
+{
+	return (size + OSPFS_BLKSIZE - 1) / OSPFS_BLKSIZE;
+}
+
+
+// ospfs_block(blockno)
+//	Use this function to load a block's contents from "disk".
+//
+//   Input:   blockno -- block number
+//   Returns: a pointer to that block's data
+
+static inline void *
+ospfs_block(uint32_t blockno)
+{
+	return &ospfs_data[blockno * OSPFS_BLKSIZE];
+}
+
+
+// ospfs_inode(ino)
+//	Use this function to load a 'ospfs_inode' structure from "disk".
+//
+//   Input:   ino -- inode number
+//   Returns: a pointer to the corresponding ospfs_inode structure
+
+static inline ospfs_inode_t *
+ospfs_inode(ino_t ino)
+{
+	ospfs_inode_t *oi;
+	if (ino >= ospfs_super->os_ninodes)
+		return 0;
+	oi = ospfs_block(ospfs_super->os_firstinob);
+	return &oi[ino];
+}
+
+
+// ospfs_inode_ino(oi)
+//	Returns the inode number of the inode 'oi'.
+
+static inline uint32_t
+ospfs_inode_ino(ospfs_inode_t *oi)
+{
+	return oi - (ospfs_inode_t *) ospfs_block(ospfs_super->os_firstinob);
+}
+
+
+// ospfs_first_datab()
+//	Returns the number of the first data block: the first block after
+//	the inode blocks.  Blocks before it are never free.
+
+static inline uint32_t
+ospfs_first_datab(void)
+{
+	return ospfs_super->os_firstinob
+		+ (ospfs_super->os_ninodes + OSPFS_BLKINODES - 1) / OSPFS_BLKINODES;
+}
+
+
+// ospfs_extent_mapped(oi)
+//	Returns nonzero if inode 'oi' is an ospfs_extent_inode_t: a regular
+//	file or directory on an image with OSPFS_FEATURE_EXTENTS.
+
+static inline int
+ospfs_extent_mapped(const ospfs_inode_t *oi)
+{
+	return (ospfs_super->os_features & OSPFS_FEATURE_EXTENTS)
+		&& oi->oi_ftype != OSPFS_FTYPE_SYMLINK;
+}
+
+
+// ospfs_inode_extent(ei, i)
+//	Returns a pointer to extent inode 'ei's 'i'th extent, which is in the
+//	inode or in one of its extent blocks, or null if the extent block
+//	that should hold it is missing.
+
+static ospfs_extent_t *
+ospfs_inode_extent(ospfs_extent_inode_t *ei, uint32_t i)
+{
+	uint32_t *extindex;
+
+	if (i < OSPFS_NIEXTENTS)
+		return &ei->oi_extent[i];
+	i -= OSPFS_NIEXTENTS;
+	if (!ei->oi_extindex)
+		return 0;
+	extindex = ospfs_block(ei->oi_extindex);
+	if (!extindex[i / OSPFS_BLKEXTENTS])
+		return 0;
+	return (ospfs_extent_t *) ospfs_block(extindex[i / OSPFS_BLKEXTENTS])
+		+ i % OSPFS_BLKEXTENTS;
+}
+
+
+// ospfs_extent_blockno(ei, b)
+//	Returns the block number of extent inode 'ei's 'b'th block, or 0 if
+//	it has no such block.  Walks the extents from the start of the file.
+
+static uint32_t
+ospfs_extent_blockno(ospfs_extent_inode_t *ei, uint32_t b)
+{
+	uint32_t i;
+
+	for (i = 0; i < ei->oi_nextents; i++) {
+		ospfs_extent_t *e = ospfs_inode_extent(ei, i);
+		if (!e)
+			return 0;
+		if (b < e->oe_count)
+			return e->oe_start + b;
+		b -= e->oe_count;
+	}
+	return 0;
+}
+
+
+// ospfs_inode_blockno(oi, offset)
+//	Use this function to look up the blocks that are part of a file's
+//	contents.
+//
+//   Inputs:  oi     -- pointer to a OSPFS inode
+//	      offset -- byte offset into that inode
+//   Returns: the block number of the block that contains the 'offset'th byte
+//	      of the file
+
+static inline uint32_t
+ospfs_inode_blockno(ospfs_inode_t *oi, uint32_t offset)
+{
+	uint32_t blockno = offset / OSPFS_BLKSIZE;
+	if (offset >= oi->oi_size || oi->oi_ftype == OSPFS_FTYPE_SYMLINK)
+		return 0;
+	else if (ospfs_extent_mapped(oi))
+		return ospfs_extent_blockno((ospfs_extent_inode_t *) oi, blockno);
+	else if (blockno >= OSPFS_NDIRECT + OSPFS_NINDIRECT) {
+		uint32_t blockoff = blockno - (OSPFS_NDIRECT + OSPFS_NINDIRECT);
+		uint32_t *indirect2_block = ospfs_block(oi->oi_indirect2);
+		uint32_t *indirect_block = ospfs_block(indirect2_block[blockoff / OSPFS_NINDIRECT]);
+		return indirect_block[blockoff % OSPFS_NINDIRECT];
+	} else if (blockno >= OSPFS_NDIRECT) {
+		uint32_t *indirect_block = ospfs_block(oi->oi_indirect);
+		return indirect_block[blockno - OSPFS_NDIRECT];
+	} else
+		return oi->oi_direct[blockno];
+}
+
+
+// ospfs_inode_data(oi, offset)
+//	Use this function to load part of inode's data from "disk",
+//	where 'offset' is relative to the first byte of inode data.
+//
+//   Inputs:  oi     -- pointer to a OSPFS inode
+//	      offset -- byte offset into 'oi's data contents
+//   Returns: a pointer to the 'offset'th byte of 'oi's data contents
+//
+//	Be careful: the returned pointer is only valid within a single block.
+//	This function is a simple combination of 'ospfs_inode_blockno'
+//	and 'ospfs_block'.
+
+static inline void *
+ospfs_inode_data(ospfs_inode_t *oi, uint32_t offset)
+{
+	uint32_t blockno = ospfs_inode_blockno(oi, offset);
+	return (uint8_t *) ospfs_block(blockno) + (offset % OSPFS_BLKSIZE);
+}
+
+
+
+/*****************************************************************************
+ * FREE-BLOCK BITMAP OPERATIONS
+ *
+ *   The allocator keeps two things in memory, worked out from the bitmap
+ *   the first time a block is allocated:
+ *   - A next-fit cursor: the block after the last one allocated.  The next
+ *     search starts there, so a file that grows a block at a time gets
+ *     consecutive blocks, and searches do not keep rescanning the full
+ *     front of the disk.
+ *   - The number of free blocks in each "group", the OSPFS_BLKBITSIZE
+ *     blocks described by one bitmap block.  Searches skip full groups
+ *     without reading their bitmap.
+ *   - The number of free blocks on the disk, so a file can find out
+ *     whether it can grow before it starts.
+ *   Searches read the bitmap an unsigned long at a time and use __ffs to
+ *   find the first free bit in a word.  Bit i of the bitmap is bit i % 32
+ *   of its (i / 32)th little-endian 32-bit word, so on a little-endian
+ *   machine it is also bit i % OSPFS_WORDBITS of its (i / OSPFS_WORDBITS)th
+ *   unsigned long.
+ */
+
+#define OSPFS_WORDBITS	(8 * sizeof(unsigned long))
+#define OSPFS_NGROUPS	(OSPFS_MAXNBLOCKS / OSPFS_BLKBITSIZE)
+
+static struct {
+	int ready;			// Have the fields below been set up?
+	uint32_t cursor;		// Where the next search starts
+	uint32_t nfree;			// Free blocks on the disk
+	uint32_t group_nfree[OSPFS_NGROUPS];	// Free blocks in each group
+} ospfs_alloc;
+
+
+// ospfs_alloc_init()
+//	Sets up the allocator's in-memory state from the bitmap.  Only
+//	blocks that can be allocated, from the first data block up to the
+//	end of the disk, are counted, whatever the bitmap says about others.
+
+static void
+ospfs_alloc_init(void)
+{
+	const unsigned long *bitmap = ospfs_block(OSPFS_FREEMAP_BLK);
+	uint32_t first = ospfs_first_datab();
+	uint32_t nblocks = ospfs_super->os_nblocks;
+	uint32_t w, b;
+
+	memset(ospfs_alloc.group_nfree, 0, sizeof(ospfs_alloc.group_nfree));
+	ospfs_alloc.nfree = 0;
+	for (w = first / OSPFS_WORDBITS; w * OSPFS_WORDBITS < nblocks; w++) {
+		unsigned long word = bitmap[w];
+		b = w * OSPFS_WORDBITS;
+		if (b < first)
+			word &= ~0UL << (first - b);
+		if (b + OSPFS_WORDBITS > nblocks)
+			word &= ~0UL >> (b + OSPFS_WORDBITS - nblocks);
+		ospfs_alloc.group_nfree[b / OSPFS_BLKBITSIZE] += hweight_long(word);
+		ospfs_alloc.nfree += hweight_long(word);
+	}
+	ospfs_alloc.cursor = first;
+	ospfs_alloc.ready = 1;
+}
+
+
+// ospfs_nfree()
+//	Returns the number of free blocks on the disk.
+
+static uint32_t
+ospfs_nfree(void)
+{
+	if (!ospfs_alloc.ready)
+		ospfs_alloc_init();
+	return ospfs_alloc.nfree;
+}
+
+
+// ospfs_bitmap_scan(from, to)
+//	Returns the number of the first free block in [from, to), or 0 if
+//	there is none.
+
+static uint32_t
+ospfs_bitmap_scan(uint32_t from, uint32_t to)
+{
+	const unsigned long *bitmap = ospfs_block(OSPFS_FREEMAP_BLK);
+	uint32_t b = from;
+
+	while (b < to) {
+		uint32_t group_end = (b / OSPFS_BLKBITSIZE + 1) * OSPFS_BLKBITSIZE;
+
+		if (ospfs_alloc.group_nfree[b / OSPFS_BLKBITSIZE] == 0) {
+			b = group_end;
+			continue;
+		}
+		if (group_end > to)
+			group_end = to;
+		while (b < group_end) {
+			uint32_t wordb = b - b % OSPFS_WORDBITS;
+			unsigned long word = bitmap[b / OSPFS_WORDBITS]
+				& (~0UL << (b % OSPFS_WORDBITS));
+			if (word) {
+				b = wordb + __ffs(word);
+				return b < to ? b : 0;
+			}
+			b = wordb + OSPFS_WORDBITS;
+		}
+	}
+	return 0;
+}
+
+
+// ospfs_bitmap_run(start, max)
+//	Returns the number of free blocks in a row starting at block 'start',
+//	counting at most 'max'.
+
+static uint32_t
+ospfs_bitmap_run(uint32_t start, uint32_t max)
+{
+	const unsigned long *bitmap = ospfs_block(OSPFS_FREEMAP_BLK);
+	uint32_t end = start + max, b = start;
+
+	if (end > ospfs_super->os_nblocks)
+		end = ospfs_super->os_nblocks;
+	while (b < end) {
+		// Set bits in 'used' are allocated blocks at or after b.
+		unsigned long used = ~bitmap[b / OSPFS_WORDBITS]
+			>> (b % OSPFS_WORDBITS);
+		if (used) {
+			b += __ffs(used);
+			break;
+		}
+		b = b - b % OSPFS_WORDBITS + OSPFS_WORDBITS;
+	}
+	return (b < end ? b : end) - start;
+}
+
+
+// ospfs_allocate_run(goal, max, count_store)
+//	Allocates up to 'max' consecutive blocks.
+//
+//   Inputs:  goal	  -- where to start looking, or 0 for the cursor
+//	      max	  -- the most blocks to allocate
+//	      count_store -- set to the number of blocks allocated
+//   Returns: the number of the first block allocated,
+//	      or 0 if the disk is full
+//
+//   Takes the first free block at or after 'goal', wrapping around to the
+//   first data block, and as many free blocks right after it as it can,
+//   up to 'max'.  The blocks themselves are not touched.  The cursor moves
+//   to the block after the run.
+
+static uint32_t
+ospfs_allocate_run(uint32_t goal, uint32_t max, uint32_t *count_store)
+{
+	void *bitmap = ospfs_block(OSPFS_FREEMAP_BLK);
+	uint32_t first = ospfs_first_datab();
+	uint32_t nblocks = ospfs_super->os_nblocks;
+	uint32_t blockno, count, b;
+
+	if (!ospfs_alloc.ready)
+		ospfs_alloc_init();
+	if (goal < first || goal >= nblocks)
+		goal = ospfs_alloc.cursor;
+	if (goal < first || goal >= nblocks)
+		goal = first;
+
+	blockno = ospfs_bitmap_scan(goal, nblocks);
+	if (!blockno)
+		blockno = ospfs_bitmap_scan(first, goal);
+	if (!blockno)
+		return 0;
+
+	count = ospfs_bitmap_run(blockno, max);
+	for (b = blockno; b < blockno + count; b++) {
+		bitvector_clear(bitmap, b);
+		ospfs_alloc.group_nfree[b / OSPFS_BLKBITSIZE]--;
+	}
+	ospfs_alloc.nfree -= count;
+	ospfs_alloc.cursor = blockno + count;
+	*count_store = count;
+	return blockno;
+}
+
+
+// allocate_block()
+//	Use this function to allocate a block.
+//
+//   Inputs:  none
+//   Returns: block number of the allocated block,
+//	      or 0 if the disk is full
+//
+//   This function searches the free-block bitmap, which starts at Block 2, for
+//   a free block, allocates it (by marking it non-free), and returns the block
+//   number to the caller.  The block itself is not touched.  The search
+//   starts at the cursor and wraps around to the first data block.
+//
+//   Note:  A value of 0 for a bit indicates the corresponding block is
+//      allocated; a value of 1 indicates the corresponding block is free.
+
+static uint32_t
+allocate_block(void)
+{
+	uint32_t count;
+	return ospfs_allocate_run(0, 1, &count);
+}
+
+
+// free_block(blockno)
+//	Use this function to free an allocated block.
+//
+//   Inputs:  blockno -- the block number to be freed
+//   Returns: none
+//
+//   This function marks the named block as free in the free-block bitmap.
+//   The boot sector, superblock, free-block bitmap, and inode blocks are
+//   never freed, so a bogus block number for one of them is ignored, as is
+//   a block that is already free.
+
+static void
+free_block(uint32_t blockno)
+{
+	void *bitmap = ospfs_block(OSPFS_FREEMAP_BLK);
+
+	if (blockno < ospfs_first_datab() || blockno >= ospfs_super->os_nblocks
+	    || bitvector_test(bitmap, blockno))
+		return;
+	bitvector_set(bitmap, blockno);
+	if (ospfs_alloc.ready) {
+		ospfs_alloc.group_nfree[blockno / OSPFS_BLKBITSIZE]++;
+		ospfs_alloc.nfree++;
+	}
+}
+
+
+// ospfs_free_run(start, count)
+//	Frees the 'count' blocks starting at block 'start'.
+
+static void
+ospfs_free_run(uint32_t start, uint32_t count)
+{
+	for (; count > 0; count--, start++)
+		free_block(start);
+}
+
+
+// ospfs_alloc_zeroed_block(goal)
+//	Allocates a block, the first free one at or after 'goal' (0 for the
+//	cursor), and erases it.  Returns its number, or 0 if the disk is
+//	full.
+
+static uint32_t
+ospfs_alloc_zeroed_block(uint32_t goal)
+{
+	uint32_t count;
+	uint32_t blockno = goal ? ospfs_allocate_run(goal, 1, &count)
+		: allocate_block();
+	if (blockno)
+		memset(ospfs_block(blockno), 0, OSPFS_BLKSIZE);
+	return blockno;
+}
+
+
+
+/*****************************************************************************
+ * FILE OPERATIONS
+ *
+ * The *_index, add_blocks, and remove_blocks functions are only there to
+ * support the change_size function.
+ */
+
+// The following functions are used to unpack a block number into its
+// consituent pieces: the doubly indirect block number (if any), the
+// indirect block number (which might be one of many in the doubly indirect
+// block), and the direct block number (which might be one of many in an
+// indirect block).
+
+
+// int32_t indir2_index(uint32_t b)
+//	Returns the doubly-indirect block index for file block b.
+//
+// Inputs:  b -- the zero-based index of the file block (e.g., 0 for the first
+//		 block, 1 for the second, etc.)
+// Returns: 0 if block index 'b' requires using the doubly indirect
+//	       block, -1 if it does not.
+
+static inline int32_t
+indir2_index(uint32_t b)
+{
+	return b >= OSPFS_NDIRECT + OSPFS_NINDIRECT ? 0 : -1;
+}
+
+
+// int32_t indir_index(uint32_t b)
+//	Returns the indirect block index for file block b.
+//
+// Inputs:  b -- the zero-based index of the file block
+// Returns: -1 if b is one of the file's direct blocks;
+//	    0 if b is located under the file's first indirect block;
+//	    otherwise, the offset of the relevant indirect block within
+//		the doubly indirect block.
+
+static inline int32_t
+indir_index(uint32_t b)
+{
+	if (b < OSPFS_NDIRECT)
+		return -1;
+	else if (b < OSPFS_NDIRECT + OSPFS_NINDIRECT)
+		return 0;
+	else
+		return (b - OSPFS_NDIRECT - OSPFS_NINDIRECT) / OSPFS_NINDIRECT;
+}
+
+
+// int32_t direct_index(uint32_t b)
+//	Returns the direct block index for file block b.
+//
+// Inputs:  b -- the zero-based index of the file block
+// Returns: the index of block b in the relevant indirect block or the direct
+//	    block array.
+
+static inline int32_t
+direct_index(uint32_t b)
+{
+	if (b < OSPFS_NDIRECT)
+		return b;
+	else if (b < OSPFS_NDIRECT + OSPFS_NINDIRECT)
+		return b - OSPFS_NDIRECT;
+	else
+		return (b - OSPFS_NDIRECT - OSPFS_NINDIRECT) % OSPFS_NINDIRECT;
+}
+
+
+// ospfs_nindirect_blocks(n)
+//	Returns the number of indirect and doubly indirect blocks a file of
+//	'n' blocks uses.
+
+static inline uint32_t
+ospfs_nindirect_blocks(uint32_t n)
+{
+	if (n <= OSPFS_NDIRECT)
+		return 0;
+	else if (n <= OSPFS_NDIRECT + OSPFS_NINDIRECT)
+		return 1;
+	else	// indirect, indirect^2, and the indirect blocks under it
+		return 2 + (n - OSPFS_NDIRECT - OSPFS_NINDIRECT
+			    + OSPFS_NINDIRECT - 1) / OSPFS_NINDIRECT;
+}
+
+
+// Bumped whenever a file loses blocks, which may free indirect and extent
+// blocks that block-map cursors point into.  See ospfs_cursor_t below.
+static uint32_t ospfs_bmap_gen;
+
+
+// ospfs_block_slot(oi, b)
+//	Returns a pointer to the slot that holds the block number of file
+//	block 'b': in the inode, in the indirect block, or in an indirect
+//	block under the doubly indirect block.  Returns null if an indirect
+//	block it needs is missing.  The slots for the blocks after 'b' follow
+//	it, up to the end of the indirect block (or the direct block array).
+
+static uint32_t *
+ospfs_block_slot(ospfs_inode_t *oi, uint32_t b)
+{
+	uint32_t *indirect2_block;
+
+	if (indir2_index(b) == 0) {
+		if (!oi->oi_indirect2)
+			return 0;
+		indirect2_block = ospfs_block(oi->oi_indirect2);
+		if (!indirect2_block[indir_index(b)])
+			return 0;
+		return (uint32_t *) ospfs_block(indirect2_block[indir_index(b)])
+			+ direct_index(b);
+	} else if (indir_index(b) == 0) {
+		if (!oi->oi_indirect)
+			return 0;
+		return (uint32_t *) ospfs_block(oi->oi_indirect) + direct_index(b);
+	} else
+		return &oi->oi_direct[b];
+}
+
+
+// A batch of allocated, erased blocks that add_blocks hands out in order.
+typedef struct ospfs_batch {
+	uint32_t next;		// Next block to hand out
+	uint32_t count;		// Number of blocks left in this run
+	uint32_t need;		// Number of blocks still to hand out
+} ospfs_batch_t;
+
+// ospfs_batch_take(batch)
+//	Returns the next block in 'batch', allocating another run of up to
+//	'batch->need' blocks when the current run is used up, or 0 if the
+//	disk is full.
+
+static uint32_t
+ospfs_batch_take(ospfs_batch_t *batch)
+{
+	if (batch->count == 0) {
+		batch->next = ospfs_allocate_run(0, batch->need, &batch->count);
+		if (!batch->next)
+			return 0;
+		memset(ospfs_block(batch->next), 0,
+		       batch->count * OSPFS_BLKSIZE);
+	}
+	batch->count--;
+	batch->need--;
+	return batch->next++;
+}
+
+
+// add_blocks(ospfs_inode_t *oi, uint32_t want)
+//   Grows a file to 'want' data blocks, adding indirect and
+//   doubly-indirect blocks if necessary. (Helper function for
+//   change_size).
+//
+//   First works out how many blocks the file needs, data and indirect,
+//   and checks that the disk has that many free.  Then it allocates them
+//   in runs from the bitmap, and fills in the new slots in order,
+//   following slot pointers along each indirect block rather than
+//   looking up each block from the inode.
+//
+// Inputs: oi   -- pointer to the file we want to grow
+//         want -- the number of blocks it should have
+// Returns: 0 if successful, < 0 on error.  Specifically:
+//          -ENOSPC if the disk does not have enough free blocks, or
+//          -EIO for any other error.
+//          If the function is successful, then oi->oi_size
+//          is set to the maximum file size in bytes that could
+//          fit in oi's data blocks.  On -ENOSPC nothing changes.  On
+//          -EIO, oi->oi_size covers the blocks added so far, and every
+//          other block allocated is freed again.  New blocks are erased.
+
+static int
+add_blocks(ospfs_inode_t *oi, uint32_t want)
+{
+	// current number of blocks in file
+	uint32_t n = ospfs_size2nblocks(oi->oi_size);
+	uint32_t b, *slot = 0, *indirect2_block;
+	ospfs_batch_t batch;
+
+	if (want > OSPFS_MAXFILEBLKS)
+		return -ENOSPC;
+	if (want <= n)
+		return 0;
+
+	batch.count = 0;
+	batch.need = want - n
+		+ ospfs_nindirect_blocks(want) - ospfs_nindirect_blocks(n);
+	if (batch.need > ospfs_nfree())
+		return -ENOSPC;
+
+	for (b = n; b < want; b++) {
+		// Find the slot for block b if it is not right after the last
+		// one, first adding the indirect blocks that hold it.
+		if (!slot || b == OSPFS_NDIRECT
+		    || (indir2_index(b) == 0 && direct_index(b) == 0)) {
+			if (b == OSPFS_NDIRECT
+			    && !(oi->oi_indirect = ospfs_batch_take(&batch)))
+				goto error;
+			if (b == OSPFS_NDIRECT + OSPFS_NINDIRECT
+			    && !(oi->oi_indirect2 = ospfs_batch_take(&batch)))
+				goto error;
+			if (indir2_index(b) == 0 && direct_index(b) == 0) {
+				if (!oi->oi_indirect2)
+					goto error;
+				indirect2_block = ospfs_block(oi->oi_indirect2);
+				if (!(indirect2_block[indir_index(b)] =
+				      ospfs_batch_take(&batch)))
+					goto error;
+			}
+			if (!(slot = ospfs_block_slot(oi, b)))
+				goto error;
+		}
+		if (!(*slot++ = ospfs_batch_take(&batch)))
+			goto error;
+		oi->oi_size = (b + 1) * OSPFS_BLKSIZE;
+	}
+	return 0;
+
+    error:
+	// Free the blocks that are not part of the file: the rest of the
+	// batch, and any indirect blocks just added for block b, which
+	// oi_size does not cover.  (free_block ignores block 0.)
+	ospfs_free_run(batch.next, batch.count);
+	if (indir2_index(b) == 0 && direct_index(b) == 0 && oi->oi_indirect2) {
+		indirect2_block = ospfs_block(oi->oi_indirect2);
+		free_block(indirect2_block[indir_index(b)]);
+		indirect2_block[indir_index(b)] = 0;
+	}
+	if (b == OSPFS_NDIRECT + OSPFS_NINDIRECT) {
+		free_block(oi->oi_indirect2);
+		oi->oi_indirect2 = 0;
+	} else if (b == OSPFS_NDIRECT) {
+		free_block(oi->oi_indirect);
+		oi->oi_indirect = 0;
+	}
+	return -EIO;
+}
+
+
+// remove_blocks(ospfs_inode_t *oi, uint32_t want)
+//   Removes data blocks from the end of a file until it has 'want',
+//   freeing any indirect and indirect^2 blocks that are no
+//   longer needed. (Helper function for change_size)
+//
+//   Walks back along the slots of each indirect block in turn, rather
+//   than looking up each block from the inode.
+//
+// Inputs: oi   -- pointer to the file we want to shrink
+//         want -- the number of blocks it should have
+// Returns: 0 if successful, < 0 on error.
+//          oi->oi_size is set to the maximum file size that could
+//          fit in oi's remaining blocks.  If the function returns -EIO
+//          (for instance if an indirect block that should be there
+//          isn't), those are the blocks before the one it could not
+//          find.  Freed block pointers are set to 0.
+
+static int
+remove_blocks(ospfs_inode_t *oi, uint32_t want)
+{
+	// current number of blocks in file
+	uint32_t n = ospfs_size2nblocks(oi->oi_size);
+	uint32_t b, *slot = 0, *indirect2_block;
+
+	if (n > want)
+		ospfs_bmap_gen++;
+	for (b = n; b > want; b--) {
+		// removing block b - 1
+		uint32_t i = b - 1;
+		if (!slot && !(slot = ospfs_block_slot(oi, i)))
+			return -EIO;
+		free_block(*slot);
+		*slot = 0;
+
+		if (indir2_index(i) == 0 && direct_index(i) == 0) {
+			indirect2_block = ospfs_block(oi->oi_indirect2);
+			free_block(indirect2_block[indir_index(i)]);
+			indirect2_block[indir_index(i)] = 0;
+			if (i == OSPFS_NDIRECT + OSPFS_NINDIRECT) {
+				free_block(oi->oi_indirect2);
+				oi->oi_indirect2 = 0;
+			}
+			slot = 0;
+		} else if (i == OSPFS_NDIRECT) {
+			free_block(oi->oi_indirect);
+			oi->oi_indirect = 0;
+			slot = 0;
+		} else
+			slot--;
+		oi->oi_size = i * OSPFS_BLKSIZE;
+	}
+	return 0;
+}
+
+
+// ospfs_extent_room(ei, goal)
+//   Makes room for extent inode 'ei's next extent, allocating the extent
+//   index block and an extent block if it needs them.  They are the first
+//   free blocks at or after 'goal'.  (Helper function for
+//   ospfs_extent_resize.)
+//
+// Returns: 0 if successful, -ENOSPC if an extent block cannot be allocated
+//          or the file has OSPFS_MAXEXTENTS extents already, or -EIO if an
+//          extent block that should be there isn't.
+
+static int
+ospfs_extent_room(ospfs_extent_inode_t *ei, uint32_t goal)
+{
+	uint32_t i = ei->oi_nextents, j, *extindex;
+
+	if (i >= OSPFS_MAXEXTENTS)
+		return -ENOSPC;
+	if (i < OSPFS_NIEXTENTS || (i - OSPFS_NIEXTENTS) % OSPFS_BLKEXTENTS != 0)
+		return 0;
+
+	j = (i - OSPFS_NIEXTENTS) / OSPFS_BLKEXTENTS;
+	if (j == 0 && !ei->oi_extindex) {
+		if (!(ei->oi_extindex = ospfs_alloc_zeroed_block(goal)))
+			return -ENOSPC;
+	} else if (!ei->oi_extindex)
+		return -EIO;
+	extindex = ospfs_block(ei->oi_extindex);
+	if (!extindex[j] && !(extindex[j] = ospfs_alloc_zeroed_block(goal))) {
+		if (j == 0) {
+			free_block(ei->oi_extindex);
+			ei->oi_extindex = 0;
+		}
+		return -ENOSPC;
+	}
+	return 0;
+}
+
+
+// ospfs_extent_unroom(ei)
+//   Frees the extent block that only extent inode 'ei's next extent would
+//   use, if any, and the extent index block if that leaves it empty.
+//   (Helper function for ospfs_extent_resize and ospfs_extent_shrink.)
+
+static void
+ospfs_extent_unroom(ospfs_extent_inode_t *ei)
+{
+	uint32_t i = ei->oi_nextents, j, *extindex;
+
+	if (i < OSPFS_NIEXTENTS || (i - OSPFS_NIEXTENTS) % OSPFS_BLKEXTENTS != 0
+	    || !ei->oi_extindex)
+		return;
+	j = (i - OSPFS_NIEXTENTS) / OSPFS_BLKEXTENTS;
+	extindex = ospfs_block(ei->oi_extindex);
+	free_block(extindex[j]);
+	extindex[j] = 0;
+	if (j == 0) {
+		free_block(ei->oi_extindex);
+		ei->oi_extindex = 0;
+	}
+}
+
+
+// ospfs_extent_append(ei, start, count)
+//   Adds the run of 'count' blocks at 'start' to the end of extent inode
+//   'ei's data, either by lengthening its last extent or as a new extent,
+//   allocating the extent index block and an extent block if the new
+//   extent needs them and ospfs_extent_room has not.  (Helper function
+//   for ospfs_extent_resize.)
+//
+// Returns: 0 if successful, -ENOSPC if an extent block cannot be allocated
+//          or the file has OSPFS_MAXEXTENTS extents already, or -EIO if an
+//          extent block that should be there isn't.  oi_size is unchanged.
+
+static int
+ospfs_extent_append(ospfs_extent_inode_t *ei, uint32_t start, uint32_t count)
+{
+	uint32_t i = ei->oi_nextents;
+	ospfs_extent_t *e;
+	int r;
+
+	if (i > 0) {
+		if (!(e = ospfs_inode_extent(ei, i - 1)))
+			return -EIO;
+		if (e->oe_start + e->oe_count == start) {
+			e->oe_count += count;
+			return 0;
+		}
+	}
+	if ((r = ospfs_extent_room(ei, 0)) < 0)
+		return r;
+
+	if (!(e = ospfs_inode_extent(ei, i)))
+		return -EIO;
+	e->oe_start = start;
+	e->oe_count = count;
+	ei->oi_nextents++;
+	return 0;
+}
+
+
+// ospfs_extent_shrink(ei, have, want)
+//   Frees the blocks of extent inode 'ei' after its first 'want', given
+//   that it has '*have', together with any extent blocks that no longer
+//   hold an extent.  (Helper function for ospfs_extent_resize.)
+//
+// Returns: 0 if successful, or -EIO if an extent block that should be
+//          there isn't.  Either way '*have' is set to the number of blocks
+//          the file has left.  oi_size is unchanged.
+
+static int
+ospfs_extent_shrink(ospfs_extent_inode_t *ei, uint32_t *have, uint32_t want)
+{
+	if (*have > want)
+		ospfs_bmap_gen++;
+	while (*have > want) {
+		uint32_t i = ei->oi_nextents - 1, n;
+		ospfs_extent_t *e;
+
+		if (ei->oi_nextents == 0 || !(e = ospfs_inode_extent(ei, i)))
+			return -EIO;
+		n = e->oe_count < *have - want ? e->oe_count : *have - want;
+		ospfs_free_run(e->oe_start + e->oe_count - n, n);
+		e->oe_count -= n;
+		*have -= n;
+		if (e->oe_count > 0)
+			continue;
+
+		e->oe_start = 0;
+		ei->oi_nextents = i;
+		ospfs_extent_unroom(ei);
+	}
+	return 0;
+}
+
+
+// ospfs_extent_resize(ei, want)
+//   Grows or shrinks extent inode 'ei' to 'want' blocks.  (Helper
+//   function for change_size.)
+//
+//   A file grows a run at a time: each step asks the allocator for all the
+//   blocks still needed, starting right after the file's last block, and
+//   takes as many consecutive free blocks as it finds there (or at the
+//   next free block).  Runs that continue the last extent lengthen it.
+//   A run that starts a new extent may need a new extent block.  That is
+//   allocated before the run, so that it does not take the block right
+//   after the run, where the file's next run should go.
+//
+// Returns: 0 if successful, -ENOSPC if the disk (or the file's extent
+//          list) is full, or -EIO if an extent block that should be there
+//          isn't.  A file that needs more data blocks than are free gets
+//          -ENOSPC before anything is allocated.  oi_size is set to the
+//          number of bytes that fit in the file's blocks.  On -ENOSPC the
+//          file keeps the blocks it had.  New blocks are erased.
+
+static int
+ospfs_extent_resize(ospfs_extent_inode_t *ei, uint32_t want)
+{
+	uint32_t old = ospfs_size2nblocks(ei->oi_size), have = old;
+	int r = 0;
+
+	if (want > OSPFS_MAXFILEBLKS
+	    || (want > have && want - have > ospfs_nfree()))
+		return -ENOSPC;
+
+	while (have < want) {
+		uint32_t goal = 0, start, count;
+		ospfs_extent_t *e;
+
+		if (ei->oi_nextents > 0
+		    && (e = ospfs_inode_extent(ei, ei->oi_nextents - 1)))
+			goal = e->oe_start + e->oe_count;
+		if (ospfs_bitmap_run(goal, 1) == 0
+		    && (r = ospfs_extent_room(ei, goal)) < 0)
+			break;
+		if (!(start = ospfs_allocate_run(goal, want - have, &count))) {
+			ospfs_extent_unroom(ei);
+			r = -ENOSPC;
+			break;
+		}
+		if ((r = ospfs_extent_append(ei, start, count)) < 0) {
+			ospfs_free_run(start, count);
+			break;
+		}
+		memset(ospfs_block(start), 0, count * OSPFS_BLKSIZE);
+		have += count;
+	}
+
+	if (r < 0)
+		ospfs_extent_shrink(ei, &have, old);
+	else
+		r = ospfs_extent_shrink(ei, &have, want);
+	ei->oi_size = have * OSPFS_BLKSIZE;
+	return r;
+}
+
+
+// change_size(oi, want_size)
+//	Use this function to change a file's size, allocating and freeing
+//	blocks as necessary.
+//
+//   Inputs:  oi	-- pointer to the file whose size we're changing
+//	      want_size -- the requested size in bytes
+//   Returns: 0 on success, < 0 on error.  In particular:
+//		-ENOSPC: if there are no free blocks available
+//		-EIO:    an I/O error -- for example an indirect block should
+//			 exist, but doesn't
+//	      If the function succeeds, the file's oi_size member is
+//	      changed to want_size, with blocks allocated as appropriate.
+//	      The file reads as zeroes between its old and new sizes.
+//	      If there is an -ENOSPC error when growing a file,
+//	      the file size and allocated blocks do not change from their
+//	      original values.
+//
+//   Files grow with add_blocks, which allocates all the blocks needed in
+//   one go, and shrink with remove_blocks, which frees the blocks past
+//   the new end in one pass.  Extent-mapped files grow and shrink a run
+//   at a time with ospfs_extent_resize.
+
+static int
+change_size(ospfs_inode_t *oi, uint32_t new_size)
+{
+	uint32_t old_size = oi->oi_size;
+	uint32_t old_nblocks = ospfs_size2nblocks(old_size);
+	uint32_t new_nblocks = ospfs_size2nblocks(new_size);
+	int r = 0;
+
+	if (ospfs_extent_mapped(oi))
+		r = ospfs_extent_resize((ospfs_extent_inode_t *) oi,
+					new_nblocks);
+	else if (new_nblocks > old_nblocks) {
+		if ((r = add_blocks(oi, new_nblocks)) == -EIO)
+			remove_blocks(oi, old_nblocks);
+	} else
+		r = remove_blocks(oi, new_nblocks);
+	if (r < 0) {
+		if (new_nblocks > old_nblocks)
+			oi->oi_size = old_size;
+		return r;
+	}
+
+	// Blocks that add_blocks allocated are already erased, but the end of
+	// the old last block may hold data from before an earlier shrink.
+	if (new_size > old_size && old_size % OSPFS_BLKSIZE != 0) {
+		uint32_t end = old_size - old_size % OSPFS_BLKSIZE + OSPFS_BLKSIZE;
+		if (end > new_size)
+			end = new_size;
+		oi->oi_size = new_size;
+		memset(ospfs_inode_data(oi, old_size), 0, end - old_size);
+	}
+
+	oi->oi_size = new_size;
+	return 0;
+}
+
+
+// Block-map cursors.  Finding the block number of a file block from
+// scratch means reading the inode and up to two indirect blocks, or
+// walking the file's extents from the first one.  Reads and writes look
+// blocks up through a cursor instead, which remembers where the last
+// lookup ended: the slot that held the block number, or the extent that
+// held the block.  The next lookup in the same indirect block, or in the
+// same or a later extent, starts from there, so sequential I/O finds each
+// block in constant time.  Each open file has its own cursor.
+//
+// A cursor also tells how many of the following blocks come right after
+// the one it found on disk, so that reads and writes can copy a run of
+// adjacent blocks at once.
+//
+// A cursor belongs to one inode and is reset when used with another.
+// Shrinking a file can free the blocks a cursor points into, so cursors
+// set before ospfs_bmap_gen last changed are reset too.
+
+typedef struct ospfs_cursor {
+	uint32_t c_ino;			// Inode number (0 if not set)
+	uint32_t c_gen;			// ospfs_bmap_gen when set
+	uint32_t c_b;			// File block of the last lookup
+	uint32_t *c_slot;		// Block-mapped files: c_b's slot
+	uint32_t c_ext;			// Extent-mapped files: extent that
+	uint32_t c_ext_b;		// holds c_b, and its first file block
+} ospfs_cursor_t;
+
+
+// ospfs_slot_group(b)
+//	Returns which array of slots holds file block 'b's block number:
+//	-1 for the direct blocks, 0 for the indirect block, and 1 + i for the
+//	i'th indirect block under the doubly indirect block.
+
+static inline int32_t
+ospfs_slot_group(uint32_t b)
+{
+	return indir2_index(b) == 0 ? 1 + indir_index(b) : indir_index(b);
+}
+
+
+// ospfs_cursor_blockno(oi, cursor, b, max, run_store)
+//	Looks up file block 'b' of 'oi' using 'cursor', and moves the cursor
+//	there.
+//
+//   Inputs:  oi	-- the file's inode
+//	      cursor	-- the cursor
+//	      b		-- a file block number
+//	      max	-- the most blocks the caller wants, counting 'b'
+//	      run_store	-- set to the number of blocks from 'b' on, at most
+//			   'max', that are in consecutive blocks on disk
+//   Returns: the block number of file block 'b', or 0 if the file has no
+//	      such block (or an indirect block that should be there isn't)
+
+static uint32_t
+ospfs_cursor_blockno(ospfs_inode_t *oi, ospfs_cursor_t *cursor, uint32_t b,
+		     uint32_t max, uint32_t *run_store)
+{
+	uint32_t nblocks = ospfs_size2nblocks(oi->oi_size);
+	uint32_t ino = ospfs_inode_ino(oi), blockno, run;
+
+	if (b >= nblocks || oi->oi_ftype == OSPFS_FTYPE_SYMLINK)
+		return 0;
+	if (max > nblocks - b)
+		max = nblocks - b;
+	if (cursor->c_ino != ino || cursor->c_gen != ospfs_bmap_gen) {
+		memset(cursor, 0, sizeof(*cursor));
+		cursor->c_ino = ino;
+		cursor->c_gen = ospfs_bmap_gen;
+	}
+
+	if (ospfs_extent_mapped(oi)) {
+		ospfs_extent_inode_t *ei = (ospfs_extent_inode_t *) oi;
+		ospfs_extent_t *e;
+
+		if (b < cursor->c_ext_b)
+			cursor->c_ext = cursor->c_ext_b = 0;
+		while (1) {
+			if (cursor->c_ext >= ei->oi_nextents
+			    || !(e = ospfs_inode_extent(ei, cursor->c_ext))) {
+				cursor->c_ext = cursor->c_ext_b = 0;
+				return 0;
+			}
+			if (b - cursor->c_ext_b < e->oe_count)
+				break;
+			cursor->c_ext_b += e->oe_count;
+			cursor->c_ext++;
+		}
+		blockno = e->oe_start + (b - cursor->c_ext_b);
+		run = cursor->c_ext_b + e->oe_count - b;
+
+	} else {
+		uint32_t nslots = b < OSPFS_NDIRECT ? OSPFS_NDIRECT : OSPFS_NINDIRECT;
+
+		if (cursor->c_slot
+		    && ospfs_slot_group(b) == ospfs_slot_group(cursor->c_b))
+			cursor->c_slot += direct_index(b) - direct_index(cursor->c_b);
+		else if (!(cursor->c_slot = ospfs_block_slot(oi, b)))
+			return 0;
+		blockno = *cursor->c_slot;
+		for (run = 1; run < max && direct_index(b) + run < nslots
+			     && cursor->c_slot[run] == blockno + run; run++)
+			/* do nothing */;
+	}
+
+	cursor->c_b = b;
+	*run_store = run < max ? run : max;
+	return blockno;
+}
+
+
+// ospfs_file_read(oi, cursor, buffer, count, f_pos)
+//	Reads data from a file: the body of the read() system call.
+//
+//   Inputs:  oi	-- the file's inode
+//            cursor    -- the open file's block-map cursor, or null
+//            buffer    -- a user space ptr where data should be copied
+//            count     -- the amount of data requested
+//            f_pos     -- points to the file position
+//   Returns: Number of chars read on success, -(error code) on error.
+//
+//   Copies the file's bytes starting at '*f_pos' into 'buffer', never past
+//   the end of the file, and advances '*f_pos'.  Copies each run of
+//   blocks that are next to each other on disk at once.
+
+static ssize_t
+ospfs_file_read(ospfs_inode_t *oi, ospfs_cursor_t *cursor,
+		char __user *buffer, size_t count, loff_t *f_pos)
+{
+	ospfs_cursor_t local_cursor;
+	int retval = 0;
+	size_t amount = 0;
+
+	if (!cursor) {
+		local_cursor.c_ino = 0;
+		cursor = &local_cursor;
+	}
+
+	// Make sure we don't read past the end of the file!
+	if (*f_pos >= oi->oi_size)
+		count = 0;
+	else if (count > oi->oi_size - *f_pos)
+		count = oi->oi_size - *f_pos;
+
+	// Copy the data to user run by run
+	while (amount < count && retval >= 0) {
+		uint32_t blkoff = *f_pos % OSPFS_BLKSIZE, run, n;
+		uint32_t blockno = ospfs_cursor_blockno(oi, cursor,
+			*f_pos / OSPFS_BLKSIZE,
+			ospfs_size2nblocks(blkoff + count - amount), &run);
+		char *data;
+
+		// ospfs_cursor_blockno returns 0 on error
+		if (blockno == 0) {
+			retval = -EIO;
+			goto done;
+		}
+
+		data = ospfs_block(blockno);
+
+		// Copy up to the end of this run, or of the request.
+		n = run * OSPFS_BLKSIZE - blkoff;
+		if (n > count - amount)
+			n = count - amount;
+		if (copy_to_user(buffer, data + blkoff, n)) {
+			retval = -EFAULT;
+			goto done;
+		}
+
+		buffer += n;
+		amount += n;
+		*f_pos += n;
+	}
+
+    done:
+	return (retval >= 0 ? amount : retval);
+}
+
+
+// ospfs_file_write(oi, cursor, buffer, count, f_pos)
+//	Writes data to a file: the body of the write() system call.
+//
+//   Inputs:  oi	-- the file's inode
+//            cursor    -- the open file's block-map cursor, or null
+//            buffer    -- a user space ptr where data should be copied from
+//            count     -- the amount of data to write
+//            f_pos     -- points to the file position
+//   Returns: Number of chars written on success, -(error code) on error.
+//
+//   Copies 'buffer' into the file starting at '*f_pos' and advances
+//   '*f_pos'.  Writing past the end of the file grows the file.  (The
+//   caller handles O_APPEND by moving '*f_pos' to the end first.)  Like
+//   ospfs_file_read, copies a run of adjacent blocks at once.
+
+static ssize_t
+ospfs_file_write(ospfs_inode_t *oi, ospfs_cursor_t *cursor,
+		 const char __user *buffer, size_t count, loff_t *f_pos)
+{
+	ospfs_cursor_t local_cursor;
+	int retval = 0;
+	size_t amount = 0;
+
+	if (!cursor) {
+		local_cursor.c_ino = 0;
+		cursor = &local_cursor;
+	}
+
+	// If the user is writing past the end of the file, change the file's
+	// size to accomodate the request.
+	if (*f_pos + count > OSPFS_MAXFILESIZE)
+		return -EFBIG;
+	if (*f_pos + count > oi->oi_size
+	    && (retval = change_size(oi, *f_pos + count)) < 0)
+		return retval;
+
+	// Copy data run by run
+	while (amount < count && retval >= 0) {
+		uint32_t blkoff = *f_pos % OSPFS_BLKSIZE, run, n;
+		uint32_t blockno = ospfs_cursor_blockno(oi, cursor,
+			*f_pos / OSPFS_BLKSIZE,
+			ospfs_size2nblocks(blkoff + count - amount), &run);
+		char *data;
+
+		if (blockno == 0) {
+			retval = -EIO;
+			goto done;
+		}
+
+		data = ospfs_block(blockno);
+
+		// Copy up to the end of this run, or of the request.
+		n = run * OSPFS_BLKSIZE - blkoff;
+		if (n > count - amount)
+			n = count - amount;
+		if (copy_from_user(data + blkoff, buffer, n)) {
+			retval = -EFAULT;
+			goto done;
+		}
+
+		buffer += n;
+		amount += n;
+		*f_pos += n;
+	}
+
+    done:
+	return (retval >= 0 ? amount : retval);
+}
+
+
+
+/*****************************************************************************
+ * DIRECTORY INDEX
+ *
+ *   The hash table behind find_direntry on images with
+ *   OSPFS_FEATURE_DIRINDEX; see ospfs.h for its format.  Entries are added
+ *   and removed along with the directory entries they point to.  If the
+ *   table cannot grow because the disk is full, it is used as it is while
+ *   it has room; once it is full it is dropped, and directories are
+ *   scanned until there is room to build it again.  The image keeps the
+ *   feature either way.
+ */
+
+// ospfs_alloc_inode()
+//	Finds a free inode (one with no links).  Returns its number, or 0 if
+//	every inode is in use.  The inode is not marked as used.
+//
+//	The search starts after the inode found last time, and wraps around,
+//	so creating many files does not rescan the inodes in use each time.
+
+static uint32_t ospfs_next_ino;
+
+static uint32_t
+ospfs_alloc_inode(void)
+{
+	uint32_t ninodes = ospfs_super->os_ninodes, ino, i;
+
+	if (ospfs_next_ino <= OSPFS_ROOT_INO || ospfs_next_ino >= ninodes)
+		ospfs_next_ino = OSPFS_ROOT_INO + 1;
+	for (i = OSPFS_ROOT_INO + 1, ino = ospfs_next_ino; i < ninodes; i++) {
+		if (ospfs_inode(ino)->oi_nlink == 0) {
+			ospfs_next_ino = ino + 1;
+			return ino;
+		}
+		if (++ino == ninodes)
+			ino = OSPFS_ROOT_INO + 1;
+	}
+	return 0;
+}
+
+
+// ospfs_dirindex_hash(dir_ino, name, namelen)
+//	Returns the index hash of the name 'name' (length 'namelen') in the
+//	directory 'dir_ino'.
+
+static inline uint32_t
+ospfs_dirindex_hash(uint32_t dir_ino, const char *name, int namelen)
+{
+	uint32_t h = 2166136261U ^ (dir_ino * 0x9E3779B1U);
+	int i;
+	for (i = 0; i < namelen; i++)
+		h = (h ^ (uint8_t) name[i]) * 16777619U;
+	h ^= h >> 16;
+	h *= 0x85EBCA6BU;
+	return h ^ (h >> 13);
+}
+
+
+// On extent images, where the directory index's extents start in the
+// file, so that a slot's block is found by binary search rather than by
+// walking the extents from the first on every probe.  (Block-mapped
+// files find any block in constant time already.)  Built on first use,
+// and again when the index inode, its size, or ospfs_bmap_gen changes.
+static struct {
+	uint32_t ino;			// Index inode (0 if not built)
+	uint32_t gen;			// ospfs_bmap_gen when built
+	uint32_t size;			// Index size when built
+	uint32_t nruns;			// Number of extents
+	struct {
+		uint32_t b;		// First file block of the extent
+		uint32_t start;		// Its block number
+	} *run;
+} ospfs_dirindex_map;
+
+
+// ospfs_dirindex_map_ready(oi)
+//	Returns 1 if ospfs_dirindex_map describes the extent-mapped index
+//	'oi', building it if necessary, or 0 if it could not be built.
+
+static int
+ospfs_dirindex_map_ready(ospfs_inode_t *oi)
+{
+	ospfs_extent_inode_t *ei = (ospfs_extent_inode_t *) oi;
+	uint32_t ino = ospfs_inode_ino(oi), i, b = 0;
+
+	if (ospfs_dirindex_map.ino == ino
+	    && ospfs_dirindex_map.gen == ospfs_bmap_gen
+	    && ospfs_dirindex_map.size == oi->oi_size)
+		return 1;
+
+	ospfs_dirindex_map.ino = 0;
+	kfree(ospfs_dirindex_map.run);
+	ospfs_dirindex_map.run = kmalloc(ei->oi_nextents
+					 * sizeof(*ospfs_dirindex_map.run),
+					 GFP_KERNEL);
+	if (!ospfs_dirindex_map.run)
+		return 0;
+	for (i = 0; i < ei->oi_nextents; i++) {
+		ospfs_extent_t *e = ospfs_inode_extent(ei, i);
+		if (!e)
+			return 0;
+		ospfs_dirindex_map.run[i].b = b;
+		ospfs_dirindex_map.run[i].start = e->oe_start;
+		b += e->oe_count;
+	}
+	ospfs_dirindex_map.ino = ino;
+	ospfs_dirindex_map.gen = ospfs_bmap_gen;
+	ospfs_dirindex_map.size = oi->oi_size;
+	ospfs_dirindex_map.nruns = ei->oi_nextents;
+	return 1;
+}
+
+
+// ospfs_dirindex_forget()
+//	Frees ospfs_dirindex_map.  Call when done with an image.
+
+static void
+ospfs_dirindex_forget(void)
+{
+	kfree(ospfs_dirindex_map.run);
+	memset(&ospfs_dirindex_map, 0, sizeof(ospfs_dirindex_map));
+}
+
+
+// ospfs_dirindex_slot(i)
+//	Returns a pointer to slot 'i' of the directory index.
+
+static ospfs_dirindex_slot_t *
+ospfs_dirindex_slot(uint32_t i)
+{
+	ospfs_inode_t *oi = ospfs_inode(ospfs_super->os_dirindex);
+	uint32_t off = i * OSPFS_DIRINDEX_SLOTSIZE;
+	uint32_t b = off / OSPFS_BLKSIZE, lo = 0, hi, mid;
+
+	if (!ospfs_extent_mapped(oi) || !ospfs_dirindex_map_ready(oi))
+		return ospfs_inode_data(oi, off);
+
+	// Find the last extent that starts at or before block 'b'.
+	hi = ospfs_dirindex_map.nruns;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (ospfs_dirindex_map.run[mid].b <= b)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return (ospfs_dirindex_slot_t *)
+		((char *) ospfs_block(ospfs_dirindex_map.run[lo].start
+				      + b - ospfs_dirindex_map.run[lo].b)
+		 + off % OSPFS_BLKSIZE);
+}
+
+
+// ospfs_dirindex_insert(dir_ino, hash, off)
+//	Adds the entry at offset 'off' in directory 'dir_ino', whose hash is
+//	'hash', to the index.  There must be a free slot.
+
+static void
+ospfs_dirindex_insert(uint32_t dir_ino, uint32_t hash, uint32_t off)
+{
+	uint32_t mask = ospfs_super->os_dirindex_nslots - 1;
+	uint32_t i = hash & mask;
+	ospfs_dirindex_slot_t *s;
+
+	while ((s = ospfs_dirindex_slot(i))->ds_dir)
+		i = (i + 1) & mask;
+	s->ds_dir = dir_ino;
+	s->ds_hash = hash;
+	s->ds_off = off;
+	ospfs_super->os_dirindex_count++;
+}
+
+
+// ospfs_dirindex_free(ino)
+//	Frees the index inode 'ino' and its blocks.
+
+static void
+ospfs_dirindex_free(uint32_t ino)
+{
+	ospfs_inode_t *oi = ospfs_inode(ino);
+	if (ino && oi) {
+		change_size(oi, 0);
+		oi->oi_nlink = 0;
+	}
+}
+
+
+// ospfs_dirindex_build(nslots)
+//	Builds the directory index with 'nslots' slots from the entries of
+//	every directory.  An existing index is grown and refilled in place,
+//	so only the first build needs a free inode.  Returns 0 on success or
+//	-ENOSPC if there is no room for it; an existing index is then left
+//	as it was.
+
+static int
+ospfs_dirindex_build(uint32_t nslots)
+{
+	uint32_t ino = ospfs_super->os_dirindex;
+	uint32_t dir_ino, off, old_size;
+	ospfs_inode_t *oi;
+	int r;
+
+	if (nslots > OSPFS_MAXFILESIZE / OSPFS_DIRINDEX_SLOTSIZE)
+		return -ENOSPC;
+	if (!ino) {
+		if (!(ino = ospfs_alloc_inode()))
+			return -ENOSPC;
+		oi = ospfs_inode(ino);
+		memset(oi, 0, sizeof(*oi));
+		oi->oi_ftype = OSPFS_FTYPE_REG;
+		oi->oi_nlink = 1;
+	} else
+		oi = ospfs_inode(ino);
+
+	// change_size erases the new blocks, so only the old slots need
+	// emptying.  (Slots fill whole blocks.)
+	old_size = oi->oi_size;
+	if ((r = change_size(oi, nslots * OSPFS_DIRINDEX_SLOTSIZE)) < 0) {
+		if (!ospfs_super->os_dirindex)
+			oi->oi_nlink = 0;
+		return r;
+	}
+	for (off = 0; off < old_size; off += OSPFS_BLKSIZE)
+		memset(ospfs_dirindex_slot(off / OSPFS_DIRINDEX_SLOTSIZE), 0,
+		       OSPFS_BLKSIZE);
+
+	ospfs_super->os_dirindex = ino;
+	ospfs_super->os_dirindex_nslots = nslots;
+	ospfs_super->os_dirindex_count = 0;
+	for (dir_ino = OSPFS_ROOT_INO; dir_ino < ospfs_super->os_ninodes; dir_ino++) {
+		ospfs_inode_t *dir_oi = ospfs_inode(dir_ino);
+		if (dir_oi->oi_nlink == 0 || dir_oi->oi_ftype != OSPFS_FTYPE_DIR)
+			continue;
+		for (off = 0; off < dir_oi->oi_size; off += OSPFS_DIRENTRY_SIZE) {
+			ospfs_direntry_t *od = ospfs_inode_data(dir_oi, off);
+			if (od->od_ino)
+				ospfs_dirindex_insert(dir_ino,
+					ospfs_dirindex_hash(dir_ino, od->od_name,
+							    strlen(od->od_name)),
+					off);
+		}
+	}
+	return 0;
+}
+
+
+// While there is no directory index because there was no room for one,
+// the number of free blocks there must be before building it is worth
+// trying again.  Freeing an inode resets it, since the build may have
+// failed for want of an inode.
+static uint32_t ospfs_dirindex_wait;
+
+
+// ospfs_dirindex_ready(nextra)
+//	Returns 1 if directory lookups should use the index, which then has
+//	room for 'nextra' more entries, or 0 if they should scan.  Builds or
+//	grows the index as needed.  Running out of space only makes this
+//	call (and later ones, until space is freed) scan.
+
+static int
+ospfs_dirindex_ready(uint32_t nextra)
+{
+	uint32_t nslots = ospfs_super->os_dirindex_nslots;
+	uint32_t need;
+
+	if (!(ospfs_super->os_features & OSPFS_FEATURE_DIRINDEX))
+		return 0;
+	if (ospfs_super->os_dirindex
+	    && 2 * (ospfs_super->os_dirindex_count + nextra) <= nslots)
+		return 1;
+
+	// Count the entries to size a new index.
+	if (!ospfs_super->os_dirindex) {
+		uint32_t dir_ino, off;
+		if (ospfs_nfree() < ospfs_dirindex_wait)
+			return 0;
+		ospfs_super->os_dirindex_count = 0;
+		for (dir_ino = OSPFS_ROOT_INO; dir_ino < ospfs_super->os_ninodes; dir_ino++) {
+			ospfs_inode_t *dir_oi = ospfs_inode(dir_ino);
+			if (dir_oi->oi_nlink == 0 || dir_oi->oi_ftype != OSPFS_FTYPE_DIR)
+				continue;
+			for (off = 0; off < dir_oi->oi_size; off += OSPFS_DIRENTRY_SIZE)
+				if (((ospfs_direntry_t *) ospfs_inode_data(dir_oi, off))->od_ino)
+					ospfs_super->os_dirindex_count++;
+		}
+		nslots = 64;
+	}
+	need = 2 * (ospfs_super->os_dirindex_count + nextra);
+	while (nslots < need)
+		nslots *= 2;
+
+	if (ospfs_dirindex_build(nslots) == 0)
+		return 1;
+
+	// The index could not grow.  Linear probing still works while an
+	// empty slot is left, just with longer probes.
+	if (ospfs_super->os_dirindex
+	    && ospfs_super->os_dirindex_count + nextra
+	       < ospfs_super->os_dirindex_nslots)
+		return 1;
+	if (ospfs_super->os_dirindex) {
+		eprintk("ospfs: disk full, dropping the directory index\n");
+		ospfs_dirindex_free(ospfs_super->os_dirindex);
+		ospfs_super->os_dirindex = 0;
+		ospfs_super->os_dirindex_nslots = 0;
+		ospfs_super->os_dirindex_count = 0;
+	}
+	ospfs_dirindex_wait = ospfs_nfree() + 1;
+	return 0;
+}
+
+
+// ospfs_dirindex_find(dir_oi, name, namelen, off_store)
+//	Looks 'name' up in the index.  Returns its directory entry and stores
+//	its offset in '*off_store', or returns NULL if there is no such entry.
+
+static ospfs_direntry_t *
+ospfs_dirindex_find(ospfs_inode_t *dir_oi, const char *name, int namelen,
+		    uint32_t *off_store)
+{
+	uint32_t dir_ino = ospfs_inode_ino(dir_oi);
+	uint32_t hash = ospfs_dirindex_hash(dir_ino, name, namelen);
+	uint32_t mask = ospfs_super->os_dirindex_nslots - 1;
+	uint32_t i = hash & mask;
+	ospfs_dirindex_slot_t *s;
+
+	while ((s = ospfs_dirindex_slot(i))->ds_dir) {
+		if (s->ds_dir == dir_ino && s->ds_hash == hash
+		    && s->ds_off < dir_oi->oi_size) {
+			ospfs_direntry_t *od = ospfs_inode_data(dir_oi, s->ds_off);
+			if (od->od_ino
+			    && strlen(od->od_name) == namelen
+			    && memcmp(od->od_name, name, namelen) == 0) {
+				*off_store = s->ds_off;
+				return od;
+			}
+		}
+		i = (i + 1) & mask;
+	}
+	return 0;
+}
+
+
+// ospfs_dirindex_remove(dir_ino, hash, off)
+//	Removes the entry at offset 'off' in directory 'dir_ino', whose hash
+//	is 'hash', from the index.  Entries after it that hashed to an
+//	earlier slot move back, so every entry stays reachable from its
+//	hash's slot without crossing an empty slot.
+
+static void
+ospfs_dirindex_remove(uint32_t dir_ino, uint32_t hash, uint32_t off)
+{
+	uint32_t mask = ospfs_super->os_dirindex_nslots - 1;
+	uint32_t i = hash & mask, j, home;
+	ospfs_dirindex_slot_t *s;
+
+	while ((s = ospfs_dirindex_slot(i))->ds_dir) {
+		if (s->ds_dir == dir_ino && s->ds_off == off)
+			break;
+		i = (i + 1) & mask;
+	}
+	if (!s->ds_dir)
+		return;
+
+	for (j = (i + 1) & mask; ospfs_dirindex_slot(j)->ds_dir; j = (j + 1) & mask) {
+		home = ospfs_dirindex_slot(j)->ds_hash & mask;
+		// Leave the entry at 'j' if its slot is in (i, j].
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+		*ospfs_dirindex_slot(i) = *ospfs_dirindex_slot(j);
+		i = j;
+	}
+	ospfs_dirindex_slot(i)->ds_dir = 0;
+	ospfs_super->os_dirindex_count--;
+}
+
+
+
+/*****************************************************************************
+ * DIRECTORY ENTRIES
+ */
+
+// Where the last search for a blank entry left off: every entry before
+// offset 'off' in directory 'dir' is in use.  Adding many files to one
+// directory would otherwise rescan all of its entries each time.
+static struct {
+	uint32_t dir;
+	uint32_t off;
+} ospfs_blank_hint;
+
+
+// ospfs_find_direntry(dir_oi, name, namelen, off_store)
+//	Like find_direntry, but also stores the entry's offset in the
+//	directory in '*off_store'.
+
+static ospfs_direntry_t *
+ospfs_find_direntry(ospfs_inode_t *dir_oi, const char *name, int namelen,
+		    uint32_t *off_store)
+{
+	uint32_t off;
+	if (namelen < 0)
+		namelen = strlen(name);
+	if (ospfs_dirindex_ready(0))
+		return ospfs_dirindex_find(dir_oi, name, namelen, off_store);
+	for (off = 0; off < dir_oi->oi_size; off += OSPFS_DIRENTRY_SIZE) {
+		ospfs_direntry_t *od = ospfs_inode_data(dir_oi, off);
+		if (od->od_ino
+		    && strlen(od->od_name) == namelen
+		    && memcmp(od->od_name, name, namelen) == 0) {
+			*off_store = off;
+			return od;
+		}
+	}
+	return 0;
+}
+
+
+// find_direntry(dir_oi, name, namelen)
+//	Looks through the directory to find an entry with name 'name' (length
+//	in characters 'namelen').  Returns a pointer to the directory entry,
+//	if one exists, or NULL if one does not.  Uses the directory index if
+//	the image has one.
+//
+//   Inputs:  dir_oi  -- the OSP inode for the directory
+//	      name    -- name to search for
+//	      namelen -- length of 'name'.  (If -1, then use strlen(name).)
+
+static ospfs_direntry_t *
+find_direntry(ospfs_inode_t *dir_oi, const char *name, int namelen)
+{
+	uint32_t off;
+	return ospfs_find_direntry(dir_oi, name, namelen, &off);
+}
+
+
+// create_blank_direntry(dir_oi, off_store)
+//	'dir_oi' is an OSP inode for a directory.
+//	Return a blank directory entry in that directory, and store its offset
+//	in '*off_store'.  This might require adding a new block to the
+//	directory.  Returns an error pointer (ERR_PTR(-ENOSPC), say) on
+//	failure.
+
+static ospfs_direntry_t *
+create_blank_direntry(ospfs_inode_t *dir_oi, uint32_t *off_store)
+{
+	uint32_t dir_ino = ospfs_inode_ino(dir_oi);
+	uint32_t off = 0;
+	int r;
+
+	if (ospfs_blank_hint.dir == dir_ino)
+		off = ospfs_blank_hint.off;
+	ospfs_blank_hint.dir = dir_ino;
+
+	for (; off < dir_oi->oi_size; off += OSPFS_DIRENTRY_SIZE) {
+		ospfs_direntry_t *od = ospfs_inode_data(dir_oi, off);
+		if (od->od_ino == 0) {
+			ospfs_blank_hint.off = *off_store = off;
+			return od;
+		}
+	}
+
+	// No empty entries: add a block.  change_size erases it, so every
+	// entry in it is blank.
+	ospfs_blank_hint.off = off;
+	if ((r = change_size(dir_oi, off + OSPFS_BLKSIZE)) < 0)
+		return ERR_PTR(r);
+	*off_store = off;
+	return ospfs_inode_data(dir_oi, off);
+}
+
+
+// ospfs_add_direntry(dir_oi, name, namelen, ino)
+//	Adds an entry named 'name' (length 'namelen') for inode 'ino' to the
+//	directory 'dir_oi'.  Does not change the inode's link count.
+//
+//   Returns: 0 on success, -(error code) on error.  In particular:
+//               -ENAMETOOLONG if 'namelen' is too large;
+//               -EEXIST       if an entry with that name already exists;
+//               -ENOSPC       if the disk is full.
+
+static int
+ospfs_add_direntry(ospfs_inode_t *dir_oi, const char *name, int namelen,
+		   uint32_t ino)
+{
+	ospfs_direntry_t *od;
+	uint32_t off = 0;
+	int indexed;
+
+	if (namelen > OSPFS_MAXNAMELEN)
+		return -ENAMETOOLONG;
+	if (find_direntry(dir_oi, name, namelen))
+		return -EEXIST;
+	// Make room in the index first: growing it rebuilds it from the
+	// directories, and the new entry is not in its directory yet.
+	indexed = ospfs_dirindex_ready(1);
+	od = create_blank_direntry(dir_oi, &off);
+	if (IS_ERR(od))
+		return PTR_ERR(od);
+
+	od->od_ino = ino;
+	memcpy(od->od_name, name, namelen);
+	od->od_name[namelen] = '\0';
+	if (indexed) {
+		uint32_t dir_ino = ospfs_inode_ino(dir_oi);
+		ospfs_dirindex_insert(dir_ino,
+				      ospfs_dirindex_hash(dir_ino, name, namelen),
+				      off);
+	}
+	return 0;
+}
+
+
+// ospfs_create_file(dir_oi, name, namelen, mode)
+//	Creates an empty regular file named 'name' in the directory 'dir_oi',
+//	with permissions 'mode'.
+//
+//   Returns: the new file's inode number on success, -(error code) on
+//	      error, as for ospfs_add_direntry.
+
+static int
+ospfs_create_file(ospfs_inode_t *dir_oi, const char *name, int namelen,
+		  int mode)
+{
+	uint32_t entry_ino = ospfs_alloc_inode();
+	ospfs_inode_t *oi;
+	int r;
+
+	if (!entry_ino)
+		return find_direntry(dir_oi, name, namelen) ? -EEXIST : -ENOSPC;
+
+	// Mark the inode used first, so that building the directory index
+	// does not take it.
+	oi = ospfs_inode(entry_ino);
+	memset(oi, 0, sizeof(*oi));
+	oi->oi_ftype = OSPFS_FTYPE_REG;
+	oi->oi_nlink = 1;
+	oi->oi_mode = mode;
+	if ((r = ospfs_add_direntry(dir_oi, name, namelen, entry_ino)) < 0) {
+		oi->oi_nlink = 0;
+		return r;
+	}
+	return entry_ino;
+}
+
+
+// ospfs_create_symlink(dir_oi, name, namelen, symname)
+//	Creates a symbolic link named 'name' in the directory 'dir_oi',
+//	pointing at 'symname'.
+//
+//   Returns: the new link's inode number on success, -(error code) on
+//	      error, as for ospfs_add_direntry.  -ENAMETOOLONG also means
+//	      'symname' is too long.
+
+static int
+ospfs_create_symlink(ospfs_inode_t *dir_oi, const char *name, int namelen,
+		     const char *symname)
+{
+	uint32_t entry_ino, symlen = strlen(symname);
+	ospfs_symlink_inode_t *oi;
+	int r;
+
+	if (symlen > OSPFS_MAXSYMLINKLEN)
+		return -ENAMETOOLONG;
+	if (!(entry_ino = ospfs_alloc_inode()))
+		return find_direntry(dir_oi, name, namelen) ? -EEXIST : -ENOSPC;
+
+	memset(ospfs_inode(entry_ino), 0, sizeof(ospfs_inode_t));
+	oi = (ospfs_symlink_inode_t *) ospfs_inode(entry_ino);
+	oi->oi_size = symlen;
+	oi->oi_ftype = OSPFS_FTYPE_SYMLINK;
+	oi->oi_nlink = 1;
+	memcpy(oi->oi_symlink, symname, symlen + 1);
+	if ((r = ospfs_add_direntry(dir_oi, name, namelen, entry_ino)) < 0) {
+		oi->oi_nlink = 0;
+		return r;
+	}
+	return entry_ino;
+}
+
+
+// ospfs_remove_direntry(dir_oi, name, namelen)
+//	Removes the entry named 'name' from the directory 'dir_oi' and drops
+//	a link to its inode.  A regular file's blocks are freed with its
+//	last link.  (A symbolic link has no blocks: its inode holds its
+//	destination where a file's inode holds block pointers.)
+//
+//   Returns: 0 on success, -ENOENT if there is no such entry.
+
+static int
+ospfs_remove_direntry(ospfs_inode_t *dir_oi, const char *name, int namelen)
+{
+	uint32_t dir_ino = ospfs_inode_ino(dir_oi), off;
+	ospfs_direntry_t *od;
+	ospfs_inode_t *oi;
+
+	if (namelen < 0)
+		namelen = strlen(name);
+	od = ospfs_find_direntry(dir_oi, name, namelen, &off);
+	if (!od || !(oi = ospfs_inode(od->od_ino)))
+		return -ENOENT;
+
+	if (ospfs_dirindex_ready(0))
+		ospfs_dirindex_remove(dir_ino,
+				      ospfs_dirindex_hash(dir_ino, name, namelen),
+				      off);
+	od->od_ino = 0;
+	if (ospfs_blank_hint.dir == dir_ino && off < ospfs_blank_hint.off)
+		ospfs_blank_hint.off = off;
+
+	if (--oi->oi_nlink > 0)
+		return 0;
+	ospfs_dirindex_wait = 0;
+	return oi->oi_ftype == OSPFS_FTYPE_SYMLINK ? 0 : change_size(oi, 0);
+}
+
+#endif /* OSPFSOPS_H */